@@ -244,7 +244,7 @@ echo "Copying binaries to output folders..."
 
 cd ${LTFS_SRC_DIR}
 
-BIN_FILES="ltfs mkltfs ltfsck unltfs"
+BIN_FILES="ltfs mkltfs ltfsck unltfs ltfsrestore"
 for f in ${BIN_FILES}
 do
 	echo "Copying ${f} to ${BASEDIR}/${OUTPUT_DIR_NAME}${LTFS_INSTALL_PREFIX}/bin/"
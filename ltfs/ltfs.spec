@@ -99,6 +99,7 @@ cp %{_prefix}/bin/ltfscopy $RPM_BUILD_ROOT%{_prefix}/bin/
 %{_prefix}/bin/ltfsck
 %{_prefix}/bin/mkltfs
 %{_prefix}/bin/unltfs
+%{_prefix}/bin/ltfsrestore
 %{_prefix}/bin/ltfscopy
 %{_libdir}/libltfs.a
 %{_libdir}/libltfs.la
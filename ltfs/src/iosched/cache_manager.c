@@ -48,6 +48,42 @@
 #include "libltfs/ltfs.h"
 #include "cache_manager.h"
 
+#ifndef mingw_PLATFORM
+#include <sys/mman.h>
+#endif
+
+/* Object data in an arena start on a boundary of this size */
+#define CACHE_ARENA_ALIGN     4096
+/* Size of the huge pages arenas are rounded up to when they can be backed by them */
+#define CACHE_HUGEPAGE_SIZE   (2 * 1024 * 1024)
+
+/* Pack and unpack the free list head: ABA tag in the upper half, object index + 1 in the lower */
+#define FREE_HEAD_INDEX(head)     ((uint32_t) ((head) & 0xffffffffULL))
+#define FREE_HEAD_TAG(head)       ((uint32_t) ((head) >> 32))
+#define FREE_HEAD(tag, index)     ((((uint64_t) (tag)) << 32) | (uint64_t) (index))
+
+/**
+ * cache_arena structure.
+ * A single large allocation holding the headers and the data of a group of objects.
+ * The data of every object starts on a CACHE_ARENA_ALIGN boundary and is followed
+ * by at least LTFS_CRC_SIZE spare bytes (see cache_pool.object_stride), so a cache
+ * block can be handed to the tape backend as is: backends that use logical block
+ * protection append the CRC to the buffer in place, and some drivers want the
+ * buffer page aligned to map it for direct I/O.
+ * Arenas are mapped from huge pages when the system has them reserved, and are
+ * only released when the pool is destroyed. The memory of parked objects in an arena
+ * mapped from regular pages is given back to the system until they are unparked
+ * (see cache_manager_park_objects()).
+ */
+struct cache_arena {
+	struct cache_arena *next;       /**< Next arena in the pool */
+	size_t length;                  /**< Size of the allocation */
+	bool mapped;                    /**< Was the arena allocated with mmap? */
+	bool releasable;                /**< Can the pages of a single object be given back? */
+	size_t count;                   /**< Number of objects in this arena */
+	struct cache_object *objects;   /**< Object headers, followed by the object data */
+};
+
 /**
  * cache_pool structure.
  * Holds objects of size @object_size.
@@ -57,16 +93,32 @@
  * the functions cache_manager_allocate_object() and cache_manager_free_object(),
  * respectivelly.
  *
+ * Available objects are kept in a lock-free stack, so allocating and freeing objects
+ * does not require any lock. Only growing the pool is serialized by @grow_lock.
+ *
+ * Freed objects are zeroed before they are reused, unless the pool is in dirty block
+ * mode (see cache_manager_set_dirty_blocks()).
+ *
  * The internal counters such as @current_capacity indicate how many objects
  * have been allocated through this cache pool; it doesn't necessarily say how
  * many available objects are in the pool.
+ *
+ * Objects can be taken out of service in bulk when memory runs short (parked), and
+ * put back later. The pool does not grow while any object is parked.
  */
 struct cache_pool {
 	size_t object_size;       /**< The size of each object in this pool */
+	size_t object_stride;     /**< Distance between two objects in an arena, see struct cache_arena */
 	size_t initial_capacity;  /**< Low water mark. Defines the initial capacity of the pool */
 	size_t max_capacity;      /**< High water mark. Defines the maximum capacity of the pool */
-	size_t current_capacity;  /**< How many objects are currently allocated */
-	TAILQ_HEAD(objects_struct, cache_object) pool; /**< Pool of cached objects */
+	volatile size_t current_capacity;  /**< How many objects are currently allocated */
+	volatile uint64_t free_head;       /**< Head of the free object stack, see FREE_HEAD() */
+	bool dirty_blocks;        /**< Hand out freed objects without zeroing them */
+	struct cache_object **objects;     /**< All objects of the pool, indexed by cache_object.index */
+	struct cache_arena *arenas;        /**< Arenas the objects are carved from */
+	uint32_t parked_head;     /**< First parked object (index + 1, 0 for none), see @grow_lock */
+	volatile size_t parked_count;      /**< Number of parked objects */
+	ltfs_mutex_t grow_lock;   /**< Serializes pool growth and changes to the parked list */
 };
 
 /**
@@ -74,50 +126,155 @@ struct cache_pool {
  * Holds objects of size @object_size, as stored in the cache_pool structure.
  */
 struct cache_object {
-	uint32_t refcount;              /**< Reference count */
-	ltfs_mutex_t lock;           /**< Lock to protect access to the refcount */
 	void *data;                     /**< Cached data. Must be the first element in the structure */
 	struct cache_pool *pool;        /**< Backpointer to the cache pool this object is part of */
-	TAILQ_ENTRY(cache_object) list; /**< Pointers to next and previous cache objects */
+	struct cache_arena *arena;      /**< Arena holding the object data */
+	volatile uint32_t refcount;     /**< Reference count, only updated with atomic operations */
+	uint32_t index;                 /**< Position of this object in the pool's object table */
+	volatile uint32_t next;         /**< Next free or parked object (index + 1, 0 for none) */
 };
 
 /**
  * Private helper.
- * Creates a new object and adds it to the cache pool on success, returning NULL if out of memory.
- * @param pool cache pool to create the object in.
- * @return a pointer to the cache_object or NULL on failure.
+ * Push an object onto the free stack of its pool.
+ * @param pool cache pool the object belongs to.
+ * @param object object to push.
  */
-struct cache_object *_cache_manager_create_object(struct cache_pool *pool)
+static void _cache_manager_push_object(struct cache_pool *pool, struct cache_object *object)
 {
-	int ret;
-	struct cache_object *object = calloc(1, sizeof(struct cache_object));
-	if (! object) {
-		ltfsmsg(LTFS_ERR, "10001E", "cache manager: object");
-		return NULL;
+	uint64_t head, new_head;
+
+	do {
+		head = pool->free_head;
+		object->next = FREE_HEAD_INDEX(head);
+		new_head = FREE_HEAD(FREE_HEAD_TAG(head) + 1, object->index + 1);
+	} while (! __sync_bool_compare_and_swap(&pool->free_head, head, new_head));
+}
+
+/**
+ * Private helper.
+ * Pop an object from the free stack of a pool.
+ * Objects are never unmapped while the pool exists, so reading the next pointer of an
+ * object which was concurrently taken by another thread is harmless: the tag makes the
+ * compare and swap fail in that case.
+ * @param pool cache pool to take the object from.
+ * @return an object, or NULL if the free stack is empty.
+ */
+static struct cache_object *_cache_manager_pop_object(struct cache_pool *pool)
+{
+	uint64_t head, new_head;
+	struct cache_object *object;
+
+	do {
+		head = pool->free_head;
+		if (FREE_HEAD_INDEX(head) == 0)
+			return NULL;
+		object = pool->objects[FREE_HEAD_INDEX(head) - 1];
+		new_head = FREE_HEAD(FREE_HEAD_TAG(head) + 1, object->next);
+	} while (! __sync_bool_compare_and_swap(&pool->free_head, head, new_head));
+
+	return object;
+}
+
+/**
+ * Private helper.
+ * Allocate the memory backing an arena, preferring huge pages.
+ * @param length requested size. On success, it holds the size actually allocated.
+ * @param mapped on success, tells whether the memory comes from mmap.
+ * @return zero-filled memory of at least @length bytes, or NULL if out of memory.
+ */
+static void *_cache_manager_map_arena(size_t *length, bool *mapped, bool *releasable)
+{
+	void *mem;
+#ifndef mingw_PLATFORM
+	size_t huge_length;
+
+#ifdef MAP_HUGETLB
+	huge_length = (*length + CACHE_HUGEPAGE_SIZE - 1) & ~((size_t) CACHE_HUGEPAGE_SIZE - 1);
+	mem = mmap(NULL, huge_length, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+	if (mem != MAP_FAILED) {
+		*length = huge_length;
+		*mapped = true;
+		*releasable = false;
+		return mem;
 	}
+#else
+	(void) huge_length;
+#endif /* MAP_HUGETLB */
+
+	/* No reserved huge pages: fall back to regular pages, and let the kernel
+	 * use transparent huge pages where it can */
+	mem = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (mem != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+		madvise(mem, *length, MADV_HUGEPAGE);
+#endif
+		*mapped = true;
+		*releasable = true;
+		return mem;
+	}
+#endif /* mingw_PLATFORM */
+
+	mem = calloc(1, *length);
+	*mapped = false;
+	*releasable = false;
+	return mem;
+}
 
-	/* HP-SOS: We don't store CRC along with the data. Hence removed the IBM's implementation */
-#if 0
-	object->data = calloc(1, pool->object_size + LTFS_CRC_SIZE); /* Allocate extra 4-bytes for SCSI logical block protection */
-#endif /* 0 */
-	object->data = calloc(1, pool->object_size);
+/**
+ * Private helper.
+ * Creates a new arena holding @count objects and adds them to the pool's object table.
+ * The objects are not put on the free stack; the caller is responsible for that.
+ * Must be called with pool->grow_lock held, or before the pool is shared.
+ * @param pool cache pool to create the arena in.
+ * @param count number of objects to create.
+ * @return a pointer to the first object of the arena, or NULL if out of memory.
+ */
+static struct cache_object *_cache_manager_create_arena(struct cache_pool *pool, size_t count)
+{
+	size_t i, header_length, length;
+	bool mapped, releasable;
+	char *mem, *data;
+	struct cache_arena *arena;
 
-	if (! object->data) {
-		ltfsmsg(LTFS_ERR, "10001E", "cache manager: object data");
-		free(object);
+	arena = calloc(1, sizeof(struct cache_arena));
+	if (! arena) {
+		ltfsmsg(LTFS_ERR, "10001E", "cache manager: arena");
 		return NULL;
 	}
-	object->pool = pool;
-	object->refcount = 1;
-	ret = ltfs_mutex_init(&object->lock);
-	if (ret) {
-		ltfsmsg(LTFS_ERR, "10002E", ret);
-		free(object->data);
-		free(object);
+
+	header_length = count * sizeof(struct cache_object);
+	header_length = (header_length + CACHE_ARENA_ALIGN - 1) & ~((size_t) CACHE_ARENA_ALIGN - 1);
+	length = header_length + count * pool->object_stride;
+
+	mem = _cache_manager_map_arena(&length, &mapped, &releasable);
+	if (! mem) {
+		ltfsmsg(LTFS_ERR, "10001E", "cache manager: arena data");
+		free(arena);
 		return NULL;
 	}
-	TAILQ_INSERT_TAIL(&pool->pool, object, list);
-	return object;
+
+	arena->length = length;
+	arena->mapped = mapped;
+	arena->releasable = releasable;
+	arena->count = count;
+	arena->objects = (struct cache_object *) mem;
+
+	data = mem + header_length;
+	for (i = 0; i < count; ++i) {
+		struct cache_object *object = &arena->objects[i];
+		object->data = data + i * pool->object_stride;
+		object->pool = pool;
+		object->arena = arena;
+		object->refcount = 1;
+		object->index = pool->current_capacity + i;
+		pool->objects[object->index] = object;
+	}
+
+	arena->next = pool->arenas;
+	pool->arenas = arena;
+	return arena->objects;
 }
 
 /**
@@ -130,7 +287,9 @@ struct cache_object *_cache_manager_create_object(struct cache_pool *pool)
 void *cache_manager_init(size_t object_size, size_t initial_capacity, size_t max_capacity)
 {
 	struct cache_pool *pool;
+	struct cache_object *objects;
 	size_t i;
+	int ret;
 
 	pool = (struct cache_pool *) calloc(1, sizeof (struct cache_pool));
 	if (! pool) {
@@ -138,18 +297,37 @@ void *cache_manager_init(size_t object_size, size_t initial_capacity, size_t max
 		return NULL;
 	}
 	pool->object_size = object_size;
+	pool->object_stride = (object_size + LTFS_CRC_SIZE + CACHE_ARENA_ALIGN - 1)
+		& ~((size_t) CACHE_ARENA_ALIGN - 1);
 	pool->initial_capacity = initial_capacity;
 	pool->max_capacity = max_capacity;
-	pool->current_capacity = initial_capacity;
-	TAILQ_INIT(&pool->pool);
+	pool->current_capacity = 0;
+	pool->free_head = FREE_HEAD(0, 0);
 
-	for (i=0; i<initial_capacity; ++i) {
-		struct cache_object *object = _cache_manager_create_object(pool);
-		if (! object) {
+	ret = ltfs_mutex_init(&pool->grow_lock);
+	if (ret) {
+		ltfsmsg(LTFS_ERR, "10002E", ret);
+		free(pool);
+		return NULL;
+	}
+
+	pool->objects = calloc(max_capacity ? max_capacity : 1, sizeof(struct cache_object *));
+	if (! pool->objects) {
+		ltfsmsg(LTFS_ERR, "10001E", "cache manager: object table");
+		cache_manager_destroy(pool);
+		return NULL;
+	}
+
+	if (initial_capacity) {
+		objects = _cache_manager_create_arena(pool, initial_capacity);
+		if (! objects) {
 			ltfsmsg(LTFS_ERR, "11114E");
 			cache_manager_destroy(pool);
 			return NULL;
 		}
+		pool->current_capacity = initial_capacity;
+		for (i = initial_capacity; i > 0; --i)
+			_cache_manager_push_object(pool, &objects[i - 1]);
 	}
 
 	return (void *) pool;
@@ -161,21 +339,27 @@ void *cache_manager_init(size_t object_size, size_t initial_capacity, size_t max
  */
 void cache_manager_destroy(void *cache)
 {
-	struct cache_object *object, *aux;
+	struct cache_arena *arena, *aux;
 	struct cache_pool *pool = (struct cache_pool *) cache;
 	if (! pool) {
 		ltfsmsg(LTFS_WARN, "10006W", "pool", __FUNCTION__);
 		return;
 	}
 
-	TAILQ_FOREACH_SAFE(object, &pool->pool, list, aux) {
-		TAILQ_REMOVE(&pool->pool, object, list);
-		ltfs_mutex_destroy(&object->lock);
-		if (object->data)
-			free(object->data);
-		free(object);
+	for (arena = pool->arenas; arena; arena = aux) {
+		aux = arena->next;
+#ifndef mingw_PLATFORM
+		if (arena->mapped)
+			munmap(arena->objects, arena->length);
+		else
+#endif
+			free(arena->objects);
+		free(arena);
 	}
 
+	if (pool->objects)
+		free(pool->objects);
+	ltfs_mutex_destroy(&pool->grow_lock);
 	free(pool);
 }
 
@@ -189,7 +373,29 @@ bool cache_manager_has_room(void *cache)
 	struct cache_pool *pool = (struct cache_pool *) cache;
 	CHECK_ARG_NULL(pool, false);
 
-	return ! (TAILQ_EMPTY(&pool->pool) && pool->current_capacity == pool->max_capacity);
+	return ! (FREE_HEAD_INDEX(pool->free_head) == 0 &&
+		(pool->current_capacity == pool->max_capacity || pool->parked_count > 0));
+}
+
+/**
+ * Enable or disable dirty block mode.
+ * In dirty block mode, objects returned by cache_manager_allocate_object() may hold data
+ * from their previous use. The caller must then track how many bytes of each object are
+ * valid and never read past them. This saves clearing up to @object_size bytes every time
+ * an object is freed.
+ * Objects created when the pool grows are always zero-filled.
+ * @param cache cache pool to configure.
+ * @param dirty true to stop zeroing freed objects, false to zero them (the default).
+ */
+void cache_manager_set_dirty_blocks(void *cache, bool dirty)
+{
+	struct cache_pool *pool = (struct cache_pool *) cache;
+	if (! pool) {
+		ltfsmsg(LTFS_WARN, "10006W", "pool", __FUNCTION__);
+		return;
+	}
+
+	pool->dirty_blocks = dirty;
 }
 
 /**
@@ -197,6 +403,7 @@ bool cache_manager_has_room(void *cache)
  * The object data and the object size can be obtained through the functions
  * cache_manager_get_object_data() and cache_manager_get_object_size(),
  * respectively.
+ * This function does not need any external lock.
  *
  * @param cache cache pool to create the object in.
  * @retval a pointer to the new allocated object or NULL if out of memory
@@ -205,14 +412,24 @@ bool cache_manager_has_room(void *cache)
  */
 void *cache_manager_allocate_object(void *cache)
 {
-	size_t i, new_size = 0;
-	struct cache_object *object, *last_object = NULL;
+	size_t i, count, new_size = 0;
+	struct cache_object *object, *objects = NULL;
 	struct cache_pool *pool = (struct cache_pool *) cache;
 	CHECK_ARG_NULL(pool, NULL);
 
-	TAILQ_FOREACH(object, &pool->pool, list) {
-		/* Return the first available object */
-		TAILQ_REMOVE(&pool->pool, object, list);
+	/* Return the first available object */
+	object = _cache_manager_pop_object(pool);
+	if (object) {
+		object->refcount = 1;
+		return (void *) object;
+	}
+
+	ltfs_mutex_lock(&pool->grow_lock);
+
+	/* Somebody else may have grown the pool while we were waiting for the lock */
+	object = _cache_manager_pop_object(pool);
+	if (object) {
+		ltfs_mutex_unlock(&pool->grow_lock);
 		object->refcount = 1;
 		return (void *) object;
 	}
@@ -221,9 +438,12 @@ void *cache_manager_allocate_object(void *cache)
 	 * If no available objects were found then we need to figure if we are allowed
 	 * to grow the pool any further. If we're not then NULL is returned and the caller
 	 * is in charge of flushing caches to overcome this situation.
+	 * Parked objects mean memory is short, so do not grow in that case either.
 	 */
-	if (pool->current_capacity == pool->max_capacity)
+	if (pool->current_capacity == pool->max_capacity || pool->parked_count > 0) {
+		ltfs_mutex_unlock(&pool->grow_lock);
 		return NULL;
+	}
 
 	else if ((pool->current_capacity * 2) < pool->max_capacity)
 		if (pool->current_capacity)
@@ -234,26 +454,30 @@ void *cache_manager_allocate_object(void *cache)
 		/* Expand until the maximum capacity */
 		new_size = pool->max_capacity;
 
-	for (i=pool->current_capacity; i<new_size; ++i) {
-		struct cache_object *object = _cache_manager_create_object(pool);
-		if (! object) {
-			/* Luckily we might have increased the size of the cache by a few entries.. */
-			ltfsmsg(LTFS_WARN, "11115W");
+	/* Grow by a single arena. If that much memory is not available, settle for less. */
+	for (count = new_size - pool->current_capacity; count > 0; count /= 2) {
+		objects = _cache_manager_create_arena(pool, count);
+		if (objects)
 			break;
-		}
-		last_object = object;
-		pool->current_capacity++;
 	}
 
-	if (! last_object) {
+	if (! objects) {
 		/* If we couldn't grow the cache any further return failure */
+		ltfs_mutex_unlock(&pool->grow_lock);
 		ltfsmsg(LTFS_ERR, "11116E");
 		return NULL;
+	} else if (count < new_size - pool->current_capacity) {
+		/* Luckily we might have increased the size of the cache by a few entries.. */
+		ltfsmsg(LTFS_WARN, "11115W");
 	}
 
-	/* Remove @last_object from the pool and return it */
-	TAILQ_REMOVE(&pool->pool, last_object, list);
-	return last_object;
+	/* Keep the first object for the caller and make the others available */
+	for (i = count; i > 1; --i)
+		_cache_manager_push_object(pool, &objects[i - 1]);
+	pool->current_capacity += count;
+
+	ltfs_mutex_unlock(&pool->grow_lock);
+	return (void *) &objects[0];
 }
 
 /**
@@ -267,16 +491,19 @@ void *cache_manager_get_object(void *cache_object)
 
 	CHECK_ARG_NULL(cache_object, NULL);
 
-	ltfs_mutex_lock(&object->lock);
-	object->refcount++;
-	ltfs_mutex_unlock(&object->lock);
+	__sync_add_and_fetch(&object->refcount, 1);
 
 	return cache_object;
 }
 
 /**
  * Dispose an object.
+ * The pool does not shrink here: objects are kept for reuse until cache_manager_destroy(),
+ * unless they are parked (see cache_manager_park_objects()).
+ * This function does not need any external lock.
  * @param cache_object object to dispose, as returned from cache_manager_allocate_object()
+ * @param count number of bytes of the object that were used, or 0 if unknown. Only these
+ *              bytes are zeroed. Ignored in dirty block mode.
  */
 void cache_manager_free_object(void *cache_object, size_t count)
 {
@@ -287,35 +514,96 @@ void cache_manager_free_object(void *cache_object, size_t count)
 		return;
 	}
 
-	ltfs_mutex_lock(&object->lock);
-	object->refcount--;
-	if (object->refcount > 0) {
-		ltfs_mutex_unlock(&object->lock);
+	if (__sync_sub_and_fetch(&object->refcount, 1) > 0)
 		return;
-	}
-	ltfs_mutex_unlock(&object->lock);
 
+	/* Add the object back to the pool of ready to be used */
 	pool = object->pool;
-
-	if (pool->current_capacity > pool->initial_capacity) {
-		/* Shrink the cache */
-		ltfs_mutex_destroy(&object->lock);
-		free(object->data);
-		free(object);
-		pool->current_capacity--;
-	} else {
-		/* Add the object back to the pool of ready to be used */
-		pool = object->pool;
+	if (! pool->dirty_blocks) {
 		if (count)
 			memset(object->data, 0, count);
 		else
 			memset(object->data, 0, pool->object_size);
-		TAILQ_INSERT_TAIL(&pool->pool, object, list);
 	}
+	_cache_manager_push_object(pool, object);
+}
+
+/**
+ * Take free objects out of service and give their memory back to the system where possible.
+ * Only objects that are free when this function is called can be parked; the caller frees
+ * more objects and calls it again if it needs to park more.
+ * Parked objects come back zero-filled, or as they were freed for arenas whose pages cannot
+ * be given back individually.
+ * @param cache cache pool to shrink.
+ * @param count number of objects to park.
+ * @return the number of objects parked.
+ */
+size_t cache_manager_park_objects(void *cache, size_t count)
+{
+	size_t i;
+	struct cache_object *object;
+	struct cache_pool *pool = (struct cache_pool *) cache;
+	CHECK_ARG_NULL(pool, 0);
+
+	ltfs_mutex_lock(&pool->grow_lock);
+	for (i = 0; i < count; ++i) {
+		object = _cache_manager_pop_object(pool);
+		if (! object)
+			break;
+#if !defined(mingw_PLATFORM) && defined(MADV_DONTNEED)
+		if (object->arena->releasable)
+			madvise(object->data, pool->object_stride, MADV_DONTNEED);
+#endif
+		object->next = pool->parked_head;
+		pool->parked_head = object->index + 1;
+		++pool->parked_count;
+	}
+	ltfs_mutex_unlock(&pool->grow_lock);
+
+	return i;
+}
+
+/**
+ * Put parked objects back in service.
+ * @param cache cache pool to grow.
+ * @param count number of objects to unpark.
+ * @return the number of objects unparked, which is smaller than @count if fewer were parked.
+ */
+size_t cache_manager_unpark_objects(void *cache, size_t count)
+{
+	size_t i;
+	struct cache_object *object;
+	struct cache_pool *pool = (struct cache_pool *) cache;
+	CHECK_ARG_NULL(pool, 0);
+
+	ltfs_mutex_lock(&pool->grow_lock);
+	for (i = 0; i < count && pool->parked_head; ++i) {
+		object = pool->objects[pool->parked_head - 1];
+		pool->parked_head = object->next;
+		--pool->parked_count;
+		_cache_manager_push_object(pool, object);
+	}
+	ltfs_mutex_unlock(&pool->grow_lock);
+
+	return i;
+}
+
+/**
+ * Get the number of objects in service: those allocated so far, minus the parked ones.
+ * @param cache cache pool to check.
+ * @return the number of objects in service.
+ */
+size_t cache_manager_get_capacity(void *cache)
+{
+	struct cache_pool *pool = (struct cache_pool *) cache;
+	CHECK_ARG_NULL(pool, 0);
+	return pool->current_capacity - pool->parked_count;
 }
 
 /**
  * Get a pointer to an object's data.
+ * The data is CACHE_ARENA_ALIGN aligned and may be written up to LTFS_CRC_SIZE bytes
+ * past the object size, so it can be passed directly to tape_write().
  * @param cache_object cache object, as returned from cache_manager_allocate_object()
  * @retval a pointer to the object's data or NULL on invalid input.
  */
@@ -51,10 +51,14 @@
 void *cache_manager_init(size_t object_size, size_t initial_capacity, size_t max_capacity);
 void cache_manager_destroy(void *cache);
 bool cache_manager_has_room(void *cache);
+void cache_manager_set_dirty_blocks(void *cache, bool dirty);
 void *cache_manager_allocate_object(void *cache);
 void *cache_manager_get_object(void *object);
 void cache_manager_free_object(void *cache_object, size_t count);
 void *cache_manager_get_object_data(void *cache_object);
 size_t cache_manager_get_object_size(void *cache_object);
+size_t cache_manager_park_objects(void *cache, size_t count);
+size_t cache_manager_unpark_objects(void *cache, size_t count);
+size_t cache_manager_get_capacity(void *cache);
 
 #endif /* __cache_manager_h */
@@ -63,6 +63,18 @@ struct fcfs_data {
 	struct ltfs_volume *vol;    /**< A reference to the LTFS volume structure */
 };
 
+/**
+ * Asynchronous I/O queue. This scheduler has no threads of its own, so each request is
+ * carried out when it is submitted and only its completion is queued.
+ */
+struct fcfs_queue {
+	ltfs_mutex_t lock;          /**< Protects the completion ring */
+	struct iosched_cqe *cqe;    /**< Completion ring, one slot per request */
+	uint32_t depth;             /**< Number of slots in the completion ring */
+	uint32_t head;              /**< Position of the oldest completion */
+	uint32_t count;             /**< Number of completions not reaped yet */
+};
+
 /**
  * Initialize the FCFS I/O scheduler.
  * @param vol LTFS volume
@@ -240,6 +252,162 @@ int fcfs_update_data_placement(struct dentry *d, void *iosched_handle)
 	return 0;
 }
 
+/**
+ * Describe the scheduler state. This scheduler keeps none, so only its name is reported.
+ *
+ * @param state On success, points to a newly allocated string. The caller must free it.
+ * @param iosched_handle the I/O scheduler handle.
+ * @return 0 on success or a negative value on error.
+ */
+int fcfs_get_state(char **state, void *iosched_handle)
+{
+	CHECK_ARG_NULL(state, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+
+	*state = strdup("fcfs");
+	if (! *state) {
+		ltfsmsg(LTFS_ERR, "10001E", "fcfs_get_state: state");
+		return -LTFS_NO_MEMORY;
+	}
+	return 0;
+}
+
+/**
+ * Create an asynchronous I/O queue.
+ *
+ * @param depth Maximum number of completions not reaped yet.
+ * @param iosched_handle the I/O scheduler handle.
+ * @return the new queue or NULL on error.
+ */
+void *fcfs_queue_create(uint32_t depth, void *iosched_handle)
+{
+	struct fcfs_queue *queue;
+	int ret;
+
+	CHECK_ARG_NULL(iosched_handle, NULL);
+
+	queue = calloc(1, sizeof(struct fcfs_queue));
+	if (queue)
+		queue->cqe = calloc(depth, sizeof(struct iosched_cqe));
+	if (! queue || ! queue->cqe) {
+		ltfsmsg(LTFS_ERR, "10001E", "fcfs_queue_create: queue");
+		free(queue);
+		return NULL;
+	}
+
+	ret = ltfs_mutex_init(&queue->lock);
+	if (ret) {
+		ltfsmsg(LTFS_ERR, "10002E", ret);
+		free(queue->cqe);
+		free(queue);
+		return NULL;
+	}
+
+	queue->depth = depth;
+	return queue;
+}
+
+/**
+ * Destroy an asynchronous I/O queue. Nothing is ever in flight here, so this only drops the
+ * completions not reaped yet.
+ *
+ * @param queue queue to destroy.
+ * @param iosched_handle the I/O scheduler handle.
+ * @return 0 on success or a negative value on error.
+ */
+int fcfs_queue_destroy(void *queue, void *iosched_handle)
+{
+	struct fcfs_queue *q = (struct fcfs_queue *) queue;
+
+	CHECK_ARG_NULL(queue, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+
+	ltfs_mutex_destroy(&q->lock);
+	free(q->cqe);
+	free(q);
+	return 0;
+}
+
+/**
+ * Carry out asynchronous requests in the calling thread and queue their completions.
+ *
+ * @param queue queue to submit to.
+ * @param sqe requests to submit.
+ * @param count number of requests in sqe.
+ * @param iosched_handle the I/O scheduler handle.
+ * @return the number of requests submitted or a negative value on error.
+ */
+int fcfs_submit(void *queue, const struct iosched_sqe *sqe, uint32_t count, void *iosched_handle)
+{
+	struct fcfs_queue *q = (struct fcfs_queue *) queue;
+	struct iosched_cqe *cqe;
+	uint32_t i;
+
+	CHECK_ARG_NULL(queue, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(sqe, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+
+	ltfs_mutex_lock(&q->lock);
+	for (i = 0; i < count && q->count < q->depth; ++i) {
+		cqe = &q->cqe[(q->head + q->count) % q->depth];
+		cqe->user_data = sqe[i].user_data;
+		switch (sqe[i].op) {
+			case IOSCHED_ASYNC_READ:
+				cqe->result = fcfs_read(sqe[i].d, sqe[i].buf, sqe[i].size, sqe[i].offset,
+					iosched_handle);
+				break;
+			case IOSCHED_ASYNC_WRITE:
+				cqe->result = fcfs_write(sqe[i].d, sqe[i].buf, sqe[i].size, sqe[i].offset,
+					sqe[i].isupdatetime, iosched_handle);
+				break;
+			case IOSCHED_ASYNC_FLUSH:
+				cqe->result = fcfs_flush(sqe[i].d, false, iosched_handle);
+				break;
+			default:
+				cqe->result = -LTFS_BAD_ARG;
+				break;
+		}
+		++q->count;
+	}
+	ltfs_mutex_unlock(&q->lock);
+
+	return i;
+}
+
+/**
+ * Collect completions of asynchronous requests. Requests complete on submission, so this
+ * never waits.
+ *
+ * @param queue queue to reap from.
+ * @param cqe on success, holds the completions.
+ * @param count maximum number of completions to return.
+ * @param min_complete ignored.
+ * @param iosched_handle the I/O scheduler handle.
+ * @return the number of completions stored in cqe or a negative value on error.
+ */
+int fcfs_reap(void *queue, struct iosched_cqe *cqe, uint32_t count, uint32_t min_complete,
+	void *iosched_handle)
+{
+	struct fcfs_queue *q = (struct fcfs_queue *) queue;
+	uint32_t i;
+
+	(void) min_complete;
+
+	CHECK_ARG_NULL(queue, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(cqe, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+
+	ltfs_mutex_lock(&q->lock);
+	for (i = 0; i < count && q->count > 0; ++i) {
+		cqe[i] = q->cqe[q->head];
+		q->head = (q->head + 1) % q->depth;
+		--q->count;
+	}
+	ltfs_mutex_unlock(&q->lock);
+
+	return i;
+}
+
 struct iosched_ops fcfs_ops = {
 	.init         = fcfs_init,
 	.destroy      = fcfs_destroy,
@@ -251,6 +419,11 @@ struct iosched_ops fcfs_ops = {
 	.truncate     = fcfs_truncate,
 	.get_filesize = fcfs_get_filesize,
 	.update_data_placement = fcfs_update_data_placement,
+	.get_state    = fcfs_get_state,
+	.queue_create = fcfs_queue_create,
+	.queue_destroy = fcfs_queue_destroy,
+	.submit       = fcfs_submit,
+	.reap         = fcfs_reap,
 };
 
 struct iosched_ops *iosched_get_ops(void)
@@ -66,6 +66,7 @@
 
 #include "libltfs/ltfs.h"
 #include "libltfs/ltfs_fsops_raw.h"
+#include "libltfs/fs.h"
 #include "libltfs/index_criteria.h"
 #include "libltfs/iosched_ops.h"
 #include "libltfs/arch/time_internal.h"
@@ -77,6 +78,130 @@
  */
 #define IP_HIGH_WATERMARK 0.6
 
+/**
+ * Minimum number of requests targeting the Index Partition, as a fraction of the total
+ * number of cache blocks in the pool, for a volume-wide flush to write them. Such a flush
+ * always precedes an index write, so the data and the index share one partition change;
+ * smaller batches stay in the cache until the next sync or unmount.
+ */
+#define IP_SYNC_WATERMARK 0.1
+
+/**
+ * Number of background writer threads. These pick files from the scheduler queues, coalesce
+ * their requests and hand them to the tape thread, which is the only one writing data
+ * partition requests to the medium.
+ */
+#define UNIFIED_WRITER_THREADS 2
+
+/**
+ * Maximum number of write batches waiting for the tape thread.
+ */
+#define UNIFIED_READY_RING_SIZE 64
+
+/**
+ * Number of threads carrying out asynchronous requests (see unified_submit). They are started
+ * when the first asynchronous queue is created.
+ */
+#define UNIFIED_ASYNC_THREADS 4
+
+/**
+ * Length of the bursts handed to an idle drive, in milliseconds of measured drive throughput.
+ * The writer threads hold full blocks back until a burst is ready (or the tape thread is
+ * already busy), so that the drive does not stop and reposition after every block.
+ */
+#define UNIFIED_BURST_MSEC 500
+
+/**
+ * Maximum factor the flush controller may apply to the burst length while the drive keeps
+ * running out of data.
+ */
+#define UNIFIED_MAX_BURST_SCALE 8
+
+/**
+ * Largest number of full blocks to hold back for a burst, as a fraction of the total number
+ * of cache blocks in the pool.
+ */
+#define UNIFIED_MAX_TRIGGER 0.5
+
+/**
+ * Amount of tape thread busy time, in milliseconds, over which the drive write rate is sampled.
+ */
+#define UNIFIED_RATE_WINDOW_MSEC 1000
+
+/**
+ * Maximum time, in seconds, full blocks are held back waiting for a burst to build up.
+ */
+#define UNIFIED_FLUSH_DELAY 5
+
+/**
+ * Maximum number of written blocks to keep in the clean tier for reads of recently written
+ * data, as a fraction of the total number of cache blocks in the pool.
+ */
+#define UNIFIED_CLEAN_HIGH_WATERMARK 0.5
+
+/**
+ * Number of shards the scheduler state is split into, as a power of two. Each file belongs to
+ * one shard, chosen by hashing its dentry, so that threads working on files of different shards
+ * do not contend for the same scheduler locks.
+ */
+#define UNIFIED_SHARD_BITS 4
+#define UNIFIED_SHARDS (1 << UNIFIED_SHARD_BITS)
+
+/**
+ * Number of read_request structures unified_read keeps on the stack. Reads falling into more
+ * holes of the request list than this allocate the extra structures from the heap.
+ */
+#define UNIFIED_READ_GAPS 16
+
+/**
+ * Number of skip list levels indexing the request list of a file, on top of the list itself.
+ * Each level links about one request in four of the level below, which covers request lists
+ * far longer than any cache configuration can produce.
+ */
+#define UNIFIED_SKIP_LEVELS 8
+
+/**
+ * Share of the cache held back for files in the high priority class (see the ltfs.priority
+ * extended attribute). While such files are open for write, other files cannot take the last
+ * blocks of the cache.
+ */
+#define UNIFIED_PRIORITY_RESERVE 0.125
+
+/**
+ * Number of cache blocks a file must write strictly sequentially before it is switched to
+ * direct mode, where its full blocks go straight to the tape thread (see _unified_direct_write).
+ */
+#define UNIFIED_DIRECT_THRESHOLD 16
+
+/**
+ * Maximum number of blocks of a file in direct mode handed to the tape thread and not written
+ * yet: one being written and one queued behind it, so that the drive does not wait for the
+ * application to fill the next block.
+ */
+#define UNIFIED_DIRECT_DEPTH 2
+
+/**
+ * Pool manager tuning. Every UNIFIED_POOL_INTERVAL seconds, the pool manager reads the memory
+ * pressure stall information of the cgroup LTFS runs in, or of the whole system. Above
+ * UNIFIED_PSI_HIGH percent, it parks UNIFIED_POOL_STEP of the cache. Below UNIFIED_PSI_LOW, it
+ * unparks as much if more than UNIFIED_POOL_STALLS of the cache block allocations since the
+ * previous check had to wait. The cache never goes below its configured minimum size.
+ */
+#define UNIFIED_POOL_INTERVAL 1
+#define UNIFIED_PSI_HIGH 10.0
+#define UNIFIED_PSI_LOW 1.0
+#define UNIFIED_POOL_STEP 0.125
+#define UNIFIED_POOL_STALLS 0.05
+
+/**
+ * Files looked at by a pass of _unified_process_shard_queue.
+ */
+enum unified_pass {
+	PASS_PRIORITY, /**< Full blocks of priority files only */
+	PASS_NORMAL,   /**< All files, but partial blocks of priority files are not evicted */
+	PASS_EVICT,    /**< All files, evicting partial blocks of priority files too */
+};
+
 /**
  * Each outstanding write request is in one of the following states.
  */
@@ -95,6 +220,7 @@ struct read_request {
 	uint64_t offset;                /**< File offset for the read request */
 	char *buf;                      /**< Buffer which will receive data */
 	size_t count;                   /**< Number of bytes to read */
+	bool heap;                      /**< Allocated with malloc rather than taken from the stack */
 };
 
 /**
@@ -106,6 +232,8 @@ struct write_request {
 	size_t count;                    /**< Current request length, always <= cache block size */
 	void *write_cache;               /**< Cache block containing this request's data */
 	enum request_state state;        /**< Current state of the request */
+	uint32_t height;                 /**< Number of skip list levels this request is linked in */
+	struct write_request *skip[UNIFIED_SKIP_LEVELS]; /**< Next request in each skip list level */
 };
 
 /**
@@ -114,6 +242,7 @@ struct write_request {
  */
 struct dentry_priv {
 	struct dentry *dentry;   /**< Dentry associated with this request list */
+	struct unified_shard *shard; /**< Shard holding this file's queue memberships */
 	ltfs_mutex_t io_lock; /**< Lock controlling file I/O to this dentry */
 	uint64_t file_size;      /**< Real file size, including outstanding write requests */
 
@@ -129,8 +258,8 @@ struct dentry_priv {
 	 * Since writes are handled asynchronously, errors hit by the background thread need to be
 	 * propagated on a future request to write, flush or close. The error code is reset once
 	 * it's been propagated to the caller.
-	 * The caller needs to have (a) a write lock on priv->lock or (b) a read lock on priv->lock
-	 * plus a lock on dentry->iosched_lock before taking the write_error_lock.
+	 * The caller needs to have (a) a write lock on all shards or (b) a read lock on the file's
+	 * shard plus a lock on dentry->iosched_lock before taking the write_error_lock.
 	 * Never take any other locks while holding write_error_lock.
 	 */
 	int write_error;
@@ -138,11 +267,18 @@ struct dentry_priv {
 
 	/* Linked list membership flags and pointers.
 	 * Depending on the type of requests this dentry_priv contains, it may belong to one or
-	 * more lists: the working set, the data writer queue, and the index writer queue.
+	 * more lists of its shard: the working set, the data writer queue, and the index writer queue.
 	 * The 'in_' counters reflect the number of requests attached to each of the corresponding
 	 * lists.
 	 */
 	uint32_t in_working_set, in_dp_queue, in_ip_queue;
+	bool priority; /**< File is in the high priority class, see struct unified_shard */
+
+	/** Sequential write detection. stream_end is the end of the last write and stream_bytes
+	 * the length of the run of writes each starting where the previous one ended. The file is
+	 * in direct mode while the run is at least UNIFIED_DIRECT_THRESHOLD blocks long. */
+	uint64_t stream_end, stream_bytes;
+	bool direct;
 	TAILQ_ENTRY(dentry_priv) working_set;
 	TAILQ_ENTRY(dentry_priv) dp_queue;
 	TAILQ_ENTRY(dentry_priv) ip_queue;
@@ -152,8 +288,30 @@ struct dentry_priv {
 	 * write_ip is unset or when the alt_extentlist is pushed to libltfs. */
 	TAILQ_ENTRY(dentry_priv) ext_queue;
 
+	/** Pointer for the pack queue. A dentry_priv is placed in the pack_queue when a flush
+	 * leaves its last partial block behind for small file packing. pack_charge is the size of
+	 * that tail as counted in the scheduler's pack_bytes, so that a tail deferred again by a
+	 * later flush replaces its old count instead of adding to it. */
+	bool in_pack_queue;
+	size_t pack_charge;
+	TAILQ_ENTRY(dentry_priv) pack_queue;
+
 	/** List of write requests, sorted by offset */
 	TAILQ_HEAD(req_struct, write_request) requests;
+	/** Skip list levels over the request list, so that a request can be found by offset
+	 * without walking the whole list (see _unified_seek_request). skip_head[i] is the first
+	 * request linked in level i. */
+	struct write_request *skip_head[UNIFIED_SKIP_LEVELS];
+
+	/**
+	 * Number of write batches of this file handed to the tape thread and not written yet.
+	 * Requests in these batches are no longer in the requests list, so anyone looking at
+	 * the file's data or freeing this structure must wait for this count to drop to 0 first
+	 * (see _unified_wait_batches). Protected by priv->ring_lock.
+	 */
+	uint32_t inflight;
+	struct write_request *failed_req; /**< First request the tape thread failed to write */
+	ssize_t failed_ret;               /**< Error returned when writing failed_req */
 
 	/**
 	 * List of index partition extents. These will be inserted into the file's real extent
@@ -165,19 +323,149 @@ struct dentry_priv {
 };
 
 /**
- * Main scheduler data structure. Each scheduler instance has exactly one of these.
+ * A group of data partition requests for one file, prepared by a background writer thread
+ * and written to the medium by the tape thread.
  */
-struct unified_data {
+struct write_batch {
+	struct dentry_priv *dpr;          /**< File the requests belong to */
+	struct req_struct requests;       /**< Requests to write, in the order they must be written */
+	bool direct;                      /**< Written in direct mode, keep out of the clean tier */
+};
+
+/**
+ * Part of a write request copied into a pack block. A request is split into two pieces
+ * when it does not fit in the space left in the block.
+ */
+struct pack_piece {
+	struct dentry_priv *dpr;          /**< File the data belongs to */
+	struct write_request *req;        /**< Request the data was copied from */
+	uint64_t fileoffset;              /**< File offset of the data */
+	size_t byteoffset;                /**< Offset of the data in the pack block */
+	size_t bytecount;                 /**< Number of bytes in this piece */
+};
+
+/**
+ * Asynchronous I/O queue created by unified_queue_create. All fields are protected by
+ * priv->async_lock.
+ */
+struct async_queue {
+	ltfs_thread_cond_t cond;          /**< Signaled when a request of this queue completes */
+	struct iosched_cqe *cqe;          /**< Completion ring, one slot per request */
+	uint32_t depth;                   /**< Maximum number of requests submitted and not reaped */
+	uint32_t pending;                 /**< Number of requests submitted and not reaped */
+	uint32_t head;                    /**< Position of the oldest completion */
+	uint32_t count;                   /**< Number of completions not reaped yet */
+};
+
+/**
+ * Asynchronous request waiting for an async thread.
+ */
+struct async_request {
+	struct iosched_sqe sqe;           /**< Request as submitted */
+	struct async_queue *queue;        /**< Queue to post the completion to */
+	TAILQ_ENTRY(async_request) list;
+};
+
+/**
+ * Key of a block in the clean tier.
+ */
+struct clean_key {
+	uint64_t uid;    /**< UID of the file the block belongs to */
+	uint64_t block;  /**< File offset of the block, in cache blocks */
+};
+
+/**
+ * A cache block whose data has been written to the data partition, kept so that reads of
+ * recently written data do not need to reposition the tape. Only requests that start on a cache
+ * block boundary are kept, so each block covers [block * cache_size, block * cache_size + count).
+ */
+struct clean_block {
+	UT_hash_handle hh;             /**< Clean tier hash table handle */
+	TAILQ_ENTRY(clean_block) lru;  /**< Pointers for the LRU list */
+	struct clean_key key;          /**< File and position of the block */
+	size_t count;                  /**< Number of valid bytes in the block */
+	void *cache;                   /**< Cache block holding the data */
+};
+
+/**
+ * Queue lengths and request counters of a shard.
+ */
+struct unified_counts {
+	/* Queue lengths. These variables count the number of dentry_privs in each queue, not the
+	 * number of requests in each state.
+	 */
+	uint32_t ws_count; /**< Number of entries in the working_set and priority_working_set */
+	uint32_t dp_count; /**< Number of entries in the dp_queue and dp_priority_queue */
+	uint32_t ip_count; /**< Number of entries in the ip_queue */
+	uint32_t ws_priority_count; /**< Number of entries in the priority_working_set */
+	uint32_t dp_priority_count; /**< Number of entries in the dp_priority_queue */
+
+	/* Counters for various types of requests.
+	 * NOTE: these variables count write_requests, not dentry_priv structures, so they
+	 * DO NOT equal the lengths of the working_set/dp_queue/ip_queue lists! */
+	uint32_t ws_request_count; /**< Number of requests in REQUEST_PARTIAL state */
+	uint32_t dp_request_count; /**< Number of requests in REQUEST_DP state which will NOT change to IP state */
+	uint32_t ip_request_count; /**< Number of requests in REQUEST_IP state */
+};
+
+/**
+ * A slice of the scheduler state, holding the queues of the files that hash to it
+ * (see _unified_get_shard).
+ */
+struct unified_shard {
 	/**
-	 * Global scheduler lock. Any thread working on scheduler data structures must take this lock
-	 * for read. Taking this lock for write will stop all other scheduler activity, which
-	 * is useful when performing operations that could cause serious tape contention
-	 * (e.g. an index partition write or a full flush).
+	 * Shard lock. Any thread working on the scheduler data of a file must take the lock of the
+	 * file's shard for read. Taking the lock of every shard for write (see _unified_lock_all)
+	 * stops all other scheduler activity, which is useful when performing operations that could
+	 * cause serious tape contention (e.g. an index partition write or a full flush).
 	 */
 	MultiReaderSingleWriter lock;
 
 	/**
-	 * Cache allocation lock. Take this lock before making calls into the cache manager.
+	 * Shard queue lock.
+	 * Take this before manipulating the working_set, dp_queue and ip_queue lists of the shard
+	 * or its counters. It is okay to take priv->queue_lock while holding this lock. Do not take
+	 * any shard lock or dentry_priv lock while holding it.
+	 */
+	ltfs_thread_mutex_t queue_lock;
+
+	/* Lists of dentry_priv structures. Note that each dentry_priv may be in more than one of
+	 * these lists. */
+	TAILQ_HEAD(workingset_struct, dentry_priv) working_set; /**< Files with partial requests */
+	TAILQ_HEAD(writequeue_struct, dentry_priv) dp_queue;    /**< Files with full (DP) requests */
+	TAILQ_HEAD(indexqueue_struct, dentry_priv) ip_queue;    /**< Files with IP requests */
+
+	/* Files in the high priority class are kept in their own lists instead of the working_set
+	 * and dp_queue. Their full blocks are written before those of any other file, and their
+	 * partial blocks are only evicted under cache pressure when no other file has any left. */
+	struct workingset_struct priority_working_set; /**< Priority files with partial requests */
+	struct writequeue_struct dp_priority_queue;    /**< Priority files with full requests */
+
+	/**
+	 * Queue lengths and request counters. The writer threads and the flush controller add them
+	 * up over all shards without taking the shard queue locks (see _unified_sum_counts), so
+	 * they only ever see a snapshot of them.
+	 */
+	struct unified_counts counts;
+
+	/* Free write_request structures of this shard, reused before falling back to the heap.
+	 * Every live request holds a cache block, so no more than cache_blocks are kept.
+	 * Protected by queue_lock. */
+	struct req_struct free_requests;
+	uint32_t free_request_count;  /**< Number of entries in free_requests */
+	uint64_t request_allocs;      /**< Number of write_request structures taken from the heap */
+};
+
+/**
+ * Main scheduler data structure. Each scheduler instance has exactly one of these.
+ */
+struct unified_data {
+	struct unified_shard shards[UNIFIED_SHARDS]; /**< Per-file scheduler state, see struct unified_shard */
+	volatile uint32_t next_shard; /**< First shard of the next writer pass, updated atomically */
+
+	/**
+	 * Cache pressure lock. The cache manager does not need any lock to allocate or free
+	 * blocks; this lock only protects waiting on cache_cond when the pool is exhausted.
 	 * Note: because it is accessed by the background thread, the cache_requests variable
 	 * is protected by queue_lock, NOT by cache_lock!
 	 * It is okay to take the queue_lock while holding this lock. Do not take any other locks
@@ -185,42 +473,107 @@ struct unified_data {
 	 */
 	ltfs_thread_mutex_t cache_lock;
 	ltfs_thread_cond_t  cache_cond; /**< Signal this variable when a cache block becomes available */
+	volatile uint32_t cache_waiters; /**< Threads waiting on cache_cond, updated atomically */
 	uint32_t cache_requests;   /**< Number of threads waiting for a cache block */
 	size_t cache_size;         /**< Size of each cache block */
 	size_t cache_blocks;       /**< Maximum cache block count */
+	volatile uint32_t blocks_used;    /**< Cache blocks taken from the pool, updated atomically */
+	volatile uint32_t priority_files; /**< Priority files with a dentry_priv, updated atomically */
+	uint32_t priority_reserve; /**< Cache blocks held back for priority files */
+	volatile uint32_t pool_parked;  /**< Cache blocks parked by the pool manager, updated atomically */
+	volatile uint64_t cache_allocs; /**< Cache block allocations, updated atomically */
+	volatile uint64_t cache_stalls; /**< Allocations that waited for a block, updated atomically */
 
 	/**
-	 * dentry_priv queue lock.
-	 * Take this before manipulating the working_set, dp_queue and ip_queue lists
-	 * or the corresponding request counters. Do not take the sched_lock or any dentry_priv lock
-	 * while holding this lock.
+	 * Global queue lock.
+	 * Take this before manipulating the ext_queue and pack_queue lists, the pack counters and
+	 * the flush controller, or before waiting on queue_cond. Do not take any shard lock or
+	 * dentry_priv lock while holding this lock.
 	 */
 	ltfs_thread_mutex_t queue_lock;
 	ltfs_thread_cond_t  queue_cond; /**< Signal this variable when the dentry_priv lists are modified */
 
-	/* Lists of dentry_priv structures. Note that each dentry_priv may be in more than one of
-	 * these lists. */
-	TAILQ_HEAD(workingset_struct, dentry_priv) working_set; /**< Files with partial requests */
-	TAILQ_HEAD(writequeue_struct, dentry_priv) dp_queue;    /**< Files with full (DP) requests */
-	TAILQ_HEAD(indexqueue_struct, dentry_priv) ip_queue;    /**< Files with IP requests */
 	TAILQ_HEAD(extqueue_struct, dentry_priv) ext_queue;     /**< Files with dirty IP extents */
+	TAILQ_HEAD(packqueue_struct, dentry_priv) pack_queue;   /**< Files with tails waiting to be packed */
+
+	/* Small file packing. The pack counters are protected by queue_lock; they are reset
+	 * whenever the pack queue is written, so they are only used to decide when to write it. */
+	bool pack_tails;           /**< Leave partial last blocks behind on flush and pack them */
+	uint32_t pack_count;       /**< Number of tails waiting in the pack queue */
+	size_t pack_bytes;         /**< Number of bytes in the tails waiting in the pack queue */
+
+	/* Flush controller. The tape thread measures the rate at which the drive takes data and
+	 * counts how often it runs dry; from these, the writer threads get the number of full blocks
+	 * to collect before feeding an idle drive and the number of requests to hand over per pass.
+	 * Protected by queue_lock. */
+	bool tape_streaming;       /**< The tape thread is writing batches */
+	uint64_t drive_rate;       /**< Smoothed drive write rate in bytes/s, 0 until measured */
+	uint32_t burst_scale;      /**< Burst length multiplier, raised while the drive keeps stopping */
+	uint32_t flush_trigger;    /**< Full blocks to collect before waking up an idle drive */
+	uint32_t flush_batch;      /**< Maximum number of requests handed over per writer pass */
+	uint64_t tape_bytes;       /**< Bytes written by the tape thread */
+	uint64_t tape_restarts;    /**< Times the tape thread resumed after running out of batches */
+	uint64_t direct_bytes;     /**< Bytes handed over by files in direct mode, updated atomically */
+	uint64_t ip_flushes;       /**< Times the index partition requests were written */
+	uint64_t window_bytes;     /**< Bytes written in the current sampling window */
+	uint64_t window_nsec;      /**< Tape thread busy time in the current sampling window */
+	uint32_t window_restarts;  /**< Restarts in the current sampling window */
+
+	ltfs_thread_t writer_threads[UNIFIED_WRITER_THREADS]; /**< Background writer thread IDs */
+	uint32_t writer_count;   /**< Number of background writer threads running */
+	bool writer_keepalive;   /**< Used to terminate the background writer threads */
 
-	/* Queue lengths. These variables count the number of dentry_privs in each queue, not the
-	 * number of requests in each state.
+	/**
+	 * Ready ring lock. Protects the ready ring, the tape_keepalive flag and the inflight
+	 * counters of all dentry_priv structures. Do not take any other locks while holding it.
 	 */
-	uint32_t ws_count; /**< Number of entries in the working_set */
-	uint32_t dp_count; /**< Number of entries in the dp_queue */
-	uint32_t ip_count; /**< Number of entries in the ip_queue */
+	ltfs_thread_mutex_t ring_lock;
+	ltfs_thread_cond_t ring_cond;       /**< Signaled when a batch is queued */
+	ltfs_thread_cond_t ring_space_cond; /**< Signaled when a slot of the ring becomes free */
+	ltfs_thread_cond_t ring_done_cond;  /**< Signaled when a batch has been written */
+	struct write_batch *ready_ring[UNIFIED_READY_RING_SIZE]; /**< Batches ready to be written */
+	uint32_t ring_head;      /**< Position of the oldest batch in the ring */
+	uint32_t ring_count;     /**< Number of batches in the ring */
+	uint32_t ring_active;    /**< Number of batches taken from the ring and not written yet */
+	ltfs_thread_t tape_thread; /**< Tape thread ID */
+	bool tape_keepalive;     /**< Used to terminate the tape thread */
 
-	/* Counters for various types of requests.
-	 * NOTE: these variables count write_requests, not dentry_priv structures, so they
-	 * DO NOT equal the lengths of the working_set/dp_queue/ip_queue lists! */
-	uint32_t ws_request_count; /**< Number of requests in REQUEST_PARTIAL state */
-	uint32_t dp_request_count; /**< Number of requests in REQUEST_DP state which will NOT change to IP state */
-	uint32_t ip_request_count; /**< Number of requests in REQUEST_IP state */
+	/**
+	 * Clean tier lock. Protects the clean tier: blocks written to the data partition that are
+	 * kept for reads until their cache blocks are needed for new data. It is okay to take this
+	 * lock while holding the cache_lock. Do not take any other locks while holding it.
+	 */
+	ltfs_thread_mutex_t clean_lock;
+	struct clean_block *clean_table;  /**< Clean blocks, hashed by file and position */
+	TAILQ_HEAD(clean_lru_struct, clean_block) clean_lru; /**< Clean blocks, least recently used first */
+	/** Number of blocks in the clean tier. Updated atomically with clean_lock held, so that
+	 * it can also be read without the lock. */
+	volatile uint32_t clean_count;
+	uint32_t clean_max;      /**< Maximum number of blocks in the clean tier */
+
+	/**
+	 * Asynchronous I/O lock. Protects the submission queue, the async thread count and all
+	 * asynchronous I/O queues. Do not take any other locks while holding it.
+	 */
+	ltfs_thread_mutex_t async_lock;
+	ltfs_thread_cond_t async_cond;    /**< Signaled when a request is submitted */
+	TAILQ_HEAD(async_request_struct, async_request) async_requests; /**< Submission queue */
+	ltfs_thread_t async_threads[UNIFIED_ASYNC_THREADS]; /**< Async thread IDs */
+	uint32_t async_count;    /**< Number of async threads running */
+	bool async_keepalive;    /**< Used to terminate the async threads */
+
+	/**
+	 * Pool manager lock. Protects pool_keepalive; the pool manager thread waits on pool_cond
+	 * between checks. Do not take any other locks while holding it.
+	 */
+	ltfs_thread_mutex_t pool_lock;
+	ltfs_thread_cond_t pool_cond;     /**< Signaled to stop the pool manager */
+	ltfs_thread_t pool_thread; /**< Pool manager thread ID */
+	bool pool_running;       /**< The pool manager thread is running */
+	bool pool_keepalive;     /**< Used to terminate the pool manager thread */
+	char *psi_path;          /**< Memory pressure file read by the pool manager */
+	uint32_t pool_floor;     /**< Cache blocks the pool manager always leaves in service */
 
-	ltfs_thread_t writer_thread; /**< Background writer thread ID */
-	bool writer_keepalive;   /**< Used to terminate the background writer thread */
 	void *pool;              /**< Handle to the cache manager */
 	struct ltfs_volume *vol; /**< Each scheduler instance is associated with a single LTFS volume */
 };
@@ -230,16 +583,65 @@ struct unified_data {
 int  _unified_get_dentry_priv(struct dentry *d, struct dentry_priv **dentry_priv,
 	struct unified_data *priv);
 ltfs_thread_return _unified_writer_thread(void *iosched_handle);
+ltfs_thread_return _unified_tape_thread(void *iosched_handle);
+int  _unified_shards_init(struct unified_data *priv);
+void _unified_shards_destroy(struct unified_data *priv);
+struct unified_shard *_unified_get_shard(struct dentry *d, struct unified_data *priv);
+void _unified_lock_all(struct unified_data *priv);
+void _unified_unlock_all(struct unified_data *priv);
+void _unified_sum_counts(struct unified_counts *total, struct unified_data *priv);
+int  _unified_ring_init(struct unified_data *priv);
+void _unified_ring_destroy(struct unified_data *priv);
+void _unified_stop_threads(struct unified_data *priv);
+void _unified_queue_batch(struct req_struct *requests, struct dentry_priv *dpr,
+	struct unified_data *priv);
+size_t _unified_write_batch(struct write_batch *batch, struct unified_data *priv);
+void _unified_tape_state(bool streaming, struct unified_data *priv);
+void _unified_tape_sample(size_t bytes, const struct ltfs_timespec *elapsed,
+	struct unified_data *priv);
+void _unified_tune_flush(struct unified_data *priv);
+void _unified_clean_insert(struct write_request *req, struct dentry_priv *dpr,
+	struct unified_data *priv);
+void _unified_clean_invalidate(uint64_t uid, uint64_t start, uint64_t end,
+	struct unified_data *priv);
+void _unified_clean_unlink_range(uint64_t uid, uint64_t start, uint64_t end,
+	struct clean_lru_struct *dropped, struct unified_data *priv);
+bool _unified_clean_reclaim(struct unified_data *priv);
+ssize_t _unified_read_clean(struct dentry *d, char *buf, size_t size, off_t offset,
+	struct unified_data *priv);
+void _unified_wait_batches(struct dentry_priv *dpr, struct unified_data *priv);
+void _unified_drain_ring(struct unified_data *priv);
+void _unified_direct_write(struct dentry_priv *dpr, struct unified_data *priv);
+void _unified_collect_batch_error(struct dentry_priv *dpr, struct unified_data *priv);
+void _unified_defer_tail(struct write_request *req, struct dentry_priv *dpr,
+	struct unified_data *priv);
+void _unified_leave_pack_queue(struct dentry_priv *dpr, struct unified_data *priv);
+void _unified_process_pack_queue(struct unified_data *priv);
+int  _unified_write_pack_unlocked(struct unified_data *priv);
+void _unified_write_pack_block(const char *buf, size_t count, struct pack_piece *pieces,
+	size_t npieces, struct unified_data *priv);
 void _unified_process_queue(enum request_state queue, struct unified_data *priv);
 void _unified_process_index_queue(struct unified_data *priv);
 void _unified_process_data_queue(enum request_state queue, struct unified_data *priv);
-void _unified_free_request(struct write_request *req, struct unified_data *priv);
+uint32_t _unified_process_shard_queue(enum request_state queue, uint32_t batch,
+	enum unified_pass pass, struct unified_shard *shard, struct unified_data *priv);
+struct write_request *_unified_alloc_request(struct unified_shard *shard);
+void _unified_free_request(struct write_request *req, struct dentry_priv *dpr,
+	struct unified_data *priv);
+void _unified_skip_find(uint64_t offset, struct write_request **pred, struct dentry_priv *dpr);
+void _unified_insert_request(struct write_request *new_req, struct write_request *req,
+	struct dentry_priv *dpr);
+void _unified_remove_request(struct write_request *req, struct dentry_priv *dpr);
+struct write_request *_unified_seek_request(uint64_t offset, struct dentry_priv *dpr,
+	struct unified_data *priv);
 void _unified_update_alt_extentlist(struct extent_info *newext, struct dentry_priv *dpr,
 	struct unified_data *priv);
 void _unified_clear_alt_extentlist(bool save, struct dentry_priv *dpr, struct unified_data *priv);
 int  _unified_update_queue_membership(bool add, bool all, enum request_state queue,
 	 struct dentry_priv *dentry_priv, struct unified_data *priv);
 int _unified_cache_alloc(void **cache, struct dentry *d, struct unified_data *priv);
+bool _unified_reserve_allows(struct dentry_priv *dpr, struct unified_data *priv);
+void *_unified_cache_take(struct dentry_priv *dpr, struct unified_data *priv);
 void _unified_cache_free(void *cache, size_t count, struct unified_data *priv);
 ssize_t _unified_insert_new_request(const char *buf, off_t offset, size_t count, void **cache,
 	bool ip_state, struct write_request *req, struct dentry *d, struct unified_data *priv);
@@ -257,6 +659,17 @@ void _unified_unset_write_ip(struct dentry_priv *dpr, struct unified_data *priv)
 void _unified_handle_write_error(ssize_t write_ret, struct write_request *req,
 	struct dentry_priv *dpr, struct unified_data *priv);
 int _unified_get_write_error(struct dentry_priv *dpr);
+int  _unified_async_init(struct unified_data *priv);
+void _unified_async_destroy(struct unified_data *priv);
+void _unified_async_stop(struct unified_data *priv);
+ltfs_thread_return _unified_async_thread(void *iosched_handle);
+char *_unified_psi_path(void);
+int  _unified_psi_read(double *pressure, struct unified_data *priv);
+void _unified_pool_start(struct unified_data *priv);
+void _unified_pool_stop(struct unified_data *priv);
+void _unified_pool_shrink(uint32_t blocks, struct unified_data *priv);
+void _unified_pool_grow(uint32_t blocks, struct unified_data *priv);
+ltfs_thread_return _unified_pool_thread(void *iosched_handle);
 
 /**
  * Initialize an instance of the unified scheduler.
@@ -266,6 +679,7 @@ int _unified_get_write_error(struct dentry_priv *dpr);
 void *unified_init(struct ltfs_volume *vol)
 {
 	int ret;
+	uint32_t i;
 	struct unified_data *priv;
 	size_t pool_size, max_pool_size, cache_size;
 
@@ -292,6 +706,10 @@ void *unified_init(struct ltfs_volume *vol)
 		return NULL;
 	}
 
+	/* Only the first req->count bytes of a cache block are ever read back or written to tape
+	 * (partial blocks are written as short records), so blocks need not be cleared when freed. */
+	cache_manager_set_dirty_blocks(priv->pool, true);
+
 	/* Initialize mutexes and condition variables.
 	 * These calls never fail on Linux, but they can fail on OS X. */
 	ret = ltfs_thread_mutex_init(&priv->cache_lock);
@@ -333,9 +751,49 @@ void *unified_init(struct ltfs_volume *vol)
 		return NULL;
 	}
 
-	ret = init_mrsw(&priv->lock);
+	ret = _unified_shards_init(priv);
+	if (ret < 0) {
+		ltfs_thread_cond_destroy(&priv->queue_cond);
+		ltfs_thread_mutex_destroy(&priv->queue_lock);
+		ltfs_thread_cond_destroy(&priv->cache_cond);
+		ltfs_thread_mutex_destroy(&priv->cache_lock);
+		cache_manager_destroy(priv->pool);
+		free(priv);
+		return NULL;
+	}
+
+	ret = _unified_ring_init(priv);
+	if (ret < 0) {
+		_unified_shards_destroy(priv);
+		ltfs_thread_cond_destroy(&priv->queue_cond);
+		ltfs_thread_mutex_destroy(&priv->queue_lock);
+		ltfs_thread_cond_destroy(&priv->cache_cond);
+		ltfs_thread_mutex_destroy(&priv->cache_lock);
+		cache_manager_destroy(priv->pool);
+		free(priv);
+		return NULL;
+	}
+
+	ret = ltfs_thread_mutex_init(&priv->clean_lock);
+	if (ret) {
+		/* Cannot initialize scheduler: failed to initialize mutex %s (%d) */
+		ltfsmsg(LTFS_ERR, "13006E", "clean_lock", ret);
+		_unified_ring_destroy(priv);
+		_unified_shards_destroy(priv);
+		ltfs_thread_cond_destroy(&priv->queue_cond);
+		ltfs_thread_mutex_destroy(&priv->queue_lock);
+		ltfs_thread_cond_destroy(&priv->cache_cond);
+		ltfs_thread_mutex_destroy(&priv->cache_lock);
+		cache_manager_destroy(priv->pool);
+		free(priv);
+		return NULL;
+	}
+
+	ret = _unified_async_init(priv);
 	if (ret < 0) {
-		ltfsmsg(LTFS_ERR, "13006E", "lock", ret);
+		ltfs_thread_mutex_destroy(&priv->clean_lock);
+		_unified_ring_destroy(priv);
+		_unified_shards_destroy(priv);
 		ltfs_thread_cond_destroy(&priv->queue_cond);
 		ltfs_thread_mutex_destroy(&priv->queue_lock);
 		ltfs_thread_cond_destroy(&priv->cache_cond);
@@ -345,28 +803,51 @@ void *unified_init(struct ltfs_volume *vol)
 		return NULL;
 	}
 
-	TAILQ_INIT(&priv->working_set);
-	TAILQ_INIT(&priv->dp_queue);
-	TAILQ_INIT(&priv->ip_queue);
 	TAILQ_INIT(&priv->ext_queue);
-	priv->ws_request_count = priv->dp_request_count = priv->ip_request_count = 0;
+	TAILQ_INIT(&priv->pack_queue);
+	TAILQ_INIT(&priv->clean_lru);
+	priv->clean_max = (uint32_t)(UNIFIED_CLEAN_HIGH_WATERMARK * priv->cache_blocks);
+	priv->priority_reserve = (uint32_t)(UNIFIED_PRIORITY_RESERVE * priv->cache_blocks);
+	priv->pack_tails = ltfs_small_file_packing(vol);
+	priv->burst_scale = 1;
+	_unified_tune_flush(priv);
 	priv->writer_keepalive = true;
+	priv->tape_keepalive = true;
+	priv->async_keepalive = true;
 	priv->vol = vol;
 
-	ret = ltfs_thread_create(&priv->writer_thread, _unified_writer_thread, priv);
+	ret = ltfs_thread_create(&priv->tape_thread, _unified_tape_thread, priv);
+	if (! ret) {
+		for (i = 0; i < UNIFIED_WRITER_THREADS; ++i) {
+			ret = ltfs_thread_create(&priv->writer_threads[i], _unified_writer_thread, priv);
+			if (ret) {
+				_unified_stop_threads(priv);
+				break;
+			}
+			++priv->writer_count;
+		}
+	}
 	if (ret) {
 		/* Cannot initialize scheduler: failed to create thread */
 		ltfsmsg(LTFS_ERR, "13008E", "queue_cond", ret);
+		_unified_async_destroy(priv);
+		ltfs_thread_mutex_destroy(&priv->clean_lock);
+		_unified_ring_destroy(priv);
 		ltfs_thread_cond_destroy(&priv->queue_cond);
 		ltfs_thread_mutex_destroy(&priv->queue_lock);
 		ltfs_thread_cond_destroy(&priv->cache_cond);
 		ltfs_thread_mutex_destroy(&priv->cache_lock);
-		destroy_mrsw(&priv->lock);
+		_unified_shards_destroy(priv);
 		cache_manager_destroy(priv->pool);
 		free(priv);
 		return NULL;
 	}
 
+	priv->pool_floor = pool_size;
+	if (priv->pool_floor < 2 * priv->priority_reserve)
+		priv->pool_floor = 2 * priv->priority_reserve;
+	_unified_pool_start(priv);
+
 	/* Unified I/O scheduler initialized */
 	ltfsmsg(LTFS_DEBUG, "13015D");
 	return priv;
@@ -385,14 +866,13 @@ int unified_destroy(void *iosched_handle)
 
 	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
 
-	/* Flush everything and wait for the writer thread */
-	acquirewrite_mrsw(&priv->lock);
-	ltfs_thread_mutex_lock(&priv->queue_lock);
-	priv->writer_keepalive = false;
-	ltfs_thread_cond_signal(&priv->queue_cond);
-	ltfs_thread_mutex_unlock(&priv->queue_lock);
-	releasewrite_mrsw(&priv->lock);
-	ltfs_thread_join(priv->writer_thread);
+	/* Stop the background threads, then flush everything. The async threads go first:
+	 * they finish the requests already submitted, which may need the writer threads. */
+	_unified_pool_stop(priv);
+	_unified_async_stop(priv);
+	_unified_stop_threads(priv);
+	_unified_flush_all(priv);
+	_unified_process_queue(REQUEST_IP, priv);
 
 	/* Push IP extents to libltfs and free remaining dentry_priv structures */
 	if (! TAILQ_EMPTY(&priv->ext_queue)) {
@@ -400,12 +880,18 @@ int unified_destroy(void *iosched_handle)
 			_unified_free_dentry_priv(dpr->dentry, priv);
 	}
 
+	/* Give the cache blocks of the clean tier back to the pool */
+	while (_unified_clean_reclaim(priv));
+
 	/* Free data structures */
+	_unified_async_destroy(priv);
+	ltfs_thread_mutex_destroy(&priv->clean_lock);
+	_unified_ring_destroy(priv);
 	ltfs_thread_cond_destroy(&priv->queue_cond);
 	ltfs_thread_mutex_destroy(&priv->queue_lock);
 	ltfs_thread_cond_destroy(&priv->cache_cond);
 	ltfs_thread_mutex_destroy(&priv->cache_lock);
-	destroy_mrsw(&priv->lock);
+	_unified_shards_destroy(priv);
 	cache_manager_destroy(priv->pool);
 	free(priv);
 
@@ -450,27 +936,47 @@ int unified_open(const char *path, bool open_write, struct dentry **dentry, void
 int unified_close(struct dentry *d, bool flush, void *iosched_handle)
 {
 	int write_error, ret = 0;
+	bool packing;
 	struct unified_data *priv = iosched_handle;
+	struct dentry_priv *dpr;
+	struct unified_shard *shard;
 
 	CHECK_ARG_NULL(d, -LTFS_NULL_ARG);
 	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+	shard = _unified_get_shard(d, priv);
 #if 0
 	ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_ENTER(REQ_IOS_CLOSE));
 #endif /* 0 */
 
-	acquireread_mrsw(&priv->lock);
+	acquireread_mrsw(&shard->lock);
 	ltfs_mutex_lock(&d->iosched_lock);
 	if (flush)
 		ret = _unified_flush_unlocked(d, priv);
 	write_error = _unified_get_write_error(d->iosched_priv);
 	_unified_free_dentry_priv_conditional(d, 3, priv);
+
+	/* A tail waiting to be packed keeps the dentry_priv alive. If the pack is written
+	 * before this handle is gone, the dentry_priv must be freed below instead. */
+	dpr = d->iosched_priv;
+	packing = dpr && dpr->in_pack_queue;
+	if (packing)
+		ltfs_fsraw_get_dentry(d, priv->vol);
 	ltfs_mutex_unlock(&d->iosched_lock);
-	releaseread_mrsw(&priv->lock);
+	releaseread_mrsw(&shard->lock);
 
 	/* No need to hold any scheduler locks when closing the file. All writes which were
 	 * outstanding when the close request started have been issued. */
 	ltfs_fsraw_close(d);
 
+	if (packing) {
+		acquireread_mrsw(&shard->lock);
+		ltfs_mutex_lock(&d->iosched_lock);
+		_unified_free_dentry_priv_conditional(d, 2, priv);
+		ltfs_mutex_unlock(&d->iosched_lock);
+		releaseread_mrsw(&shard->lock);
+		ltfs_fsraw_put_dentry(d, priv->vol);
+	}
+
 #if 0
 	ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EXIT(REQ_IOS_CLOSE));
 #endif /* 0 */
@@ -482,7 +988,7 @@ int unified_close(struct dentry *d, bool flush, void *iosched_handle)
  * Read from a file.
  * This checks the outstanding write queue for any overlapping blocks. It issues
  * ltfs_fsraw_read() requests for any parts of the requested block which are not
- * in the write queue.
+ * in the write queue, unless recently written blocks in the clean tier cover them.
  * @param d File to read.
  * @param buf Output buffer for data read from the file.
  * @param size Number of bytes to read.
@@ -495,8 +1001,11 @@ ssize_t unified_read(struct dentry *d, char *buf, size_t size, off_t offset, voi
 {
 	struct unified_data *priv = iosched_handle;
 	struct dentry_priv *dpr;
+	struct unified_shard *shard;
 	struct write_request *req;
 	struct read_request *rreq, *rreq_aux;
+	struct read_request local_rreqs[UNIFIED_READ_GAPS];
+	uint32_t nlocal = 0;
 	ssize_t ret = 0, nread;
 	size_t to_read;
 	bool past_eof = false, have_io_lock = false;
@@ -506,6 +1015,7 @@ ssize_t unified_read(struct dentry *d, char *buf, size_t size, off_t offset, voi
 	CHECK_ARG_NULL(d, -LTFS_NULL_ARG);
 	CHECK_ARG_NULL(buf, -LTFS_NULL_ARG);
 	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+	shard = _unified_get_shard(d, priv);
 
 #if 0
 	ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_ENTER(REQ_IOS_READ));
@@ -519,7 +1029,7 @@ ssize_t unified_read(struct dentry *d, char *buf, size_t size, off_t offset, voi
 		return 0;
 	}
 
-	acquireread_mrsw(&priv->lock);
+	acquireread_mrsw(&shard->lock);
 	ret = ltfs_get_volume_lock(false, priv->vol);
 	if (ret < 0)
 		goto out;
@@ -529,22 +1039,25 @@ ssize_t unified_read(struct dentry *d, char *buf, size_t size, off_t offset, voi
 	dpr = d->iosched_priv;
 	if (! dpr) {
 		ltfs_mutex_unlock(&d->iosched_lock);
-		ret = ltfs_fsraw_read(d, buf, size, offset, priv->vol);
+		ret = _unified_read_clean(d, buf, size, offset, priv);
 		goto out;
 	}
 
+	/* Data handed to the tape thread is in neither the request list nor libltfs yet */
+	_unified_wait_batches(dpr, priv);
+
 	/* If there are no outstanding requests, get data from libltfs */
 	if (TAILQ_EMPTY(&dpr->requests)) {
 		ltfs_mutex_lock(&dpr->io_lock);
 		ltfs_mutex_unlock(&d->iosched_lock);
-		ret = ltfs_fsraw_read(d, buf, size, offset, priv->vol);
+		ret = _unified_read_clean(d, buf, size, offset, priv);
 		ltfs_mutex_unlock(&dpr->io_lock);
 		goto out;
 	}
 
 	/* Check for cached write data, queueing up read requests for any holes in the write
 	 * request queue. */
-	TAILQ_FOREACH(req, &dpr->requests, list) {
+	for (req = _unified_seek_request(offset, dpr, priv); req; req = TAILQ_NEXT(req, list)) {
 		/* Need to get more bytes before looking at this request? */
 		if ((uint64_t)offset < req->offset) {
 			to_read = req->offset - offset;
@@ -552,12 +1065,18 @@ ssize_t unified_read(struct dentry *d, char *buf, size_t size, off_t offset, voi
 				to_read = size;
 
 			/* Queue up a tape read */
-			rreq = malloc(sizeof(struct read_request));
-			if (! rreq) {
-				ltfsmsg(LTFS_ERR, "10001E", "unified_read: read request");
-				ltfs_mutex_unlock(&d->iosched_lock);
-				ret = -LTFS_NO_MEMORY;
-				goto out;
+			if (nlocal < UNIFIED_READ_GAPS) {
+				rreq = &local_rreqs[nlocal++];
+				rreq->heap = false;
+			} else {
+				rreq = malloc(sizeof(struct read_request));
+				if (! rreq) {
+					ltfsmsg(LTFS_ERR, "10001E", "unified_read: read request");
+					ltfs_mutex_unlock(&d->iosched_lock);
+					ret = -LTFS_NO_MEMORY;
+					goto out;
+				}
+				rreq->heap = true;
 			}
 			rreq->offset = offset;
 			rreq->buf = buf;
@@ -602,10 +1121,13 @@ ssize_t unified_read(struct dentry *d, char *buf, size_t size, off_t offset, voi
 			nread = 0;
 
 			/* Read from tape */
+			TAILQ_REMOVE(&requests, rreq, list);
 			if (! past_eof) {
-				nread = ltfs_fsraw_read(d, rreq->buf, to_read, rreq->offset, priv->vol);
+				nread = _unified_read_clean(d, rreq->buf, to_read, rreq->offset, priv);
 				if (nread < 0) {
 					ltfs_mutex_unlock(&dpr->io_lock);
+					if (rreq->heap)
+						free(rreq);
 					ret = nread;
 					goto out;
 				} else if ((size_t)nread < to_read)
@@ -623,7 +1145,8 @@ ssize_t unified_read(struct dentry *d, char *buf, size_t size, off_t offset, voi
 			if (to_read > 0)
 				memset(rreq->buf + nread, 0, to_read);
 
-			free(rreq);
+			if (rreq->heap)
+				free(rreq);
 		}
 	}
 
@@ -635,7 +1158,7 @@ ssize_t unified_read(struct dentry *d, char *buf, size_t size, off_t offset, voi
 			ltfs_mutex_lock(&dpr->io_lock);
 			ltfs_mutex_unlock(&d->iosched_lock);
 		}
-		nread = ltfs_fsraw_read(d, buf, size, offset, priv->vol);
+		nread = _unified_read_clean(d, buf, size, offset, priv);
 		if (nread > 0)
 			ret += nread;
 		else if (nread < 0)
@@ -647,7 +1170,13 @@ ssize_t unified_read(struct dentry *d, char *buf, size_t size, off_t offset, voi
 		ltfs_mutex_unlock(&d->iosched_lock);
 
 out:
-	releaseread_mrsw(&priv->lock);
+	releaseread_mrsw(&shard->lock);
+
+	/* Reads not issued because of an error */
+	TAILQ_FOREACH_SAFE(rreq, &requests, list, rreq_aux) {
+		if (rreq->heap)
+			free(rreq);
+	}
 
 #if 0
 	ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EXIT(REQ_IOS_READ));
@@ -677,6 +1206,7 @@ ssize_t unified_write(struct dentry *d, const char *buf, size_t size, off_t offs
 	ssize_t ret = 0;
 	struct unified_data *priv = iosched_handle;
 	struct dentry_priv *dpr;
+	struct unified_shard *shard;
 	struct write_request *req, *aux, *prev_req;
 	char *req_cache;
 	size_t original_size = size;
@@ -685,10 +1215,12 @@ ssize_t unified_write(struct dentry *d, const char *buf, size_t size, off_t offs
 	off_t last_offset;
 	int did_merge = 0;
 	bool checked_readonly = false;
+	bool checked_stream = false;
 
 	CHECK_ARG_NULL(d, -LTFS_NULL_ARG);
 	CHECK_ARG_NULL(buf, -LTFS_NULL_ARG);
 	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+	shard = _unified_get_shard(d, priv);
 
 #if 0
 	ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_ENTER(REQ_IOS_WRITE));
@@ -696,10 +1228,10 @@ ssize_t unified_write(struct dentry *d, const char *buf, size_t size, off_t offs
 	if (size == 0)
 		return 0;
 
-	acquireread_mrsw(&priv->lock);
+	acquireread_mrsw(&shard->lock);
 	ret = ltfs_get_volume_lock(false, priv->vol);
 	if (ret < 0) {
-		releaseread_mrsw(&priv->lock);
+		releaseread_mrsw(&shard->lock);
 #if 0
 		ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EXIT(REQ_IOS_WRITE));
 #endif /* 0 */
@@ -719,11 +1251,12 @@ write_start:
 	}
 
 	/* Check if a write request previously queued resulted in a write error */
+	_unified_collect_batch_error(dpr, priv);
 	ret = _unified_get_write_error(dpr);
 	if (ret < 0) {
 		/* Propagate the write error to the caller */
 		ltfs_mutex_unlock(&d->iosched_lock);
-		releaseread_mrsw(&priv->lock);
+		releaseread_mrsw(&shard->lock);
 #if 0
 		ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EXIT(REQ_IOS_WRITE));
 #endif /* 0 */
@@ -738,7 +1271,7 @@ write_start:
 		/*  Otherwise you get "successful" writes but incomplete files */
 		if (ret < 0 && ret != -LTFS_NO_SPACE) {
 			ltfs_mutex_unlock(&d->iosched_lock);
-			releaseread_mrsw(&priv->lock);
+			releaseread_mrsw(&shard->lock);
 #if 0
 			ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EXIT(REQ_IOS_WRITE));
 #endif /* 0 */
@@ -755,6 +1288,18 @@ write_start:
 			_unified_unset_write_ip(dpr, priv);
 	}
 
+	/* Detect large sequential writes. FUSE splits them into requests smaller than a cache
+	 * block, so look at the run of consecutive writes rather than at the size of each one. */
+	if (! checked_stream) {
+		if ((uint64_t)offset == dpr->stream_end && ! dpr->write_ip)
+			dpr->stream_bytes += size;
+		else
+			dpr->stream_bytes = size;
+		dpr->stream_end = offset + size;
+		dpr->direct = dpr->stream_bytes >= (uint64_t)UNIFIED_DIRECT_THRESHOLD * priv->cache_size;
+		checked_stream = true;
+	}
+
 do_append:
 
 	if (TAILQ_EMPTY(&dpr->requests)) {
@@ -775,6 +1320,7 @@ do_append:
 			buf += copy_count;
 			offset += copy_count;
 			size -= copy_count;
+			_unified_direct_write(dpr, priv);
 		}
 
 		/* Append new request(s) to the end of the queue */
@@ -789,13 +1335,16 @@ do_append:
 			buf += ret;
 			offset += ret;
 			size -= ret;
+			_unified_direct_write(dpr, priv);
 		}
 		goto out;
 	}
 
-	/* Not a simple append; need to traverse the request list */
+	/* Not a simple append; need to traverse the request list from the first request
+	 * the new write can touch */
 	prev_req = NULL;
-	TAILQ_FOREACH_SAFE(req, &dpr->requests, list, aux) {
+	for (req = _unified_seek_request(offset, dpr, priv); req && (aux = TAILQ_NEXT(req, list), 1);
+		req = aux) {
 		/* Skip this request the new write belongs farther down the queue */
 		if ((uint64_t)offset > req->offset + req->count)
 			continue;
@@ -843,14 +1392,13 @@ do_insert_before:
 			} else if (req->state == REQUEST_IP && (uint64_t)offset < req->offset + req->count) {
 				/* Truncate, split or remove this request to avoid overlapping with the new write */
 				if ((uint64_t)offset == req->offset && size >= req->count) { /* Remove */
-					TAILQ_REMOVE(&dpr->requests, req, list);
+					_unified_remove_request(req, dpr);
 					_unified_update_queue_membership(false, false, REQUEST_IP, dpr, priv);
-					if (spare_cache)
-						_unified_free_request(req, priv);
-					else {
+					if (! spare_cache) {
 						spare_cache = req->write_cache;
-						free(req);
+						req->write_cache = NULL;
 					}
+					_unified_free_request(req, dpr, priv);
 					continue;
 				} else if ((uint64_t)offset == req->offset) {
 					/* Truncate from the beginning */
@@ -897,6 +1445,7 @@ out:
                 acquirewrite_mrsw(&d->meta_lock);
                 get_current_timespec(&d->modify_time);
                 d->change_time = d->modify_time;
+                fs_set_xml_dirty(d);
                 releasewrite_mrsw(&d->meta_lock);
             }
 			/* Don't set index dirty flag here. Will be set later by ltfs_fsraw_add_extent. */
@@ -906,7 +1455,7 @@ out:
 	ltfs_mutex_unlock(&d->iosched_lock);
 	if (spare_cache)
 		_unified_cache_free(spare_cache, 0, priv);
-	releaseread_mrsw(&priv->lock);
+	releaseread_mrsw(&shard->lock);
 #if 0
 	ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EXIT(REQ_IOS_WRITE));
 #endif /* 0 */
@@ -925,6 +1474,8 @@ int unified_flush(struct dentry *d, bool closeflag, void *iosched_handle)
 {
 	int ret;
 	struct unified_data *priv = iosched_handle;
+	struct unified_shard *shard;
+	struct unified_counts counts;
 
 	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
 #if 0
@@ -932,14 +1483,22 @@ int unified_flush(struct dentry *d, bool closeflag, void *iosched_handle)
 #endif /* 0 */
 
 	if (d) {
-		acquireread_mrsw(&priv->lock);
+		shard = _unified_get_shard(d, priv);
+		acquireread_mrsw(&shard->lock);
 		ltfs_mutex_lock(&d->iosched_lock);
 		ret = _unified_flush_unlocked(d, priv);
 		ltfs_mutex_unlock(&d->iosched_lock);
-		releaseread_mrsw(&priv->lock);
-	} else
+		releaseread_mrsw(&shard->lock);
+	} else {
 		ret = _unified_flush_all(priv);
 
+		/* A volume-wide flush comes right before an index write, which is the cheapest time
+		 * to visit the index partition. */
+		_unified_sum_counts(&counts, priv);
+		if (ret == 0 && counts.ip_request_count >= (uint32_t)(IP_SYNC_WATERMARK * priv->cache_blocks))
+			_unified_process_queue(REQUEST_IP, priv);
+	}
+
 #if 0
 	ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EXIT(REQ_IOS_FLUSH));
 #endif /* 0 */
@@ -958,6 +1517,7 @@ int unified_truncate(struct dentry *d, off_t length, void *iosched_handle)
 	int ret;
 	struct unified_data *priv = iosched_handle;
 	struct dentry_priv *dpr;
+	struct unified_shard *shard;
 	struct write_request *req, *aux;
 	struct extent_info *ext, *ext_aux;
 	uint64_t max_filesize;
@@ -965,6 +1525,7 @@ int unified_truncate(struct dentry *d, off_t length, void *iosched_handle)
 
 	CHECK_ARG_NULL(d, -LTFS_NULL_ARG);
 	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+	shard = _unified_get_shard(d, priv);
 #if 0
 	ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_ENTER(REQ_IOS_TRUNCATE));
 #endif /* 0 */
@@ -978,18 +1539,19 @@ int unified_truncate(struct dentry *d, off_t length, void *iosched_handle)
 		return ret;
 	}
 
-	acquireread_mrsw(&priv->lock);
+	acquireread_mrsw(&shard->lock);
 	ltfs_mutex_lock(&d->iosched_lock);
 
 	dpr = d->iosched_priv;
 	if (dpr) {
+		_unified_wait_batches(dpr, priv);
 		if ((uint64_t)length < dpr->file_size) {
 			if (! TAILQ_EMPTY(&dpr->requests)) {
 				TAILQ_FOREACH_REVERSE_SAFE(req, &dpr->requests, req_struct, list, aux) {
 					if (req->offset >= (uint64_t)length) {
-						TAILQ_REMOVE(&dpr->requests, req, list);
+						_unified_remove_request(req, dpr);
 						_unified_update_queue_membership(false, false, req->state, dpr, priv);
-						_unified_free_request(req, priv);
+						_unified_free_request(req, dpr, priv);
 					} else if (req->offset + req->count > (uint64_t)length)
 						req->count = length - req->offset;
 					else
@@ -1032,8 +1594,11 @@ int unified_truncate(struct dentry *d, off_t length, void *iosched_handle)
 		ltfs_mutex_unlock(&dpr->io_lock);
 	}
 
+	/* Written data past the new end of file is gone, even if the file grows again */
+	_unified_clean_invalidate(d->uid, length, UINT64_MAX, priv);
+
 	ltfs_mutex_unlock(&d->iosched_lock);
-	releaseread_mrsw(&priv->lock);
+	releaseread_mrsw(&shard->lock);
 
 	if (! dpr)
 		ret = ltfs_fsraw_truncate(d, length, priv->vol);
@@ -1055,22 +1620,24 @@ uint64_t unified_get_filesize(struct dentry *d, void *iosched_handle)
 {
 	struct unified_data *priv = iosched_handle;
 	struct dentry_priv *dentry_priv;
+	struct unified_shard *shard;
 	uint64_t size;
 
 	CHECK_ARG_NULL(d, -LTFS_NULL_ARG);
 	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+	shard = _unified_get_shard(d, priv);
 #if 0
 	ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_ENTER(REQ_IOS_GETFSIZE));
 #endif /* 0 */
 
 	/* Try to get the file size from the dentry_priv */
-	acquireread_mrsw(&priv->lock);
+	acquireread_mrsw(&shard->lock);
 	ltfs_mutex_lock(&d->iosched_lock);
 	dentry_priv = (struct dentry_priv *) d->iosched_priv;
 	if (dentry_priv)
 		size = dentry_priv->file_size;
 	ltfs_mutex_unlock(&d->iosched_lock);
-	releaseread_mrsw(&priv->lock);
+	releaseread_mrsw(&shard->lock);
 
 	/* If there was no dentry_priv, return file size as stored in the dentry structure */
 	if (! dentry_priv) {
@@ -1100,16 +1667,18 @@ int unified_update_data_placement(struct dentry *d, void *iosched_handle)
 {
 	struct unified_data *priv = (struct unified_data *) iosched_handle;
 	struct dentry_priv *dpr;
+	struct unified_shard *shard;
 	uint64_t filesize, max_filesize;
 	bool matches_name_criteria, deleted;
 
 	CHECK_ARG_NULL(d, -LTFS_NULL_ARG);
 	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+	shard = _unified_get_shard(d, priv);
 #if 0
 	ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_ENTER(REQ_IOS_UPDPLACE));
 #endif /* 0 */
 
-	acquireread_mrsw(&priv->lock);
+	acquireread_mrsw(&shard->lock);
 	ltfs_mutex_lock(&d->iosched_lock);
 
 	dpr = d->iosched_priv;
@@ -1132,7 +1701,7 @@ int unified_update_data_placement(struct dentry *d, void *iosched_handle)
 
 out:
 	ltfs_mutex_unlock(&d->iosched_lock);
-	releaseread_mrsw(&priv->lock);
+	releaseread_mrsw(&shard->lock);
 
 #if 0
 	ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EXIT(REQ_IOS_UPDPLACE));
@@ -1140,48 +1709,148 @@ out:
 	return 0;
 }
 
+/**
+ * Describe the state of the flush controller: the measured drive rate, the current flush trigger
+ * and batch size, and the occupancy of the cache, of the clean tier and of the ready ring.
+ * requestAllocs counts the write_request structures that could not be reused from a shard and
+ * were taken from the heap instead.
+ * @param state On success, points to a newly allocated string. The caller must free it.
+ * @param iosched_handle the I/O scheduler handle.
+ * @return 0 on success or a negative value on error.
+ */
+int unified_get_state(char **state, void *iosched_handle)
+{
+	struct unified_data *priv = (struct unified_data *) iosched_handle;
+	struct unified_counts counts;
+	uint32_t ring_count, clean_count, i;
+	uint64_t request_allocs = 0;
+	int ret;
+
+	CHECK_ARG_NULL(state, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+
+	ltfs_thread_mutex_lock(&priv->ring_lock);
+	ring_count = priv->ring_count;
+	ltfs_thread_mutex_unlock(&priv->ring_lock);
+
+	ltfs_thread_mutex_lock(&priv->clean_lock);
+	clean_count = priv->clean_count;
+	ltfs_thread_mutex_unlock(&priv->clean_lock);
+
+	for (i = 0; i < UNIFIED_SHARDS; ++i) {
+		ltfs_thread_mutex_lock(&priv->shards[i].queue_lock);
+		request_allocs += priv->shards[i].request_allocs;
+		ltfs_thread_mutex_unlock(&priv->shards[i].queue_lock);
+	}
+
+	ltfs_thread_mutex_lock(&priv->queue_lock);
+	_unified_sum_counts(&counts, priv);
+	ret = asprintf(state, "driveRate=%"PRIu64" streaming=%d restarts=%"PRIu64" written=%"PRIu64
+		" burstScale=%"PRIu32" flushTrigger=%"PRIu32" flushBatch=%"PRIu32
+		" cacheBlocks=%zu partial=%"PRIu32" full=%"PRIu32" index=%"PRIu32" packed=%"PRIu32
+		" clean=%"PRIu32"/%"PRIu32" ring=%"PRIu32"/%d requestAllocs=%"PRIu64
+		" priorityFiles=%"PRIu32" priorityReserve=%"PRIu32" direct=%"PRIu64" parked=%"PRIu32
+		" ipFlushes=%"PRIu64" partitionSwitches=%"PRIu64,
+		priv->drive_rate, priv->tape_streaming ? 1 : 0, priv->tape_restarts, priv->tape_bytes,
+		priv->burst_scale, priv->flush_trigger, priv->flush_batch,
+		priv->cache_blocks, counts.ws_request_count, counts.dp_request_count,
+		counts.ip_request_count, priv->pack_count, clean_count, priv->clean_max,
+		ring_count, UNIFIED_READY_RING_SIZE, request_allocs,
+		priv->priority_files, priv->priority_reserve, priv->direct_bytes, priv->pool_parked,
+		priv->ip_flushes, ltfs_get_partition_switches(priv->vol));
+	ltfs_thread_mutex_unlock(&priv->queue_lock);
+
+	if (ret < 0) {
+		ltfsmsg(LTFS_ERR, "10001E", "unified_get_state: state");
+		*state = NULL;
+		return -LTFS_NO_MEMORY;
+	}
+	return 0;
+}
+
 /**
  * Background writer thread.
  * Processes requests from the dp_queue, working_set and ip_queue. The latter is only
  * processed when the number of requests waiting in that queue exceeds the high watermark
- * specified for the index partition.
+ * specified for the index partition; otherwise it is left for the next volume-wide flush.
+ * While the drive is idle, full blocks are held back until the flush trigger is reached, so that
+ * the tape thread gets a burst long enough to keep the drive streaming.
  * @param iosched_handle Handle to the I/O scheduler data.
  * @return NULL.
  */
 ltfs_thread_return _unified_writer_thread(void *iosched_handle)
 {
 	struct unified_data *priv = (struct unified_data *) iosched_handle;
+	struct unified_counts counts;
+	struct ltfs_timespec hold_start, now, held;
+	bool holding = false;
 
 	while (true) {
 		ltfs_thread_mutex_lock(&priv->queue_lock);
 #if 0
 		ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EXIT(REQ_IOS_IOSCHED));
 #endif /* 0 */
-		while (TAILQ_EMPTY(&priv->dp_queue) && priv->cache_requests == 0 && priv->writer_keepalive)
+		while (priv->cache_requests == 0 && priv->pack_bytes < priv->cache_size &&
+			priv->writer_keepalive) {
+			/* A shard adding the first file to its dp_queue signals queue_cond under queue_lock,
+			 * so the unlocked sum cannot miss it before this thread waits */
+			_unified_sum_counts(&counts, priv);
+			if (counts.dp_count == 0)
+				holding = false;
+			else if (counts.dp_request_count >= priv->flush_trigger || priv->tape_streaming ||
+				counts.dp_priority_count > 0)
+				break; /* Priority files do not wait for a burst to build up */
+			else {
+				/* Let a burst build up for the idle drive, but do not hold data back forever */
+				get_current_timespec(&now);
+				if (! holding) {
+					hold_start = now;
+					holding = true;
+				}
+				timer_sub(&now, &hold_start, &held);
+				if (held.tv_sec >= UNIFIED_FLUSH_DELAY || held.tv_sec < 0)
+					break;
+				ltfs_thread_cond_timedwait(&priv->queue_cond, &priv->queue_lock, 1);
+				continue;
+			}
 			ltfs_thread_cond_wait(&priv->queue_cond, &priv->queue_lock);
+		}
+		holding = false;
 
 #if 0
 		ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_ENTER(REQ_IOS_IOSCHED));
 #endif /* 0 */
 		if (! priv->writer_keepalive) {
 			ltfs_thread_mutex_unlock(&priv->queue_lock);
-			_unified_flush_all(priv);
-			_unified_process_queue(REQUEST_IP, priv);
 			break;
 
 		} else if (priv->cache_requests > 0) {
 			uint32_t num_waiting = priv->cache_requests;
-			uint32_t num_dp = priv->dp_request_count;
-			uint32_t num_ip = priv->ip_request_count;
+			uint32_t num_dp, num_ip;
+			uint32_t num_pack = priv->pack_count;
+			uint32_t num_trigger = priv->flush_trigger;
 			ltfs_thread_mutex_unlock(&priv->queue_lock);
 
-			if (num_dp > 2 * num_waiting)
+			_unified_sum_counts(&counts, priv);
+			num_dp = counts.dp_request_count;
+			num_ip = counts.ip_request_count;
+
+			/* Full blocks free cache just as well as partial ones, and a whole burst of them
+			 * keeps the drive streaming */
+			if (num_dp > 2 * num_waiting || num_dp >= num_trigger)
 				_unified_process_queue(REQUEST_DP, priv);
+			else if (num_pack > 0)
+				/* Each tail waiting to be packed holds a whole cache block */
+				_unified_process_pack_queue(priv);
 			else if (num_ip < (uint32_t)(IP_HIGH_WATERMARK * priv->cache_blocks))
 				_unified_process_queue(REQUEST_PARTIAL, priv);
 			else
 				_unified_process_queue(REQUEST_IP, priv);
 
+		} else if (priv->pack_bytes >= priv->cache_size) {
+			ltfs_thread_mutex_unlock(&priv->queue_lock);
+			_unified_process_pack_queue(priv);
+
 		} else {
 			ltfs_thread_mutex_unlock(&priv->queue_lock);
 			_unified_process_queue(REQUEST_DP, priv);
@@ -1192,8 +1861,1061 @@ ltfs_thread_return _unified_writer_thread(void *iosched_handle)
 	return LTFS_THREAD_RC_NULL;
 }
 
-void _unified_process_queue(enum request_state queue, struct unified_data *priv)
-{
+/**
+ * Tape thread.
+ * Writes the batches prepared by the background writer threads to the data partition, in the
+ * order they were queued. This thread does not take any shard lock or dentry lock, so the
+ * writer threads can keep preparing batches while the drive is busy.
+ * @param iosched_handle Handle to the I/O scheduler data.
+ * @return NULL.
+ */
+ltfs_thread_return _unified_tape_thread(void *iosched_handle)
+{
+	struct unified_data *priv = (struct unified_data *) iosched_handle;
+	struct write_batch *batch;
+	struct ltfs_timespec start, end, elapsed;
+	size_t bytes;
+	bool idle;
+
+	while (true) {
+		ltfs_thread_mutex_lock(&priv->ring_lock);
+		idle = (priv->ring_count == 0);
+		if (idle) {
+			/* The drive is about to run out of data */
+			ltfs_thread_mutex_unlock(&priv->ring_lock);
+			_unified_tape_state(false, priv);
+			ltfs_thread_mutex_lock(&priv->ring_lock);
+		}
+		while (priv->ring_count == 0 && priv->tape_keepalive)
+			ltfs_thread_cond_wait(&priv->ring_cond, &priv->ring_lock);
+
+		if (priv->ring_count == 0) {
+			ltfs_thread_mutex_unlock(&priv->ring_lock);
+			break;
+		}
+
+		batch = priv->ready_ring[priv->ring_head];
+		priv->ring_head = (priv->ring_head + 1) % UNIFIED_READY_RING_SIZE;
+		--priv->ring_count;
+		++priv->ring_active;
+		ltfs_thread_cond_signal(&priv->ring_space_cond);
+		ltfs_thread_mutex_unlock(&priv->ring_lock);
+
+		if (idle)
+			_unified_tape_state(true, priv);
+
+		get_current_timespec(&start);
+		bytes = _unified_write_batch(batch, priv);
+		get_current_timespec(&end);
+		timer_sub(&end, &start, &elapsed);
+		if (bytes > 0 && elapsed.tv_sec >= 0)
+			_unified_tape_sample(bytes, &elapsed, priv);
+
+		ltfs_thread_mutex_lock(&priv->ring_lock);
+		--batch->dpr->inflight;
+		--priv->ring_active;
+		ltfs_thread_cond_broadcast(&priv->ring_done_cond);
+		ltfs_thread_mutex_unlock(&priv->ring_lock);
+		free(batch);
+	}
+
+	ltfs_thread_exit();
+	return LTFS_THREAD_RC_NULL;
+}
+
+/**
+ * Initialize the ready ring and its locks.
+ * @param priv Handle to the I/O scheduler data.
+ * @return 0 on success or a negative value on error.
+ */
+int _unified_ring_init(struct unified_data *priv)
+{
+	int ret;
+
+	ret = ltfs_thread_mutex_init(&priv->ring_lock);
+	if (ret) {
+		/* Cannot initialize scheduler: failed to initialize mutex %s (%d) */
+		ltfsmsg(LTFS_ERR, "13006E", "ring_lock", ret);
+		return -LTFS_MUTEX_INIT;
+	}
+	ret = ltfs_thread_cond_init(&priv->ring_cond);
+	if (ret) {
+		/* Cannot initialize scheduler: failed to initialize condition variable %s (%d) */
+		ltfsmsg(LTFS_ERR, "13007E", "ring_cond", ret);
+		ltfs_thread_mutex_destroy(&priv->ring_lock);
+		return -LTFS_MUTEX_INIT;
+	}
+	ret = ltfs_thread_cond_init(&priv->ring_space_cond);
+	if (ret) {
+		/* Cannot initialize scheduler: failed to initialize condition variable %s (%d) */
+		ltfsmsg(LTFS_ERR, "13007E", "ring_space_cond", ret);
+		ltfs_thread_cond_destroy(&priv->ring_cond);
+		ltfs_thread_mutex_destroy(&priv->ring_lock);
+		return -LTFS_MUTEX_INIT;
+	}
+	ret = ltfs_thread_cond_init(&priv->ring_done_cond);
+	if (ret) {
+		/* Cannot initialize scheduler: failed to initialize condition variable %s (%d) */
+		ltfsmsg(LTFS_ERR, "13007E", "ring_done_cond", ret);
+		ltfs_thread_cond_destroy(&priv->ring_space_cond);
+		ltfs_thread_cond_destroy(&priv->ring_cond);
+		ltfs_thread_mutex_destroy(&priv->ring_lock);
+		return -LTFS_MUTEX_INIT;
+	}
+
+	priv->ring_head = priv->ring_count = priv->ring_active = 0;
+	return 0;
+}
+
+/**
+ * Free the locks of the ready ring. The tape thread must not be running.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_ring_destroy(struct unified_data *priv)
+{
+	ltfs_thread_cond_destroy(&priv->ring_done_cond);
+	ltfs_thread_cond_destroy(&priv->ring_space_cond);
+	ltfs_thread_cond_destroy(&priv->ring_cond);
+	ltfs_thread_mutex_destroy(&priv->ring_lock);
+}
+
+/**
+ * Initialize the shards and their locks.
+ * @param priv Handle to the I/O scheduler data.
+ * @return 0 on success or a negative value on error.
+ */
+int _unified_shards_init(struct unified_data *priv)
+{
+	int ret;
+	uint32_t i;
+	struct unified_shard *shard;
+
+	for (i = 0; i < UNIFIED_SHARDS; ++i) {
+		shard = &priv->shards[i];
+		ret = init_mrsw(&shard->lock);
+		if (ret < 0) {
+			/* Cannot initialize scheduler: failed to initialize mutex %s (%d) */
+			ltfsmsg(LTFS_ERR, "13006E", "shard lock", ret);
+			break;
+		}
+		ret = ltfs_thread_mutex_init(&shard->queue_lock);
+		if (ret) {
+			/* Cannot initialize scheduler: failed to initialize mutex %s (%d) */
+			ltfsmsg(LTFS_ERR, "13006E", "shard queue_lock", ret);
+			destroy_mrsw(&shard->lock);
+			break;
+		}
+
+		TAILQ_INIT(&shard->working_set);
+		TAILQ_INIT(&shard->dp_queue);
+		TAILQ_INIT(&shard->ip_queue);
+		TAILQ_INIT(&shard->priority_working_set);
+		TAILQ_INIT(&shard->dp_priority_queue);
+		TAILQ_INIT(&shard->free_requests);
+		memset(&shard->counts, 0, sizeof(shard->counts));
+		shard->free_request_count = 0;
+		shard->request_allocs = 0;
+	}
+
+	if (i < UNIFIED_SHARDS) {
+		while (i-- > 0) {
+			ltfs_thread_mutex_destroy(&priv->shards[i].queue_lock);
+			destroy_mrsw(&priv->shards[i].lock);
+		}
+		return -LTFS_MUTEX_INIT;
+	}
+
+	priv->next_shard = 0;
+	return 0;
+}
+
+/**
+ * Free the locks and the free write_request structures of the shards. The background threads
+ * must not be running.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_shards_destroy(struct unified_data *priv)
+{
+	uint32_t i;
+	struct write_request *req, *aux;
+
+	for (i = 0; i < UNIFIED_SHARDS; ++i) {
+		TAILQ_FOREACH_SAFE(req, &priv->shards[i].free_requests, list, aux)
+			free(req);
+		ltfs_thread_mutex_destroy(&priv->shards[i].queue_lock);
+		destroy_mrsw(&priv->shards[i].lock);
+	}
+}
+
+/**
+ * Find the shard a file belongs to. This only depends on the address of the dentry, so it
+ * can be called before the file has a dentry_priv, and without holding any lock.
+ * @param d Dentry of the file.
+ * @param priv Handle to the I/O scheduler data.
+ * @return The file's shard.
+ */
+struct unified_shard *_unified_get_shard(struct dentry *d, struct unified_data *priv)
+{
+	/* Dentries are allocated next to each other, so mix the address (Fibonacci hashing)
+	 * and keep the top bits */
+	uint32_t hash = (uint32_t) ((uintptr_t) d >> 4) * 2654435761U;
+
+	return &priv->shards[hash >> (32 - UNIFIED_SHARD_BITS)];
+}
+
+/**
+ * Take the lock of every shard for write, stopping all other scheduler activity.
+ * The shard locks are always taken in the same order, so concurrent callers cannot deadlock.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_lock_all(struct unified_data *priv)
+{
+	uint32_t i;
+
+	for (i = 0; i < UNIFIED_SHARDS; ++i)
+		acquirewrite_mrsw(&priv->shards[i].lock);
+}
+
+/**
+ * Release the shard locks taken by _unified_lock_all.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_unlock_all(struct unified_data *priv)
+{
+	uint32_t i;
+
+	for (i = UNIFIED_SHARDS; i > 0; --i)
+		releasewrite_mrsw(&priv->shards[i - 1].lock);
+}
+
+/**
+ * Add up the queue lengths and request counters of all shards.
+ * The shard queue locks are not taken, so the totals are only good for scheduling decisions.
+ * @param total On return, holds the sums.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_sum_counts(struct unified_counts *total, struct unified_data *priv)
+{
+	uint32_t i;
+	struct unified_counts *counts;
+
+	memset(total, 0, sizeof(*total));
+	for (i = 0; i < UNIFIED_SHARDS; ++i) {
+		counts = &priv->shards[i].counts;
+		total->ws_count += counts->ws_count;
+		total->dp_count += counts->dp_count;
+		total->ip_count += counts->ip_count;
+		total->ws_priority_count += counts->ws_priority_count;
+		total->dp_priority_count += counts->dp_priority_count;
+		total->ws_request_count += counts->ws_request_count;
+		total->dp_request_count += counts->dp_request_count;
+		total->ip_request_count += counts->ip_request_count;
+	}
+}
+
+/**
+ * Stop the background writer threads and the tape thread. Batches already queued are written
+ * before the tape thread exits; requests still in the scheduler queues are left alone.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_stop_threads(struct unified_data *priv)
+{
+	uint32_t i;
+
+	_unified_lock_all(priv);
+	ltfs_thread_mutex_lock(&priv->queue_lock);
+	priv->writer_keepalive = false;
+	ltfs_thread_cond_broadcast(&priv->queue_cond);
+	ltfs_thread_mutex_unlock(&priv->queue_lock);
+	_unified_unlock_all(priv);
+	for (i = 0; i < priv->writer_count; ++i)
+		ltfs_thread_join(priv->writer_threads[i]);
+	priv->writer_count = 0;
+
+	ltfs_thread_mutex_lock(&priv->ring_lock);
+	priv->tape_keepalive = false;
+	ltfs_thread_cond_signal(&priv->ring_cond);
+	ltfs_thread_mutex_unlock(&priv->ring_lock);
+	ltfs_thread_join(priv->tape_thread);
+}
+
+/**
+ * Hand a list of data partition requests to the tape thread. Blocks while the ready ring is full.
+ * The caller must hold dpr->dentry->iosched_lock (or a write lock on all shards), which keeps
+ * the batches of a file in the order their requests were taken from dpr->requests.
+ * If the tape thread has stopped or the batch cannot be allocated, the requests are written
+ * from the calling thread.
+ * @param requests Requests to write. The list is empty on return.
+ * @param dpr dentry_priv the requests belong to.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_queue_batch(struct req_struct *requests, struct dentry_priv *dpr,
+	struct unified_data *priv)
+{
+	struct write_batch *batch, local_batch;
+	struct write_request *req, *aux;
+
+	if (TAILQ_EMPTY(requests))
+		return;
+
+	batch = malloc(sizeof(struct write_batch));
+	if (! batch)
+		ltfsmsg(LTFS_ERR, "10001E", "_unified_queue_batch: batch");
+	else {
+		batch->dpr = dpr;
+		batch->direct = dpr->direct;
+		TAILQ_INIT(&batch->requests);
+		TAILQ_FOREACH_SAFE(req, requests, list, aux) {
+			TAILQ_REMOVE(requests, req, list);
+			TAILQ_INSERT_TAIL(&batch->requests, req, list);
+		}
+
+		ltfs_thread_mutex_lock(&priv->ring_lock);
+		while (priv->ring_count == UNIFIED_READY_RING_SIZE && priv->tape_keepalive)
+			ltfs_thread_cond_wait(&priv->ring_space_cond, &priv->ring_lock);
+		if (priv->tape_keepalive) {
+			priv->ready_ring[(priv->ring_head + priv->ring_count) % UNIFIED_READY_RING_SIZE] = batch;
+			++priv->ring_count;
+			++dpr->inflight;
+			ltfs_thread_cond_signal(&priv->ring_cond);
+			ltfs_thread_mutex_unlock(&priv->ring_lock);
+			return;
+		}
+		ltfs_thread_mutex_unlock(&priv->ring_lock);
+
+		TAILQ_FOREACH_SAFE(req, &batch->requests, list, aux) {
+			TAILQ_REMOVE(&batch->requests, req, list);
+			TAILQ_INSERT_TAIL(requests, req, list);
+		}
+		free(batch);
+	}
+
+	/* Write the requests here, after anything already queued for this file */
+	_unified_wait_batches(dpr, priv);
+	local_batch.dpr = dpr;
+	local_batch.direct = dpr->direct;
+	TAILQ_INIT(&local_batch.requests);
+	TAILQ_FOREACH_SAFE(req, requests, list, aux) {
+		TAILQ_REMOVE(requests, req, list);
+		TAILQ_INSERT_TAIL(&local_batch.requests, req, list);
+	}
+	_unified_write_batch(&local_batch, priv);
+	_unified_collect_batch_error(dpr, priv);
+}
+
+/**
+ * Write the requests of a batch to the data partition and free them.
+ * If a write fails, the failed request is kept in the dentry_priv so that the error can be
+ * handled by someone holding the right locks (see _unified_collect_batch_error), and the
+ * remaining requests of the batch are discarded.
+ * @param batch Batch to write. Its request list is empty on return.
+ * @param priv Handle to the I/O scheduler data.
+ * @return Number of bytes written to the medium.
+ */
+size_t _unified_write_batch(struct write_batch *batch, struct unified_data *priv)
+{
+	struct dentry_priv *dpr = batch->dpr;
+	struct write_request *req, *aux;
+	char *cache_obj;
+	ssize_t ret = 0;
+	size_t written = 0;
+
+	TAILQ_FOREACH_SAFE(req, &batch->requests, list, aux) {
+		TAILQ_REMOVE(&batch->requests, req, list);
+		if (ret >= 0) {
+			cache_obj = cache_manager_get_object_data(req->write_cache);
+			ret = ltfs_fsraw_write(dpr->dentry, cache_obj, req->count, req->offset,
+				ltfs_dp_id(priv->vol), false, priv->vol);
+			if (ret < 0) {
+				/* Data partition writer: failed to write data to the tape (%d) */
+				ltfsmsg(LTFS_WARN, "13014W", ret);
+				ltfs_thread_mutex_lock(&priv->ring_lock);
+				if (! dpr->failed_req) {
+					dpr->failed_req = req;
+					dpr->failed_ret = ret;
+					req = NULL;
+				}
+				ltfs_thread_mutex_unlock(&priv->ring_lock);
+			} else {
+				written += req->count;
+				if (! batch->direct) {
+					_unified_clean_insert(req, dpr, priv);
+					continue;
+				}
+				/* Direct blocks are not kept, but older clean copies of them are now stale */
+				_unified_clean_invalidate(dpr->dentry->uid, req->offset, req->offset + req->count,
+					priv);
+			}
+		}
+		if (req)
+			_unified_free_request(req, dpr, priv);
+	}
+
+	return written;
+}
+
+/**
+ * Tell the flush controller whether the tape thread is writing. Full blocks are handed
+ * over without waiting for a burst while it is, and each transition from idle to busy counts
+ * as a drive restart.
+ * @param streaming true if the tape thread is about to write a batch, false if it ran out of them.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_tape_state(bool streaming, struct unified_data *priv)
+{
+	ltfs_thread_mutex_lock(&priv->queue_lock);
+	if (streaming && ! priv->tape_streaming) {
+		++priv->tape_restarts;
+		++priv->window_restarts;
+		/* Writer threads holding back data for a burst can feed the drive now */
+		ltfs_thread_cond_broadcast(&priv->queue_cond);
+	}
+	priv->tape_streaming = streaming;
+	ltfs_thread_mutex_unlock(&priv->queue_lock);
+}
+
+/**
+ * Account a batch written by the tape thread. Once enough busy time has been sampled, update
+ * the drive rate estimate and the burst length, and retune the writer threads.
+ * @param bytes Number of bytes written.
+ * @param elapsed Time taken to write them.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_tape_sample(size_t bytes, const struct ltfs_timespec *elapsed,
+	struct unified_data *priv)
+{
+	uint64_t rate;
+
+	ltfs_thread_mutex_lock(&priv->queue_lock);
+	priv->tape_bytes += bytes;
+	priv->window_bytes += bytes;
+	priv->window_nsec += elapsed->tv_sec * 1000000000ULL + elapsed->tv_nsec;
+
+	if (priv->window_nsec >= UNIFIED_RATE_WINDOW_MSEC * 1000000ULL) {
+		rate = priv->window_bytes * 1000000ULL / (priv->window_nsec / 1000);
+		priv->drive_rate = priv->drive_rate ? (3 * priv->drive_rate + rate) / 4 : rate;
+
+		/* Lengthen the bursts while the drive keeps running dry, shorten them again once
+		 * it streams, so that no more cache than needed is held back */
+		if (priv->window_restarts > 1 && priv->burst_scale < UNIFIED_MAX_BURST_SCALE)
+			priv->burst_scale *= 2;
+		else if (priv->window_restarts == 0 && priv->burst_scale > 1)
+			priv->burst_scale /= 2;
+
+		_unified_tune_flush(priv);
+		priv->window_bytes = priv->window_nsec = 0;
+		priv->window_restarts = 0;
+	}
+	ltfs_thread_mutex_unlock(&priv->queue_lock);
+}
+
+/**
+ * Derive the flush trigger and batch size from the measured drive rate and the cache
+ * occupancy. Until the drive rate is known, full blocks are handed over as soon as they appear.
+ * The caller must hold priv->queue_lock, unless the background threads are not running yet.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_tune_flush(struct unified_data *priv)
+{
+	uint64_t trigger, max_trigger, held;
+	struct unified_counts counts;
+
+	trigger = priv->drive_rate * UNIFIED_BURST_MSEC / 1000 * priv->burst_scale / priv->cache_size;
+
+	/* Only half of the cache not taken by partial, IP and packed blocks may be held back */
+	max_trigger = (uint64_t)(UNIFIED_MAX_TRIGGER * priv->cache_blocks);
+	_unified_sum_counts(&counts, priv);
+	held = counts.ws_request_count + counts.ip_request_count + priv->pack_count;
+	if (held >= priv->cache_blocks)
+		max_trigger = 1;
+	else if ((priv->cache_blocks - held) / 2 < max_trigger)
+		max_trigger = (priv->cache_blocks - held) / 2;
+
+	if (trigger > max_trigger)
+		trigger = max_trigger;
+	if (trigger < 1)
+		trigger = 1;
+	priv->flush_trigger = trigger;
+
+	/* One burst plus what arrives while it is written, but at least enough to fill the ring */
+	priv->flush_batch = 2 * priv->flush_trigger;
+	if (priv->flush_batch < UNIFIED_READY_RING_SIZE)
+		priv->flush_batch = UNIFIED_READY_RING_SIZE;
+}
+
+/**
+ * Free a request whose data has just been written to the data partition, keeping its cache
+ * block in the clean tier if the request starts on a cache block boundary. Clean blocks
+ * overlapping the request are dropped either way, so the tier never holds stale data.
+ * Blocks are not kept while other threads wait for cache space.
+ * @param req Request to free.
+ * @param dpr dentry_priv the request belongs to.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_clean_insert(struct write_request *req, struct dentry_priv *dpr,
+	struct unified_data *priv)
+{
+	struct clean_lru_struct dropped;
+	struct clean_block *cb = NULL, *aux;
+	uint64_t uid = dpr->dentry->uid;
+
+	if (priv->clean_max > 0 && req->offset % priv->cache_size == 0) {
+		cb = calloc(1, sizeof(struct clean_block));
+		if (! cb)
+			ltfsmsg(LTFS_ERR, "10001E", "_unified_clean_insert: clean block");
+		else {
+			cb->key.uid = uid;
+			cb->key.block = req->offset / priv->cache_size;
+			cb->count = req->count;
+			cb->cache = req->write_cache;
+		}
+	}
+
+	TAILQ_INIT(&dropped);
+	ltfs_thread_mutex_lock(&priv->clean_lock);
+	_unified_clean_unlink_range(uid, req->offset, req->offset + req->count, &dropped, priv);
+	if (cb && __sync_add_and_fetch(&priv->cache_waiters, 0) == 0) {
+		if (priv->clean_count >= priv->clean_max) {
+			aux = TAILQ_FIRST(&priv->clean_lru);
+			HASH_DEL(priv->clean_table, aux);
+			TAILQ_REMOVE(&priv->clean_lru, aux, lru);
+			TAILQ_INSERT_TAIL(&dropped, aux, lru);
+			__sync_sub_and_fetch(&priv->clean_count, 1);
+		}
+		HASH_ADD(hh, priv->clean_table, key, sizeof(cb->key), cb);
+		TAILQ_INSERT_TAIL(&priv->clean_lru, cb, lru);
+		__sync_add_and_fetch(&priv->clean_count, 1);
+		req->write_cache = NULL;
+		cb = NULL;
+	}
+	ltfs_thread_mutex_unlock(&priv->clean_lock);
+
+	free(cb);
+	TAILQ_FOREACH_SAFE(cb, &dropped, lru, aux) {
+		_unified_cache_free(cb->cache, cb->count, priv);
+		free(cb);
+	}
+	_unified_free_request(req, dpr, priv);
+}
+
+/**
+ * Drop the clean blocks of a file that overlap a range of file offsets.
+ * @param uid UID of the file.
+ * @param start First file offset to drop.
+ * @param end File offset past the last one to drop, or UINT64_MAX to drop up to the end of file.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_clean_invalidate(uint64_t uid, uint64_t start, uint64_t end,
+	struct unified_data *priv)
+{
+	struct clean_lru_struct dropped;
+	struct clean_block *cb, *aux;
+
+	TAILQ_INIT(&dropped);
+	ltfs_thread_mutex_lock(&priv->clean_lock);
+	_unified_clean_unlink_range(uid, start, end, &dropped, priv);
+	ltfs_thread_mutex_unlock(&priv->clean_lock);
+
+	TAILQ_FOREACH_SAFE(cb, &dropped, lru, aux) {
+		_unified_cache_free(cb->cache, cb->count, priv);
+		free(cb);
+	}
+}
+
+/**
+ * Remove the clean blocks of a file that overlap a range of file offsets from the clean tier.
+ * The caller must hold priv->clean_lock, and must free the removed blocks after releasing it.
+ * @param uid UID of the file.
+ * @param start First file offset to remove.
+ * @param end File offset past the last one to remove.
+ * @param dropped List receiving the removed blocks.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_clean_unlink_range(uint64_t uid, uint64_t start, uint64_t end,
+	struct clean_lru_struct *dropped, struct unified_data *priv)
+{
+	struct clean_block *cb, *aux;
+	struct clean_key key;
+	uint64_t first, last;
+
+	if (end <= start || priv->clean_count == 0)
+		return;
+
+	first = start / priv->cache_size;
+	last = (end - 1) / priv->cache_size;
+
+	if (last - first >= priv->clean_count) {
+		/* Long range: cheaper to look at every block in the tier */
+		TAILQ_FOREACH_SAFE(cb, &priv->clean_lru, lru, aux) {
+			if (cb->key.uid == uid && cb->key.block >= first && cb->key.block <= last) {
+				HASH_DEL(priv->clean_table, cb);
+				TAILQ_REMOVE(&priv->clean_lru, cb, lru);
+				TAILQ_INSERT_TAIL(dropped, cb, lru);
+				__sync_sub_and_fetch(&priv->clean_count, 1);
+			}
+		}
+		return;
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.uid = uid;
+	for (key.block = first; key.block <= last; ++key.block) {
+		HASH_FIND(hh, priv->clean_table, &key, sizeof(key), cb);
+		if (cb) {
+			HASH_DEL(priv->clean_table, cb);
+			TAILQ_REMOVE(&priv->clean_lru, cb, lru);
+			TAILQ_INSERT_TAIL(dropped, cb, lru);
+			__sync_sub_and_fetch(&priv->clean_count, 1);
+		}
+	}
+}
+
+/**
+ * Give the least recently used block of the clean tier back to the cache pool.
+ * This does not signal threads waiting for cache space: it is called by threads that are about
+ * to allocate the block themselves, possibly with priv->cache_lock held.
+ * @param priv Handle to the I/O scheduler data.
+ * @return true if a block was freed, false if the clean tier is empty.
+ */
+bool _unified_clean_reclaim(struct unified_data *priv)
+{
+	struct clean_block *cb;
+
+	ltfs_thread_mutex_lock(&priv->clean_lock);
+	cb = TAILQ_FIRST(&priv->clean_lru);
+	if (cb) {
+		HASH_DEL(priv->clean_table, cb);
+		TAILQ_REMOVE(&priv->clean_lru, cb, lru);
+		__sync_sub_and_fetch(&priv->clean_count, 1);
+	}
+	ltfs_thread_mutex_unlock(&priv->clean_lock);
+
+	if (! cb)
+		return false;
+	cache_manager_free_object(cb->cache, cb->count);
+	__sync_sub_and_fetch(&priv->blocks_used, 1);
+	free(cb);
+	return true;
+}
+
+/**
+ * Read file data which is not in the request list. Blocks found in the clean tier are copied
+ * from the cache; the holes between them are read through libltfs.
+ * The caller must hold the same locks as for ltfs_fsraw_read().
+ * @param d File to read.
+ * @param buf Output buffer.
+ * @param size Number of bytes to read.
+ * @param offset Logical file offset to read from.
+ * @param priv Handle to the I/O scheduler data.
+ * @return Number of bytes read, which is smaller than size at the end of the file,
+ *         or a negative value on error.
+ */
+ssize_t _unified_read_clean(struct dentry *d, char *buf, size_t size, off_t offset,
+	struct unified_data *priv)
+{
+	struct clean_block *cb;
+	struct clean_key key;
+	uint64_t inblock;
+	size_t to_read;
+	ssize_t ret = 0, nread;
+	char *cache_obj;
+
+	/* Data in the clean tier is also on the medium, so missing a block added concurrently
+	 * only costs a tape read */
+	if (__sync_add_and_fetch(&priv->clean_count, 0) == 0)
+		return ltfs_fsraw_read(d, buf, size, offset, priv->vol);
+
+	memset(&key, 0, sizeof(key));
+	key.uid = d->uid;
+
+	while (size > 0) {
+		key.block = offset / priv->cache_size;
+		inblock = offset - key.block * priv->cache_size;
+
+		ltfs_thread_mutex_lock(&priv->clean_lock);
+		HASH_FIND(hh, priv->clean_table, &key, sizeof(key), cb);
+		if (cb && inblock < cb->count) {
+			to_read = cb->count - inblock;
+			if (to_read > size)
+				to_read = size;
+			cache_obj = cache_manager_get_object_data(cb->cache);
+			memcpy(buf, cache_obj + inblock, to_read);
+			TAILQ_REMOVE(&priv->clean_lru, cb, lru);
+			TAILQ_INSERT_TAIL(&priv->clean_lru, cb, lru);
+			ltfs_thread_mutex_unlock(&priv->clean_lock);
+
+			buf += to_read;
+			offset += to_read;
+			ret += to_read;
+			size -= to_read;
+			continue;
+		}
+
+		/* Read up to the next block found in the clean tier */
+		to_read = priv->cache_size - inblock;
+		while (to_read < size) {
+			++key.block;
+			HASH_FIND(hh, priv->clean_table, &key, sizeof(key), cb);
+			if (cb)
+				break;
+			to_read += priv->cache_size;
+		}
+		ltfs_thread_mutex_unlock(&priv->clean_lock);
+		if (to_read > size)
+			to_read = size;
+
+		nread = ltfs_fsraw_read(d, buf, to_read, offset, priv->vol);
+		if (nread < 0)
+			return nread;
+		ret += nread;
+		if ((size_t)nread < to_read)
+			break;
+		buf += nread;
+		offset += nread;
+		size -= nread;
+	}
+
+	return ret;
+}
+
+/**
+ * Wait until the tape thread has written all batches of a file, then process any error
+ * it got while doing so.
+ * The caller must hold dpr->dentry->iosched_lock and a read lock on the file's shard, or a
+ * write lock on all shards.
+ * @param dpr dentry_priv to wait for.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_wait_batches(struct dentry_priv *dpr, struct unified_data *priv)
+{
+	ltfs_thread_mutex_lock(&priv->ring_lock);
+	while (dpr->inflight > 0)
+		ltfs_thread_cond_wait(&priv->ring_done_cond, &priv->ring_lock);
+	ltfs_thread_mutex_unlock(&priv->ring_lock);
+
+	_unified_collect_batch_error(dpr, priv);
+}
+
+/**
+ * Wait until the tape thread has written every batch handed to it. Batches are only queued
+ * under a shard lock, so with a write lock on all shards the ring stays empty afterwards.
+ * The caller must hold a write lock on all shards.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_drain_ring(struct unified_data *priv)
+{
+	ltfs_thread_mutex_lock(&priv->ring_lock);
+	while (priv->ring_count > 0 || priv->ring_active > 0)
+		ltfs_thread_cond_wait(&priv->ring_done_cond, &priv->ring_lock);
+	ltfs_thread_mutex_unlock(&priv->ring_lock);
+}
+
+/**
+ * Hand the last request of a file in direct mode to the tape thread as soon as it is full,
+ * without going through the data partition queue and the background writer threads. The
+ * caller waits while UNIFIED_DIRECT_DEPTH blocks of the file are in flight, so a large
+ * sequential file streams through a couple of cache blocks instead of filling the cache.
+ * Full requests still waiting in the data partition queue, such as the blocks written before
+ * the file entered direct mode, go in the same batch ahead of it to keep the file contiguous.
+ * The caller must hold dpr->dentry->iosched_lock and a read lock on the file's shard.
+ * @param dpr dentry_priv of the file being written.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_direct_write(struct dentry_priv *dpr, struct unified_data *priv)
+{
+	struct req_struct local_req_list;
+	struct write_request *req, *last, *aux;
+
+	if (! dpr->direct || dpr->write_ip)
+		return;
+	last = TAILQ_LAST(&dpr->requests, req_struct);
+	if (! last || last->state != REQUEST_DP || last->count < priv->cache_size)
+		return;
+
+	ltfs_thread_mutex_lock(&priv->ring_lock);
+	while (dpr->inflight >= UNIFIED_DIRECT_DEPTH && priv->tape_keepalive)
+		ltfs_thread_cond_wait(&priv->ring_done_cond, &priv->ring_lock);
+	ltfs_thread_mutex_unlock(&priv->ring_lock);
+
+	/* The list only needs a walk if the last request is not the file's only queued one */
+	TAILQ_INIT(&local_req_list);
+	req = (dpr->in_dp_queue > 1) ? TAILQ_FIRST(&dpr->requests) : last;
+	for (; req; req = aux) {
+		aux = TAILQ_NEXT(req, list);
+		if (req->state != REQUEST_DP)
+			continue;
+		_unified_remove_request(req, dpr);
+		_unified_update_queue_membership(false, false, REQUEST_DP, dpr, priv);
+		__sync_add_and_fetch(&priv->direct_bytes, req->count);
+		TAILQ_INSERT_TAIL(&local_req_list, req, list);
+	}
+	_unified_queue_batch(&local_req_list, dpr, priv);
+}
+
+/**
+ * Process a write error the tape thread recorded for a file, if any. This drops the
+ * file's other outstanding requests and sets its write_error code.
+ * The caller must hold the same locks as for _unified_wait_batches.
+ * @param dpr dentry_priv to check.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_collect_batch_error(struct dentry_priv *dpr, struct unified_data *priv)
+{
+	struct write_request *req;
+	ssize_t ret;
+
+	ltfs_thread_mutex_lock(&priv->ring_lock);
+	req = dpr->failed_req;
+	ret = dpr->failed_ret;
+	dpr->failed_req = NULL;
+	ltfs_thread_mutex_unlock(&priv->ring_lock);
+
+	if (req) {
+		ltfs_mutex_lock(&dpr->io_lock);
+		_unified_handle_write_error(ret, req, dpr, priv);
+		ltfs_mutex_unlock(&dpr->io_lock);
+		_unified_free_request(req, dpr, priv);
+	}
+}
+
+/**
+ * Leave a flushed request in the dentry_priv so that it can be packed together with the tails
+ * of other files, and add the dentry_priv to the pack queue.
+ * The caller must hold the same locks as for _unified_flush_unlocked.
+ * @param req Request left behind.
+ * @param dpr dentry_priv the request belongs to.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_defer_tail(struct write_request *req, struct dentry_priv *dpr,
+	struct unified_data *priv)
+{
+	ltfs_thread_mutex_lock(&priv->queue_lock);
+	if (! dpr->in_pack_queue) {
+		TAILQ_INSERT_TAIL(&priv->pack_queue, dpr, pack_queue);
+		dpr->in_pack_queue = true;
+		++priv->pack_count;
+	} else
+		priv->pack_bytes -= dpr->pack_charge;
+	dpr->pack_charge = req->count;
+	priv->pack_bytes += req->count;
+	/* Tell background thread a full pack block is ready */
+	if (priv->pack_bytes >= priv->cache_size)
+		ltfs_thread_cond_signal(&priv->queue_cond);
+	ltfs_thread_mutex_unlock(&priv->queue_lock);
+}
+
+/**
+ * Remove a dentry_priv from the pack queue if it is there.
+ * @param dpr dentry_priv to remove.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_leave_pack_queue(struct dentry_priv *dpr, struct unified_data *priv)
+{
+	ltfs_thread_mutex_lock(&priv->queue_lock);
+	if (dpr->in_pack_queue) {
+		TAILQ_REMOVE(&priv->pack_queue, dpr, pack_queue);
+		dpr->in_pack_queue = false;
+		--priv->pack_count;
+		priv->pack_bytes -= dpr->pack_charge;
+		dpr->pack_charge = 0;
+	}
+	ltfs_thread_mutex_unlock(&priv->queue_lock);
+}
+
+/**
+ * Write the tails waiting in the pack queue.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_process_pack_queue(struct unified_data *priv)
+{
+	_unified_lock_all(priv);
+	_unified_write_pack_unlocked(priv);
+	_unified_unlock_all(priv);
+}
+
+/**
+ * Write the outstanding requests of all files in the pack queue to the data partition,
+ * concatenated into shared blocks. Each piece of a request gets its own extent, with a
+ * byte offset pointing at its data within the block.
+ * Full requests are written on their own, and files that were selected for the index
+ * partition since their tails were left behind are flushed normally.
+ * The caller must hold a write lock on all shards.
+ * @param priv Handle to the I/O scheduler data.
+ * @return 0 on success or a negative value on error. Write errors are reported through the
+ *         write_error code of the affected files, as for any other background write.
+ */
+int _unified_write_pack_unlocked(struct unified_data *priv)
+{
+	int ret;
+	struct packqueue_struct packed_files;
+	struct req_struct packed_reqs;
+	struct dentry_priv *dpr, *dpr_aux;
+	struct write_request *req, *req_aux;
+	struct pack_piece *pieces = NULL, *new_pieces;
+	size_t npieces = 0, max_pieces = 0, used = 0, copied, to_copy;
+	char *buf, *req_cache;
+
+	ltfs_thread_mutex_lock(&priv->queue_lock);
+	TAILQ_INIT(&packed_files);
+	TAILQ_CONCAT(&packed_files, &priv->pack_queue, pack_queue);
+	priv->pack_count = 0;
+	priv->pack_bytes = 0;
+	ltfs_thread_mutex_unlock(&priv->queue_lock);
+
+	if (TAILQ_EMPTY(&packed_files))
+		return 0;
+
+	/* Leave room for the CRC the backend appends in place, as cache blocks do */
+	buf = malloc(priv->cache_size + LTFS_CRC_SIZE);
+	if (! buf) {
+		ltfsmsg(LTFS_ERR, "10001E", "_unified_write_pack_unlocked: buffer");
+		ltfs_thread_mutex_lock(&priv->queue_lock);
+		TAILQ_FOREACH(dpr, &packed_files, pack_queue) {
+			++priv->pack_count;
+			priv->pack_bytes += dpr->pack_charge;
+		}
+		TAILQ_CONCAT(&priv->pack_queue, &packed_files, pack_queue);
+		ltfs_thread_mutex_unlock(&priv->queue_lock);
+		return -LTFS_NO_MEMORY;
+	}
+
+	TAILQ_INIT(&packed_reqs);
+	TAILQ_FOREACH(dpr, &packed_files, pack_queue) {
+		dpr->in_pack_queue = false;
+		dpr->pack_charge = 0;
+		if (dpr->write_ip) {
+			_unified_flush_unlocked(dpr->dentry, priv);
+			continue;
+		}
+
+		/* Data in flight for this file must reach the medium before the tail's extent */
+		_unified_wait_batches(dpr, priv);
+
+		TAILQ_FOREACH_SAFE(req, &dpr->requests, list, req_aux) {
+			req_cache = cache_manager_get_object_data(req->write_cache);
+			if (req->count == priv->cache_size) {
+				ret = ltfs_fsraw_write(dpr->dentry, req_cache, req->count, req->offset,
+					ltfs_dp_id(priv->vol), false, priv->vol);
+				if (ret < 0) {
+					ltfsmsg(LTFS_ERR, "13019E", ret);
+					_unified_handle_write_error(ret, req, dpr, priv);
+					break;
+				}
+				_unified_remove_request(req, dpr);
+				_unified_update_queue_membership(false, false, req->state, dpr, priv);
+				_unified_clean_insert(req, dpr, priv);
+				continue;
+			}
+
+			_unified_remove_request(req, dpr);
+			_unified_update_queue_membership(false, false, req->state, dpr, priv);
+			TAILQ_INSERT_TAIL(&packed_reqs, req, list);
+			_unified_clean_invalidate(dpr->dentry->uid, req->offset, req->offset + req->count,
+				priv);
+
+			copied = 0;
+			while (copied < req->count) {
+				if (npieces == max_pieces) {
+					new_pieces = realloc(pieces, (max_pieces ? 2 * max_pieces : 16) *
+						sizeof(struct pack_piece));
+					if (new_pieces) {
+						pieces = new_pieces;
+						max_pieces = max_pieces ? 2 * max_pieces : 16;
+					} else {
+						/* Write a short block to make room */
+						ltfsmsg(LTFS_ERR, "10001E", "_unified_write_pack_unlocked: pieces");
+						_unified_write_pack_block(buf, used, pieces, npieces, priv);
+						npieces = used = 0;
+						if (max_pieces == 0) {
+							_unified_handle_write_error(-LTFS_NO_MEMORY, req, dpr, priv);
+							break;
+						}
+					}
+				}
+
+				to_copy = req->count - copied;
+				if (to_copy > priv->cache_size - used)
+					to_copy = priv->cache_size - used;
+				memcpy(buf + used, req_cache + copied, to_copy);
+				pieces[npieces].dpr = dpr;
+				pieces[npieces].req = req;
+				pieces[npieces].fileoffset = req->offset + copied;
+				pieces[npieces].byteoffset = used;
+				pieces[npieces].bytecount = to_copy;
+				++npieces;
+				used += to_copy;
+				copied += to_copy;
+
+				if (used == priv->cache_size) {
+					_unified_write_pack_block(buf, used, pieces, npieces, priv);
+					npieces = used = 0;
+				}
+			}
+		}
+	}
+
+	/* The last pack block is usually short */
+	if (used > 0)
+		_unified_write_pack_block(buf, used, pieces, npieces, priv);
+
+	/* Packed requests of all files are mixed in this list, so they go back to the heap */
+	TAILQ_FOREACH_SAFE(req, &packed_reqs, list, req_aux) {
+		TAILQ_REMOVE(&packed_reqs, req, list);
+		_unified_free_request(req, NULL, priv);
+	}
+	TAILQ_FOREACH_SAFE(dpr, &packed_files, pack_queue, dpr_aux) {
+		TAILQ_REMOVE(&packed_files, dpr, pack_queue);
+		_unified_free_dentry_priv_conditional(dpr->dentry, 2, priv);
+	}
+
+	free(pieces);
+	free(buf);
+	return 0;
+}
+
+/**
+ * Write one pack block to the data partition and give each piece in it an extent.
+ * The caller must hold a write lock on all shards.
+ * @param buf Block contents.
+ * @param count Number of bytes in the block.
+ * @param pieces Pieces making up the block, in block order.
+ * @param npieces Number of pieces.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_write_pack_block(const char *buf, size_t count, struct pack_piece *pieces,
+	size_t npieces, struct unified_data *priv)
+{
+	int ret;
+	size_t i;
+	struct extent_info extent;
+
+	if (count == 0)
+		return;
+
+	extent.start.partition = ltfs_dp_id(priv->vol);
+	ret = ltfs_fsraw_write_data(extent.start.partition, buf, count, 1, &extent.start.block,
+		priv->vol);
+	if (ret < 0)
+		/* Data partition writer: failed to write data to the tape (%d) */
+		ltfsmsg(LTFS_WARN, "13014W", ret);
+
+	for (i = 0; i < npieces; ++i) {
+		if (ret == 0) {
+			extent.byteoffset = pieces[i].byteoffset;
+			extent.bytecount = pieces[i].bytecount;
+			extent.fileoffset = pieces[i].fileoffset;
+			ret = ltfs_fsraw_add_extent(pieces[i].dpr->dentry, &extent, false, priv->vol);
+			if (ret < 0) {
+				_unified_handle_write_error(ret, pieces[i].req, pieces[i].dpr, priv);
+				ret = 0;
+			}
+		} else
+			_unified_handle_write_error(ret, pieces[i].req, pieces[i].dpr, priv);
+	}
+}
+
+void _unified_process_queue(enum request_state queue, struct unified_data *priv)
+{
 	if (! priv) {
 		ltfsmsg(LTFS_ERR, "10005E", "priv", __FUNCTION__);
 		return;
@@ -1211,65 +2933,147 @@ void _unified_process_index_queue(struct unified_data *priv)
 {
 	struct write_request *req, *req_aux;
 	struct dentry_priv *dentry_priv, *dpr_aux;
+	struct unified_shard *shard;
 	char partition_id;
 	ssize_t ret;
+	uint32_t i;
 
 	partition_id = ltfs_ip_id(priv->vol);
 
-	acquirewrite_mrsw(&priv->lock);
-	TAILQ_FOREACH_SAFE(dentry_priv, &priv->ip_queue, ip_queue, dpr_aux) {
-		/* Remove dentry_priv from the IP queue, process its IP requests,
-		 * then free it if the request list is empty. */
-		_unified_update_queue_membership(false, true, REQUEST_IP, dentry_priv, priv);
+	_unified_lock_all(priv);
 
-		TAILQ_FOREACH_SAFE(req, &dentry_priv->requests, list, req_aux) {
-			if (req->state == REQUEST_IP) {
-				char *cache_obj = cache_manager_get_object_data(req->write_cache);
-				struct extent_info *extent = calloc(1, sizeof(struct extent_info));
-				if (! extent) {
-					ltfsmsg(LTFS_ERR, "10001E", "_unified_process_index_queue: extent");
-					_unified_handle_write_error(-ENOMEM, req, dentry_priv, priv);
-					break;
-				}
+	/* Each switch between data partition and index partition writes puts down an index and
+	 * costs a long locate, so the whole batch goes out in one run: let the tape thread finish
+	 * its data partition batches first, and keep new ones out until this is done. */
+	for (i = 0; i < UNIFIED_SHARDS && TAILQ_EMPTY(&priv->shards[i].ip_queue); ++i);
+	if (i == UNIFIED_SHARDS) {
+		_unified_unlock_all(priv);
+		return;
+	}
+	_unified_drain_ring(priv);
+	++priv->ip_flushes;
+
+	for (i = 0; i < UNIFIED_SHARDS; ++i) {
+		shard = &priv->shards[i];
+		TAILQ_FOREACH_SAFE(dentry_priv, &shard->ip_queue, ip_queue, dpr_aux) {
+			/* Remove dentry_priv from the IP queue, process its IP requests,
+			 * then free it if the request list is empty. */
+			_unified_update_queue_membership(false, true, REQUEST_IP, dentry_priv, priv);
+
+			TAILQ_FOREACH_SAFE(req, &dentry_priv->requests, list, req_aux) {
+				if (req->state == REQUEST_IP) {
+					char *cache_obj = cache_manager_get_object_data(req->write_cache);
+					struct extent_info *extent = calloc(1, sizeof(struct extent_info));
+					if (! extent) {
+						ltfsmsg(LTFS_ERR, "10001E", "_unified_process_index_queue: extent");
+						_unified_handle_write_error(-ENOMEM, req, dentry_priv, priv);
+						break;
+					}
 
-				ret = ltfs_fsraw_write_data(partition_id, cache_obj, req->count, 1,
-					&extent->start.block, priv->vol);
-				if (ret < 0) {
-					/* Index partition writer: failed to write data to the tape (%d) */
-					ltfsmsg(LTFS_WARN, "13013W", ret);
-					_unified_handle_write_error(ret, req, dentry_priv, priv);
-					break;
-				} else {
-					extent->start.partition = partition_id;
-					extent->byteoffset = 0;
-					extent->bytecount = req->count;
-					extent->fileoffset = req->offset;
-					_unified_update_alt_extentlist(extent, dentry_priv, priv);
-				}
+					ret = ltfs_fsraw_write_data(partition_id, cache_obj, req->count, 1,
+						&extent->start.block, priv->vol);
+					if (ret < 0) {
+						/* Index partition writer: failed to write data to the tape (%d) */
+						ltfsmsg(LTFS_WARN, "13013W", ret);
+						_unified_handle_write_error(ret, req, dentry_priv, priv);
+						break;
+					} else {
+						extent->start.partition = partition_id;
+						extent->byteoffset = 0;
+						extent->bytecount = req->count;
+						extent->fileoffset = req->offset;
+						_unified_update_alt_extentlist(extent, dentry_priv, priv);
+					}
 
-				TAILQ_REMOVE(&dentry_priv->requests, req, list);
-				_unified_free_request(req, priv);
+					_unified_remove_request(req, dentry_priv);
+					_unified_free_request(req, dentry_priv, priv);
+				}
 			}
-		}
 
-		_unified_free_dentry_priv_conditional(dentry_priv->dentry, 2, priv);
+			_unified_free_dentry_priv_conditional(dentry_priv->dentry, 2, priv);
+		}
 	}
-	releasewrite_mrsw(&priv->lock);
+	_unified_unlock_all(priv);
 }
 
+/**
+ * Hand the requests of the files in the dp_queue (and in the working_set, for REQUEST_PARTIAL)
+ * of every shard to the tape thread. Each pass starts at a different shard, so that the writer
+ * threads spread over the shards and no shard is left waiting behind the others.
+ * Full blocks of priority files are handed over first, whichever shard they are in.
+ * @param queue REQUEST_DP to write full requests, REQUEST_PARTIAL to write partial ones too.
+ * @param priv Handle to the I/O scheduler data.
+ */
 void _unified_process_data_queue(enum request_state queue, struct unified_data *priv)
 {
-	struct workingset_struct *ws = &priv->working_set;
-	struct writequeue_struct *dq = &priv->dp_queue;
-	char partition_id = ltfs_dp_id(priv->vol);
-	uint32_t count, i;
-	ssize_t ret;
+	struct unified_counts counts;
+	uint32_t batch, queued = 0, start, i;
 
-	acquireread_mrsw(&priv->lock);
 	ltfs_thread_mutex_lock(&priv->queue_lock);
-	count = queue == REQUEST_DP ? priv->dp_count : priv->dp_count + priv->ws_count;
+	batch = priv->flush_batch;
 	ltfs_thread_mutex_unlock(&priv->queue_lock);
 
+	start = __sync_fetch_and_add(&priv->next_shard, 1);
+	_unified_sum_counts(&counts, priv);
+	if (counts.dp_priority_count > 0) {
+		for (i = 0; i < UNIFIED_SHARDS && queued < batch; ++i)
+			queued += _unified_process_shard_queue(REQUEST_DP, batch - queued, PASS_PRIORITY,
+				&priv->shards[(start + i) % UNIFIED_SHARDS], priv);
+		if (queue == REQUEST_DP && queued >= batch)
+			return;
+	}
+
+	for (i = 0; i < UNIFIED_SHARDS; ++i) {
+		queued += _unified_process_shard_queue(queue, batch - queued, PASS_NORMAL,
+			&priv->shards[(start + i) % UNIFIED_SHARDS], priv);
+
+		/* Go back to the writer thread to check for cache pressure between batches */
+		if (queue == REQUEST_DP && queued >= batch)
+			break;
+	}
+
+	/* Under cache pressure with nothing else to evict, priority files give up their
+	 * partial blocks too */
+	if (queue == REQUEST_PARTIAL && queued == 0 && counts.ws_priority_count > 0) {
+		for (i = 0; i < UNIFIED_SHARDS; ++i)
+			_unified_process_shard_queue(queue, batch, PASS_EVICT,
+				&priv->shards[(start + i) % UNIFIED_SHARDS], priv);
+	}
+}
+
+/**
+ * Process the data queues of one shard for _unified_process_data_queue.
+ * @param queue REQUEST_DP or REQUEST_PARTIAL, as for _unified_process_data_queue.
+ * @param batch Stop after handing over this many REQUEST_DP requests.
+ * @param pass Files to look at.
+ * @param shard Shard to process.
+ * @param priv Handle to the I/O scheduler data.
+ * @return Number of requests handed to the tape thread.
+ */
+uint32_t _unified_process_shard_queue(enum request_state queue, uint32_t batch,
+	enum unified_pass pass, struct unified_shard *shard, struct unified_data *priv)
+{
+	struct workingset_struct *ws = &shard->working_set;
+	struct workingset_struct *pws = &shard->priority_working_set;
+	struct writequeue_struct *dq = &shard->dp_queue;
+	struct writequeue_struct *pdq = &shard->dp_priority_queue;
+	enum request_state file_queue;
+	char partition_id = ltfs_dp_id(priv->vol);
+	uint32_t count, queued = 0, i;
+	ssize_t ret;
+
+	if (pass == PASS_PRIORITY)
+		queue = REQUEST_DP;
+
+	acquireread_mrsw(&shard->lock);
+	ltfs_thread_mutex_lock(&shard->queue_lock);
+	count = (pass == PASS_PRIORITY) ? shard->counts.dp_priority_count : shard->counts.dp_count;
+	if (queue == REQUEST_PARTIAL)
+		count += shard->counts.ws_count;
+	if (queue == REQUEST_PARTIAL && pass == PASS_NORMAL)
+		count -= shard->counts.ws_priority_count;
+	ltfs_thread_mutex_unlock(&shard->queue_lock);
+
 	/*
 	 * Process only the 'count' entries that are known to be in the queue.
 	 * This is needed to guarantee a limited runtime.
@@ -1280,17 +3084,21 @@ void _unified_process_data_queue(enum request_state queue, struct unified_data *
 		struct req_struct local_req_list;
 		struct write_request *req, *req_aux;
 
-		ltfs_thread_mutex_lock(&priv->queue_lock);
-		if (! TAILQ_EMPTY(dq))
+		ltfs_thread_mutex_lock(&shard->queue_lock);
+		if (! TAILQ_EMPTY(pdq))
+			dentry_priv = TAILQ_FIRST(pdq);
+		else if (pass != PASS_PRIORITY && ! TAILQ_EMPTY(dq))
 			dentry_priv = TAILQ_FIRST(dq);
 		else if (queue == REQUEST_PARTIAL && ! TAILQ_EMPTY(ws))
 			dentry_priv = TAILQ_FIRST(ws);
+		else if (queue == REQUEST_PARTIAL && pass == PASS_EVICT && ! TAILQ_EMPTY(pws))
+			dentry_priv = TAILQ_FIRST(pws);
 		else {
-			ltfs_thread_mutex_unlock(&priv->queue_lock);
+			ltfs_thread_mutex_unlock(&shard->queue_lock);
 			break;
 		}
 		dentry = dentry_priv->dentry;
-		ltfs_thread_mutex_unlock(&priv->queue_lock);
+		ltfs_thread_mutex_unlock(&shard->queue_lock);
 
 		if (! dentry) {
 			/* Invalid backpointer to the dentry in the dentry_priv structure */
@@ -1308,10 +3116,18 @@ void _unified_process_data_queue(enum request_state queue, struct unified_data *
 		}
 
 		/* Remove dentry_priv from the DP queue, also from the working set if requested */
-		_unified_update_queue_membership(false, true, queue, dentry_priv, priv);
-		if (queue == REQUEST_PARTIAL)
+		file_queue = queue;
+		if (dentry_priv->priority && pass != PASS_EVICT)
+			file_queue = REQUEST_DP;
+		_unified_update_queue_membership(false, true, file_queue, dentry_priv, priv);
+		if (file_queue == REQUEST_PARTIAL)
 			_unified_update_queue_membership(false, true, REQUEST_DP, dentry_priv, priv);
 
+		/* Files written to both partitions are still written synchronously here, because their
+		 * requests change state after hitting the data partition. */
+		if (dentry_priv->write_ip)
+			_unified_wait_batches(dentry_priv, priv);
+
 		/* Move entries to be processed into a private list */
 		TAILQ_INIT(&local_req_list);
 		ltfs_mutex_lock(&dentry_priv->io_lock);
@@ -1320,7 +3136,7 @@ void _unified_process_data_queue(enum request_state queue, struct unified_data *
 				_unified_merge_requests(TAILQ_PREV(req, req_struct, list), req, NULL,
 					dentry_priv, priv);
 
-			} else if (req->state == REQUEST_DP || queue == REQUEST_PARTIAL) {
+			} else if (req->state == REQUEST_DP || file_queue == REQUEST_PARTIAL) {
 				if (dentry_priv->write_ip) {
 					char *cache_obj = cache_manager_get_object_data(req->write_cache);
 					ret = ltfs_fsraw_write(dentry, cache_obj, req->count, req->offset,
@@ -1331,6 +3147,8 @@ void _unified_process_data_queue(enum request_state queue, struct unified_data *
 						_unified_handle_write_error(ret, req, dentry_priv, priv);
 						break;
 					} else {
+						_unified_clean_invalidate(dentry->uid, req->offset,
+							req->offset + req->count, priv);
 						req->state = REQUEST_IP;
 						_unified_update_queue_membership(true, false, REQUEST_IP,
 							dentry_priv, priv);
@@ -1339,9 +3157,10 @@ void _unified_process_data_queue(enum request_state queue, struct unified_data *
 					}
 
 				} else {
-					TAILQ_REMOVE(&dentry_priv->requests, req, list);
+					_unified_remove_request(req, dentry_priv);
 					TAILQ_INSERT_TAIL(&local_req_list, req, list);
-					if (queue != REQUEST_PARTIAL) {
+					++queued;
+					if (file_queue != REQUEST_PARTIAL) {
 #if 0
 						ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EVENT(REQ_IOS_DEQUEUE_DP));
 #endif /* 0 */
@@ -1350,53 +3169,24 @@ void _unified_process_data_queue(enum request_state queue, struct unified_data *
 			}
 		}
 
-		ltfs_mutex_unlock(&dentry->iosched_lock);
-
-		/* Send requests to tape */
-		if (! TAILQ_EMPTY(&local_req_list)) {
-			TAILQ_FOREACH_SAFE(req, &local_req_list, list, req_aux) {
-				char *cache_obj = cache_manager_get_object_data(req->write_cache);
-				ret = ltfs_fsraw_write(dentry, cache_obj, req->count, req->offset,
-					partition_id, false, priv->vol);
-				if (ret < 0) {
-					/* Data partition writer: failed to write data to the tape (%d) */
-					ltfsmsg(LTFS_WARN, "13014W", ret);
-					break;
-				} else {
-					TAILQ_REMOVE(&local_req_list, req, list);
-					_unified_free_request(req, priv);
-				}
-			}
+		ltfs_mutex_unlock(&dentry_priv->io_lock);
 
-			/* If there are requests left, then a write error (ret) occurred */
-			if (! TAILQ_EMPTY(&local_req_list)) {
-				ltfs_mutex_unlock(&dentry_priv->io_lock);
-				ltfs_mutex_lock(&dentry->iosched_lock);
-				if (dentry->iosched_priv) {
-					dentry_priv = dentry->iosched_priv;
-					ltfs_mutex_lock(&dentry_priv->io_lock);
-					_unified_handle_write_error(ret, req, dentry_priv, priv);
-				} else
-					dentry_priv = NULL;
-				ltfs_mutex_unlock(&dentry->iosched_lock);
-
-				TAILQ_FOREACH_SAFE(req, &local_req_list, list, req_aux) {
-					TAILQ_REMOVE(&local_req_list, req, list);
-					_unified_free_request(req, priv);
-				}
-			}
-		}
+		/* Send requests to the tape thread. This is done before releasing the iosched_lock
+		 * so that batches of the same file reach the ring in the order they were taken. */
+		_unified_queue_batch(&local_req_list, dentry_priv, priv);
+		ltfs_mutex_unlock(&dentry->iosched_lock);
 
-		if (dentry_priv)
-			ltfs_mutex_unlock(&dentry_priv->io_lock);
+		if (queue == REQUEST_DP && queued >= batch)
+			break;
 	}
 
-	releaseread_mrsw(&priv->lock);
+	releaseread_mrsw(&shard->lock);
+	return queued;
 }
 
 /**
  * Returns the dentry_priv structure for a dentry, allocating it if it does not exist.
- * Must be called with a read lock on priv->lock and with d->iosched_lock held.
+ * Must be called with a read lock on the shard of d and with d->iosched_lock held.
  * @param d Dentry to retrieve scheduler data for. The caller must hold the d->iosched_lock mutex.
  * @param dentry_priv If alloc is false, contains the dentry_priv structure or NULL if the dentry
  *             has no dentry_priv. If alloc is true, contains the dentry_priv structure on success,
@@ -1425,6 +3215,7 @@ int _unified_get_dentry_priv(struct dentry *d, struct dentry_priv **dentry_priv,
 
 	dpr->in_working_set = dpr->in_dp_queue = dpr->in_ip_queue = 0;
 	dpr->dentry = d;
+	dpr->shard = _unified_get_shard(d, priv);
 	TAILQ_INIT(&dpr->requests);
 	TAILQ_INIT(&dpr->alt_extentlist);
 
@@ -1447,7 +3238,10 @@ int _unified_get_dentry_priv(struct dentry *d, struct dentry_priv **dentry_priv,
 	acquireread_mrsw(&d->meta_lock);
 	dpr->file_size = d->size;
 	dpr->write_ip = d->matches_name_criteria;
+	dpr->priority = d->high_priority;
 	releaseread_mrsw(&d->meta_lock);
+	if (dpr->priority)
+		__sync_add_and_fetch(&priv->priority_files, 1);
 	max_filesize = index_criteria_get_max_filesize(priv->vol);
 	if (max_filesize == 0 || dpr->file_size > max_filesize)
 		dpr->write_ip = false;
@@ -1588,6 +3382,7 @@ void _unified_clear_alt_extentlist(bool save, struct dentry_priv *dpr, struct un
 /**
  * Update the queue membership of a given dentry_priv structure.
  * Requires the caller to have a lock held on dentry->iosched_lock.
+ * The queues and counters updated are those of the dentry_priv's shard.
  * Performs reference counting so that counts of write requests in each queue are known.
  * @param add True to add the dentry_priv to a queue membership, False to remove it from that queue.
  * @param all If 'add' is false and 'all' is true, set the counter for the given queue to 0
@@ -1601,31 +3396,41 @@ int _unified_update_queue_membership(bool add, bool all, enum request_state queu
 	struct dentry_priv *dentry_priv, struct unified_data *priv)
 {
 	int ret = 0;
+	struct unified_shard *shard;
+	struct workingset_struct *ws;
+	struct writequeue_struct *dq;
 
 	CHECK_ARG_NULL(priv, -LTFS_NULL_ARG);
 	CHECK_ARG_NULL(dentry_priv, -LTFS_NULL_ARG);
 	CHECK_ARG_NULL(dentry_priv->dentry, -LTFS_NULL_ARG);
 
-	ltfs_thread_mutex_lock(&priv->queue_lock);
+	shard = dentry_priv->shard;
+	ws = dentry_priv->priority ? &shard->priority_working_set : &shard->working_set;
+	dq = dentry_priv->priority ? &shard->dp_priority_queue : &shard->dp_queue;
+	ltfs_thread_mutex_lock(&shard->queue_lock);
 	switch (queue) {
 		case REQUEST_PARTIAL:
 			if (add) {
 				if (! dentry_priv->in_working_set) {
-					TAILQ_INSERT_TAIL(&priv->working_set, dentry_priv, working_set);
-					++priv->ws_count;
+					TAILQ_INSERT_TAIL(ws, dentry_priv, working_set);
+					++shard->counts.ws_count;
+					if (dentry_priv->priority)
+						++shard->counts.ws_priority_count;
 				}
 				++dentry_priv->in_working_set;
-				++priv->ws_request_count;
+				++shard->counts.ws_request_count;
 			} else {
 				if ((all && dentry_priv->in_working_set) || dentry_priv->in_working_set == 1) {
-					TAILQ_REMOVE(&priv->working_set, dentry_priv, working_set);
-					--priv->ws_count;
+					TAILQ_REMOVE(ws, dentry_priv, working_set);
+					--shard->counts.ws_count;
+					if (dentry_priv->priority)
+						--shard->counts.ws_priority_count;
 				}
 				if (all) {
-					priv->ws_request_count -= dentry_priv->in_working_set;
+					shard->counts.ws_request_count -= dentry_priv->in_working_set;
 					dentry_priv->in_working_set = 0;
 				} else if (dentry_priv->in_working_set) {
-					--priv->ws_request_count;
+					--shard->counts.ws_request_count;
 					--dentry_priv->in_working_set;
 				}
 			}
@@ -1634,29 +3439,35 @@ int _unified_update_queue_membership(bool add, bool all, enum request_state queu
 		case REQUEST_DP:
 			if (add) {
 				if (! dentry_priv->in_dp_queue) {
-					TAILQ_INSERT_TAIL(&priv->dp_queue, dentry_priv, dp_queue);
-					++priv->dp_count;
+					TAILQ_INSERT_TAIL(dq, dentry_priv, dp_queue);
+					++shard->counts.dp_count;
+					if (dentry_priv->priority)
+						++shard->counts.dp_priority_count;
 					/* Tell background thread a write request is ready */
+					ltfs_thread_mutex_lock(&priv->queue_lock);
 					ltfs_thread_cond_signal(&priv->queue_cond);
+					ltfs_thread_mutex_unlock(&priv->queue_lock);
 				}
 				if (! dentry_priv->write_ip)
-					++priv->dp_request_count;
+					++shard->counts.dp_request_count;
 				++dentry_priv->in_dp_queue;
 #if 0
 				ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EVENT(REQ_IOS_ENQUEUE_DP));
 #endif /* 0 */
 			} else {
 				if ((all && dentry_priv->in_dp_queue) || dentry_priv->in_dp_queue == 1) {
-					TAILQ_REMOVE(&priv->dp_queue, dentry_priv, dp_queue);
-					--priv->dp_count;
+					TAILQ_REMOVE(dq, dentry_priv, dp_queue);
+					--shard->counts.dp_count;
+					if (dentry_priv->priority)
+						--shard->counts.dp_priority_count;
 				}
 				if (all) {
 					if (! dentry_priv->write_ip)
-						priv->dp_request_count -= dentry_priv->in_dp_queue;
+						shard->counts.dp_request_count -= dentry_priv->in_dp_queue;
 					dentry_priv->in_dp_queue = 0;
 				} else if (dentry_priv->in_dp_queue) {
 					if (! dentry_priv->write_ip)
-						--priv->dp_request_count;
+						--shard->counts.dp_request_count;
 					--dentry_priv->in_dp_queue;
 				}
 			}
@@ -1665,25 +3476,25 @@ int _unified_update_queue_membership(bool add, bool all, enum request_state queu
 		case REQUEST_IP:
 			if (add) {
 				if (! dentry_priv->in_ip_queue) {
-					TAILQ_INSERT_TAIL(&priv->ip_queue, dentry_priv, ip_queue);
-					++priv->ip_count;
+					TAILQ_INSERT_TAIL(&shard->ip_queue, dentry_priv, ip_queue);
+					++shard->counts.ip_count;
 				}
 				++dentry_priv->in_ip_queue;
-				++priv->ip_request_count;
+				++shard->counts.ip_request_count;
 #if 0
 				ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EVENT(REQ_IOS_ENQUEUE_IP));
 #endif /* 0 */
 			} else {
 				if ((all && dentry_priv->in_ip_queue) || dentry_priv->in_ip_queue == 1) {
-					TAILQ_REMOVE(&priv->ip_queue, dentry_priv, ip_queue);
-					--priv->ip_count;
+					TAILQ_REMOVE(&shard->ip_queue, dentry_priv, ip_queue);
+					--shard->counts.ip_count;
 				}
 				if (all) {
-					priv->ip_request_count -= dentry_priv->in_ip_queue;
+					shard->counts.ip_request_count -= dentry_priv->in_ip_queue;
 					dentry_priv->in_ip_queue = 0;
 				} else if (dentry_priv->in_ip_queue) {
 					--dentry_priv->in_ip_queue;
-					--priv->ip_request_count;
+					--shard->counts.ip_request_count;
 				}
 #if 0
 				ltfs_profiler_add_entry(ios_profiler, &ios_profiler_lock, IOSCHED_REQ_EVENT(REQ_IOS_DEQUEUE_IP));
@@ -1696,23 +3507,181 @@ int _unified_update_queue_membership(bool add, bool all, enum request_state queu
 			ltfsmsg(LTFS_ERR, "13012E", queue);
 			ret = -LTFS_BAD_ARG;
 	};
-	ltfs_thread_mutex_unlock(&priv->queue_lock);
+	ltfs_thread_mutex_unlock(&shard->queue_lock);
 
 	return ret;
 }
 
 /**
- * Free a write_request structure, including its write cache.
+ * Allocate a zeroed write_request structure, reusing a free one of the shard if there is any.
+ * @param shard Shard of the file the request is for.
+ * @return The new request, or NULL if out of memory.
+ */
+struct write_request *_unified_alloc_request(struct unified_shard *shard)
+{
+	struct write_request *req;
+
+	ltfs_thread_mutex_lock(&shard->queue_lock);
+	req = TAILQ_FIRST(&shard->free_requests);
+	if (req) {
+		TAILQ_REMOVE(&shard->free_requests, req, list);
+		--shard->free_request_count;
+	} else
+		++shard->request_allocs;
+	ltfs_thread_mutex_unlock(&shard->queue_lock);
+
+	if (req)
+		memset(req, 0, sizeof(struct write_request));
+	else
+		req = calloc(1, sizeof(struct write_request));
+	return req;
+}
+
+/**
+ * Free a write_request structure, including its write cache. The structure goes back to the
+ * shard of the file for reuse.
  * @param req Request structure to free.
+ * @param dpr dentry_priv the request belonged to, or NULL to give the structure back to the heap.
  * @param priv Handle to I/O scheduler data.
  */
-void _unified_free_request(struct write_request *req, struct unified_data *priv)
+void _unified_free_request(struct write_request *req, struct dentry_priv *dpr,
+	struct unified_data *priv)
 {
+	struct unified_shard *shard;
+
 	if (req->write_cache)
 		_unified_cache_free(req->write_cache, req->count, priv);
+
+	if (dpr) {
+		shard = dpr->shard;
+		ltfs_thread_mutex_lock(&shard->queue_lock);
+		if (shard->free_request_count < priv->cache_blocks) {
+			TAILQ_INSERT_HEAD(&shard->free_requests, req, list);
+			++shard->free_request_count;
+			req = NULL;
+		}
+		ltfs_thread_mutex_unlock(&shard->queue_lock);
+	}
 	free(req);
 }
 
+/**
+ * Find the last request of each skip list level which starts before a given offset.
+ * Request start offsets strictly increase along the request list, even while unified_write
+ * has overlapping requests outstanding: merges and truncations only move the start of a
+ * request forward within its own range.
+ * @param offset File offset to search for.
+ * @param pred On exit, pred[i] is the last request in level i starting before offset,
+ *             or NULL if there is none.
+ * @param dpr dentry_priv whose requests are searched.
+ */
+void _unified_skip_find(uint64_t offset, struct write_request **pred, struct dentry_priv *dpr)
+{
+	struct write_request *req = NULL, *next;
+	int i;
+
+	for (i = UNIFIED_SKIP_LEVELS - 1; i >= 0; --i) {
+		next = req ? req->skip[i] : dpr->skip_head[i];
+		while (next && next->offset < offset) {
+			req = next;
+			next = req->skip[i];
+		}
+		pred[i] = req;
+	}
+}
+
+/**
+ * Link a request into the request list of a file and into its skip list levels.
+ * Must call with a read lock on the file's shard and a lock on dpr->dentry->iosched_lock.
+ * @param new_req Request to insert. Its offset must fall between the requests around it.
+ * @param req Request to insert new_req before, or NULL to insert it at the end of the list.
+ * @param dpr dentry_priv the request belongs to.
+ */
+void _unified_insert_request(struct write_request *new_req, struct write_request *req,
+	struct dentry_priv *dpr)
+{
+	struct write_request *pred[UNIFIED_SKIP_LEVELS];
+	uint64_t hash;
+	uint32_t i;
+
+	if (req)
+		TAILQ_INSERT_BEFORE(req, new_req, list);
+	else
+		TAILQ_INSERT_TAIL(&dpr->requests, new_req, list);
+
+	/* Take the height from a hash of the request, so that no random state is shared
+	 * between threads. Each pair of leading zero bits adds a level. */
+	hash = ((uint64_t) (uintptr_t) new_req ^ new_req->offset) * 0x9E3779B97F4A7C15ULL;
+	for (new_req->height = 0; new_req->height < UNIFIED_SKIP_LEVELS && ! (hash >> 62); hash <<= 2)
+		++new_req->height;
+	if (! new_req->height)
+		return;
+
+	_unified_skip_find(req ? req->offset : UINT64_MAX, pred, dpr);
+	for (i = 0; i < new_req->height; ++i) {
+		if (pred[i]) {
+			new_req->skip[i] = pred[i]->skip[i];
+			pred[i]->skip[i] = new_req;
+		} else {
+			new_req->skip[i] = dpr->skip_head[i];
+			dpr->skip_head[i] = new_req;
+		}
+	}
+}
+
+/**
+ * Unlink a request from the request list of a file and from its skip list levels.
+ * Must call with a read lock on the file's shard and a lock on dpr->dentry->iosched_lock,
+ * or with a write lock on all shards.
+ * @param req Request to remove.
+ * @param dpr dentry_priv the request belongs to.
+ */
+void _unified_remove_request(struct write_request *req, struct dentry_priv *dpr)
+{
+	struct write_request *pred[UNIFIED_SKIP_LEVELS];
+	uint32_t i;
+
+	TAILQ_REMOVE(&dpr->requests, req, list);
+	if (! req->height)
+		return;
+
+	_unified_skip_find(req->offset, pred, dpr);
+	for (i = 0; i < req->height; ++i) {
+		if (pred[i])
+			pred[i]->skip[i] = req->skip[i];
+		else
+			dpr->skip_head[i] = req->skip[i];
+	}
+}
+
+/**
+ * Find the first request of a file which ends at or after a given offset. This is where reads
+ * and writes at that offset start looking at the request list.
+ * A request never holds more than a cache block, so requests starting more than a block before
+ * the offset are skipped through the skip list. The rest are walked in list order, which gives
+ * the same answer as walking the whole list even when requests overlap.
+ * @param offset File offset to search for.
+ * @param dpr dentry_priv whose requests are searched.
+ * @param priv Handle to I/O scheduler data.
+ * @return The first request ending at or after offset, or NULL if there is none.
+ */
+struct write_request *_unified_seek_request(uint64_t offset, struct dentry_priv *dpr,
+	struct unified_data *priv)
+{
+	struct write_request *pred[UNIFIED_SKIP_LEVELS], *req = NULL;
+
+	if (offset > priv->cache_size) {
+		_unified_skip_find(offset - priv->cache_size, pred, dpr);
+		req = pred[0];
+	}
+	if (! req)
+		req = TAILQ_FIRST(&dpr->requests);
+
+	while (req && req->offset + req->count < offset)
+		req = TAILQ_NEXT(req, list);
+	return req;
+}
+
 /**
  * Free a cache block and signal anyone waiting on cache pressure.
  * @param cache Cache manager block to free.
@@ -1720,58 +3689,124 @@ void _unified_free_request(struct write_request *req, struct unified_data *priv)
  */
 void _unified_cache_free(void *cache, size_t count, struct unified_data *priv)
 {
-	ltfs_thread_mutex_lock(&priv->cache_lock);
 	cache_manager_free_object(cache, count);
-	ltfs_thread_cond_signal(&priv->cache_cond);
-	ltfs_thread_mutex_unlock(&priv->cache_lock);
+	__sync_sub_and_fetch(&priv->blocks_used, 1);
+
+	/* A waiter registers itself before its last allocation attempt, so if none is
+	 * registered now, any later waiter will find the block just freed. */
+	if (__sync_add_and_fetch(&priv->cache_waiters, 0) > 0) {
+		ltfs_thread_mutex_lock(&priv->cache_lock);
+		/* A waiter held back by the priority reserve must not swallow the wakeup
+		 * of a priority file */
+		if (__sync_add_and_fetch(&priv->priority_files, 0) > 0)
+			ltfs_thread_cond_broadcast(&priv->cache_cond);
+		else
+			ltfs_thread_cond_signal(&priv->cache_cond);
+		ltfs_thread_mutex_unlock(&priv->cache_lock);
+	}
 }
 
 /**
  * Allocate a cache block for the given dentry. This is a helper function for unified_write;
  * it may not be very useful elsewhere.
- * The caller must hold d->iosched_lock and a read lock on priv->lock.
+ * The caller must hold d->iosched_lock and a read lock on the shard of d.
  * This function tries to allocate a cache block without releasing any locks. If it fails (due to
  * cache pressure), it releases both locks, waits for the cache pressure to be relieved,
- * retakes priv->lock for read, and returns.
+ * retakes the shard lock for read, and returns.
  * @param cache On exit, holds a newly allocated cache block.
  * @param d Dentry to allocate a cache block for.
  * @param priv Handle to I/O scheduler data.
  * @return 1 if dentry_priv lock was released due to cache pressure, 0 if not, or a negative value
- *         on error. Both locks (priv->lock and d->iosched_lock) are released on error.
+ *         on error. Both locks (the shard lock and d->iosched_lock) are released on error.
  */
 int _unified_cache_alloc(void **cache, struct dentry *d, struct unified_data *priv)
 {
-	ltfs_thread_mutex_lock(&priv->cache_lock);
-	*cache = cache_manager_allocate_object(priv->pool);
-	if (*cache) {
-		ltfs_thread_mutex_unlock(&priv->cache_lock);
+	struct unified_shard *shard = _unified_get_shard(d, priv);
+	struct dentry_priv *dpr = d->iosched_priv;
+
+	__sync_add_and_fetch(&priv->cache_allocs, 1);
+	*cache = _unified_cache_take(dpr, priv);
+	while (! (*cache) && _unified_reserve_allows(dpr, priv) && _unified_clean_reclaim(priv))
+		*cache = _unified_cache_take(dpr, priv);
+	if (*cache)
 		return 0;
-	}
 
 	/* Cache pressure occurred. Release locks and wait for space to become free */
+	__sync_add_and_fetch(&priv->cache_stalls, 1);
 	ltfs_mutex_unlock(&d->iosched_lock);
 	ltfs_thread_mutex_lock(&priv->queue_lock);
 	ltfs_thread_cond_signal(&priv->queue_cond);
 	++priv->cache_requests;
 	ltfs_thread_mutex_unlock(&priv->queue_lock);
-	releaseread_mrsw(&priv->lock);
+	releaseread_mrsw(&shard->lock);
+	ltfs_thread_mutex_lock(&priv->cache_lock);
+	__sync_add_and_fetch(&priv->cache_waiters, 1);
+	*cache = _unified_cache_take(dpr, priv);
 	while (! (*cache)) {
-		ltfs_thread_cond_wait(&priv->cache_cond, &priv->cache_lock);
-		*cache = cache_manager_allocate_object(priv->pool);
+		/* Blocks written while this thread was registering may have gone to the clean tier */
+		if (! _unified_reserve_allows(dpr, priv) || ! _unified_clean_reclaim(priv))
+			ltfs_thread_cond_wait(&priv->cache_cond, &priv->cache_lock);
+		*cache = _unified_cache_take(dpr, priv);
 	}
+	__sync_sub_and_fetch(&priv->cache_waiters, 1);
 	ltfs_thread_mutex_unlock(&priv->cache_lock);
 
-	acquireread_mrsw(&priv->lock);
+	acquireread_mrsw(&shard->lock);
 	ltfs_thread_mutex_lock(&priv->queue_lock);
 	--priv->cache_requests;
 	ltfs_thread_mutex_unlock(&priv->queue_lock);
 	return 1;
 }
 
+/**
+ * Check whether a file may take a cache block. Files outside the high priority class
+ * cannot take the blocks reserved for priority files while any of them is open for write.
+ * Blocks in the clean tier count as free, since they are given back on demand.
+ * @param dpr dentry_priv of the file.
+ * @param priv Handle to I/O scheduler data.
+ * @return true if the file may take a block, false if it must wait for one.
+ */
+bool _unified_reserve_allows(struct dentry_priv *dpr, struct unified_data *priv)
+{
+	uint32_t used, clean;
+
+	if (dpr->priority || __sync_add_and_fetch(&priv->priority_files, 0) == 0)
+		return true;
+
+	/* Unlocked snapshots: the reserve only needs to hold roughly */
+	used = __sync_add_and_fetch(&priv->blocks_used, 0);
+	clean = __sync_add_and_fetch(&priv->clean_count, 0);
+	if (used > clean)
+		used -= clean;
+	else
+		used = 0;
+	return used + priv->priority_reserve
+		< priv->cache_blocks - __sync_add_and_fetch(&priv->pool_parked, 0);
+}
+
+/**
+ * Take a block from the cache pool for a file, honoring the priority reserve.
+ * @param dpr dentry_priv of the file.
+ * @param priv Handle to I/O scheduler data.
+ * @return A cache block, or NULL if none is available to this file.
+ */
+void *_unified_cache_take(struct dentry_priv *dpr, struct unified_data *priv)
+{
+	void *cache;
+
+	if (! _unified_reserve_allows(dpr, priv))
+		return NULL;
+
+	cache = cache_manager_allocate_object(priv->pool);
+	if (cache)
+		__sync_add_and_fetch(&priv->blocks_used, 1);
+	return cache;
+}
+
 /**
  * Insert a new write request before 'req', or at the end of the request list if
  * 'req' is NULL.
- * Call this function with d->iosched_lock held and a read lock on priv->lock.
+ * Call this function with d->iosched_lock held and a read lock on the shard of d.
  * d->iosched_lock may be released during allocation of a new cache block, in which case
  * the function returns without actually inserting a new request into the queue.
  * This is a helper function for unified_write; it may not be useful elsewhere.
@@ -1816,12 +3851,12 @@ ssize_t _unified_insert_new_request(const char *buf, off_t offset, size_t count,
 	memcpy(cache_manager_get_object_data(*cache), buf, copy_count);
 
 	/* Store new write request */
-	new_req = calloc(1, sizeof(struct write_request));
+	new_req = _unified_alloc_request(dpr->shard);
 	if (! new_req) {
 		ltfsmsg(LTFS_ERR, "13018E");
 		_unified_cache_free(*cache, 0, priv);
 		ltfs_mutex_unlock(&d->iosched_lock);
-		releaseread_mrsw(&priv->lock);
+		releaseread_mrsw(&dpr->shard->lock);
 		return -LTFS_NO_MEMORY;
 	}
 	new_req->offset = offset;
@@ -1832,10 +3867,7 @@ ssize_t _unified_insert_new_request(const char *buf, off_t offset, size_t count,
 		new_req->state = (copy_count == priv->cache_size) ? REQUEST_DP : REQUEST_PARTIAL;
 	new_req->write_cache = *cache;
 	*cache = NULL;
-	if (req)
-		TAILQ_INSERT_BEFORE(req, new_req, list);
-	else
-		TAILQ_INSERT_TAIL(&dpr->requests, new_req, list);
+	_unified_insert_request(new_req, req, dpr);
 	_unified_update_queue_membership(true, false, new_req->state, dpr, priv);
 
 	/* Update file size */
@@ -1854,7 +3886,7 @@ ssize_t _unified_insert_new_request(const char *buf, off_t offset, size_t count,
 
 /**
  * Update an existing request with bytes from a new buffer, changing the state if needed.
- * Must call with a read lock on priv->lock and a lock on dpr->dentry->iosched_lock.
+ * Must call with a read lock on the file's shard and a lock on dpr->dentry->iosched_lock.
  * This function must not be called to merge dirty (DP targeted) bytes into a REQUEST_IP
  * request.
  * @param buf New bytes to write.
@@ -1959,14 +3991,13 @@ int _unified_merge_requests(struct write_request *dest, struct write_request *sr
 			}
 		} else {
 			ret = 2;
-			TAILQ_REMOVE(&dpr->requests, src, list);
+			_unified_remove_request(src, dpr);
 			_unified_update_queue_membership(false, false, src->state, dpr, priv);
-			if (! spare_cache || *spare_cache)
-				_unified_free_request(src, priv);
-			else {
+			if (spare_cache && ! *spare_cache) {
 				*spare_cache = src->write_cache;
-				free(src);
+				src->write_cache = NULL;
 			}
+			_unified_free_request(src, dpr, priv);
 		}
 	}
 
@@ -1975,8 +4006,8 @@ int _unified_merge_requests(struct write_request *dest, struct write_request *sr
 
 /**
  * Flush requests for a dentry.
- * The caller should hold (a) d->iosched_lock and a read lock on priv->lock, or
- * (b) a write lock on priv->lock.
+ * The caller should hold (a) d->iosched_lock and a read lock on the shard of d, or
+ * (b) a write lock on all shards.
  * @param d Dentry to flush.
  * @param priv I/O scheduler private data.
  * @return 0 on success or a negative value on error.
@@ -1998,7 +4029,8 @@ int _unified_flush_unlocked(struct dentry *d, struct unified_data *priv)
 	if (! dpr)
 		return 0;
 
-	/* Check for previous write errors */
+	/* Check for previous write errors, including those of batches still in flight */
+	_unified_wait_batches(dpr, priv);
 	ret = _unified_get_write_error(dpr);
 	if (ret < 0)
 		return ret;
@@ -2038,7 +4070,11 @@ int _unified_flush_unlocked(struct dentry *d, struct unified_data *priv)
 	TAILQ_FOREACH_SAFE(req, &dpr->requests, list, aux) {
 		if (req->state == REQUEST_IP)
 			_unified_merge_requests(TAILQ_PREV(req, req_struct, list), req, NULL, dpr, priv);
-		else {
+		else if (priv->pack_tails && ! dpr->write_ip && req->count < priv->cache_size &&
+			req->offset + req->count == dpr->file_size) {
+			/* Leave the partial last block of the file for the next pack */
+			_unified_defer_tail(req, dpr, priv);
+		} else {
 			req_cache = cache_manager_get_object_data(req->write_cache);
 			ret = ltfs_fsraw_write(d, req_cache, req->count, req->offset, dp_id, false, priv->vol);
 			if (ret < 0) {
@@ -2046,12 +4082,13 @@ int _unified_flush_unlocked(struct dentry *d, struct unified_data *priv)
 				_unified_handle_write_error(ret, req, dpr, priv);
 				break;
 			} else if (dpr->write_ip) {
+				_unified_clean_invalidate(d->uid, req->offset, req->offset + req->count, priv);
 				req->state = REQUEST_IP;
 				_unified_update_queue_membership(true, false, REQUEST_IP, dpr, priv);
 				_unified_merge_requests(TAILQ_PREV(req, req_struct, list), req, NULL, dpr, priv);
 			} else {
-				TAILQ_REMOVE(&dpr->requests, req, list);
-				_unified_free_request(req, priv);
+				_unified_remove_request(req, dpr);
+				_unified_clean_insert(req, dpr, priv);
 			}
 		}
 	}
@@ -2071,36 +4108,50 @@ int _unified_flush_unlocked(struct dentry *d, struct unified_data *priv)
 int _unified_flush_all(struct unified_data *priv)
 {
 	int ret;
+	uint32_t i;
 	struct dentry_priv *dpr, *aux;
+	struct unified_shard *shard;
+	struct writequeue_struct *dq;
+	struct workingset_struct *ws;
 
 	CHECK_ARG_NULL(priv, -LTFS_NULL_ARG);
 
-	acquirewrite_mrsw(&priv->lock);
+	_unified_lock_all(priv);
 
-	if (! TAILQ_EMPTY(&priv->dp_queue)) {
-		TAILQ_FOREACH_SAFE(dpr, &priv->dp_queue, dp_queue, aux) {
-			ret = _unified_flush_unlocked(dpr->dentry, priv);
-			if (ret < 0) {
-				ltfsmsg(LTFS_ERR, "13020E", dpr->dentry->platform_safe_name, ret);
-				releasewrite_mrsw(&priv->lock);
-				return ret;
+	for (i = 0; i < 2 * UNIFIED_SHARDS; ++i) {
+		/* Priority files of every shard go first */
+		shard = &priv->shards[i % UNIFIED_SHARDS];
+		dq = (i < UNIFIED_SHARDS) ? &shard->dp_priority_queue : &shard->dp_queue;
+		ws = (i < UNIFIED_SHARDS) ? &shard->priority_working_set : &shard->working_set;
+
+		if (! TAILQ_EMPTY(dq)) {
+			TAILQ_FOREACH_SAFE(dpr, dq, dp_queue, aux) {
+				ret = _unified_flush_unlocked(dpr->dentry, priv);
+				if (ret < 0) {
+					ltfsmsg(LTFS_ERR, "13020E", dpr->dentry->platform_safe_name, ret);
+					_unified_unlock_all(priv);
+					return ret;
+				}
 			}
 		}
-	}
 
-	if (! TAILQ_EMPTY(&priv->working_set)) {
-		TAILQ_FOREACH_SAFE(dpr, &priv->working_set, working_set, aux) {
-			ret = _unified_flush_unlocked(dpr->dentry, priv);
-			if (ret < 0) {
-				ltfsmsg(LTFS_ERR, "13020E", dpr->dentry->platform_safe_name, ret);
-				releasewrite_mrsw(&priv->lock);
-				return ret;
+		if (! TAILQ_EMPTY(ws)) {
+			TAILQ_FOREACH_SAFE(dpr, ws, working_set, aux) {
+				ret = _unified_flush_unlocked(dpr->dentry, priv);
+				if (ret < 0) {
+					ltfsmsg(LTFS_ERR, "13020E", dpr->dentry->platform_safe_name, ret);
+					_unified_unlock_all(priv);
+					return ret;
+				}
 			}
 		}
 	}
 
-	releasewrite_mrsw(&priv->lock);
-	return 0;
+	/* Write the tails left behind by the flushes above */
+	ret = _unified_write_pack_unlocked(priv);
+
+	_unified_unlock_all(priv);
+	return (ret < 0) ? ret : 0;
 }
 
 /**
@@ -2130,6 +4181,8 @@ void _unified_free_dentry_priv_conditional(struct dentry *d, uint32_t target_han
 		/* Take I/O lock first. The background thread could be processing this dentry */
 		ltfs_mutex_lock(&dpr->io_lock);
 		ltfs_mutex_unlock(&dpr->io_lock);
+		_unified_wait_batches(dpr, priv);
+		_unified_leave_pack_queue(dpr, priv);
 
 		ltfs_mutex_destroy(&dpr->write_error_lock);
 		ltfs_mutex_destroy(&dpr->io_lock);
@@ -2157,14 +4210,19 @@ void _unified_free_dentry_priv(struct dentry *d, struct unified_data *priv)
 	if (! TAILQ_EMPTY(&dpr->requests))
 		ltfsmsg(LTFS_WARN, "13022W");
 
-	/* Wait for background thread to finish flushing requests */
+	/* Wait for background threads to finish flushing requests */
 	ltfs_mutex_lock(&dpr->io_lock);
 	ltfs_mutex_unlock(&dpr->io_lock);
+	_unified_wait_batches(dpr, priv);
+	_unified_leave_pack_queue(dpr, priv);
 
 	/* Sent alt_extentlist to libltfs */
 	if (dpr->write_ip && ! TAILQ_EMPTY(&dpr->alt_extentlist))
 		_unified_clear_alt_extentlist(true, dpr, priv);
 
+	if (dpr->priority)
+		__sync_sub_and_fetch(&priv->priority_files, 1);
+
 	ltfs_mutex_destroy(&dpr->write_error_lock);
 	ltfs_mutex_destroy(&dpr->io_lock);
 	free(dpr);
@@ -2174,7 +4232,7 @@ void _unified_free_dentry_priv(struct dentry *d, struct unified_data *priv)
 
 /**
  * Set the write_ip flag for a dentry_priv structure.
- * This also requires updating the global DP request counter so that the background writer thread
+ * This also requires updating the shard's DP request counter so that the background writer thread
  * knows this dentry_priv's requests can be freed immediately after writing.
  * The caller should hold an appropriate lock (usually dpr->d->iosched_lock).
  * @param dpr dentry_priv structure to modify.
@@ -2186,9 +4244,9 @@ void _unified_set_write_ip(struct dentry_priv *dpr, struct unified_data *priv)
 
 	/* Hide DP requests from the global request counter, as they can't be freed */
 	if (dpr->in_dp_queue) {
-		ltfs_thread_mutex_lock(&priv->queue_lock);
-		priv->dp_request_count -= dpr->in_dp_queue;
-		ltfs_thread_mutex_unlock(&priv->queue_lock);
+		ltfs_thread_mutex_lock(&dpr->shard->queue_lock);
+		dpr->shard->counts.dp_request_count -= dpr->in_dp_queue;
+		ltfs_thread_mutex_unlock(&dpr->shard->queue_lock);
 	}
 }
 
@@ -2210,8 +4268,8 @@ void _unified_unset_write_ip(struct dentry_priv *dpr, struct unified_data *priv)
 	if (dpr->in_ip_queue) {
 		TAILQ_FOREACH_SAFE(req, &dpr->requests, list, req_aux) {
 			if (req->state == REQUEST_IP) {
-				TAILQ_REMOVE(&dpr->requests, req, list);
-				_unified_free_request(req, priv);
+				_unified_remove_request(req, dpr);
+				_unified_free_request(req, dpr, priv);
 			}
 		}
 
@@ -2222,9 +4280,9 @@ void _unified_unset_write_ip(struct dentry_priv *dpr, struct unified_data *priv)
 
 	/* write_ip hides DP requests from the global request counter. Unhide them now */
 	if (dpr->in_dp_queue) {
-		ltfs_thread_mutex_lock(&priv->queue_lock);
-		priv->dp_request_count += dpr->in_dp_queue;
-		ltfs_thread_mutex_unlock(&priv->queue_lock);
+		ltfs_thread_mutex_lock(&dpr->shard->queue_lock);
+		dpr->shard->counts.dp_request_count += dpr->in_dp_queue;
+		ltfs_thread_mutex_unlock(&dpr->shard->queue_lock);
 	}
 
 	/* Clear the alt_extentlist */
@@ -2297,8 +4355,8 @@ void _unified_handle_write_error(ssize_t write_ret, struct write_request *failed
 			_unified_update_queue_membership(false, true, REQUEST_IP, dpr, priv);
 		TAILQ_FOREACH_SAFE(req, &dpr->requests, list, aux) {
 			if ((req->state == REQUEST_IP && clear_ip) || (req->state != REQUEST_IP && clear_dp)) {
-				TAILQ_REMOVE(&dpr->requests, req, list);
-				_unified_free_request(req, priv);
+				_unified_remove_request(req, dpr);
+				_unified_free_request(req, dpr, priv);
 			} else if (req->offset + req->count > dpr->file_size)
 				dpr->file_size = req->offset + req->count;
 		}
@@ -2308,8 +4366,8 @@ void _unified_handle_write_error(ssize_t write_ret, struct write_request *failed
 /**
  * Return the contents of the write_error code of the dentry_priv structure.
  * The write_error flag is reset after being read.
- * The caller is expected to have (a) a write lock on priv->lock or (b) a read lock on
- * priv->lock and a lock on dentry->iosched_lock.
+ * The caller is expected to have (a) a write lock on all shards or (b) a read lock on the
+ * file's shard and a lock on dentry->iosched_lock.
  * @param dpr dentry_priv structure to access.
  * @return The write_error code.
  */
@@ -2327,6 +4385,499 @@ int _unified_get_write_error(struct dentry_priv *dpr)
 	return ret;
 }
 
+/**
+ * Initialize the asynchronous I/O lock and submission queue.
+ * @param priv Handle to the I/O scheduler data.
+ * @return 0 on success or a negative value on error.
+ */
+int _unified_async_init(struct unified_data *priv)
+{
+	int ret;
+
+	ret = ltfs_thread_mutex_init(&priv->async_lock);
+	if (ret) {
+		/* Cannot initialize scheduler: failed to initialize mutex %s (%d) */
+		ltfsmsg(LTFS_ERR, "13006E", "async_lock", ret);
+		return -LTFS_MUTEX_INIT;
+	}
+	ret = ltfs_thread_cond_init(&priv->async_cond);
+	if (ret) {
+		/* Cannot initialize scheduler: failed to initialize condition variable %s (%d) */
+		ltfsmsg(LTFS_ERR, "13007E", "async_cond", ret);
+		ltfs_thread_mutex_destroy(&priv->async_lock);
+		return -LTFS_MUTEX_INIT;
+	}
+
+	TAILQ_INIT(&priv->async_requests);
+	priv->async_count = 0;
+	return 0;
+}
+
+/**
+ * Free the asynchronous I/O lock. The async threads must not be running.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_async_destroy(struct unified_data *priv)
+{
+	ltfs_thread_cond_destroy(&priv->async_cond);
+	ltfs_thread_mutex_destroy(&priv->async_lock);
+}
+
+/**
+ * Stop the async threads. Requests already submitted are carried out before they exit.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_async_stop(struct unified_data *priv)
+{
+	uint32_t i;
+
+	ltfs_thread_mutex_lock(&priv->async_lock);
+	priv->async_keepalive = false;
+	ltfs_thread_cond_broadcast(&priv->async_cond);
+	ltfs_thread_mutex_unlock(&priv->async_lock);
+
+	for (i = 0; i < priv->async_count; ++i)
+		ltfs_thread_join(priv->async_threads[i]);
+	priv->async_count = 0;
+}
+
+/**
+ * Async thread. Takes requests from the submission queue, carries them out through the
+ * synchronous entry points of the scheduler and posts their results to the completion ring
+ * of the queue they were submitted to.
+ * @param iosched_handle Handle to the I/O scheduler data.
+ */
+ltfs_thread_return _unified_async_thread(void *iosched_handle)
+{
+	struct unified_data *priv = (struct unified_data *) iosched_handle;
+	struct async_request *req;
+	struct async_queue *queue;
+	struct iosched_cqe *cqe;
+	ssize_t ret;
+
+	ltfs_thread_mutex_lock(&priv->async_lock);
+	while (true) {
+		while (TAILQ_EMPTY(&priv->async_requests) && priv->async_keepalive)
+			ltfs_thread_cond_wait(&priv->async_cond, &priv->async_lock);
+		req = TAILQ_FIRST(&priv->async_requests);
+		if (! req)
+			break;
+		TAILQ_REMOVE(&priv->async_requests, req, list);
+		ltfs_thread_mutex_unlock(&priv->async_lock);
+
+		switch (req->sqe.op) {
+			case IOSCHED_ASYNC_READ:
+				ret = unified_read(req->sqe.d, req->sqe.buf, req->sqe.size, req->sqe.offset, priv);
+				break;
+			case IOSCHED_ASYNC_WRITE:
+				ret = unified_write(req->sqe.d, req->sqe.buf, req->sqe.size, req->sqe.offset,
+					req->sqe.isupdatetime, priv);
+				break;
+			case IOSCHED_ASYNC_FLUSH:
+				ret = unified_flush(req->sqe.d, false, priv);
+				break;
+			default:
+				ret = -LTFS_BAD_ARG;
+				break;
+		}
+
+		ltfs_thread_mutex_lock(&priv->async_lock);
+		queue = req->queue;
+		cqe = &queue->cqe[(queue->head + queue->count) % queue->depth];
+		cqe->user_data = req->sqe.user_data;
+		cqe->result = ret;
+		++queue->count;
+		ltfs_thread_cond_broadcast(&queue->cond);
+		free(req);
+	}
+	ltfs_thread_mutex_unlock(&priv->async_lock);
+
+	ltfs_thread_exit();
+	return LTFS_THREAD_RC_NULL;
+}
+
+/**
+ * Create an asynchronous I/O queue, starting the async threads if this is the first one.
+ * A queue may be shared by several threads.
+ * @param depth Maximum number of requests submitted to the queue and not reaped yet.
+ * @param iosched_handle Handle to the I/O scheduler data.
+ * @return The new queue, or NULL on failure.
+ */
+void *unified_queue_create(uint32_t depth, void *iosched_handle)
+{
+	struct unified_data *priv = (struct unified_data *) iosched_handle;
+	struct async_queue *queue;
+	int ret;
+
+	CHECK_ARG_NULL(iosched_handle, NULL);
+
+	queue = calloc(1, sizeof(struct async_queue));
+	if (queue)
+		queue->cqe = calloc(depth, sizeof(struct iosched_cqe));
+	if (! queue || ! queue->cqe) {
+		ltfsmsg(LTFS_ERR, "10001E", "unified_queue_create: queue");
+		free(queue);
+		return NULL;
+	}
+	ret = ltfs_thread_cond_init(&queue->cond);
+	if (ret) {
+		/* Cannot initialize scheduler: failed to initialize condition variable %s (%d) */
+		ltfsmsg(LTFS_ERR, "13007E", "queue->cond", ret);
+		free(queue->cqe);
+		free(queue);
+		return NULL;
+	}
+	queue->depth = depth;
+
+	ltfs_thread_mutex_lock(&priv->async_lock);
+	while (priv->async_keepalive && priv->async_count < UNIFIED_ASYNC_THREADS) {
+		ret = ltfs_thread_create(&priv->async_threads[priv->async_count],
+			_unified_async_thread, priv);
+		if (ret) {
+			/* Cannot start asynchronous I/O: failed to create thread (%d) */
+			ltfsmsg(LTFS_ERR, "13024E", ret);
+			break;
+		}
+		++priv->async_count;
+	}
+	ret = priv->async_count;
+	ltfs_thread_mutex_unlock(&priv->async_lock);
+
+	if (! ret) {
+		ltfs_thread_cond_destroy(&queue->cond);
+		free(queue->cqe);
+		free(queue);
+		return NULL;
+	}
+	return queue;
+}
+
+/**
+ * Destroy an asynchronous I/O queue. Waits for its requests in flight to complete; completions
+ * not reaped yet are discarded.
+ * @param queue Queue to destroy.
+ * @param iosched_handle Handle to the I/O scheduler data.
+ * @return 0 on success or a negative value on error.
+ */
+int unified_queue_destroy(void *queue, void *iosched_handle)
+{
+	struct unified_data *priv = (struct unified_data *) iosched_handle;
+	struct async_queue *q = (struct async_queue *) queue;
+
+	CHECK_ARG_NULL(queue, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+
+	ltfs_thread_mutex_lock(&priv->async_lock);
+	while (q->pending > q->count)
+		ltfs_thread_cond_wait(&q->cond, &priv->async_lock);
+	ltfs_thread_mutex_unlock(&priv->async_lock);
+
+	ltfs_thread_cond_destroy(&q->cond);
+	free(q->cqe);
+	free(q);
+	return 0;
+}
+
+/**
+ * Submit asynchronous requests. Each request takes a slot of the queue until its completion
+ * is reaped; submission stops at the first request that does not fit.
+ * @param queue Queue to submit to.
+ * @param sqe Requests to submit.
+ * @param count Number of requests in sqe.
+ * @param iosched_handle Handle to the I/O scheduler data.
+ * @return Number of requests submitted, or a negative value on error.
+ */
+int unified_submit(void *queue, const struct iosched_sqe *sqe, uint32_t count,
+	void *iosched_handle)
+{
+	struct unified_data *priv = (struct unified_data *) iosched_handle;
+	struct async_queue *q = (struct async_queue *) queue;
+	struct async_request *req;
+	uint32_t i;
+
+	CHECK_ARG_NULL(queue, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(sqe, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+
+	ltfs_thread_mutex_lock(&priv->async_lock);
+	for (i = 0; i < count && q->pending < q->depth; ++i) {
+		req = malloc(sizeof(struct async_request));
+		if (! req) {
+			ltfsmsg(LTFS_ERR, "10001E", "unified_submit: request");
+			break;
+		}
+		req->sqe = sqe[i];
+		req->queue = q;
+		TAILQ_INSERT_TAIL(&priv->async_requests, req, list);
+		++q->pending;
+	}
+	if (i > 0)
+		ltfs_thread_cond_broadcast(&priv->async_cond);
+	ltfs_thread_mutex_unlock(&priv->async_lock);
+
+	if (i == 0 && count > 0 && q->pending < q->depth)
+		return -LTFS_NO_MEMORY;
+	return i;
+}
+
+/**
+ * Collect completions of asynchronous requests, in completion order.
+ * @param queue Queue to reap from.
+ * @param cqe On success, holds the completions.
+ * @param count Maximum number of completions to return.
+ * @param min_complete Wait until at least this many completions are available, or until no
+ *                     request of the queue is left in flight.
+ * @param iosched_handle Handle to the I/O scheduler data.
+ * @return Number of completions stored in cqe, or a negative value on error.
+ */
+int unified_reap(void *queue, struct iosched_cqe *cqe, uint32_t count, uint32_t min_complete,
+	void *iosched_handle)
+{
+	struct unified_data *priv = (struct unified_data *) iosched_handle;
+	struct async_queue *q = (struct async_queue *) queue;
+	uint32_t i;
+
+	CHECK_ARG_NULL(queue, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(cqe, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(iosched_handle, -LTFS_NULL_ARG);
+
+	ltfs_thread_mutex_lock(&priv->async_lock);
+	while (q->count < min_complete && q->pending > q->count)
+		ltfs_thread_cond_wait(&q->cond, &priv->async_lock);
+	for (i = 0; i < count && q->count > 0; ++i) {
+		cqe[i] = q->cqe[q->head];
+		q->head = (q->head + 1) % q->depth;
+		--q->count;
+		--q->pending;
+	}
+	ltfs_thread_mutex_unlock(&priv->async_lock);
+
+	return i;
+}
+
+/**
+ * Find the memory pressure stall information to watch: that of the cgroup (v2) LTFS runs in
+ * if the kernel exposes it, otherwise that of the whole system.
+ * @return A newly allocated path, or NULL if the system does not report memory pressure.
+ */
+char *_unified_psi_path(void)
+{
+	FILE *f;
+	char line[PATH_MAX];
+	char *path = NULL;
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (strncmp(line, "0::", 3) == 0) {
+				line[strcspn(line, "\n")] = '\0';
+				if (asprintf(&path, "/sys/fs/cgroup%s/memory.pressure", line + 3) < 0)
+					path = NULL;
+				break;
+			}
+		}
+		fclose(f);
+	}
+
+	if (path && access(path, R_OK) != 0) {
+		free(path);
+		path = NULL;
+	}
+	if (! path && access("/proc/pressure/memory", R_OK) == 0)
+		path = strdup("/proc/pressure/memory");
+	return path;
+}
+
+/**
+ * Read the share of the last 10 seconds during which some task stalled on memory.
+ * @param pressure On success, holds the share in percent.
+ * @param priv Handle to the I/O scheduler data.
+ * @return 0 on success or a negative value on error.
+ */
+int _unified_psi_read(double *pressure, struct unified_data *priv)
+{
+	FILE *f;
+	char line[256];
+	int ret = -LTFS_FILE_ERR;
+
+	f = fopen(priv->psi_path, "r");
+	if (! f)
+		return -LTFS_FILE_ERR;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "some avg10=%lf", pressure) == 1) {
+			ret = 0;
+			break;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+/**
+ * Start the pool manager if the system reports memory pressure. Without it, the cache keeps
+ * the size it is configured with.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_pool_start(struct unified_data *priv)
+{
+	int ret;
+
+	priv->psi_path = _unified_psi_path();
+	if (! priv->psi_path)
+		return;
+
+	ret = ltfs_thread_mutex_init(&priv->pool_lock);
+	if (ret) {
+		/* Pool manager: failed to start (%d), the cache size stays fixed */
+		ltfsmsg(LTFS_WARN, "13025W", ret);
+		goto out_free;
+	}
+	ret = ltfs_thread_cond_init(&priv->pool_cond);
+	if (ret) {
+		/* Pool manager: failed to start (%d), the cache size stays fixed */
+		ltfsmsg(LTFS_WARN, "13025W", ret);
+		goto out_mutex;
+	}
+
+	priv->pool_keepalive = true;
+	ret = ltfs_thread_create(&priv->pool_thread, _unified_pool_thread, priv);
+	if (ret) {
+		/* Pool manager: failed to start (%d), the cache size stays fixed */
+		ltfsmsg(LTFS_WARN, "13025W", ret);
+		goto out_cond;
+	}
+
+	/* Pool manager: watching memory pressure in %s */
+	ltfsmsg(LTFS_DEBUG, "13026D", priv->psi_path);
+	priv->pool_running = true;
+	return;
+
+out_cond:
+	ltfs_thread_cond_destroy(&priv->pool_cond);
+out_mutex:
+	ltfs_thread_mutex_destroy(&priv->pool_lock);
+out_free:
+	free(priv->psi_path);
+	priv->psi_path = NULL;
+}
+
+/**
+ * Stop the pool manager and put the blocks it parked back in service.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_pool_stop(struct unified_data *priv)
+{
+	if (priv->pool_running) {
+		ltfs_thread_mutex_lock(&priv->pool_lock);
+		priv->pool_keepalive = false;
+		ltfs_thread_cond_signal(&priv->pool_cond);
+		ltfs_thread_mutex_unlock(&priv->pool_lock);
+		ltfs_thread_join(priv->pool_thread);
+
+		ltfs_thread_cond_destroy(&priv->pool_cond);
+		ltfs_thread_mutex_destroy(&priv->pool_lock);
+		priv->pool_running = false;
+	}
+
+	free(priv->psi_path);
+	priv->psi_path = NULL;
+	_unified_pool_grow(priv->pool_parked, priv);
+}
+
+/**
+ * Park free cache blocks, giving back blocks of the clean tier if there are not enough free
+ * ones. Blocks holding data to write are left alone; the writer threads free them over time,
+ * and the next check parks more if memory is still short.
+ * @param blocks Number of blocks to park.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_pool_shrink(uint32_t blocks, struct unified_data *priv)
+{
+	size_t capacity;
+	uint32_t parked;
+
+	capacity = cache_manager_get_capacity(priv->pool);
+	if (capacity <= priv->pool_floor)
+		return;
+	if (blocks > capacity - priv->pool_floor)
+		blocks = capacity - priv->pool_floor;
+
+	parked = cache_manager_park_objects(priv->pool, blocks);
+	while (parked < blocks && _unified_clean_reclaim(priv))
+		parked += cache_manager_park_objects(priv->pool, blocks - parked);
+
+	if (parked > 0) {
+		__sync_add_and_fetch(&priv->pool_parked, parked);
+		/* Pool manager: parked %u cache blocks, %u in service */
+		ltfsmsg(LTFS_DEBUG, "13027D", parked, (unsigned int) (capacity - parked));
+	}
+}
+
+/**
+ * Put parked cache blocks back in service and wake up threads waiting for a block.
+ * @param blocks Number of blocks to unpark.
+ * @param priv Handle to the I/O scheduler data.
+ */
+void _unified_pool_grow(uint32_t blocks, struct unified_data *priv)
+{
+	uint32_t unparked;
+
+	unparked = cache_manager_unpark_objects(priv->pool, blocks);
+	if (unparked == 0)
+		return;
+	__sync_sub_and_fetch(&priv->pool_parked, unparked);
+
+	ltfs_thread_mutex_lock(&priv->cache_lock);
+	ltfs_thread_cond_broadcast(&priv->cache_cond);
+	ltfs_thread_mutex_unlock(&priv->cache_lock);
+
+	/* Pool manager: unparked %u cache blocks */
+	ltfsmsg(LTFS_DEBUG, "13028D", unparked);
+}
+
+/**
+ * Pool manager thread. Shrinks the cache in bulk while the system is short of memory, and
+ * grows it back once memory is available again and writers are waiting for cache blocks.
+ * @param iosched_handle Handle to the I/O scheduler data.
+ */
+ltfs_thread_return _unified_pool_thread(void *iosched_handle)
+{
+	struct unified_data *priv = (struct unified_data *) iosched_handle;
+	uint64_t allocs, stalls, last_allocs = 0, last_stalls = 0;
+	uint32_t step;
+	double pressure;
+
+	step = (uint32_t) (UNIFIED_POOL_STEP * priv->cache_blocks);
+	if (step == 0)
+		step = 1;
+
+	ltfs_thread_mutex_lock(&priv->pool_lock);
+	while (priv->pool_keepalive) {
+		ltfs_thread_cond_timedwait(&priv->pool_cond, &priv->pool_lock, UNIFIED_POOL_INTERVAL);
+		if (! priv->pool_keepalive)
+			break;
+		ltfs_thread_mutex_unlock(&priv->pool_lock);
+
+		allocs = __sync_add_and_fetch(&priv->cache_allocs, 0);
+		stalls = __sync_add_and_fetch(&priv->cache_stalls, 0);
+		if (_unified_psi_read(&pressure, priv) == 0) {
+			if (pressure >= UNIFIED_PSI_HIGH)
+				_unified_pool_shrink(step, priv);
+			else if (pressure < UNIFIED_PSI_LOW && priv->pool_parked > 0 &&
+				stalls - last_stalls > UNIFIED_POOL_STALLS * (allocs - last_allocs))
+				_unified_pool_grow(step, priv);
+		}
+		last_allocs = allocs;
+		last_stalls = stalls;
+
+		ltfs_thread_mutex_lock(&priv->pool_lock);
+	}
+	ltfs_thread_mutex_unlock(&priv->pool_lock);
+
+	ltfs_thread_exit();
+	return LTFS_THREAD_RC_NULL;
+}
+
 struct iosched_ops unified_ops = {
 	.init         = unified_init,
 	.destroy      = unified_destroy,
@@ -2338,6 +4889,11 @@ struct iosched_ops unified_ops = {
 	.truncate     = unified_truncate,
 	.get_filesize = unified_get_filesize,
 	.update_data_placement = unified_update_data_placement,
+	.get_state    = unified_get_state,
+	.queue_create = unified_queue_create,
+	.queue_destroy = unified_queue_destroy,
+	.submit       = unified_submit,
+	.reap         = unified_reap,
 };
 
 struct iosched_ops *iosched_get_ops(void)
@@ -254,6 +254,7 @@ struct dentry * fs_allocate_dentry(struct dentry *parent, const char *name, cons
 	}
 	d->isdir = isdir;
 	d->readonly = readonly;
+	d->xml_dirty = true;
 	d->numhandles = 1;
 	d->link_count = 0;
 	if (isdir)
@@ -312,6 +313,20 @@ struct dentry * fs_allocate_dentry(struct dentry *parent, const char *name, cons
 		return NULL;
 	}
 
+	ret = ltfs_mutex_init(&d->extent_index_lock);
+	if (ret) {
+		ltfsmsg(LTFS_ERR, "10002E", ret);
+		destroy_mrsw(&d->contents_lock);
+		destroy_mrsw(&d->meta_lock);
+		ltfs_mutex_destroy(&d->iosched_lock);
+		if (d->name)
+			free(d->name);
+		if (d->platform_safe_name)
+			free(d->platform_safe_name);
+		free(d);
+		return NULL;
+	}
+
 	d->tag_count = 0;
 	d->preserved_tags = NULL;
 
@@ -334,6 +349,7 @@ struct dentry * fs_allocate_dentry(struct dentry *parent, const char *name, cons
 		}
 		/* The volume initialization assumes that the parent data has been set before */
 		d->vol = parent->vol;
+		parent->xml_dirty = true;
 		d->link_count++;
 		if (isdir)
 			parent->link_count++;
@@ -654,6 +670,7 @@ void _fs_dispose_dentry_contents(struct dentry *dentry, bool unlock, bool gc)
 		free(dentry->iosched_priv);
 		dentry->iosched_priv = NULL;
 	}
+	fs_clear_extent_index(dentry);
 	if (! TAILQ_EMPTY(&dentry->extentlist)) {
 		TAILQ_FOREACH_SAFE(ext_entry, &dentry->extentlist, list, ext_aux)
 			free(ext_entry);
@@ -675,6 +692,7 @@ void _fs_dispose_dentry_contents(struct dentry *dentry, bool unlock, bool gc)
 			HASH_DEL(dentry->parent->child_list, namelist);
 			free(namelist->name);
 			free(namelist);
+			dentry->parent->xml_dirty = true;
 		}
 		dentry->parent = NULL;
 	}
@@ -691,11 +709,16 @@ void _fs_dispose_dentry_contents(struct dentry *dentry, bool unlock, bool gc)
 	destroy_mrsw(&dentry->contents_lock);
 	destroy_mrsw(&dentry->meta_lock);
 	ltfs_mutex_destroy(&dentry->iosched_lock);
+	ltfs_mutex_destroy(&dentry->extent_index_lock);
 	HASH_CLEAR(hh, dentry->child_list);
 	if (dentry->target) {
 		free(dentry->target);
 		dentry->target = NULL;
 	}
+	if (dentry->xml_cache)
+		free(dentry->xml_cache);
+	if (dentry->xml_holes)
+		free(dentry->xml_holes);
 	free(dentry);
 }
 
@@ -772,6 +795,7 @@ static struct name_list* fs_update_platform_safe_names_and_hash_table(struct den
 
 		/* Add hash table whose key is upper case of platform safe name */
 		basedir->child_list = fs_add_key_to_hash_table(basedir->child_list, list_ptr->d, &rc);
+		basedir->xml_dirty = true;
 		if (rc != 0) {
 			ltfsmsg(LTFS_ERR, "11319E", "fs_update_platform_safe_names_and_hash_table", rc);
 		} else {
@@ -846,6 +870,36 @@ uint64_t fs_get_used_blocks(struct dentry *d)
 	return used;
 }
 
+/**
+ * Drop the extent index and read cursor of a dentry. Must be called whenever its extent
+ * list changes. The caller must hold d->contents_lock for write.
+ * @param d dentry whose extent list changed
+ */
+void fs_clear_extent_index(struct dentry *d)
+{
+	if (d->extent_index) {
+		free(d->extent_index);
+		d->extent_index = NULL;
+		d->extent_index_count = 0;
+	}
+	d->extent_cursor = NULL;
+}
+
+/**
+ * Note that a dentry has changed in a way that shows up in the Index. The cached XML of the
+ * directory which holds the dentry's XML (the dentry itself for a directory, its parent for a
+ * file) is rebuilt the next time an Index is written. Changes to the child list of a directory
+ * must be noted on the directory as well.
+ * @param d dentry which changed
+ */
+void fs_set_xml_dirty(struct dentry *d)
+{
+	if (d->isdir)
+		d->xml_dirty = true;
+	else if (d->parent)
+		d->parent->xml_dirty = true;
+}
+
 /**
  * Dump a single dentry. Doesn't recurse.
  * @param ptr dentry to dump
@@ -71,6 +71,8 @@ uint64_t fs_allocate_uid(struct ltfs_index *idx);
 int fs_update_platform_safe_names(struct dentry* basedir, struct ltfs_index *idx, struct name_list *list);
 bool fs_is_predecessor(struct dentry *d1, struct dentry *d2);
 uint64_t fs_get_used_blocks(struct dentry *d);
+void fs_clear_extent_index(struct dentry *d);
+void fs_set_xml_dirty(struct dentry *d);
 void fs_dump_tree(struct dentry *root);
 void fs_increment_file_count(struct ltfs_index *idx);
 void fs_decrement_file_count(struct ltfs_index *idx);
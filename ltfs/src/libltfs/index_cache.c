@@ -0,0 +1,1166 @@
+/*
+**  %Z% %I% %W% %G% %U%
+**
+**  ZZ_Copyright_BEGIN
+**
+**
+**  Licensed Materials - Property of IBM
+**
+**  IBM Linear Tape File System Single Drive Edition Version 2.2.0.2 for Linux and Mac OS X
+**
+**  Copyright IBM Corp. 2010, 2014
+**
+**  This file is part of the IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X
+**  (formally known as IBM Linear Tape File System)
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is free software;
+**  you can redistribute it and/or modify it under the terms of the GNU Lesser
+**  General Public License as published by the Free Software Foundation,
+**  version 2.1 of the License.
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is distributed in the
+**  hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+**  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**  See the GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public
+**  License along with this library; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+**  or download the license from <http://www.gnu.org/licenses/>.
+**
+**  ZZ_Copyright_END
+**
+*************************************************************************************
+*************************************************************************************
+**
+** COMPONENT NAME:  IBM Linear Tape File System
+**
+** FILE NAME:       index_cache.c
+**
+** DESCRIPTION:     Binary snapshot of an Index, saved in the work directory so that a
+**                  volume can be remounted without reading and parsing its Index again.
+**                  The snapshot is a header followed by arrays of fixed-size dentry,
+**                  extent and extended attribute records and by a table of interned
+**                  strings. It is mapped into memory and checked against the first block
+**                  of the Index on tape before it is used.
+**
+*************************************************************************************
+*/
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef mingw_PLATFORM
+#include <sys/mman.h>
+#endif
+
+#include "ltfs.h"
+#include "fs.h"
+#include "index_cache.h"
+#include "index_criteria.h"
+#include "arch/time_internal.h"
+
+/* O_BINARY is defined only in MinGW */
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define INDEX_CACHE_MAGIC      "LTFSIDXC"
+#define INDEX_CACHE_VERSION    1
+#define INDEX_CACHE_BYTE_ORDER 0x01020304
+#define INDEX_CACHE_SUFFIX     ".idxcache"
+#define INDEX_CACHE_TMP_SUFFIX ".idxcache.tmp"
+
+/* Offset of an absent string */
+#define INDEX_CACHE_NONE       UINT64_MAX
+
+/* Size of the write buffer of each section. Must be a multiple of 8, see
+ * _index_cache_checksum(). */
+#define INDEX_CACHE_BUF_SIZE   (1024 * 1024)
+
+#define INDEX_CACHE_HASH_SEED  0xcbf29ce484222325ULL
+#define INDEX_CACHE_HASH_PRIME 0x100000001b3ULL
+
+/* Sections of the cache file, in file order */
+#define INDEX_CACHE_DENTRIES   0
+#define INDEX_CACHE_EXTENTS    1
+#define INDEX_CACHE_XATTRS     2
+#define INDEX_CACHE_STRINGS    3
+#define INDEX_CACHE_SECTIONS   4
+
+/* Indices into the time stamp arrays of a dentry record */
+#define INDEX_CACHE_CREATION   0
+#define INDEX_CACHE_CHANGE     1
+#define INDEX_CACHE_MODIFY     2
+#define INDEX_CACHE_ACCESS     3
+#define INDEX_CACHE_BACKUP     4
+#define INDEX_CACHE_TIMES      5
+
+/* All structures below are stored in native byte order and padded to a multiple of 8 bytes,
+ * so that the records of a mapped file can be used in place. */
+struct index_cache_header {
+	char magic[8];                    /**< INDEX_CACHE_MAGIC */
+	uint32_t version;                 /**< INDEX_CACHE_VERSION */
+	uint32_t byte_order;              /**< INDEX_CACHE_BYTE_ORDER in the writer's byte order */
+	uint64_t file_size;               /**< Size of the whole file */
+
+	/* Identity of the Index on tape */
+	char vol_uuid[40];                /**< Volume UUID */
+	uint64_t generation;              /**< Generation number */
+	int64_t mod_time_sec;             /**< Update time */
+	int64_t mod_time_nsec;
+	uint64_t selfptr_block;           /**< First block of the Index */
+	uint64_t fm_block;                /**< File mark which ends the Index */
+	char selfptr_partition;           /**< Partition holding the Index */
+	char backptr_partition;           /**< Partition of the previous generation */
+	uint8_t criteria_allow_update;    /**< Can the data placement policy be changed? */
+	uint8_t have_criteria;            /**< Is there a data placement policy? */
+	uint32_t blocksize;               /**< Volume block size, which determines used_blocks */
+
+	/* Other Index properties */
+	int32_t index_version;            /**< Index format version */
+	uint32_t glob_count;              /**< Number of name patterns in the placement policy */
+	uint64_t backptr_block;           /**< First block of the previous generation */
+	uint64_t uid_number;              /**< Highest UID */
+	uint64_t max_filesize_criteria;   /**< Size limit of the placement policy */
+	uint64_t creator;                 /**< String offset of the creator */
+	uint64_t volume_name;             /**< String offset of the volume name */
+	uint64_t commit_message;          /**< String offset of the comment */
+	uint64_t glob_patterns;           /**< String offset of the first name pattern */
+
+	/* Sections */
+	uint64_t offset[INDEX_CACHE_SECTIONS];    /**< File offset of each section */
+	uint64_t count[INDEX_CACHE_SECTIONS];     /**< Records in each section (bytes for strings) */
+	uint64_t checksum[INDEX_CACHE_SECTIONS];  /**< Checksum of each section */
+	uint64_t header_checksum;                 /**< Checksum of this header, computed as 0 */
+};
+
+/* Dentries are stored depth first: the child_count children of a directory follow it, each
+ * one followed in turn by its own children. The root directory comes first. */
+struct index_cache_dentry {
+	uint64_t uid;
+	uint64_t size;
+	uint64_t name;                    /**< String offset, unused for the root directory */
+	uint64_t target;                  /**< String offset of the symlink target */
+	uint64_t first_extent;            /**< Index of the first extent record */
+	uint64_t first_xattr;             /**< Index of the first xattr record */
+	uint64_t child_count;             /**< Number of direct children of a directory */
+	uint32_t extent_count;
+	uint32_t xattr_count;
+	int64_t time_sec[INDEX_CACHE_TIMES];
+	int32_t time_nsec[INDEX_CACHE_TIMES];
+	uint8_t isdir;
+	uint8_t readonly;
+	uint8_t isslink;
+	uint8_t pad[1];
+};
+
+struct index_cache_extent {
+	uint64_t start_block;
+	uint64_t bytecount;
+	uint64_t fileoffset;
+	uint32_t byteoffset;
+	char partition;
+	uint8_t pad[3];
+};
+
+struct index_cache_xattr {
+	uint64_t key;                     /**< String offset of the name */
+	uint64_t value;                   /**< String offset of the value, INDEX_CACHE_NONE if empty */
+	uint64_t size;                    /**< Size of the value */
+};
+
+static const uint64_t index_cache_record_size[INDEX_CACHE_SECTIONS] = {
+	sizeof(struct index_cache_dentry),
+	sizeof(struct index_cache_extent),
+	sizeof(struct index_cache_xattr),
+	1,
+};
+
+/* A string already stored in the string table */
+struct index_cache_string {
+	const char *str;
+	size_t len;
+	uint64_t offset;
+	UT_hash_handle hh;
+};
+
+/* A section being written, through a buffer which is flushed whenever it fills up */
+struct index_cache_section {
+	char *buf;
+	size_t used;
+	uint64_t offset;                  /**< File offset of the section */
+	uint64_t flushed;                 /**< Bytes already written to the file */
+	uint64_t count;                   /**< Records appended so far */
+	uint64_t checksum;                /**< Checksum of the flushed bytes */
+};
+
+struct index_cache_writer {
+	int fd;
+	struct index_cache_section section[INDEX_CACHE_SECTIONS];
+	struct index_cache_string *strings;
+};
+
+struct index_cache_reader {
+	const struct index_cache_header *hdr;
+	const struct index_cache_dentry *dentries;
+	const struct index_cache_extent *extents;
+	const struct index_cache_xattr *xattrs;
+	const char *strings;
+	uint64_t next;                    /**< Next dentry record to load */
+	struct ltfs_index *idx;
+};
+
+static char *_index_cache_path(const char *work_dir, const char *vol_uuid, const char *suffix)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%s%s", work_dir, vol_uuid, suffix) < 0) {
+		ltfsmsg(LTFS_ERR, "10001E", "_index_cache_path");
+		return NULL;
+	}
+	return path;
+}
+
+/**
+ * Update a checksum with the given data. The data are consumed 8 bytes at a time, so callers
+ * which checksum a section in pieces must pass pieces whose sizes are multiples of 8, except
+ * for the last one.
+ */
+static uint64_t _index_cache_checksum(uint64_t sum, const char *buf, uint64_t size)
+{
+	uint64_t word, i;
+
+	for (i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, buf + i, sizeof(word));
+		sum = (sum ^ word) * INDEX_CACHE_HASH_PRIME;
+		sum ^= sum >> 32;
+	}
+	for (; i < size; ++i)
+		sum = (sum ^ (unsigned char) buf[i]) * INDEX_CACHE_HASH_PRIME;
+
+	return sum;
+}
+
+static int _index_cache_write_all(int fd, const char *buf, size_t size)
+{
+	ssize_t nwrite;
+
+	while (size > 0) {
+		nwrite = write(fd, buf, size);
+		if (nwrite < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += nwrite;
+		size -= nwrite;
+	}
+	return 0;
+}
+
+static int _index_cache_flush(struct index_cache_writer *w, int s)
+{
+	struct index_cache_section *sec = &w->section[s];
+	int ret;
+
+	if (sec->used == 0)
+		return 0;
+	if (lseek(w->fd, sec->offset + sec->flushed, SEEK_SET) == (off_t) -1)
+		return -errno;
+	ret = _index_cache_write_all(w->fd, sec->buf, sec->used);
+	if (ret < 0)
+		return ret;
+
+	sec->checksum = _index_cache_checksum(sec->checksum, sec->buf, sec->used);
+	sec->flushed += sec->used;
+	sec->used = 0;
+	return 0;
+}
+
+static int _index_cache_append(struct index_cache_writer *w, int s, const void *data, size_t size)
+{
+	struct index_cache_section *sec = &w->section[s];
+	const char *p = data;
+	size_t count;
+	int ret;
+
+	while (size > 0) {
+		count = INDEX_CACHE_BUF_SIZE - sec->used;
+		if (count > size)
+			count = size;
+		memcpy(sec->buf + sec->used, p, count);
+		sec->used += count;
+		p += count;
+		size -= count;
+
+		if (sec->used == INDEX_CACHE_BUF_SIZE) {
+			ret = _index_cache_flush(w, s);
+			if (ret < 0)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Append a string of the given length and a terminating NUL to the string table.
+ */
+static int _index_cache_append_string(struct index_cache_writer *w, const char *str, size_t len,
+	uint64_t *offset)
+{
+	struct index_cache_section *sec = &w->section[INDEX_CACHE_STRINGS];
+	int ret;
+
+	*offset = sec->flushed + sec->used;
+	ret = _index_cache_append(w, INDEX_CACHE_STRINGS, str, len);
+	if (ret == 0)
+		ret = _index_cache_append(w, INDEX_CACHE_STRINGS, "", 1);
+	return ret;
+}
+
+/**
+ * Add a string to the string table, or find the copy which is already there. The string must
+ * stay in place until the writer is disposed of.
+ */
+static int _index_cache_add_string(struct index_cache_writer *w, const char *str, size_t len,
+	uint64_t *offset)
+{
+	struct index_cache_string *entry;
+	int ret;
+
+	HASH_FIND(hh, w->strings, str, len, entry);
+	if (entry) {
+		*offset = entry->offset;
+		return 0;
+	}
+
+	entry = malloc(sizeof(struct index_cache_string));
+	if (! entry) {
+		ltfsmsg(LTFS_ERR, "10001E", "_index_cache_add_string");
+		return -LTFS_NO_MEMORY;
+	}
+	entry->str = str;
+	entry->len = len;
+
+	ret = _index_cache_append_string(w, str, len, &entry->offset);
+	if (ret < 0) {
+		free(entry);
+		return ret;
+	}
+
+	errno = 0;
+	HASH_ADD_KEYPTR(hh, w->strings, entry->str, entry->len, entry);
+	if (errno == ENOMEM) {
+		free(entry);
+		return -LTFS_NO_MEMORY;
+	}
+
+	*offset = entry->offset;
+	return 0;
+}
+
+static void _index_cache_put_time(struct index_cache_dentry *rec, int i, struct ltfs_timespec t)
+{
+	/* Out-of-range time stamps are clamped on tape, see xml_format_time() */
+	normalize_ltfs_time(&t);
+	rec->time_sec[i] = t.tv_sec;
+	rec->time_nsec[i] = t.tv_nsec;
+}
+
+/**
+ * Count the records needed for a dentry and its descendants.
+ * @return 0 on success or 1 if the tree cannot be cached.
+ */
+static int _index_cache_count(const struct dentry *d, uint64_t *count)
+{
+	struct name_list *entry, *tmp;
+	struct extent_info *xt;
+	struct xattr_info *xattr;
+
+	/* Unrecognized tags are only kept as XML */
+	if (d->tag_count > 0)
+		return 1;
+
+	++count[INDEX_CACHE_DENTRIES];
+	TAILQ_FOREACH(xattr, &d->xattrlist, list)
+		++count[INDEX_CACHE_XATTRS];
+
+	if (d->isdir) {
+		HASH_ITER(hh, d->child_list, entry, tmp) {
+			if (_index_cache_count(entry->d, count) != 0)
+				return 1;
+		}
+	} else if (! d->isslink) {
+		TAILQ_FOREACH(xt, &d->extentlist, list)
+			++count[INDEX_CACHE_EXTENTS];
+	}
+
+	return 0;
+}
+
+/**
+ * Write the records of a dentry and its descendants. Only what the Index on tape holds is
+ * saved, see _xml_write_dirtree() and _xml_write_file().
+ */
+static int _index_cache_write_dentry(struct index_cache_writer *w, struct dentry *d,
+	const struct ltfs_index *idx)
+{
+	struct index_cache_dentry rec;
+	struct index_cache_extent xrec;
+	struct index_cache_xattr arec;
+	struct name_list *entry, *tmp;
+	struct extent_info *xt;
+	struct xattr_info *xattr;
+	int ret;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.uid = d->uid;
+	rec.name = INDEX_CACHE_NONE;
+	rec.target = INDEX_CACHE_NONE;
+	rec.isdir = d->isdir;
+	rec.readonly = d->readonly;
+	_index_cache_put_time(&rec, INDEX_CACHE_CREATION, d->creation_time);
+	_index_cache_put_time(&rec, INDEX_CACHE_CHANGE, d->change_time);
+	_index_cache_put_time(&rec, INDEX_CACHE_MODIFY, d->modify_time);
+	_index_cache_put_time(&rec, INDEX_CACHE_ACCESS, d->access_time);
+	_index_cache_put_time(&rec, INDEX_CACHE_BACKUP, d->backup_time);
+
+	if (d != idx->root) {
+		ret = _index_cache_add_string(w, d->name, strlen(d->name), &rec.name);
+		if (ret < 0)
+			return ret;
+	}
+
+	rec.first_xattr = w->section[INDEX_CACHE_XATTRS].count;
+	TAILQ_FOREACH(xattr, &d->xattrlist, list) {
+		memset(&arec, 0, sizeof(arec));
+		ret = _index_cache_add_string(w, xattr->key, strlen(xattr->key), &arec.key);
+		if (ret < 0)
+			return ret;
+		if (xattr->value) {
+			ret = _index_cache_add_string(w, xattr->value, xattr->size, &arec.value);
+			if (ret < 0)
+				return ret;
+			arec.size = xattr->size;
+		} else
+			arec.value = INDEX_CACHE_NONE;
+
+		ret = _index_cache_append(w, INDEX_CACHE_XATTRS, &arec, sizeof(arec));
+		if (ret < 0)
+			return ret;
+		++w->section[INDEX_CACHE_XATTRS].count;
+		++rec.xattr_count;
+	}
+
+	rec.first_extent = w->section[INDEX_CACHE_EXTENTS].count;
+	if (d->isdir)
+		rec.child_count = HASH_COUNT(d->child_list);
+	else {
+		rec.size = d->size;
+		if (d->isslink) {
+			rec.isslink = 1;
+			ret = _index_cache_add_string(w, d->target ? d->target : "",
+				d->target ? strlen(d->target) : 0, &rec.target);
+			if (ret < 0)
+				return ret;
+		} else {
+			TAILQ_FOREACH(xt, &d->extentlist, list) {
+				memset(&xrec, 0, sizeof(xrec));
+				xrec.start_block = xt->start.block;
+				xrec.partition = xt->start.partition;
+				xrec.byteoffset = xt->byteoffset;
+				xrec.bytecount = xt->bytecount;
+				xrec.fileoffset = xt->fileoffset;
+
+				ret = _index_cache_append(w, INDEX_CACHE_EXTENTS, &xrec, sizeof(xrec));
+				if (ret < 0)
+					return ret;
+				++w->section[INDEX_CACHE_EXTENTS].count;
+				++rec.extent_count;
+			}
+		}
+	}
+
+	ret = _index_cache_append(w, INDEX_CACHE_DENTRIES, &rec, sizeof(rec));
+	if (ret < 0)
+		return ret;
+	++w->section[INDEX_CACHE_DENTRIES].count;
+
+	if (d->isdir) {
+		HASH_ITER(hh, d->child_list, entry, tmp) {
+			ret = _index_cache_write_dentry(w, entry->d, idx);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Write the strings of the index properties and fill in the corresponding header fields.
+ */
+static int _index_cache_write_properties(struct index_cache_writer *w, const char *creator,
+	const struct ltfs_index *idx, struct index_cache_header *hdr)
+{
+	char *patterns, **glob;
+	size_t len = 0;
+	int ret;
+
+	hdr->creator = INDEX_CACHE_NONE;
+	hdr->volume_name = INDEX_CACHE_NONE;
+	hdr->commit_message = INDEX_CACHE_NONE;
+	hdr->glob_patterns = INDEX_CACHE_NONE;
+
+	if (creator) {
+		ret = _index_cache_add_string(w, creator, strlen(creator), &hdr->creator);
+		if (ret < 0)
+			return ret;
+	}
+	if (idx->volume_name) {
+		ret = _index_cache_add_string(w, idx->volume_name, strlen(idx->volume_name),
+			&hdr->volume_name);
+		if (ret < 0)
+			return ret;
+	}
+	if (idx->commit_message && strlen(idx->commit_message)) {
+		ret = _index_cache_add_string(w, idx->commit_message, strlen(idx->commit_message),
+			&hdr->commit_message);
+		if (ret < 0)
+			return ret;
+	}
+
+	/* Name patterns are stored one after the other */
+	if (! idx->original_criteria.have_criteria || ! idx->original_criteria.glob_patterns)
+		return 0;
+	for (glob = idx->original_criteria.glob_patterns; *glob && **glob; ++glob)
+		len += strlen(*glob) + 1;
+	if (len == 0)
+		return 0;
+
+	patterns = malloc(len);
+	if (! patterns) {
+		ltfsmsg(LTFS_ERR, "10001E", "_index_cache_write_properties");
+		return -LTFS_NO_MEMORY;
+	}
+	len = 0;
+	for (glob = idx->original_criteria.glob_patterns; *glob && **glob; ++glob) {
+		strcpy(patterns + len, *glob);
+		len += strlen(*glob) + 1;
+		++hdr->glob_count;
+	}
+
+	ret = _index_cache_append_string(w, patterns, len - 1, &hdr->glob_patterns);
+	free(patterns);
+	return ret;
+}
+
+/**
+ * Read and check the header of a cache file.
+ * @return 0 on success or a negative value if the file is missing or unusable.
+ */
+static int _index_cache_read_header(const char *path, struct index_cache_header *hdr)
+{
+	ssize_t nread;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return -errno;
+	nread = read(fd, hdr, sizeof(*hdr));
+	close(fd);
+
+	if (nread != (ssize_t) sizeof(*hdr) || memcmp(hdr->magic, INDEX_CACHE_MAGIC, 8) ||
+		hdr->version != INDEX_CACHE_VERSION || hdr->byte_order != INDEX_CACHE_BYTE_ORDER)
+		return -LTFS_INDEX_INVALID;
+	return 0;
+}
+
+/**
+ * Save the current index as the Index cache of its volume, replacing the previous cache file.
+ * The cache must describe the Index on tape exactly, so this is only called right after the
+ * Index has been read from or written to tape, with the creator string found in or written to
+ * the Index and the position of the file mark which follows it.
+ * Nothing is saved if the existing cache holds a newer generation, as happens while older
+ * Indexes are traversed, or if the index holds unrecognized tags, which are only kept as XML.
+ * @param work_dir Directory holding the cache.
+ * @param creator Creator string of the Index on tape.
+ * @param fm_block Block number of the file mark following the Index.
+ * @param vol LTFS volume.
+ * @return 0 if the cache was saved, 1 if it was not, or a negative value on error.
+ */
+int index_cache_save(const char *work_dir, const char *creator, tape_block_t fm_block,
+	struct ltfs_volume *vol)
+{
+	struct ltfs_index *idx;
+	struct index_cache_header hdr;
+	struct index_cache_writer w;
+	struct index_cache_string *entry, *tmp;
+	struct ltfs_timespec mod_time;
+	uint64_t count[INDEX_CACHE_SECTIONS] = { 0 }, offset;
+	char *path, *tmp_path = NULL;
+	int ret, s;
+
+	CHECK_ARG_NULL(work_dir, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(vol->index, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(vol->label, -LTFS_NULL_ARG);
+	idx = vol->index;
+
+	if (idx->tag_count > 0 || _index_cache_count(idx->root, count) != 0)
+		return 1;
+
+	path = _index_cache_path(work_dir, idx->vol_uuid, INDEX_CACHE_SUFFIX);
+	if (! path)
+		return -LTFS_NO_MEMORY;
+	if (_index_cache_read_header(path, &hdr) == 0 &&
+		! strncmp(hdr.vol_uuid, idx->vol_uuid, sizeof(idx->vol_uuid)) &&
+		hdr.generation > idx->generation) {
+		free(path);
+		return 1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, INDEX_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = INDEX_CACHE_VERSION;
+	hdr.byte_order = INDEX_CACHE_BYTE_ORDER;
+	strncpy(hdr.vol_uuid, idx->vol_uuid, sizeof(idx->vol_uuid) - 1);
+	hdr.generation = idx->generation;
+	mod_time = idx->mod_time;
+	normalize_ltfs_time(&mod_time);
+	hdr.mod_time_sec = mod_time.tv_sec;
+	hdr.mod_time_nsec = mod_time.tv_nsec;
+	hdr.selfptr_block = idx->selfptr.block;
+	hdr.selfptr_partition = idx->selfptr.partition;
+	hdr.fm_block = fm_block;
+	hdr.blocksize = vol->label->blocksize;
+	if (idx->backptr.block) {
+		hdr.backptr_block = idx->backptr.block;
+		hdr.backptr_partition = idx->backptr.partition;
+	}
+	hdr.criteria_allow_update = idx->criteria_allow_update;
+	hdr.have_criteria = idx->original_criteria.have_criteria;
+	hdr.max_filesize_criteria = idx->original_criteria.max_filesize_criteria;
+	hdr.index_version = idx->version;
+	hdr.uid_number = idx->uid_number;
+
+	offset = sizeof(hdr);
+	for (s = 0; s < INDEX_CACHE_SECTIONS; ++s) {
+		hdr.offset[s] = offset;
+		offset += count[s] * index_cache_record_size[s];
+	}
+
+	memset(&w, 0, sizeof(w));
+	for (s = 0; s < INDEX_CACHE_SECTIONS; ++s) {
+		w.section[s].offset = hdr.offset[s];
+		w.section[s].checksum = INDEX_CACHE_HASH_SEED;
+		w.section[s].buf = malloc(INDEX_CACHE_BUF_SIZE);
+		if (! w.section[s].buf) {
+			ltfsmsg(LTFS_ERR, "10001E", "index_cache_save: buffer");
+			ret = -LTFS_NO_MEMORY;
+			w.fd = -1;
+			goto out;
+		}
+	}
+
+	tmp_path = _index_cache_path(work_dir, idx->vol_uuid, INDEX_CACHE_TMP_SUFFIX);
+	if (! tmp_path) {
+		ret = -LTFS_NO_MEMORY;
+		w.fd = -1;
+		goto out;
+	}
+	w.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (w.fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	ret = _index_cache_write_properties(&w, creator, idx, &hdr);
+	if (ret == 0)
+		ret = _index_cache_write_dentry(&w, idx->root, idx);
+	for (s = 0; s < INDEX_CACHE_SECTIONS && ret == 0; ++s)
+		ret = _index_cache_flush(&w, s);
+	if (ret < 0)
+		goto out;
+
+	/* The tree may not change while it is saved */
+	for (s = 0; s < INDEX_CACHE_STRINGS; ++s) {
+		if (w.section[s].count != count[s]) {
+			ret = -LTFS_INDEX_INVALID;
+			goto out;
+		}
+	}
+
+	for (s = 0; s < INDEX_CACHE_SECTIONS; ++s) {
+		hdr.count[s] = (s == INDEX_CACHE_STRINGS) ? w.section[s].flushed : w.section[s].count;
+		hdr.checksum[s] = w.section[s].checksum;
+	}
+	hdr.file_size = hdr.offset[INDEX_CACHE_STRINGS] + hdr.count[INDEX_CACHE_STRINGS];
+	hdr.header_checksum = _index_cache_checksum(INDEX_CACHE_HASH_SEED, (const char *) &hdr,
+		sizeof(hdr));
+
+	if (lseek(w.fd, 0, SEEK_SET) == (off_t) -1) {
+		ret = -errno;
+		goto out;
+	}
+	ret = _index_cache_write_all(w.fd, (const char *) &hdr, sizeof(hdr));
+	if (ret < 0)
+		goto out;
+
+	ret = close(w.fd);
+	w.fd = -1;
+	if (ret < 0 || rename(tmp_path, path) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+out:
+	if (w.fd >= 0)
+		close(w.fd);
+	if (ret < 0) {
+		ltfsmsg(LTFS_WARN, "17316W", path, ret);
+		if (tmp_path)
+			unlink(tmp_path);
+	}
+	HASH_ITER(hh, w.strings, entry, tmp) {
+		HASH_DEL(w.strings, entry);
+		free(entry);
+	}
+	for (s = 0; s < INDEX_CACHE_SECTIONS; ++s) {
+		if (w.section[s].buf)
+			free(w.section[s].buf);
+	}
+	if (tmp_path)
+		free(tmp_path);
+	free(path);
+	return ret;
+}
+
+/**
+ * Look up a NUL-terminated string in the string table.
+ * @return the string, or NULL if the offset is invalid.
+ */
+static const char *_index_cache_string(const struct index_cache_reader *r, uint64_t offset)
+{
+	uint64_t size = r->hdr->count[INDEX_CACHE_STRINGS];
+
+	if (offset >= size || ! memchr(r->strings + offset, '\0', size - offset))
+		return NULL;
+	return r->strings + offset;
+}
+
+/**
+ * Copy a NUL-terminated string out of the string table.
+ * @return 0 on success, or -1 if the offset is invalid or memory runs out.
+ */
+static int _index_cache_dup_string(const struct index_cache_reader *r, uint64_t offset,
+	char **out)
+{
+	const char *str = _index_cache_string(r, offset);
+
+	if (! str)
+		return -1;
+	*out = strdup(str);
+	return *out ? 0 : -1;
+}
+
+static void _index_cache_get_time(const struct index_cache_dentry *rec, int i,
+	struct ltfs_timespec *t)
+{
+	t->tv_sec = rec->time_sec[i];
+	t->tv_nsec = rec->time_nsec[i];
+}
+
+/**
+ * Load the attributes, extended attributes and extents of a dentry from its record, the
+ * same way the XML parsers fill them in.
+ */
+static int _index_cache_load_dentry(const struct index_cache_reader *r,
+	const struct index_cache_dentry *rec, struct dentry *d)
+{
+	const struct index_cache_header *hdr = r->hdr;
+	const struct index_cache_extent *xrec;
+	const struct index_cache_xattr *arec;
+	struct extent_info *xt;
+	struct xattr_info *xattr;
+	uint64_t i;
+
+	if (rec->uid == 0 || rec->first_xattr > hdr->count[INDEX_CACHE_XATTRS] ||
+		rec->xattr_count > hdr->count[INDEX_CACHE_XATTRS] - rec->first_xattr ||
+		rec->first_extent > hdr->count[INDEX_CACHE_EXTENTS] ||
+		rec->extent_count > hdr->count[INDEX_CACHE_EXTENTS] - rec->first_extent)
+		return -1;
+	if (rec->isdir && (rec->extent_count || rec->isslink))
+		return -1;
+	if (! rec->isdir && rec->child_count)
+		return -1;
+
+	d->uid = rec->uid;
+	d->readonly = rec->readonly;
+	_index_cache_get_time(rec, INDEX_CACHE_CREATION, &d->creation_time);
+	_index_cache_get_time(rec, INDEX_CACHE_CHANGE, &d->change_time);
+	_index_cache_get_time(rec, INDEX_CACHE_MODIFY, &d->modify_time);
+	_index_cache_get_time(rec, INDEX_CACHE_ACCESS, &d->access_time);
+	_index_cache_get_time(rec, INDEX_CACHE_BACKUP, &d->backup_time);
+
+	for (i = 0; i < rec->xattr_count; ++i) {
+		arec = &r->xattrs[rec->first_xattr + i];
+		xattr = calloc(1, sizeof(struct xattr_info));
+		if (! xattr)
+			return -1;
+		TAILQ_INSERT_TAIL(&d->xattrlist, xattr, list);
+
+		if (_index_cache_dup_string(r, arec->key, &xattr->key) < 0)
+			return -1;
+		if (arec->value != INDEX_CACHE_NONE) {
+			if (arec->value >= hdr->count[INDEX_CACHE_STRINGS] ||
+				arec->size >= hdr->count[INDEX_CACHE_STRINGS] - arec->value)
+				return -1;
+			xattr->value = malloc(arec->size + 1);
+			if (! xattr->value)
+				return -1;
+			memcpy(xattr->value, r->strings + arec->value, arec->size + 1);
+			xattr->size = arec->size;
+		}
+	}
+
+	if (rec->isdir)
+		return 0;
+
+	d->size = rec->size;
+	if (rec->isslink) {
+		if (_index_cache_dup_string(r, rec->target, &d->target) < 0)
+			return -1;
+		d->isslink = true;
+	}
+
+	for (i = 0; i < rec->extent_count; ++i) {
+		xrec = &r->extents[rec->first_extent + i];
+		xt = calloc(1, sizeof(struct extent_info));
+		if (! xt)
+			return -1;
+		xt->start.block = xrec->start_block;
+		xt->start.partition = xrec->partition;
+		xt->byteoffset = xrec->byteoffset;
+		xt->bytecount = xrec->bytecount;
+		xt->fileoffset = xrec->fileoffset;
+		TAILQ_INSERT_TAIL(&d->extentlist, xt, list);
+
+		d->realsize += xt->bytecount;
+		if (d->vol) {
+			d->used_blocks += ((xt->byteoffset + xt->bytecount) / d->vol->label->blocksize);
+			if ((xt->byteoffset + xt->bytecount) % d->vol->label->blocksize)
+				d->used_blocks++;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Dispose of dentries which were allocated for a directory but never linked into it.
+ */
+static void _index_cache_free_name_list(struct name_list *list)
+{
+	struct name_list *entry, *tmp;
+
+	HASH_ITER(hh, list, entry, tmp) {
+		HASH_DEL(list, entry);
+		entry->d->parent = NULL;
+		fs_release_dentry(entry->d);
+		free(entry);
+	}
+}
+
+/**
+ * Load the children of a directory, then link them into it.
+ */
+static int _index_cache_load_dir(struct index_cache_reader *r,
+	const struct index_cache_dentry *rec, struct dentry *dir)
+{
+	const struct index_cache_dentry *child;
+	struct name_list *list = NULL, *entry;
+	uint64_t i;
+	int ret;
+
+	for (i = 0; i < rec->child_count; ++i) {
+		if (r->next >= r->hdr->count[INDEX_CACHE_DENTRIES])
+			goto out_free;
+		child = &r->dentries[r->next++];
+		if (child->uid == 1)
+			goto out_free;
+
+		entry = calloc(1, sizeof(struct name_list));
+		if (! entry)
+			goto out_free;
+		entry->d = fs_allocate_dentry(dir, NULL, NULL, child->isdir, false, false, r->idx);
+		if (! entry->d) {
+			free(entry);
+			goto out_free;
+		}
+
+		ret = _index_cache_dup_string(r, child->name, &entry->d->name);
+		if (ret == 0 && ! entry->d->name[0])
+			ret = -1;
+		if (ret == 0)
+			ret = _index_cache_load_dentry(r, child, entry->d);
+		if (ret == 0 && child->isdir)
+			ret = _index_cache_load_dir(r, child, entry->d);
+		if (ret < 0) {
+			entry->d->parent = NULL;
+			fs_release_dentry(entry->d);
+			free(entry);
+			goto out_free;
+		}
+		entry->name = entry->d->name;
+		entry->uid = entry->d->uid;
+
+		errno = 0;
+		HASH_ADD_KEYPTR(hh, list, entry->name, strlen(entry->name), entry);
+		if (errno == ENOMEM) {
+			entry->d->parent = NULL;
+			fs_release_dentry(entry->d);
+			free(entry);
+			goto out_free;
+		}
+	}
+
+	if (fs_update_platform_safe_names(dir, r->idx, list) != 0)
+		return -1;
+
+	return 0;
+
+out_free:
+	_index_cache_free_name_list(list);
+	return -1;
+}
+
+/**
+ * Load the index properties and the directory tree.
+ */
+static int _index_cache_load_index(struct index_cache_reader *r, struct ltfs_volume *vol)
+{
+	const struct index_cache_header *hdr = r->hdr;
+	const struct index_cache_dentry *root_rec;
+	struct ltfs_index *idx = r->idx;
+	const char *glob;
+	char **patterns;
+	uint64_t glob_offset;
+	uint32_t i;
+
+	if (hdr->creator != INDEX_CACHE_NONE) {
+		if (idx->creator) {
+			free(idx->creator);
+			idx->creator = NULL;
+		}
+		if (_index_cache_dup_string(r, hdr->creator, &idx->creator) < 0)
+			return -1;
+	}
+	if (hdr->volume_name != INDEX_CACHE_NONE &&
+		_index_cache_dup_string(r, hdr->volume_name, &idx->volume_name) < 0)
+		return -1;
+	if (idx->commit_message) {
+		free(idx->commit_message);
+		idx->commit_message = NULL;
+	}
+	if (hdr->commit_message != INDEX_CACHE_NONE &&
+		_index_cache_dup_string(r, hdr->commit_message, &idx->commit_message) < 0)
+		return -1;
+
+	memcpy(idx->vol_uuid, hdr->vol_uuid, sizeof(idx->vol_uuid) - 1);
+	idx->vol_uuid[sizeof(idx->vol_uuid) - 1] = '\0';
+	idx->generation = hdr->generation;
+	idx->mod_time.tv_sec = hdr->mod_time_sec;
+	idx->mod_time.tv_nsec = hdr->mod_time_nsec;
+	idx->selfptr.block = hdr->selfptr_block;
+	idx->selfptr.partition = hdr->selfptr_partition;
+	idx->backptr.block = hdr->backptr_block;
+	idx->backptr.partition = hdr->backptr_partition;
+	idx->criteria_allow_update = hdr->criteria_allow_update;
+	idx->version = hdr->index_version;
+	if (hdr->uid_number > idx->uid_number)
+		idx->uid_number = hdr->uid_number;
+
+	if (hdr->have_criteria) {
+		index_criteria_free(&idx->original_criteria);
+		index_criteria_free(&idx->index_criteria);
+		idx->original_criteria.have_criteria = true;
+		idx->original_criteria.max_filesize_criteria = hdr->max_filesize_criteria;
+
+		if (hdr->glob_count > 0) {
+			patterns = calloc(hdr->glob_count + 1, sizeof(char *));
+			if (! patterns)
+				return -1;
+			idx->original_criteria.glob_patterns = patterns;
+
+			glob_offset = hdr->glob_patterns;
+			for (i = 0; i < hdr->glob_count; ++i) {
+				glob = _index_cache_string(r, glob_offset);
+				if (! glob)
+					return -1;
+				patterns[i] = strdup(glob);
+				if (! patterns[i])
+					return -1;
+				glob_offset += strlen(glob) + 1;
+			}
+		}
+
+		if (index_criteria_dup_rules(&idx->index_criteria, &idx->original_criteria) < 0)
+			return -1;
+	}
+
+	/* The root directory comes first */
+	if (hdr->count[INDEX_CACHE_DENTRIES] == 0)
+		return -1;
+	root_rec = &r->dentries[0];
+	if (! root_rec->isdir || root_rec->uid != 1)
+		return -1;
+	idx->root->vol = vol;
+	if (_index_cache_load_dentry(r, root_rec, idx->root) < 0)
+		return -1;
+
+	r->next = 1;
+	if (_index_cache_load_dir(r, root_rec, idx->root) < 0)
+		return -1;
+
+	return (r->next == hdr->count[INDEX_CACHE_DENTRIES]) ? 0 : -1;
+}
+
+/**
+ * Check the layout and the checksums of a cache file.
+ */
+static int _index_cache_check_file(const struct index_cache_header *hdr, const char *base,
+	uint64_t size)
+{
+	struct index_cache_header copy;
+	int s;
+
+	copy = *hdr;
+	copy.header_checksum = 0;
+	if (_index_cache_checksum(INDEX_CACHE_HASH_SEED, (const char *) &copy, sizeof(copy)) !=
+		hdr->header_checksum || hdr->file_size != size)
+		return -1;
+	for (s = 0; s < INDEX_CACHE_SECTIONS; ++s) {
+		if (hdr->offset[s] % 8 || hdr->offset[s] < sizeof(*hdr) || hdr->offset[s] > size ||
+			hdr->count[s] > (size - hdr->offset[s]) / index_cache_record_size[s])
+			return -1;
+		if (_index_cache_checksum(INDEX_CACHE_HASH_SEED, base + hdr->offset[s],
+			hdr->count[s] * index_cache_record_size[s]) != hdr->checksum[s])
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Populate the index from the Index cache of its volume, if the cache holds the Index
+ * identified by the given header.
+ * @param work_dir Directory holding the cache.
+ * @param tape_idx Index properties found at the start of the Index on tape: the volume UUID,
+ *                 generation, update time and self pointer must match the cache.
+ * @param fm_block On success, the block number of the file mark following the Index.
+ * @param vol LTFS volume. vol->index must be freshly allocated. On failure it may be partially
+ *            populated, and the caller must reset it before parsing the Index from tape.
+ * @return 0 on success, 1 if there is no cache for this Index, or a negative value if the
+ *         cache is damaged or cannot be loaded.
+ */
+int index_cache_load(const char *work_dir, const struct ltfs_index *tape_idx,
+	tape_block_t *fm_block, struct ltfs_volume *vol)
+{
+	const struct index_cache_header *hdr;
+	struct index_cache_reader r;
+	struct stat st;
+	char *path, *base;
+	int fd, ret;
+
+	CHECK_ARG_NULL(work_dir, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(tape_idx, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(fm_block, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(vol->index, -LTFS_NULL_ARG);
+
+	path = _index_cache_path(work_dir, tape_idx->vol_uuid, INDEX_CACHE_SUFFIX);
+	if (! path)
+		return -LTFS_NO_MEMORY;
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		free(path);
+		return 1;
+	}
+	if (fstat(fd, &st) < 0 || (uint64_t) st.st_size < sizeof(struct index_cache_header)) {
+		ltfsmsg(LTFS_WARN, "17315W", path);
+		close(fd);
+		free(path);
+		return -LTFS_INDEX_INVALID;
+	}
+
+#ifndef mingw_PLATFORM
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		base = NULL;
+#else
+	base = malloc(st.st_size);
+	if (base && read(fd, base, st.st_size) != st.st_size) {
+		free(base);
+		base = NULL;
+	}
+#endif
+	close(fd);
+	if (! base) {
+		ltfsmsg(LTFS_WARN, "17315W", path);
+		free(path);
+		return -LTFS_INDEX_INVALID;
+	}
+
+	hdr = (const struct index_cache_header *) base;
+	if (memcmp(hdr->magic, INDEX_CACHE_MAGIC, 8) || hdr->version != INDEX_CACHE_VERSION ||
+		hdr->byte_order != INDEX_CACHE_BYTE_ORDER) {
+		ltfsmsg(LTFS_WARN, "17315W", path);
+		ret = -LTFS_INDEX_INVALID;
+		goto out;
+	}
+
+	if (strncmp(hdr->vol_uuid, tape_idx->vol_uuid, sizeof(tape_idx->vol_uuid)) ||
+		hdr->generation != tape_idx->generation ||
+		hdr->mod_time_sec != tape_idx->mod_time.tv_sec ||
+		hdr->mod_time_nsec != tape_idx->mod_time.tv_nsec ||
+		hdr->selfptr_partition != tape_idx->selfptr.partition ||
+		hdr->selfptr_block != tape_idx->selfptr.block ||
+		hdr->blocksize != vol->label->blocksize) {
+		ltfsmsg(LTFS_DEBUG, "17314D", path);
+		ret = 1;
+		goto out;
+	}
+
+	if (_index_cache_check_file(hdr, base, st.st_size) < 0) {
+		ltfsmsg(LTFS_WARN, "17315W", path);
+		ret = -LTFS_INDEX_INVALID;
+		goto out;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.hdr = hdr;
+	r.dentries = (const struct index_cache_dentry *) (base + hdr->offset[INDEX_CACHE_DENTRIES]);
+	r.extents = (const struct index_cache_extent *) (base + hdr->offset[INDEX_CACHE_EXTENTS]);
+	r.xattrs = (const struct index_cache_xattr *) (base + hdr->offset[INDEX_CACHE_XATTRS]);
+	r.strings = base + hdr->offset[INDEX_CACHE_STRINGS];
+	r.idx = vol->index;
+
+	if (_index_cache_load_index(&r, vol) < 0) {
+		ltfsmsg(LTFS_WARN, "17315W", path);
+		ret = -LTFS_INDEX_INVALID;
+		goto out;
+	}
+
+	*fm_block = hdr->fm_block;
+	ret = 0;
+
+out:
+#ifndef mingw_PLATFORM
+	munmap(base, st.st_size);
+#else
+	free(base);
+#endif
+	free(path);
+	return ret;
+}
@@ -324,3 +324,126 @@ int iosched_update_data_placement(struct dentry *d, struct ltfs_volume *vol)
 	ret = priv->ops->update_data_placement(d, priv->backend_handle);
 	return ret;
 }
+
+/**
+ * Get a description of the internal state of the I/O scheduler, for diagnostics.
+ *
+ * @param state On success, points to a newly allocated string. The caller must free it.
+ * @param vol LTFS volume
+ * @return 0 on success or a negative value on error.
+ */
+int iosched_get_state(char **state, struct ltfs_volume *vol)
+{
+	int ret;
+	struct iosched_priv *priv = (struct iosched_priv *) vol ? vol->iosched_handle : NULL;
+
+	CHECK_ARG_NULL(state, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv->ops, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv->ops->get_state, -LTFS_NULL_ARG);
+
+	ret = priv->ops->get_state(state, priv->backend_handle);
+	return ret;
+}
+
+/**
+ * Create a queue for asynchronous I/O through the I/O scheduler.
+ * @param depth Maximum number of requests submitted to the queue and not reaped yet.
+ * @param queue On success, points to the new queue.
+ * @param vol LTFS volume
+ * @return 0 on success or a negative value on error.
+ */
+int iosched_queue_create(uint32_t depth, void **queue, struct ltfs_volume *vol)
+{
+	struct iosched_priv *priv = (struct iosched_priv *) vol ? vol->iosched_handle : NULL;
+
+	CHECK_ARG_NULL(queue, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv->ops, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv->ops->queue_create, -LTFS_NULL_ARG);
+
+	if (depth == 0)
+		return -LTFS_BAD_ARG;
+
+	*queue = priv->ops->queue_create(depth, priv->backend_handle);
+	if (! *queue)
+		return -LTFS_NO_MEMORY;
+	return 0;
+}
+
+/**
+ * Destroy an asynchronous I/O queue. This waits for the requests in flight to complete;
+ * completions not reaped yet are discarded.
+ * @param queue Queue to destroy.
+ * @param vol LTFS volume
+ * @return 0 on success or a negative value on error.
+ */
+int iosched_queue_destroy(void *queue, struct ltfs_volume *vol)
+{
+	int ret;
+	struct iosched_priv *priv = (struct iosched_priv *) vol ? vol->iosched_handle : NULL;
+
+	CHECK_ARG_NULL(queue, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv->ops, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv->ops->queue_destroy, -LTFS_NULL_ARG);
+
+	ret = priv->ops->queue_destroy(queue, priv->backend_handle);
+	return ret;
+}
+
+/**
+ * Submit asynchronous requests through the I/O scheduler. Each request takes a slot of the
+ * queue until its completion is reaped; requests that do not fit are not submitted.
+ * @param queue Queue to submit to.
+ * @param sqe Requests to submit.
+ * @param count Number of requests in sqe.
+ * @param vol LTFS volume
+ * @return Number of requests submitted, starting from the first one, or a negative value on error.
+ */
+int iosched_submit(void *queue, const struct iosched_sqe *sqe, uint32_t count,
+	struct ltfs_volume *vol)
+{
+	int ret;
+	struct iosched_priv *priv = (struct iosched_priv *) vol ? vol->iosched_handle : NULL;
+
+	CHECK_ARG_NULL(queue, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(sqe, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv->ops, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv->ops->submit, -LTFS_NULL_ARG);
+
+	ret = priv->ops->submit(queue, sqe, count, priv->backend_handle);
+	return ret;
+}
+
+/**
+ * Collect the results of asynchronous requests, in completion order.
+ * @param queue Queue to reap from.
+ * @param cqe On success, holds the completions.
+ * @param count Maximum number of completions to return.
+ * @param min_complete Wait until at least this many completions are available, or until
+ *                     no request is left in flight. 0 does not wait.
+ * @param vol LTFS volume
+ * @return Number of completions stored in cqe, or a negative value on error.
+ */
+int iosched_reap(void *queue, struct iosched_cqe *cqe, uint32_t count, uint32_t min_complete,
+	struct ltfs_volume *vol)
+{
+	int ret;
+	struct iosched_priv *priv = (struct iosched_priv *) vol ? vol->iosched_handle : NULL;
+
+	CHECK_ARG_NULL(queue, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(cqe, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv->ops, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv->ops->reap, -LTFS_NULL_ARG);
+
+	ret = priv->ops->reap(queue, cqe, count, min_complete, priv->backend_handle);
+	return ret;
+}
@@ -69,6 +69,13 @@ int iosched_flush(struct dentry *d, bool closeflag, struct ltfs_volume *vol);
 int iosched_truncate(struct dentry *d, off_t length, struct ltfs_volume *vol);
 uint64_t iosched_get_filesize(struct dentry *d, struct ltfs_volume *vol);
 int iosched_update_data_placement(struct dentry *d, struct ltfs_volume *vol);
+int iosched_get_state(char **state, struct ltfs_volume *vol);
+int iosched_queue_create(uint32_t depth, void **queue, struct ltfs_volume *vol);
+int iosched_queue_destroy(void *queue, struct ltfs_volume *vol);
+int iosched_submit(void *queue, const struct iosched_sqe *sqe, uint32_t count,
+	struct ltfs_volume *vol);
+int iosched_reap(void *queue, struct iosched_cqe *cqe, uint32_t count, uint32_t min_complete,
+	struct ltfs_volume *vol);
 
 #ifdef __cplusplus
 }
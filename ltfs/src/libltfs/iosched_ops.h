@@ -50,6 +50,41 @@
 
 #include "ltfs.h"
 
+/**
+ * Asynchronous I/O operations.
+ */
+enum iosched_async_op {
+	IOSCHED_ASYNC_READ,  /**< Read size bytes at offset into buf */
+	IOSCHED_ASYNC_WRITE, /**< Write size bytes from buf at offset */
+	IOSCHED_ASYNC_FLUSH  /**< Flush the file; buf, size and offset are ignored */
+};
+
+/**
+ * Submission queue entry: one asynchronous request posted with the submit operation.
+ * The caller keeps buf valid and the file open until the request completes. Requests in
+ * flight at the same time may run in any order, so a caller that needs ordering (a write
+ * followed by a read of the same range, or a write followed by a flush) must reap the first
+ * request before submitting the second.
+ */
+struct iosched_sqe {
+	enum iosched_async_op op;
+	struct dentry *d;
+	char *buf;
+	size_t size;
+	off_t offset;
+	bool isupdatetime;  /**< Passed to the write operation */
+	uint64_t user_data; /**< Returned unchanged in the completion queue entry */
+};
+
+/**
+ * Completion queue entry: the result of one asynchronous request, as returned by the
+ * synchronous read, write or flush operation.
+ */
+struct iosched_cqe {
+	uint64_t user_data;
+	ssize_t result;
+};
+
 /**
  * iosched_ops structure.
  * Defines operations that must be supported by the I/O schedulers.
@@ -67,6 +102,16 @@ struct iosched_ops {
 	int      (*truncate)(struct dentry *d, off_t length, void *iosched_handle);
 	uint64_t (*get_filesize)(struct dentry *d, void *iosched_handle);
 	int      (*update_data_placement)(struct dentry *d, void *iosched_handle);
+	int      (*get_state)(char **state, void *iosched_handle);
+
+	/* Asynchronous I/O. A queue is created with room for a number of requests; each one
+	 * takes a slot from submission until its completion is reaped. */
+	void    *(*queue_create)(uint32_t depth, void *iosched_handle);
+	int      (*queue_destroy)(void *queue, void *iosched_handle);
+	int      (*submit)(void *queue, const struct iosched_sqe *sqe, uint32_t count,
+					   void *iosched_handle);
+	int      (*reap)(void *queue, struct iosched_cqe *cqe, uint32_t count, uint32_t min_complete,
+					 void *iosched_handle);
 };
 
 struct iosched_ops *iosched_get_ops(void);
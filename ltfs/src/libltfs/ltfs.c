@@ -114,6 +114,8 @@
 #include "iosched.h"
 #include "dcache.h"
 #include "kmi.h"
+#include "ltfs_fsops_raw.h"
+#include "index_cache.h"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 /*
@@ -374,6 +376,8 @@ int ltfs_volume_alloc(const char *execname, struct ltfs_volume **volume)
 	newvol->livelink = false;
 	newvol->mountpoint_len = 0;
 	newvol->set_pew = false;
+	newvol->read_cache_blocks = LTFS_READ_CACHE_BLOCKS_DEFAULT;
+	newvol->readahead_blocks = LTFS_READAHEAD_BLOCKS_DEFAULT;
 
 	ret = init_mrsw(&newvol->lock);
 	if (ret < 0) {
@@ -462,10 +466,10 @@ void _ltfs_volume_free(bool force, struct ltfs_volume **volume)
 			free((*volume)->mam_attr.barcode);
 			(*volume)->mam_attr.barcode = NULL;
 		}
-		if ((*volume)->last_block)
-			free((*volume)->last_block);
 		if ((*volume)->creator)
 			free((*volume)->creator);
+		if ((*volume)->index_cache_dir)
+			free((*volume)->index_cache_dir);
 		if ((*volume)->mountpoint)
 			free((*volume)->mountpoint);
 		destroy_mrsw(&(*volume)->lock);
@@ -1171,6 +1175,21 @@ uint64_t ltfs_get_valid_block_count_unlocked(struct ltfs_volume *vol)
 	return ret;
 }
 
+/**
+ * Get the number of times the drive was positioned on a different partition since the
+ * volume was opened. Each such change costs a long locate, and usually an index write.
+ * @param vol LTFS volume.
+ * @return Partition change count, or 0 if vol is NULL or has no device.
+ */
+uint64_t ltfs_get_partition_switches(struct ltfs_volume *vol)
+{
+	CHECK_ARG_NULL(vol, 0);
+
+	if (! vol->device)
+		return 0;
+	return vol->device->partition_switches;
+}
+
 /**
  * Update number of valid blocks
  * @param vol LTFS volume.
@@ -1787,6 +1806,29 @@ void ltfs_unset_index_dirty(bool update_version, struct ltfs_index *idx)
 	}
 }
 
+/**
+ * Save the Index just written to the index partition to the Index cache.
+ * Failures are not reported to the caller, since the cache is only an optimization.
+ */
+static void _ltfs_save_index_cache(char *reason, struct ltfs_volume *vol)
+{
+	struct tc_position pos;
+	char *creator = NULL;
+
+	if (tape_get_position(vol->device, &pos) < 0 ||
+		vol->label->part_num2id[pos.partition] != ltfs_ip_id(vol) ||
+		vol->index->selfptr.partition != ltfs_ip_id(vol) || pos.block <= vol->index->selfptr.block)
+		return;
+
+	/* Use the creator string written to tape, see xml_schema_to_tape() */
+	if (asprintf(&creator, "%s - %s", vol->creator, reason) < 0) {
+		ltfsmsg(LTFS_ERR, "10001E", "_ltfs_save_index_cache");
+		return;
+	}
+	index_cache_save(vol->index_cache_dir, creator, pos.block - 1, vol);
+	free(creator);
+}
+
 /**
  * Make cartridge consistent and close the associated device.
  * The current index file must reside on the index partition, so write that index file
@@ -1798,6 +1840,7 @@ int ltfs_unmount(char *reason, struct ltfs_volume *vol)
 {
 	int ret;
 	cartridge_health_info h;
+	uint64_t merged;
 
 	ltfsmsg(LTFS_DEBUG, "11032D"); /* Unmount the volume... */
 
@@ -1806,6 +1849,13 @@ start:
 	if (ret == 0) {
 		if (vol->rollback_mount == false &&
 			 (ltfs_is_dirty(vol) || vol->index->selfptr.partition != ltfs_ip_id(vol))) {
+			/* Keep extents fragmented by small flushes out of the final index. This walks
+			 * every file, so it is not done by the index writes made while mounted. */
+			if (ltfs_is_dirty(vol)) {
+				merged = ltfs_fsraw_defrag_extents(vol->index->root, vol);
+				if (merged)
+					ltfsmsg(LTFS_DEBUG, "17309D", (unsigned long long) merged);
+			}
 			ret = ltfs_write_index(ltfs_ip_id(vol), reason, vol);
 			if (NEED_REVAL(ret)) {
 				ret = ltfs_revalidate(true, vol);
@@ -1828,6 +1878,11 @@ start:
 				releasewrite_mrsw(&vol->lock);
 				return ret;
 			}
+
+			/* Keep a copy of the Index for the next mount. The tape is positioned after
+			 * the file mark which follows it. */
+			if (vol->index_cache_dir)
+				_ltfs_save_index_cache(reason, vol);
 		}
 	} else {
 		/* could not unmount */
@@ -2083,6 +2138,100 @@ size_t ltfs_max_cache_size(struct ltfs_volume *vol)
 	return vol->cache_size_max ? vol->cache_size_max : LTFS_MAX_CACHE_SIZE_DEFAULT;
 }
 
+/**
+ * Set the size of the tape read cache and the maximum read-ahead window.
+ * Takes effect the next time the cache is created, i.e. on the first read from tape.
+ * @param nblocks Number of tape blocks to keep in the read cache. 0 selects the default.
+ * @param readahead Maximum number of blocks to read ahead of a sequential reader.
+ *                  0 disables read-ahead. Limited to nblocks - 1.
+ * @param vol LTFS volume.
+ * @return 0 on success or -LTFS_NULL_ARG if vol is NULL.
+ */
+int ltfs_set_read_cache(size_t nblocks, size_t readahead, struct ltfs_volume *vol)
+{
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+	vol->read_cache_blocks = nblocks ? nblocks : LTFS_READ_CACHE_BLOCKS_DEFAULT;
+	vol->readahead_blocks = readahead;
+	return 0;
+}
+
+size_t ltfs_read_cache_blocks(struct ltfs_volume *vol)
+{
+	CHECK_ARG_NULL(vol, 0);
+	return vol->read_cache_blocks ? vol->read_cache_blocks : LTFS_READ_CACHE_BLOCKS_DEFAULT;
+}
+
+size_t ltfs_readahead_blocks(struct ltfs_volume *vol)
+{
+	CHECK_ARG_NULL(vol, 0);
+	return vol->readahead_blocks;
+}
+
+/**
+ * Enable or disable small file packing in the I/O scheduler. When enabled, the partial
+ * last block of a file is not written when the file is flushed; the scheduler collects such
+ * tails and writes them together in shared blocks, using the extent byte offset to locate
+ * each file's data. Takes effect when the I/O scheduler is initialized.
+ * @param enable true to enable packing.
+ * @param vol LTFS volume.
+ * @return 0 on success or -LTFS_NULL_ARG if vol is NULL.
+ */
+int ltfs_set_small_file_packing(bool enable, struct ltfs_volume *vol)
+{
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+	vol->pack_small_files = enable;
+	return 0;
+}
+
+bool ltfs_small_file_packing(struct ltfs_volume *vol)
+{
+	CHECK_ARG_NULL(vol, false);
+	return vol->pack_small_files;
+}
+
+/**
+ * Enable or disable the Index cache. When enabled, a binary copy of the Index is kept in the
+ * given directory whenever an Index is read from tape or written to the index partition at
+ * unmount, and the next mount loads the copy instead of parsing the Index if the Index on
+ * tape is still the same. Takes effect at the next mount.
+ * @param dir Directory holding the cache, or NULL to disable it.
+ * @param vol LTFS volume.
+ * @return 0 on success or a negative value on error.
+ */
+int ltfs_set_index_cache(const char *dir, struct ltfs_volume *vol)
+{
+	char *tmp = NULL;
+
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+
+	if (dir) {
+		tmp = strdup(dir);
+		if (! tmp) {
+			ltfsmsg(LTFS_ERR, "10001E", "ltfs_set_index_cache");
+			return -LTFS_NO_MEMORY;
+		}
+	}
+	if (vol->index_cache_dir)
+		free(vol->index_cache_dir);
+	vol->index_cache_dir = tmp;
+	return 0;
+}
+
+/**
+ * Enable or disable incremental Index writes. When enabled, the XML of each directory is kept
+ * in memory after an Index is written, and only directories which changed since then are
+ * serialized again by the next Index write.
+ * @param enable true to enable incremental Index writes.
+ * @param vol LTFS volume.
+ * @return 0 on success or -LTFS_NULL_ARG if vol is NULL.
+ */
+int ltfs_set_incremental_index(bool enable, struct ltfs_volume *vol)
+{
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+	vol->incremental_index = enable;
+	return 0;
+}
+
 /**
  * Write an index file to the given partition.
  * This should only be called after a successful ltfs_mount or ltfs_format,
@@ -2541,6 +2690,7 @@ int ltfs_set_volume_name(const char *volname, struct ltfs_volume *vol)
 		}
 	}
 
+	fs_set_xml_dirty(vol->index->root);
 	ltfs_set_index_dirty(false, false, vol->index);
 	ltfs_mutex_unlock(&vol->index->dirty_lock);
 	releaseread_mrsw(&vol->lock);
@@ -144,6 +144,8 @@ struct device_data;
 #define LTFS_BUILD_VERSION            47 /* Build version */
 #define LTFS_MIN_CACHE_SIZE_DEFAULT   25 /* Default minimum cache size (MiB) */
 #define LTFS_MAX_CACHE_SIZE_DEFAULT   50 /* Default maximum cache size (MiB) */
+#define LTFS_READ_CACHE_BLOCKS_DEFAULT 16 /* Default read cache size (blocks) */
+#define LTFS_READAHEAD_BLOCKS_DEFAULT   4 /* Default maximum read-ahead window (blocks) */
 #define LTFS_SYNC_PERIOD_DEFAULT (5 * 60) /* default sync period (5 minutes) */
 
 #define LTFS_NUM_PARTITIONS           2
@@ -215,6 +217,7 @@ struct device_data;
 #endif
 #endif
 #define LTFS_LIVELINK_EA_NAME         "ltfs.vendor.IBM.prefixLength"
+#define LTFS_PRIORITY_EA_NAME         "ltfs.priority"
 
 #ifdef __APPLE__
 #define BYTE_MULTIPLIER					(1000 * 1000 * 1000)
@@ -301,6 +304,7 @@ struct dentry {
 	struct MultiReaderSingleWriter contents_lock;      /**< Lock for 'extentlist' and 'list' */
 	struct MultiReaderSingleWriter meta_lock;          /**< Lock for metadata */
 	ltfs_mutex_t iosched_lock;                      /**< Lock for use by the I/O scheduler */
+	ltfs_mutex_t extent_index_lock;                 /**< Lock for the extent index under a read contents_lock */
 
 	/* Immutable fields. No locks are needed to access these. */
 	ino_t ino;               /**< Per-session inode number, unique across all LTFS volumes in this process */
@@ -317,6 +321,12 @@ struct dentry {
 	/* Take the contents_lock before accessing these fields. */
 	TAILQ_HEAD(extent_struct, extent_info) extentlist; /**< List of extents (file only) */
 
+	/* Take the contents_lock for write, or for read and the extent_index_lock, before
+	 * accessing these fields. Both are dropped whenever the extentlist changes. */
+	struct extent_info **extent_index; /**< Extents sorted by fileoffset, NULL if not built */
+	size_t extent_index_count;         /**< Number of entries in extent_index */
+	struct extent_info *extent_cursor; /**< Extent in which the last read ended */
+
 	/* Take the contents_lock and the meta_lock before writing to these fields. Take either of
 	 * those locks before reading these fields. */
 	uint64_t realsize;             /**< Size, not counting sparse tail */
@@ -342,6 +352,7 @@ struct dentry {
 	uint32_t link_count;           /**< Number of file system links to this dentry */
 	bool     deleted;              /**< True if dentry is unlinked from the file system */
 	bool matches_name_criteria;    /**< True if file name matches the name criteria rules */
+	bool high_priority;            /**< True if the I/O scheduler serves this file ahead of others */
 	void *dentry_proxy;            /**< dentry proxy corresponding to this dentry */
 	bool need_update_time;         /**< True if write api has come from Windows side */
 
@@ -349,6 +360,14 @@ struct dentry {
 	void *iosched_priv;            /**< I/O scheduler private data. */
 
 	struct name_list *child_list;  /* for hash search */
+
+	/* Serialized Index XML of a directory, see xml_writer_libltfs.c. Only the Index writer,
+	 * which holds the volume lock for write, reads or builds these. */
+	char *xml_cache;               /**< XML of the directory without its subdirectories */
+	size_t xml_cache_size;         /**< Length of xml_cache */
+	size_t *xml_holes;             /**< Offset in xml_cache of each subdirectory, in order */
+	size_t xml_hole_count;         /**< Number of subdirectories in xml_cache */
+	bool xml_dirty;                /**< True if xml_cache needs to be rebuilt, see fs_set_xml_dirty() */
 };
 
 /*
@@ -380,6 +399,7 @@ struct ltfs_volume {
 	void *changer_handle;          /**< Handle to changer controller state */
 	void *dcache_handle;           /**< Handle to the Dentry cache manager state */
 	void *periodic_sync_handle;    /**< Handle to the periodic sync state */
+	void *prefetch_handle;         /**< Handle to the background read-ahead state */
 	void *kmi_handle;              /**< Handle to the key manager interface state */
 
 	/* Internal state variables */
@@ -391,12 +411,6 @@ struct ltfs_volume {
 	bool skip_eod_check;           /**< Skip EOD existance check? */
 	bool ignore_wrong_version;     /**< Ignore wrong index version while seeking index? */
 
-	/* A 1-block read cache, used to prevent reading the same block from tape over and over.
-	 * You MUST hold the tape device lock before accessing this buffer. */
-	struct tape_offset last_pos;   /**< Position of last block read from the tape. */
-	unsigned long last_size;       /**< Size of last block read from the tape. */
-	char *last_block;              /**< Contents of last block read from the tape. */
-
 	/* Caches of cartridge health and capacity data. Take the device lock before using these. */
 	cartridge_health_info health_cache;
 	uint64_t              tape_alert;
@@ -407,6 +421,11 @@ struct ltfs_volume {
 	void *opt_args;                /**< FUSE command-line arguments */
 	size_t cache_size_min;         /**< Starting scheduler cache size in MiB */
 	size_t cache_size_max;         /**< Maximum scheduler cache size in MiB */
+	size_t read_cache_blocks;      /**< Number of blocks in the tape read cache */
+	size_t readahead_blocks;       /**< Maximum number of blocks to read ahead */
+	bool pack_small_files;         /**< Let the scheduler pack file tails into shared blocks */
+	char *index_cache_dir;         /**< Directory holding the Index cache, NULL to disable it */
+	bool incremental_index;        /**< Reuse the XML of unchanged directories in Index writes */
 	bool reset_capacity;           /**< Force to reset tape capacity when formatting tape */
 
 	/* Revalidation control. If the cartridge in the drive changes externally, e.g. after
@@ -600,6 +619,7 @@ struct ltfs_timespec ltfs_get_format_time(struct ltfs_volume *vol);
 uint64_t ltfs_get_file_count(struct ltfs_volume *vol);
 uint64_t ltfs_get_valid_block_count(struct ltfs_volume *vol);
 uint64_t ltfs_get_valid_block_count_unlocked(struct ltfs_volume *vol);
+uint64_t ltfs_get_partition_switches(struct ltfs_volume *vol);
 int ltfs_update_valid_block_count(struct ltfs_volume *vol, int64_t c);
 int ltfs_update_valid_block_count_unlocked(struct ltfs_volume *vol, int64_t c);
 unsigned int ltfs_get_index_generation(struct ltfs_volume *vol);
@@ -645,6 +665,13 @@ int ltfs_override_policy(const char *rules, bool permanent, struct ltfs_volume *
 int ltfs_set_scheduler_cache(size_t min_size, size_t max_size, struct ltfs_volume *vol);
 size_t ltfs_min_cache_size(struct ltfs_volume *vol);
 size_t ltfs_max_cache_size(struct ltfs_volume *vol);
+int ltfs_set_read_cache(size_t nblocks, size_t readahead, struct ltfs_volume *vol);
+size_t ltfs_read_cache_blocks(struct ltfs_volume *vol);
+size_t ltfs_readahead_blocks(struct ltfs_volume *vol);
+int ltfs_set_small_file_packing(bool enable, struct ltfs_volume *vol);
+int ltfs_set_index_cache(const char *dir, struct ltfs_volume *vol);
+int ltfs_set_incremental_index(bool enable, struct ltfs_volume *vol);
+bool ltfs_small_file_packing(struct ltfs_volume *vol);
 
 int ltfs_parse_tape_backend_opts(void *opt_args, struct ltfs_volume *vol);
 int ltfs_parse_kmi_backend_opts(void *opt_args, struct ltfs_volume *vol);
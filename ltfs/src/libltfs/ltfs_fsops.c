@@ -185,6 +185,7 @@ int ltfs_fsops_close(struct dentry *d, bool dirty, bool open_write, bool use_ios
 		acquirewrite_mrsw(&d->meta_lock);
 		get_current_timespec(&d->modify_time);
 		d->change_time = d->modify_time;
+		fs_set_xml_dirty(d);
 		releasewrite_mrsw(&d->meta_lock);
 		d->need_update_time = false;
 	}
@@ -341,6 +342,7 @@ int ltfs_fsops_create(const char *path, bool isdir, bool readonly, struct dentry
 		releasewrite_mrsw(&parent->meta_lock);
 		goto out_dispose;
 	}
+	fs_set_xml_dirty(parent);
 
 	releasewrite_mrsw(&d->meta_lock);
 	releasewrite_mrsw(&parent->meta_lock);
@@ -356,6 +358,12 @@ int ltfs_fsops_create(const char *path, bool isdir, bool readonly, struct dentry
 
 out_dispose:
 	releasewrite_mrsw(&parent->contents_lock);
+	if (ret == 0 && ! isdir && xattr_priority_high(parent)) {
+		/* New files take the priority class of their directory */
+		acquirewrite_mrsw(&d->meta_lock);
+		d->high_priority = true;
+		releasewrite_mrsw(&d->meta_lock);
+	}
 	if (ret == 0 && dcache_initialized(NULL)) {
 		ret = dcache_create(dentry_path, d, vol);
 		if (ret < 0) {
@@ -463,6 +471,7 @@ int ltfs_fsops_unlink(const char *path, ltfs_file_id *id, struct ltfs_volume *vo
 		HASH_DEL(parent->child_list, namelist);
 		free(namelist->name);
 		free(namelist);
+		fs_set_xml_dirty(parent);
 	}
 	else {
 		ltfsmsg(LTFS_ERR, "11320E", "ltfs_fsops_unlink", ret);
@@ -733,6 +742,7 @@ int ltfs_fsops_rename(const char *from, const char *to, ltfs_file_id *id, struct
 			HASH_DEL(todir->child_list, namelist);
 			free(namelist->name);
 			free(namelist);
+			fs_set_xml_dirty(todir);
 		}
 		else {
 			ltfsmsg(LTFS_ERR, "11320E", "ltfs_fsops_rename", ret);
@@ -777,6 +787,9 @@ int ltfs_fsops_rename(const char *from, const char *to, ltfs_file_id *id, struct
 	todir->modify_time = newtime;
 	todir->change_time = newtime;
 	fromdentry->change_time = newtime;
+	fs_set_xml_dirty(fromdir);
+	fs_set_xml_dirty(todir);
+	fs_set_xml_dirty(fromdentry);
 
 	/* Update fromdentry */
 	fromdentry->parent = todir;
@@ -1332,6 +1345,7 @@ int ltfs_fsops_readdir(struct dentry *d, void *buf, ltfs_dir_filler filler, void
 	if (ret == 0) {
 		acquirewrite_mrsw(&d->meta_lock);
 		get_current_timespec(&d->access_time);
+		fs_set_xml_dirty(d);
 		releasewrite_mrsw(&d->meta_lock);
 		ltfs_set_index_dirty(true, true, vol->index);
 	}
@@ -1501,6 +1515,7 @@ int ltfs_fsops_utimens(struct dentry *d, const struct ltfs_timespec ts[2], struc
 		get_current_timespec(&d->change_time);
 		ltfs_set_index_dirty(true, false, vol->index);
 	}
+	fs_set_xml_dirty(d);
 	if (dcache_initialized(NULL))
 		dcache_flush(d, FLUSH_METADATA, vol);
 
@@ -1594,6 +1609,7 @@ int ltfs_fsops_utimens_all(struct dentry *d, const struct ltfs_timespec ts[4], s
 		if(!isctime) get_current_timespec(&d->change_time);
 		ltfs_set_index_dirty(true, false, vol->index);
 	}
+	fs_set_xml_dirty(d);
 
 	if (dcache_initialized(NULL))
 		dcache_flush(d, FLUSH_METADATA, vol);
@@ -1629,6 +1645,7 @@ int ltfs_fsops_set_readonly(struct dentry *d, bool readonly, struct ltfs_volume
 	if (readonly != d->readonly) {
 		d->readonly = readonly;
 		get_current_timespec(&d->change_time);
+		fs_set_xml_dirty(d);
 		ltfs_set_index_dirty(true, false, vol->index);
 		if (dcache_initialized(NULL))
 			dcache_flush(d, FLUSH_METADATA, vol);
@@ -1818,6 +1835,7 @@ int ltfs_fsops_symlink_path(const char* to, const char* from, ltfs_file_id *id,
 	id->ino = d->ino;
 	d->target = strdup(to);
 	d->isslink = true;
+	fs_set_xml_dirty(d);
 
 	/* Set mount point length in EA (LiveLink support mode only) */
 	if ( ( strncmp( to, vol->mountpoint, vol->mountpoint_len )==0 ) &&
@@ -57,6 +57,14 @@
 #include "arch/time_internal.h"
 #include "tape.h"
 #include "dcache.h"
+#include "read_cache.h"
+#include "prefetch.h"
+#include "pathname.h"
+#include "xattr.h"
+#include "ltfs_fsops_raw.h"
+
+/* Files with more extents than this get a sorted extent index for reads */
+#define LTFS_EXTENT_INDEX_MIN 32
 
 int ltfs_fsraw_open(const char *path, bool open_write, struct dentry **d, struct ltfs_volume *vol)
 {
@@ -85,9 +93,11 @@ int ltfs_fsraw_open(const char *path, bool open_write, struct dentry **d, struct
 
 	if (open_write && ! dtmp->isdir) {
 		uint64_t max_filesize = index_criteria_get_max_filesize(vol);
+		bool high_priority = xattr_priority_high(dtmp);
 		acquirewrite_mrsw(&dtmp->meta_lock);
 		if (! dtmp->matches_name_criteria && max_filesize > 0 && dtmp->size <= max_filesize)
 			dtmp->matches_name_criteria = index_criteria_match(dtmp, vol);
+		dtmp->high_priority = high_priority;
 		releasewrite_mrsw(&dtmp->meta_lock);
 	}
 
@@ -252,6 +262,27 @@ start:
 	return ret;
 }
 
+/**
+ * Check whether the data of extent b directly follows the data of extent a, both in the file
+ * and on tape, so that a single extent can describe both. On tape, b must start at the block
+ * and byte where a ends; this includes b continuing inside the last block of a, as the tails
+ * of packed small files do.
+ * @param a First extent.
+ * @param b Extent to check against the end of a.
+ * @param blocksize Block size of the volume.
+ * @return true if the two extents can be merged.
+ */
+static bool _ltfs_fsraw_extents_contiguous(const struct extent_info *a, const struct extent_info *b,
+	uint64_t blocksize)
+{
+	uint64_t a_byteoffset_end = a->byteoffset + a->bytecount;
+
+	return a->fileoffset + a->bytecount == b->fileoffset &&
+		a->start.partition == b->start.partition &&
+		a->start.block + a_byteoffset_end / blocksize == b->start.block &&
+		a_byteoffset_end % blocksize == b->byteoffset;
+}
+
 /**
  * Non-locking version of ltfs_fsraw_add_extent.
  * The caller should hold a read lock on vol->lock and a write lock on d->contents_lock.
@@ -259,11 +290,11 @@ start:
 int _ltfs_fsraw_add_extent_unlocked(struct dentry *d, struct extent_info *ext, bool update_time,
 	struct ltfs_volume *vol)
 {
-	struct extent_info *entry, *preventry;
+	struct extent_info *entry, *preventry, *nextentry;
 	struct extent_info *ext_copy, *splitentry;
 	bool ext_used = false, free_ext = false;
 	uint64_t ext_fileoffset_end, fileoffset_diff;
-	uint64_t entry_fileoffset_end, entry_byteoffset_end, entry_blockcount, entry_byteoffset_mod;
+	uint64_t entry_fileoffset_end, entry_byteoffset_mod;
 	uint64_t realsize_new, blocksize;
 
 	blocksize = vol->label->blocksize;
@@ -279,11 +310,10 @@ int _ltfs_fsraw_add_extent_unlocked(struct dentry *d, struct extent_info *ext, b
 	*ext_copy = *ext;
 
 	/* Update the extent list */
+	fs_clear_extent_index(d);
 	if (! TAILQ_EMPTY(&d->extentlist)) {
 		TAILQ_FOREACH_REVERSE_SAFE(entry, &d->extentlist, extent_struct, list, preventry) {
 			entry_fileoffset_end = entry->fileoffset + entry->bytecount;
-			entry_byteoffset_end = entry->byteoffset + entry->bytecount;
-			entry_blockcount = entry_byteoffset_end / blocksize;
 
 			/* Update existing entry by truncating, deleting, or splitting it */
 			if (ext->fileoffset <= entry->fileoffset && ext_fileoffset_end > entry->fileoffset) {
@@ -302,8 +332,6 @@ int _ltfs_fsraw_add_extent_unlocked(struct dentry *d, struct extent_info *ext, b
 					entry->bytecount -= fileoffset_diff;
 					entry->fileoffset += fileoffset_diff;
 					realsize_new -= fileoffset_diff;
-					entry_byteoffset_end = entry->byteoffset + entry->bytecount;
-					entry_blockcount = entry_byteoffset_end / blocksize;
 				}
 			} else if (ext->fileoffset > entry->fileoffset &&
 				ext->fileoffset < entry_fileoffset_end) {
@@ -312,8 +340,6 @@ int _ltfs_fsraw_add_extent_unlocked(struct dentry *d, struct extent_info *ext, b
 					entry->bytecount = ext->fileoffset - entry->fileoffset;
 					realsize_new -= entry_fileoffset_end - ext->fileoffset;
 					entry_fileoffset_end = entry->fileoffset + entry->bytecount;
-					entry_byteoffset_end = entry->byteoffset + entry->bytecount;
-					entry_blockcount = entry_byteoffset_end / blocksize;
 				} else {
 					/* Split entry */
 					splitentry = malloc(sizeof(struct extent_info));
@@ -336,18 +362,12 @@ int _ltfs_fsraw_add_extent_unlocked(struct dentry *d, struct extent_info *ext, b
 
 					entry->bytecount = ext->fileoffset - entry->fileoffset;
 					entry_fileoffset_end = entry->fileoffset + entry->bytecount;
-					entry_byteoffset_end = entry->byteoffset + entry->bytecount;
-					entry_blockcount = entry_byteoffset_end / blocksize;
 					realsize_new -= ext->bytecount;
 				}
 			}
 
 			/* Process ext's contents by appending to entry or inserting ext after entry */
-			if (entry && ext->fileoffset == entry_fileoffset_end &&
-				entry->start.partition == ext->start.partition &&
-				entry_byteoffset_end % blocksize == 0 &&
-				entry->start.block + entry_blockcount == ext->start.block &&
-				ext->byteoffset == 0) {
+			if (entry && _ltfs_fsraw_extents_contiguous(entry, ext, blocksize)) {
 				/* Add ext's bytes to entry */
 				entry->bytecount += ext->bytecount;
 				realsize_new += ext->bytecount;
@@ -367,8 +387,19 @@ int _ltfs_fsraw_add_extent_unlocked(struct dentry *d, struct extent_info *ext, b
 	if (! ext_used) {
 		TAILQ_INSERT_HEAD(&d->extentlist, ext_copy, list);
 		realsize_new += ext->bytecount;
+		entry = ext_copy;
 	} else if (free_ext)
 		free(ext_copy);
+	else
+		entry = ext_copy;
+
+	/* The new data may also fill the gap before the following extent */
+	nextentry = TAILQ_NEXT(entry, list);
+	if (nextentry && _ltfs_fsraw_extents_contiguous(entry, nextentry, blocksize)) {
+		entry->bytecount += nextentry->bytecount;
+		TAILQ_REMOVE(&d->extentlist, nextentry, list);
+		free(nextentry);
+	}
 
 	/* Update file size and times */
 	acquirewrite_mrsw(&d->meta_lock);
@@ -385,6 +416,7 @@ int _ltfs_fsraw_add_extent_unlocked(struct dentry *d, struct extent_info *ext, b
 	 *  No need to mark at this time but reserve this value for fueture release
 	 */
 	d->extents_dirty = true;
+	fs_set_xml_dirty(d);
 
 	releasewrite_mrsw(&d->meta_lock);
 
@@ -393,6 +425,45 @@ int _ltfs_fsraw_add_extent_unlocked(struct dentry *d, struct extent_info *ext, b
 	return 0;
 }
 
+/**
+ * Merge the extents of a file, or of all files under a directory, which are contiguous both in
+ * the file and on tape. Extents are merged as they are added, but a file written before that
+ * or trimmed by truncation and overwrites can still hold runs of such extents.
+ * This visits every file under d, so it is only run before the final Index write at unmount.
+ * The caller must hold vol->lock for write.
+ * @param d File or directory to process.
+ * @param vol LTFS volume.
+ * @return Number of extents removed.
+ */
+uint64_t ltfs_fsraw_defrag_extents(struct dentry *d, struct ltfs_volume *vol)
+{
+	struct name_list *list_ptr, *list_tmp;
+	struct extent_info *entry, *nextentry;
+	uint64_t removed = 0;
+
+	if (d->isdir) {
+		HASH_ITER(hh, d->child_list, list_ptr, list_tmp)
+			removed += ltfs_fsraw_defrag_extents(list_ptr->d, vol);
+		return removed;
+	}
+
+	entry = TAILQ_FIRST(&d->extentlist);
+	while (entry && (nextentry = TAILQ_NEXT(entry, list))) {
+		if (_ltfs_fsraw_extents_contiguous(entry, nextentry, vol->label->blocksize)) {
+			entry->bytecount += nextentry->bytecount;
+			TAILQ_REMOVE(&d->extentlist, nextentry, list);
+			free(nextentry);
+			++removed;
+		} else
+			entry = nextentry;
+	}
+	if (removed) {
+		fs_clear_extent_index(d);
+		fs_set_xml_dirty(d);
+	}
+	return removed;
+}
+
 int ltfs_fsraw_add_extent(struct dentry *d, struct extent_info *ext, bool update_time,
 	struct ltfs_volume *vol)
 {
@@ -476,17 +547,209 @@ start:
 	return ret;
 }
 
+/**
+ * Get the tape block cache, allocating it on first use or when the volume block size
+ * no longer matches the cache. The caller must hold the device lock.
+ * @param cache On success, points to the block cache of the volume's device.
+ * @param vol LTFS volume.
+ * @return 0 on success or a negative value on error.
+ */
+static int _ltfs_fsraw_get_read_cache(struct read_cache **cache, struct ltfs_volume *vol)
+{
+	int ret;
+	struct device_data *dev = vol->device;
+
+	if (dev->read_cache && read_cache_blocksize(dev->read_cache) != vol->label->blocksize) {
+		read_cache_destroy(dev->read_cache);
+		dev->read_cache = NULL;
+	}
+
+	if (! dev->read_cache) {
+		ret = read_cache_init(ltfs_read_cache_blocks(vol), ltfs_readahead_blocks(vol),
+			vol->label->blocksize, &dev->read_cache);
+		if (ret < 0)
+			return ret;
+
+		/* The prefetch thread fills the cache without allocating memory */
+		if (prefetch_thread_initialized(vol)) {
+			ret = read_cache_preallocate(dev->read_cache);
+			if (ret < 0) {
+				read_cache_destroy(dev->read_cache);
+				dev->read_cache = NULL;
+				return ret;
+			}
+		}
+	}
+
+	*cache = dev->read_cache;
+	return 0;
+}
+
+/**
+ * Read a block of an extent into the block cache, along with as many of the following
+ * blocks of the same extent as the cache's read-ahead detection asks for.
+ * A failure on the requested block is returned to the caller. A failure on a read-ahead
+ * block just ends the read-ahead, unless the device needs revalidation.
+ * The caller must hold the device lock.
+ * @param entry Extent containing the block.
+ * @param seekpos Physical position of the block.
+ * @param cache Block cache.
+ * @param vol LTFS volume.
+ * @return 0 on success or a negative value on error.
+ */
+static int _ltfs_fsraw_read_blocks(struct extent_info *entry, struct tc_position *seekpos,
+	struct read_cache *cache, struct ltfs_volume *vol)
+{
+	int ret;
+	ssize_t nread;
+	char *blockbuf;
+	struct tc_position curpos;
+	tape_block_t block, extent_blocks, extent_end;
+	uint64_t extent_bytes, blockbytes;
+	size_t readahead, i;
+	unsigned long blocksize = vol->label->blocksize;
+
+	/* Compute current position */
+	ret = tape_get_position(vol->device, &curpos);
+	if (ret < 0) {
+		ltfsmsg(LTFS_ERR, "11085E", ret);
+		return ret;
+	}
+
+	/* Seek if required */
+	if (curpos.partition != seekpos->partition || curpos.block != seekpos->block) {
+		ret = tape_seek(vol->device, seekpos);
+		if (ret < 0) {
+			ltfsmsg(LTFS_ERR, "11086E", ret, entry->start.partition, seekpos->block);
+			return ret;
+		}
+	}
+
+	/* Never read ahead past the end of this extent */
+	extent_bytes = entry->byteoffset + entry->bytecount;
+	extent_blocks = (extent_bytes + blocksize - 1) / blocksize;
+	extent_end = entry->start.block + extent_blocks;
+	readahead = read_cache_readahead_hint(cache, seekpos->partition, seekpos->block);
+	if (prefetch_thread_initialized(vol))
+		readahead = 0; /* the prefetch thread reads ahead in the background */
+	if (readahead > extent_end - seekpos->block - 1)
+		readahead = extent_end - seekpos->block - 1;
+
+	for (i = 0; i <= readahead; ++i) {
+		block = seekpos->block + i;
+		blockbytes = extent_bytes - (block - entry->start.block) * blocksize;
+		if (blockbytes > blocksize)
+			blockbytes = blocksize;
+
+		blockbuf = read_cache_reserve(cache, seekpos->partition, block);
+		if (! blockbuf)
+			return (i == 0) ? -LTFS_NO_MEMORY : 0;
+
+		nread = tape_read(vol->device, blockbuf, blocksize, blockbytes != blocksize,
+			vol->kmi_handle);
+		if (nread < 0) {
+			read_cache_abort(cache);
+			if (i > 0 && ! NEED_REVAL(nread) && ! IS_UNEXPECTED_MOVE(nread))
+				return 0;
+			ltfsmsg(LTFS_ERR, "11088E", (int)nread);
+			return nread;
+		} else if ((size_t) nread < blockbytes) {
+			read_cache_abort(cache);
+			if (i > 0)
+				return 0;
+			ltfsmsg(LTFS_ERR, "11089E", blockbytes, (unsigned long)nread);
+			return -LTFS_SMALL_BLOCK;
+		}
+
+		read_cache_commit(cache, nread);
+	}
+
+	return 0;
+}
+
+/**
+ * Find the first extent of a file which ends after the given file offset.
+ * A read which continues where the previous one ended is served from the extent cursor.
+ * Otherwise short lists are scanned, and longer ones are searched through a sorted array
+ * of their extents which is built on first use and kept until the list changes.
+ * The caller must hold d->contents_lock for read or write.
+ * @param d File to search.
+ * @param offset File offset to look up.
+ * @return The extent containing offset or the first one after it, or NULL if there is none.
+ */
+static struct extent_info *_ltfs_fsraw_find_extent(struct dentry *d, uint64_t offset)
+{
+	struct extent_info *entry, **index;
+	size_t count = 0, lo, hi, mid;
+
+	ltfs_mutex_lock(&d->extent_index_lock);
+
+	entry = d->extent_cursor;
+	if (entry && entry->fileoffset <= offset) {
+		if (entry->fileoffset + entry->bytecount <= offset)
+			entry = TAILQ_NEXT(entry, list);
+		if (! entry || entry->fileoffset + entry->bytecount > offset)
+			goto out;
+	}
+
+	if (! d->extent_index) {
+		TAILQ_FOREACH(entry, &d->extentlist, list) {
+			if (entry->fileoffset + entry->bytecount > offset || ++count > LTFS_EXTENT_INDEX_MIN)
+				break;
+		}
+		if (! entry || count <= LTFS_EXTENT_INDEX_MIN)
+			goto out;
+
+		for (; entry; entry = TAILQ_NEXT(entry, list))
+			++count;
+		index = malloc(count * sizeof(*index));
+		if (! index) {
+			/* Not fatal: fall back to scanning the list */
+			ltfsmsg(LTFS_WARN, "17310W", (unsigned long long) count);
+			TAILQ_FOREACH(entry, &d->extentlist, list) {
+				if (entry->fileoffset + entry->bytecount > offset)
+					break;
+			}
+			goto out;
+		}
+		count = 0;
+		TAILQ_FOREACH(entry, &d->extentlist, list)
+			index[count++] = entry;
+		d->extent_index = index;
+		d->extent_index_count = count;
+	}
+
+	index = d->extent_index;
+	lo = 0;
+	hi = d->extent_index_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index[mid]->fileoffset + index[mid]->bytecount <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	entry = (lo < d->extent_index_count) ? index[lo] : NULL;
+
+out:
+	ltfs_mutex_unlock(&d->extent_index_lock);
+	return entry;
+}
+
 ssize_t ltfs_fsraw_read(struct dentry *d, char *buf, size_t count, off_t offset,
 	struct ltfs_volume *vol)
 {
 	int ret;
 	uint64_t next_off, last_off;
-	ssize_t nread, ncopy;
-	size_t read_count;
-	struct extent_info *entry;
-	struct tc_position seekpos, curpos;
+	ssize_t ncopy;
+	size_t read_count, cached_size;
+	struct extent_info *entry, *last_entry = NULL;
+	struct tc_position seekpos;
+	struct read_cache *cache;
+	const char *block;
 	uint64_t firstbyte, lastbyte, blockbytes;
-	uint64_t entry_fileoffset_end;
+	uint64_t entry_fileoffset_end, extent_bytes;
+	tape_block_t extent_end;
 	unsigned long blocksize;
 
 	ltfsmsg(LTFS_DEBUG2, "11254D", d->platform_safe_name, (long long)offset, count);
@@ -520,21 +783,16 @@ start:
 		return ret;
 	}
 
-	/* allocate the last block cache if necessary */
-	if (! vol->last_block) {
-		vol->last_block = malloc(vol->label->blocksize);
-		if (! vol->last_block) {
-			ltfsmsg(LTFS_ERR, "10001E", "ltfs_fsraw_read: block cache");
-			ret = -LTFS_NO_MEMORY;
-			goto out_unlock;
-		}
-	}
+	/* allocate the block cache if necessary */
+	ret = _ltfs_fsraw_get_read_cache(&cache, vol);
+	if (ret < 0)
+		goto out_unlock;
 
 	blocksize = vol->label->blocksize;
 	next_off = (uint64_t)offset;
 	last_off = (uint64_t)offset + count;
 
-	TAILQ_FOREACH(entry, &d->extentlist, list) {
+	for (entry = _ltfs_fsraw_find_extent(d, next_off); entry; entry = TAILQ_NEXT(entry, list)) {
 		if (read_count == count)
 			break;
 
@@ -554,29 +812,11 @@ start:
 
 		/* Read any needed data from this extent */
 		if (entry_fileoffset_end > next_off) {
-			/* Compute current position */
-			ret = tape_get_position(vol->device, &curpos);
-			if (ret < 0) {
-				ltfsmsg(LTFS_ERR, "11085E", ret);
-				goto out_unlock;
-			}
-
 			/* Compute target position */
 			seekpos.partition = ltfs_part_id2num(entry->start.partition, vol);
 			seekpos.block = entry->start.block +
 				(next_off - entry->fileoffset + entry->byteoffset) / blocksize;
-
-			/* Seek if required */
-			if ((curpos.partition != seekpos.partition || curpos.block != seekpos.block) &&
-				! (curpos.partition == seekpos.partition && curpos.block == seekpos.block + 1 &&
-				   entry->start.partition == vol->last_pos.partition &&
-				   seekpos.block == vol->last_pos.block)) {
-				ret = tape_seek(vol->device, &seekpos);
-				if (ret < 0) {
-					ltfsmsg(LTFS_ERR, "11086E", ret, entry->start.partition, seekpos.block);
-					goto out_unlock;
-				}
-			}
+			last_entry = entry;
 
 			/* Read from the extent until end of extent or output buffer full */
 			firstbyte = entry->fileoffset - entry->byteoffset +
@@ -588,43 +828,23 @@ start:
 					lastbyte = entry_fileoffset_end;
 				blockbytes = lastbyte - firstbyte;
 
-				/* Read this block into a temp buffer or return the existing contents */
-				if (entry->start.partition == vol->last_pos.partition &&
-					seekpos.block == vol->last_pos.block &&
-					(seekpos.partition == curpos.partition && seekpos.block + 1 == curpos.block)) {
-					if (vol->last_size < blockbytes) {
-						ltfsmsg(LTFS_ERR, "11087E", blockbytes, vol->last_size);
-						ret = -LTFS_SMALL_BLOCK;
-						goto out_unlock;
-					}
-
-				} else {
-					if (blocksize == blockbytes)
-						nread = tape_read(vol->device, vol->last_block, blocksize, false,
-							vol->kmi_handle);
-					else
-						nread = tape_read(vol->device, vol->last_block, blocksize, true,
-							vol->kmi_handle);
-
-					if (nread < 0) {
-						ret = nread;
-						ltfsmsg(LTFS_ERR, "11088E", ret);
-						goto out_unlock;
-					} else if ((size_t) nread < blockbytes) {
-						ltfsmsg(LTFS_ERR, "11089E", blockbytes, (unsigned long)nread);
-						ret = -LTFS_SMALL_BLOCK;
+				/* Return the cached contents, or read this block (and any read-ahead) */
+				block = read_cache_lookup(cache, seekpos.partition, seekpos.block, &cached_size);
+				if (! block) {
+					ret = _ltfs_fsraw_read_blocks(entry, &seekpos, cache, vol);
+					if (ret < 0)
 						goto out_unlock;
-					}
-
-					vol->last_pos.partition = entry->start.partition;
-					vol->last_pos.block = seekpos.block;
-					vol->last_size = nread;
-					++curpos.block;
+					block = read_cache_lookup(cache, seekpos.partition, seekpos.block, &cached_size);
+				}
+				if (! block || cached_size < blockbytes) {
+					ltfsmsg(LTFS_ERR, "11087E", blockbytes, block ? (unsigned long)cached_size : 0UL);
+					ret = -LTFS_SMALL_BLOCK;
+					goto out_unlock;
 				}
 
 				/* Copy data into output buffer */
 				ncopy = (lastbyte > last_off ? last_off : lastbyte) - next_off;
-				memcpy(buf + read_count, vol->last_block + (next_off - firstbyte), ncopy);
+				memcpy(buf + read_count, block + (next_off - firstbyte), ncopy);
 
 				firstbyte += blocksize;
 				next_off += ncopy;
@@ -634,6 +854,20 @@ start:
 		}
 	}
 
+	if (last_entry) {
+		ltfs_mutex_lock(&d->extent_index_lock);
+		d->extent_cursor = last_entry;
+		ltfs_mutex_unlock(&d->extent_index_lock);
+	}
+
+	/* Keep the drive streaming ahead of a sequential reader */
+	if (last_entry && read_cache_stream_active(cache, seekpos.partition, seekpos.block - 1)) {
+		extent_bytes = last_entry->byteoffset + last_entry->bytecount;
+		extent_end = last_entry->start.block + (extent_bytes + blocksize - 1) / blocksize;
+		prefetch_request(vol, seekpos.partition, seekpos.block, extent_end,
+			extent_bytes - (extent_end - 1 - last_entry->start.block) * blocksize);
+	}
+
 	/* Handle sparse end-of-file: fill buffer with zeros */
 	if (count > read_count && next_off < d->size) {
 		ncopy = (last_off < d->size) ? (last_off - next_off) : (d->size - next_off);
@@ -644,6 +878,7 @@ start:
 	/* update access time */
 	acquirewrite_mrsw(&d->meta_lock);
 	get_current_timespec(&d->access_time);
+	fs_set_xml_dirty(d);
 	releasewrite_mrsw(&d->meta_lock);
 
 	ltfs_set_index_dirty(true, true, vol->index);
@@ -670,6 +905,219 @@ out_unlock:
 	return read_count;
 }
 
+/**
+ * One extent of a file read by ltfs_fsraw_batch_read.
+ */
+struct batch_extent {
+	size_t file;                 /**< Index of the file in the path list */
+	tape_partition_t partition;  /**< Physical partition of the extent */
+	tape_block_t block;          /**< First block of the extent */
+	uint32_t byteoffset;         /**< Offset of the data in the first block */
+	uint64_t fileoffset;         /**< Offset of the data in the file */
+	uint64_t bytecount;          /**< Length of the extent */
+};
+
+/**
+ * Per-file state of ltfs_fsraw_batch_read.
+ */
+struct batch_file {
+	struct dentry *d;            /**< Dentry of the file, NULL if it could not be opened */
+	uint64_t size;               /**< Logical file size */
+	size_t remaining;            /**< Number of extents not read yet */
+	bool opened;                 /**< Has ops->open been called? */
+	bool closed;                 /**< Has ops->close been called? */
+	int result;                  /**< First error for this file, or 0 */
+};
+
+static int _ltfs_fsraw_batch_compare(const void *a, const void *b)
+{
+	const struct batch_extent *ea = a, *eb = b;
+
+	if (ea->partition != eb->partition)
+		return (ea->partition < eb->partition) ? -1 : 1;
+	if (ea->block != eb->block)
+		return (ea->block < eb->block) ? -1 : 1;
+	if (ea->byteoffset != eb->byteoffset)
+		return (ea->byteoffset < eb->byteoffset) ? -1 : 1;
+	if (ea->file != eb->file)
+		return (ea->file < eb->file) ? -1 : 1;
+	return 0;
+}
+
+static void _ltfs_fsraw_batch_close(size_t index, struct batch_file *file,
+	struct ltfs_fsraw_batch_ops *ops, void *priv)
+{
+	int ret;
+
+	if (file->closed)
+		return;
+	file->closed = true;
+
+	ret = ops->close(index, file->result, priv);
+	if (ret < 0 && file->result == 0)
+		file->result = ret;
+	if (file->d) {
+		ltfs_fsraw_close(file->d);
+		file->d = NULL;
+	}
+}
+
+int ltfs_fsraw_batch_read(const char **paths, size_t npaths, struct ltfs_fsraw_batch_ops *ops,
+	void *priv, struct ltfs_volume *vol)
+{
+	int ret = 0, cbret;
+	size_t i, nextents = 0, maxextents = 0;
+	ssize_t nread;
+	char *path_norm, *buf = NULL;
+	struct batch_file *files, *file;
+	struct batch_extent *extents = NULL, *ext, *tmp;
+	struct extent_info *entry;
+	uint64_t offset, end, count, inblock;
+	unsigned long blocksize;
+
+	CHECK_ARG_NULL(paths, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(ops, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(ops->open, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(ops->write, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(ops->close, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+
+	if (npaths == 0)
+		return 0;
+
+	files = calloc(npaths, sizeof(struct batch_file));
+	if (! files) {
+		ltfsmsg(LTFS_ERR, "10001E", "ltfs_fsraw_batch_read: file list");
+		return -LTFS_NO_MEMORY;
+	}
+
+	/* Resolve all paths and collect their extents */
+	for (i = 0; i < npaths; ++i) {
+		file = &files[i];
+		file->result = pathname_format(paths[i], &path_norm, true, true);
+		if (file->result == -LTFS_INVALID_PATH)
+			file->result = -LTFS_INVALID_SRC_PATH;
+		if (file->result < 0)
+			continue;
+		file->result = ltfs_fsraw_open(path_norm, false, &file->d, vol);
+		free(path_norm);
+		if (file->result < 0) {
+			file->d = NULL;
+			continue;
+		}
+		if (file->d->isdir) {
+			file->result = -LTFS_ISDIRECTORY;
+			continue;
+		}
+
+		acquireread_mrsw(&file->d->contents_lock);
+		acquireread_mrsw(&file->d->meta_lock);
+		file->size = file->d->size;
+		releaseread_mrsw(&file->d->meta_lock);
+		TAILQ_FOREACH(entry, &file->d->extentlist, list) {
+			if (nextents == maxextents) {
+				maxextents = maxextents ? maxextents * 2 : 1024;
+				tmp = realloc(extents, maxextents * sizeof(struct batch_extent));
+				if (! tmp) {
+					ltfsmsg(LTFS_ERR, "10001E", "ltfs_fsraw_batch_read: extent list");
+					releaseread_mrsw(&file->d->contents_lock);
+					ret = -LTFS_NO_MEMORY;
+					goto out_free;
+				}
+				extents = tmp;
+			}
+			ext = &extents[nextents++];
+			ext->file = i;
+			ext->partition = ltfs_part_id2num(entry->start.partition, vol);
+			ext->block = entry->start.block;
+			ext->byteoffset = entry->byteoffset;
+			ext->fileoffset = entry->fileoffset;
+			ext->bytecount = entry->bytecount;
+			++file->remaining;
+		}
+		releaseread_mrsw(&file->d->contents_lock);
+	}
+
+	/* Files without data on tape (and files that could not be resolved) are done already */
+	for (i = 0; i < npaths; ++i) {
+		file = &files[i];
+		if (file->remaining > 0)
+			continue;
+		if (file->result == 0) {
+			cbret = ops->open(i, file->size, priv);
+			if (cbret < 0)
+				file->result = cbret;
+			file->opened = true;
+		}
+		_ltfs_fsraw_batch_close(i, file, ops, priv);
+	}
+
+	/* One forward pass over the tape */
+	qsort(extents, nextents, sizeof(struct batch_extent), _ltfs_fsraw_batch_compare);
+
+	blocksize = vol->label->blocksize;
+	buf = malloc(blocksize);
+	if (! buf) {
+		ltfsmsg(LTFS_ERR, "10001E", "ltfs_fsraw_batch_read: buffer");
+		ret = -LTFS_NO_MEMORY;
+		goto out_free;
+	}
+
+	for (i = 0; i < nextents; ++i) {
+		ext = &extents[i];
+		file = &files[ext->file];
+
+		if (file->result == 0 && ! file->opened) {
+			cbret = ops->open(ext->file, file->size, priv);
+			if (cbret < 0)
+				file->result = cbret;
+			file->opened = true;
+		}
+
+		/* Read one tape block worth of data at a time */
+		offset = ext->fileoffset;
+		end = ext->fileoffset + ext->bytecount;
+		while (file->result == 0 && offset < end) {
+			inblock = (ext->byteoffset + (offset - ext->fileoffset)) % blocksize;
+			count = blocksize - inblock;
+			if (count > end - offset)
+				count = end - offset;
+
+			nread = ltfs_fsraw_read(file->d, buf, count, offset, vol);
+			if (nread < 0) {
+				file->result = nread;
+				break;
+			} else if (nread == 0)
+				break; /* file was truncated */
+
+			cbret = ops->write(ext->file, buf, nread, offset, priv);
+			if (cbret < 0)
+				file->result = cbret;
+			offset += nread;
+		}
+
+		if (--file->remaining == 0)
+			_ltfs_fsraw_batch_close(ext->file, file, ops, priv);
+	}
+
+out_free:
+	for (i = 0; i < npaths; ++i) {
+		if (! files[i].closed) {
+			if (ret < 0 && files[i].result == 0)
+				files[i].result = ret;
+			_ltfs_fsraw_batch_close(i, &files[i], ops, priv);
+		}
+		if (ret == 0 && files[i].result < 0)
+			ret = files[i].result;
+	}
+	if (buf)
+		free(buf);
+	if (extents)
+		free(extents);
+	free(files);
+	return ret;
+}
+
 int ltfs_fsraw_truncate(struct dentry *d, off_t length, struct ltfs_volume *vol)
 {
 	int ret;
@@ -688,6 +1136,7 @@ int ltfs_fsraw_truncate(struct dentry *d, off_t length, struct ltfs_volume *vol)
 
 	/* Truncate the extent list if necessary */
 	if (ulength < d->size && ! TAILQ_EMPTY(&d->extentlist)) {
+		fs_clear_extent_index(d);
 		TAILQ_FOREACH_REVERSE_SAFE(entry, &d->extentlist, extent_struct, list, preventry) {
 			entry_fileoffset_last = entry->fileoffset + entry->bytecount;
 			if (entry->fileoffset >= ulength || ulength == 0) {
@@ -709,6 +1158,7 @@ int ltfs_fsraw_truncate(struct dentry *d, off_t length, struct ltfs_volume *vol)
 	d->realsize = new_realsize;
 	get_current_timespec(&d->modify_time);
 	d->change_time = d->modify_time;
+	fs_set_xml_dirty(d);
 	releasewrite_mrsw(&d->meta_lock);
 
 	releasewrite_mrsw(&d->contents_lock);
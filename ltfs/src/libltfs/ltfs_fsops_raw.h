@@ -118,6 +118,14 @@ int ltfs_fsraw_write_data(char partition, const char *buf, size_t count, uint64_
 int ltfs_fsraw_add_extent(struct dentry *d, struct extent_info *ext, bool update_time,
 	struct ltfs_volume *vol);
 
+/**
+ * Merge extents which are contiguous both in the file and on tape.
+ * @param d File, or directory whose files should all be processed.
+ * @param vol LTFS volume. The caller must hold vol->lock for write.
+ * @return The number of extents removed.
+ */
+uint64_t ltfs_fsraw_defrag_extents(struct dentry *d, struct ltfs_volume *vol);
+
 /**
  * Write data to a file without buffering.
  * @param d File to write.
@@ -155,6 +163,43 @@ int ltfs_fsraw_write(struct dentry *d, const char *buf, size_t count, off_t offs
 ssize_t ltfs_fsraw_read(struct dentry *d, char *buf, size_t count, off_t offset,
 	struct ltfs_volume *vol);
 
+/**
+ * Callbacks used by ltfs_fsraw_batch_read to hand file data to the caller.
+ * Every callback receives the index of the file in the path list passed to
+ * ltfs_fsraw_batch_read and the caller's private data pointer.
+ * A callback returning a negative value fails the file it was called for.
+ */
+struct ltfs_fsraw_batch_ops {
+	/** Called before the first data of a file, with the logical file size. */
+	int (*open)(size_t index, uint64_t size, void *priv);
+	/** Called with file data, in tape order rather than file offset order. */
+	int (*write)(size_t index, const char *buf, size_t count, uint64_t offset, void *priv);
+	/** Called exactly once per file, with 0 or the error that failed the file.
+	 * open() may not have been called if the file could not be resolved. */
+	int (*close)(size_t index, int result, void *priv);
+};
+
+/**
+ * Read many files in a single forward pass over the medium.
+ * All paths are resolved first, and the extents of all files are sorted by their position
+ * on tape. Data are then read in that order, so that each extent is reached without seeking
+ * backwards. Files whose data are interleaved on tape are open at the same time; all other
+ * files are closed as soon as their last extent has been read.
+ * A failure on one file does not stop the others.
+ * @param paths Paths of the files to read.
+ * @param npaths Number of entries in paths.
+ * @param ops Callbacks receiving the file data.
+ * @param priv Private data passed to the callbacks.
+ * @param vol LTFS volume.
+ * @return
+ *    - 0 if every file was read successfully
+ *    - -LTFS_NULL_ARG if any of the input arguments are NULL
+ *    - -LTFS_NO_MEMORY if the extent list cannot be built
+ *    - Otherwise the first error reported for any file
+ */
+int ltfs_fsraw_batch_read(const char **paths, size_t npaths, struct ltfs_fsraw_batch_ops *ops,
+	void *priv, struct ltfs_volume *vol);
+
 /**
  * Truncate a file to shorten it or extend it with zeros.
  * When extending a file, the file is made sparse; explicit zeros are not written to the medium.
@@ -0,0 +1,373 @@
+/*
+**  %Z% %I% %W% %G% %U%
+**
+**  ZZ_Copyright_BEGIN
+**
+**
+**  Licensed Materials - Property of IBM
+**
+**  IBM Linear Tape File System Single Drive Edition Version 2.2.0.2 for Linux and Mac OS X
+**
+**  Copyright IBM Corp. 2010, 2014
+**
+**  This file is part of the IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X
+**  (formally known as IBM Linear Tape File System)
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is free software;
+**  you can redistribute it and/or modify it under the terms of the GNU Lesser
+**  General Public License as published by the Free Software Foundation,
+**  version 2.1 of the License.
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is distributed in the
+**  hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+**  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**  See the GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public
+**  License along with this library; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+**  or download the license from <http://www.gnu.org/licenses/>.
+**
+**
+**  ZZ_Copyright_END
+**
+*************************************************************************************
+**
+** COMPONENT NAME:  IBM Linear Tape File System
+**
+** FILE NAME:       prefetch.c
+**
+** DESCRIPTION:     Implements a per-volume thread that keeps reading the blocks that
+**                  follow a sequential reader into the tape read cache, so that the
+**                  drive keeps streaming between file system requests.
+**
+*************************************************************************************
+*/
+
+#include "ltfs.h"
+#include "tape.h"
+#include "read_cache.h"
+#include "prefetch.h"
+
+/**
+ * A range of blocks to read ahead of a sequential reader.
+ */
+struct prefetch_request {
+	tape_partition_t partition;  /**< Physical partition to read from */
+	tape_block_t next;           /**< First block to read */
+	tape_block_t end;            /**< Block after the last one to read */
+	tape_block_t extent_end;     /**< Block after the last block of the extent */
+	uint64_t last_bytes;         /**< Number of bytes in the last block of the extent */
+};
+
+/**
+ * Prefetch thread private data structure.
+ */
+struct prefetch_data {
+	ltfs_thread_cond_t   prefetch_thread_cond;   /**< Used to wake up the prefetch thread */
+	ltfs_thread_mutex_t  prefetch_thread_mutex;  /**< Protects request, pending and keepalive */
+	ltfs_thread_t        prefetch_thread_id;     /**< Thread id of the prefetch thread */
+	bool                 keepalive;              /**< Used to terminate the background thread */
+	bool                 pending;                /**< Is there a request the thread has not taken? */
+	bool                 active;                 /**< Is the thread working on the current range? */
+	struct prefetch_request request;             /**< Most recent request not taken yet */
+	struct prefetch_request current;             /**< Range the thread is working on */
+	struct ltfs_volume   *vol;                   /**< A reference to the LTFS volume structure */
+};
+
+/**
+ * Check whether the thread should go on with the next block of the current range.
+ * The range may have been extended by prefetch_request() since the last call.
+ * @param priv Prefetch private data
+ * @param block Next block the thread would read
+ * @return true to read the block, false if the range is done, a newer request arrived
+ *         or the thread is stopping.
+ */
+static bool _prefetch_continue(struct prefetch_data *priv, tape_block_t block)
+{
+	bool cont;
+
+	ltfs_thread_mutex_lock(&priv->prefetch_thread_mutex);
+	cont = (priv->keepalive && ! priv->pending && block < priv->current.end);
+	if (! cont)
+		priv->active = false;
+	ltfs_thread_mutex_unlock(&priv->prefetch_thread_mutex);
+
+	return cont;
+}
+
+/**
+ * Read one block into the read cache. The block is only read if the drive is already
+ * positioned on it: prefetching must never move the head away from other work.
+ * @param priv Prefetch private data
+ * @param req Range being prefetched
+ * @param block Block to read
+ * @return 1 if the thread may continue with the following block, 0 if it should stop,
+ *         or a negative value on error.
+ */
+static int _prefetch_block(struct prefetch_data *priv, struct prefetch_request *req,
+	tape_block_t block)
+{
+	int ret;
+	ssize_t nread;
+	size_t cached_size;
+	char *blockbuf;
+	uint64_t blockbytes;
+	unsigned long blocksize;
+	struct tc_position curpos;
+	struct read_cache *cache;
+	struct ltfs_volume *vol = priv->vol;
+
+	ret = ltfs_get_volume_lock(false, vol);
+	if (ret < 0)
+		return ret;
+	ret = tape_device_lock(vol->device);
+	if (ret < 0) {
+		releaseread_mrsw(&vol->lock);
+		return ret;
+	}
+
+	/* The cache is created by the first foreground read */
+	blocksize = vol->label->blocksize;
+	cache = vol->device->read_cache;
+	if (! cache || read_cache_blocksize(cache) != blocksize) {
+		ret = 0;
+		goto out_unlock;
+	}
+
+	if (read_cache_lookup(cache, req->partition, block, &cached_size)) {
+		ret = 1;
+		goto out_unlock;
+	}
+
+	ret = tape_get_position(vol->device, &curpos);
+	if (ret < 0)
+		goto out_unlock;
+	if (curpos.partition != req->partition || curpos.block != block) {
+		ret = 0;
+		goto out_unlock;
+	}
+
+	blockbytes = (block + 1 == req->extent_end) ? req->last_bytes : blocksize;
+	blockbuf = read_cache_reserve(cache, req->partition, block);
+	if (! blockbuf) {
+		ret = -LTFS_NO_MEMORY;
+		goto out_unlock;
+	}
+
+	nread = tape_read(vol->device, blockbuf, blocksize, blockbytes != blocksize, vol->kmi_handle);
+	if (nread < 0) {
+		read_cache_abort(cache);
+		ret = nread;
+	} else if ((uint64_t) nread < blockbytes) {
+		read_cache_abort(cache);
+		ret = 0;
+	} else {
+		read_cache_commit(cache, nread);
+		ret = 1;
+	}
+
+out_unlock:
+	if (NEED_REVAL(ret)) {
+		tape_start_fence(vol->device);
+		tape_device_unlock(vol->device);
+		ltfs_revalidate(false, vol);
+	} else if (IS_UNEXPECTED_MOVE(ret)) {
+		vol->reval = -LTFS_REVAL_FAILED;
+		tape_device_unlock(vol->device);
+		releaseread_mrsw(&vol->lock);
+	} else {
+		tape_device_unlock(vol->device);
+		releaseread_mrsw(&vol->lock);
+	}
+
+	return ret;
+}
+
+/**
+ * Main routine for the prefetch thread.
+ * @param data Prefetch private data
+ * @return NULL.
+ */
+ltfs_thread_return prefetch_thread(void *data)
+{
+	int ret;
+	tape_block_t block;
+	struct prefetch_request req;
+	struct prefetch_data *priv = (struct prefetch_data *) data;
+
+	ltfs_thread_mutex_lock(&priv->prefetch_thread_mutex);
+	while (priv->keepalive) {
+		if (! priv->pending) {
+			ltfs_thread_cond_wait(&priv->prefetch_thread_cond, &priv->prefetch_thread_mutex);
+			continue;
+		}
+
+		req = priv->request;
+		priv->current = req;
+		priv->pending = false;
+		priv->active = true;
+		ltfs_thread_mutex_unlock(&priv->prefetch_thread_mutex);
+
+		/* Drop the device lock between blocks so that foreground requests are not delayed */
+		for (block = req.next; _prefetch_continue(priv, block); ++block) {
+			ret = _prefetch_block(priv, &req, block);
+			if (ret <= 0) {
+				if (ret < 0)
+					ltfsmsg(LTFS_DEBUG, "17308D", (unsigned int)req.partition,
+						(unsigned long long)block, ret);
+				break;
+			}
+		}
+
+		ltfs_thread_mutex_lock(&priv->prefetch_thread_mutex);
+		priv->active = false;
+	}
+	ltfs_thread_mutex_unlock(&priv->prefetch_thread_mutex);
+
+	ltfs_thread_exit();
+
+	return LTFS_THREAD_RC_NULL;
+}
+
+/**
+ * Verifies if the prefetch thread is currently running.
+ * @param vol LTFS volume
+ * @return true if the thread is running, false if not.
+ */
+bool prefetch_thread_initialized(struct ltfs_volume *vol)
+{
+	struct prefetch_data *priv = vol ? vol->prefetch_handle : NULL;
+	bool initialized = false;
+
+	if (priv) {
+		ltfs_thread_mutex_lock(&priv->prefetch_thread_mutex);
+		initialized = priv->keepalive;
+		ltfs_thread_mutex_unlock(&priv->prefetch_thread_mutex);
+	}
+
+	return initialized;
+}
+
+/**
+ * Initialize the prefetch thread. The thread reads up to ltfs_readahead_blocks() blocks
+ * ahead of each sequential reader, so it is not started when read-ahead is disabled.
+ * @param vol LTFS volume
+ * @return 0 on success or a negative value on error.
+ */
+int prefetch_thread_init(struct ltfs_volume *vol)
+{
+	int ret;
+	struct prefetch_data *priv;
+
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+
+	if (ltfs_readahead_blocks(vol) == 0)
+		return 0;
+
+	priv = calloc(1, sizeof(struct prefetch_data));
+	if (! priv) {
+		ltfsmsg(LTFS_ERR, "10001E", "prefetch_thread_init: prefetch data");
+		return -LTFS_NO_MEMORY;
+	}
+
+	priv->vol = vol;
+	priv->keepalive = true;
+
+	ret = ltfs_thread_cond_init(&priv->prefetch_thread_cond);
+	if (ret) {
+		ltfsmsg(LTFS_ERR, "10003E", ret);
+		free(priv);
+		return -ret;
+	}
+	ret = ltfs_thread_mutex_init(&priv->prefetch_thread_mutex);
+	if (ret) {
+		ltfsmsg(LTFS_ERR, "10002E", ret);
+		ltfs_thread_cond_destroy(&priv->prefetch_thread_cond);
+		free(priv);
+		return -ret;
+	}
+	ret = ltfs_thread_create(&priv->prefetch_thread_id, prefetch_thread, priv);
+	if (ret) {
+		/* Failed to spawn the prefetch thread (%d) */
+		ltfsmsg(LTFS_ERR, "17305E", ret);
+		ltfs_thread_mutex_destroy(&priv->prefetch_thread_mutex);
+		ltfs_thread_cond_destroy(&priv->prefetch_thread_cond);
+		free(priv);
+		return -ret;
+	}
+
+	ltfsmsg(LTFS_DEBUG, "17306D");
+	vol->prefetch_handle = priv;
+
+	return 0;
+}
+
+/**
+ * Destroy the prefetch thread.
+ * @param vol LTFS volume
+ * @return 0 on success or a negative value on error.
+ */
+int prefetch_thread_destroy(struct ltfs_volume *vol)
+{
+	struct prefetch_data *priv = vol ? vol->prefetch_handle : NULL;
+
+	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(priv, -LTFS_NULL_ARG);
+
+	ltfs_thread_mutex_lock(&priv->prefetch_thread_mutex);
+	priv->keepalive = false;
+	ltfs_thread_cond_signal(&priv->prefetch_thread_cond);
+	ltfs_thread_mutex_unlock(&priv->prefetch_thread_mutex);
+
+	ltfs_thread_join(priv->prefetch_thread_id);
+	ltfs_thread_cond_destroy(&priv->prefetch_thread_cond);
+	ltfs_thread_mutex_destroy(&priv->prefetch_thread_mutex);
+	free(priv);
+
+	vol->prefetch_handle = NULL;
+
+	ltfsmsg(LTFS_DEBUG, "17307D");
+	return 0;
+}
+
+/**
+ * Ask the prefetch thread to read ahead of a sequential reader. A request that follows
+ * the range the thread is reading just extends that range. Any other request replaces
+ * the range, and any request the thread has not started yet.
+ * Does nothing if the thread is not running.
+ * @param vol LTFS volume
+ * @param part Physical partition the reader is reading from
+ * @param next First block the reader has not consumed yet
+ * @param extent_end Block after the last block of the extent being read
+ * @param last_bytes Number of bytes in the last block of the extent
+ */
+void prefetch_request(struct ltfs_volume *vol, tape_partition_t part, tape_block_t next,
+	tape_block_t extent_end, uint64_t last_bytes)
+{
+	struct prefetch_data *priv = vol ? vol->prefetch_handle : NULL;
+	tape_block_t end;
+
+	if (! priv || next >= extent_end)
+		return;
+
+	end = next + ltfs_readahead_blocks(vol);
+	if (end > extent_end)
+		end = extent_end;
+
+	ltfs_thread_mutex_lock(&priv->prefetch_thread_mutex);
+	if (priv->active && ! priv->pending && priv->current.partition == part &&
+		priv->current.extent_end == extent_end && priv->current.next <= next) {
+		if (priv->current.end < end)
+			priv->current.end = end;
+	} else {
+		priv->request.partition = part;
+		priv->request.next = next;
+		priv->request.end = end;
+		priv->request.extent_end = extent_end;
+		priv->request.last_bytes = last_bytes;
+		priv->pending = true;
+		ltfs_thread_cond_signal(&priv->prefetch_thread_cond);
+	}
+	ltfs_thread_mutex_unlock(&priv->prefetch_thread_mutex);
+}
@@ -0,0 +1,61 @@
+/*
+**  %Z% %I% %W% %G% %U%
+**
+**  ZZ_Copyright_BEGIN
+**
+**
+**  Licensed Materials - Property of IBM
+**
+**  IBM Linear Tape File System Single Drive Edition Version 2.2.0.2 for Linux and Mac OS X
+**
+**  Copyright IBM Corp. 2010, 2014
+**
+**  This file is part of the IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X
+**  (formally known as IBM Linear Tape File System)
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is free software;
+**  you can redistribute it and/or modify it under the terms of the GNU Lesser
+**  General Public License as published by the Free Software Foundation,
+**  version 2.1 of the License.
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is distributed in the
+**  hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+**  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**  See the GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public
+**  License along with this library; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+**  or download the license from <http://www.gnu.org/licenses/>.
+**
+**
+**  ZZ_Copyright_END
+**
+*************************************************************************************
+**
+** COMPONENT NAME:  IBM Linear Tape File System
+**
+** FILE NAME:       prefetch.h
+**
+** DESCRIPTION:     Prototypes for the background tape read-ahead thread
+**
+*************************************************************************************
+*/
+#ifndef __prefetch_h
+#define __prefetch_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int prefetch_thread_init(struct ltfs_volume *vol);
+int prefetch_thread_destroy(struct ltfs_volume *vol);
+bool prefetch_thread_initialized(struct ltfs_volume *vol);
+void prefetch_request(struct ltfs_volume *vol, tape_partition_t part, tape_block_t next,
+	tape_block_t extent_end, uint64_t last_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __prefetch_h */
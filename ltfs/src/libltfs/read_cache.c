@@ -0,0 +1,431 @@
+/*
+**  %Z% %I% %W% %G% %U%
+**
+**  ZZ_Copyright_BEGIN
+**
+**
+**  Licensed Materials - Property of IBM
+**
+**  IBM Linear Tape File System Single Drive Edition Version 2.2.0.2 for Linux and Mac OS X
+**
+**  Copyright IBM Corp. 2010, 2014
+**
+**  This file is part of the IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X
+**  (formally known as IBM Linear Tape File System)
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is free software;
+**  you can redistribute it and/or modify it under the terms of the GNU Lesser
+**  General Public License as published by the Free Software Foundation,
+**  version 2.1 of the License.
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is distributed in the
+**  hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+**  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**  See the GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public
+**  License along with this library; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+**  or download the license from <http://www.gnu.org/licenses/>.
+**
+**
+**  ZZ_Copyright_END
+**
+*************************************************************************************
+**
+** COMPONENT NAME:  IBM Linear Tape File System
+**
+** FILE NAME:       read_cache.c
+**
+** DESCRIPTION:     Implements a small cache of tape blocks keyed by their physical
+**                  position, with detection of sequential read streams.
+**
+*************************************************************************************
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ltfs.h"
+#include "queue.h"
+#include "uthash.h"
+#include "read_cache.h"
+
+/** Number of concurrent sequential read streams tracked by the cache. */
+#define READ_CACHE_STREAMS 8
+
+/**
+ * Physical position of a cached block. Used as the hash key, so it must be fully
+ * initialized (padding included) before lookups.
+ */
+struct read_cache_key {
+	tape_block_t     block;       /**< Logical block number */
+	tape_partition_t partition;   /**< Physical partition number */
+	uint32_t         reserved;    /**< Padding, always zero */
+};
+
+/**
+ * A cached tape block.
+ */
+struct read_cache_block {
+	TAILQ_ENTRY(read_cache_block) list;  /**< Pointers to LRU list */
+	UT_hash_handle hh;                   /**< Position hash table handle */
+	struct read_cache_key key;           /**< Position of the block on tape */
+	size_t size;                         /**< Number of valid bytes in data */
+	bool valid;                          /**< Does this slot hold a block? */
+	char *data;                          /**< Block contents, allocated on first use */
+};
+
+/**
+ * A sequential read stream. A stream turns sequential when a miss lands on the block
+ * following the last block read in that stream.
+ */
+struct read_cache_stream {
+	tape_partition_t partition;  /**< Partition the stream is reading */
+	tape_block_t next;           /**< Next block the stream is expected to request */
+	size_t window;               /**< Current read-ahead window in blocks, 0 if not sequential */
+	unsigned int age;            /**< Last use, for stream replacement */
+	bool valid;                  /**< Is this stream slot in use? */
+};
+
+struct read_cache {
+	size_t nblocks;                         /**< Number of cache slots */
+	size_t readahead;                       /**< Maximum read-ahead window in blocks */
+	size_t blocksize;                       /**< Size of each slot in bytes */
+	struct read_cache_block *slots;         /**< All cache slots */
+	struct read_cache_block *table;         /**< Valid slots, hashed by position */
+	TAILQ_HEAD(read_cache_lru, read_cache_block) lru; /**< Slots, most recently used first */
+	struct read_cache_block *pending;       /**< Slot handed out by read_cache_reserve */
+	struct read_cache_stream streams[READ_CACHE_STREAMS];
+	unsigned int clock;                     /**< Stream age counter */
+};
+
+static void _read_cache_drop(struct read_cache *cache, struct read_cache_block *slot)
+{
+	if (slot->valid) {
+		HASH_DEL(cache->table, slot);
+		slot->valid = false;
+	}
+	TAILQ_REMOVE(&cache->lru, slot, list);
+	TAILQ_INSERT_TAIL(&cache->lru, slot, list);
+}
+
+static struct read_cache_block *_read_cache_find(struct read_cache *cache,
+	tape_partition_t part, tape_block_t block)
+{
+	struct read_cache_key key;
+	struct read_cache_block *slot = NULL;
+
+	memset(&key, 0, sizeof(key));
+	key.partition = part;
+	key.block = block;
+	HASH_FIND(hh, cache->table, &key, sizeof(key), slot);
+	return slot;
+}
+
+/**
+ * Allocate a read cache.
+ * @param nblocks Number of blocks the cache can hold. Must be at least 1.
+ * @param readahead Maximum number of blocks to read ahead for a sequential stream.
+ * @param blocksize Size of each block in bytes.
+ * @param cache On success, points to the new cache.
+ * @return 0 on success or a negative value on error.
+ */
+int read_cache_init(size_t nblocks, size_t readahead, size_t blocksize, struct read_cache **cache)
+{
+	size_t i;
+	struct read_cache *newcache;
+
+	CHECK_ARG_NULL(cache, -LTFS_NULL_ARG);
+	if (nblocks == 0 || blocksize == 0)
+		return -LTFS_BAD_ARG;
+
+	newcache = calloc(1, sizeof(struct read_cache));
+	if (! newcache) {
+		ltfsmsg(LTFS_ERR, "10001E", "read_cache_init: cache");
+		return -LTFS_NO_MEMORY;
+	}
+	newcache->slots = calloc(nblocks, sizeof(struct read_cache_block));
+	if (! newcache->slots) {
+		ltfsmsg(LTFS_ERR, "10001E", "read_cache_init: slots");
+		free(newcache);
+		return -LTFS_NO_MEMORY;
+	}
+
+	newcache->nblocks = nblocks;
+	newcache->readahead = (readahead < nblocks) ? readahead : nblocks - 1;
+	newcache->blocksize = blocksize;
+	TAILQ_INIT(&newcache->lru);
+	for (i = 0; i < nblocks; ++i)
+		TAILQ_INSERT_TAIL(&newcache->lru, &newcache->slots[i], list);
+
+	*cache = newcache;
+	return 0;
+}
+
+/**
+ * Free a read cache and all of its buffers.
+ * @param cache Cache to free. May be NULL.
+ */
+void read_cache_destroy(struct read_cache *cache)
+{
+	size_t i;
+
+	if (! cache)
+		return;
+
+	HASH_CLEAR(hh, cache->table);
+	for (i = 0; i < cache->nblocks; ++i) {
+		if (cache->slots[i].data)
+			free(cache->slots[i].data);
+	}
+	free(cache->slots);
+	free(cache);
+}
+
+/**
+ * Allocate the buffers of all cache slots up front, so that filling the cache never
+ * needs to allocate memory. Used when a background thread reads into the cache.
+ * @param cache Read cache.
+ * @return 0 on success or a negative value on error.
+ */
+int read_cache_preallocate(struct read_cache *cache)
+{
+	size_t i;
+
+	CHECK_ARG_NULL(cache, -LTFS_NULL_ARG);
+
+	for (i = 0; i < cache->nblocks; ++i) {
+		if (cache->slots[i].data)
+			continue;
+		cache->slots[i].data = malloc(cache->blocksize);
+		if (! cache->slots[i].data) {
+			ltfsmsg(LTFS_ERR, "10001E", "read_cache_preallocate: block");
+			return -LTFS_NO_MEMORY;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Get the block size the cache was created with.
+ * @param cache Read cache.
+ * @return Size of each cache slot in bytes.
+ */
+size_t read_cache_blocksize(struct read_cache *cache)
+{
+	CHECK_ARG_NULL(cache, 0);
+	return cache->blocksize;
+}
+
+/**
+ * Look up a block in the cache. On a hit the block becomes the most recently used one.
+ * The returned buffer is only valid until the next call that modifies the cache.
+ * @param cache Read cache.
+ * @param part Physical partition number.
+ * @param block Block number.
+ * @param size On a hit, receives the number of valid bytes in the block.
+ * @return Block contents, or NULL if the block is not cached.
+ */
+const char *read_cache_lookup(struct read_cache *cache, tape_partition_t part, tape_block_t block,
+	size_t *size)
+{
+	struct read_cache_block *slot;
+
+	CHECK_ARG_NULL(cache, NULL);
+	CHECK_ARG_NULL(size, NULL);
+
+	slot = _read_cache_find(cache, part, block);
+	if (! slot)
+		return NULL;
+
+	TAILQ_REMOVE(&cache->lru, slot, list);
+	TAILQ_INSERT_HEAD(&cache->lru, slot, list);
+	*size = slot->size;
+	return slot->data;
+}
+
+/**
+ * Take a buffer to read a block into. The least recently used block is evicted to make
+ * room. The caller must follow up with read_cache_commit() or read_cache_abort() before
+ * calling any other function on this cache.
+ * @param cache Read cache.
+ * @param part Physical partition number of the block that will be read.
+ * @param block Block number of the block that will be read.
+ * @return A buffer of read_cache_blocksize() bytes, or NULL on allocation failure.
+ */
+char *read_cache_reserve(struct read_cache *cache, tape_partition_t part, tape_block_t block)
+{
+	struct read_cache_block *slot;
+
+	CHECK_ARG_NULL(cache, NULL);
+
+	slot = _read_cache_find(cache, part, block);
+	if (! slot)
+		slot = TAILQ_LAST(&cache->lru, read_cache_lru);
+	_read_cache_drop(cache, slot);
+
+	if (! slot->data) {
+		slot->data = malloc(cache->blocksize);
+		if (! slot->data) {
+			ltfsmsg(LTFS_ERR, "10001E", "read_cache_reserve: block");
+			return NULL;
+		}
+	}
+
+	memset(&slot->key, 0, sizeof(slot->key));
+	slot->key.partition = part;
+	slot->key.block = block;
+	cache->pending = slot;
+	return slot->data;
+}
+
+/**
+ * Insert the block previously handed out by read_cache_reserve() into the cache.
+ * @param cache Read cache.
+ * @param size Number of bytes read into the block.
+ */
+void read_cache_commit(struct read_cache *cache, size_t size)
+{
+	int i;
+	struct read_cache_block *slot;
+
+	if (! cache || ! cache->pending)
+		return;
+
+	slot = cache->pending;
+	cache->pending = NULL;
+	slot->size = size;
+	slot->valid = true;
+	HASH_ADD(hh, cache->table, key, sizeof(slot->key), slot);
+	TAILQ_REMOVE(&cache->lru, slot, list);
+	TAILQ_INSERT_HEAD(&cache->lru, slot, list);
+
+	/* Let the stream that read this block follow it */
+	for (i = 0; i < READ_CACHE_STREAMS; ++i) {
+		if (cache->streams[i].valid && cache->streams[i].partition == slot->key.partition &&
+			cache->streams[i].next == slot->key.block) {
+			cache->streams[i].next = slot->key.block + 1;
+			break;
+		}
+	}
+}
+
+/**
+ * Give back the block previously handed out by read_cache_reserve() without caching it.
+ * @param cache Read cache.
+ */
+void read_cache_abort(struct read_cache *cache)
+{
+	if (cache)
+		cache->pending = NULL;
+}
+
+/**
+ * Report a cache miss and get the number of blocks that should be read ahead of it.
+ * Random accesses get no read-ahead. A stream that keeps missing on the block right
+ * after its previous read is sequential, and its window doubles on every such miss up
+ * to the configured maximum.
+ * @param cache Read cache.
+ * @param part Physical partition number of the missed block.
+ * @param block Block number of the missed block.
+ * @return Number of blocks to read after the missed block.
+ */
+size_t read_cache_readahead_hint(struct read_cache *cache, tape_partition_t part, tape_block_t block)
+{
+	int i, victim = 0;
+	struct read_cache_stream *stream;
+
+	CHECK_ARG_NULL(cache, 0);
+
+	++cache->clock;
+	for (i = 0; i < READ_CACHE_STREAMS; ++i) {
+		stream = &cache->streams[i];
+		if (stream->valid && stream->partition == part && stream->next == block) {
+			stream->age = cache->clock;
+			if (stream->window == 0)
+				stream->window = 1;
+			else if (stream->window < cache->readahead)
+				stream->window *= 2;
+			if (stream->window > cache->readahead)
+				stream->window = cache->readahead;
+			return stream->window;
+		}
+		if (! stream->valid)
+			victim = i;
+		else if (cache->streams[victim].valid && stream->age < cache->streams[victim].age)
+			victim = i;
+	}
+
+	/* New stream; commit of the missed block will point it at the following block */
+	stream = &cache->streams[victim];
+	stream->valid = true;
+	stream->partition = part;
+	stream->next = block;
+	stream->window = 0;
+	stream->age = cache->clock;
+	return 0;
+}
+
+/**
+ * Check whether a block belongs to a sequential stream, i.e. the block was consumed by
+ * a reader whose stream has already read ahead of it or is about to.
+ * @param cache Read cache.
+ * @param part Physical partition number.
+ * @param block Block number the reader consumed.
+ * @return true if the block is part of a sequential stream.
+ */
+bool read_cache_stream_active(struct read_cache *cache, tape_partition_t part, tape_block_t block)
+{
+	int i;
+	struct read_cache_stream *stream;
+
+	CHECK_ARG_NULL(cache, false);
+
+	for (i = 0; i < READ_CACHE_STREAMS; ++i) {
+		stream = &cache->streams[i];
+		if (stream->valid && stream->window > 0 && stream->partition == part &&
+			block < stream->next && stream->next - block <= cache->nblocks)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Invalidate cached blocks that may have been overwritten on tape.
+ * @param cache Read cache. May be NULL.
+ * @param part Physical partition number.
+ * @param from First block that is no longer valid. All following blocks in the same
+ *             partition are invalidated as well.
+ */
+void read_cache_invalidate(struct read_cache *cache, tape_partition_t part, tape_block_t from)
+{
+	size_t i;
+
+	if (! cache)
+		return;
+
+	for (i = 0; i < cache->nblocks; ++i) {
+		if (cache->slots[i].valid && cache->slots[i].key.partition == part &&
+			cache->slots[i].key.block >= from)
+			_read_cache_drop(cache, &cache->slots[i]);
+	}
+}
+
+/**
+ * Invalidate every block in the cache and forget all read streams.
+ * @param cache Read cache. May be NULL.
+ */
+void read_cache_invalidate_all(struct read_cache *cache)
+{
+	size_t i;
+
+	if (! cache)
+		return;
+
+	for (i = 0; i < cache->nblocks; ++i)
+		_read_cache_drop(cache, &cache->slots[i]);
+	memset(cache->streams, 0, sizeof(cache->streams));
+}
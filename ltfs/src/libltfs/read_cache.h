@@ -0,0 +1,76 @@
+/*
+**  %Z% %I% %W% %G% %U%
+**
+**  ZZ_Copyright_BEGIN
+**
+**
+**  Licensed Materials - Property of IBM
+**
+**  IBM Linear Tape File System Single Drive Edition Version 2.2.0.2 for Linux and Mac OS X
+**
+**  Copyright IBM Corp. 2010, 2014
+**
+**  This file is part of the IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X
+**  (formally known as IBM Linear Tape File System)
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is free software;
+**  you can redistribute it and/or modify it under the terms of the GNU Lesser
+**  General Public License as published by the Free Software Foundation,
+**  version 2.1 of the License.
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is distributed in the
+**  hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+**  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**  See the GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public
+**  License along with this library; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+**  or download the license from <http://www.gnu.org/licenses/>.
+**
+**
+**  ZZ_Copyright_END
+**
+*************************************************************************************
+**
+** COMPONENT NAME:  IBM Linear Tape File System
+**
+** FILE NAME:       read_cache.h
+**
+** DESCRIPTION:     Prototypes for the position-keyed tape block read cache
+**
+*************************************************************************************
+*/
+#ifndef __read_cache_h
+#define __read_cache_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include "ltfs_types.h"
+
+struct read_cache;
+
+int read_cache_init(size_t nblocks, size_t readahead, size_t blocksize, struct read_cache **cache);
+void read_cache_destroy(struct read_cache *cache);
+int read_cache_preallocate(struct read_cache *cache);
+size_t read_cache_blocksize(struct read_cache *cache);
+
+const char *read_cache_lookup(struct read_cache *cache, tape_partition_t part, tape_block_t block,
+	size_t *size);
+char *read_cache_reserve(struct read_cache *cache, tape_partition_t part, tape_block_t block);
+void read_cache_commit(struct read_cache *cache, size_t size);
+void read_cache_abort(struct read_cache *cache);
+
+size_t read_cache_readahead_hint(struct read_cache *cache, tape_partition_t part, tape_block_t block);
+bool read_cache_stream_active(struct read_cache *cache, tape_partition_t part, tape_block_t block);
+void read_cache_invalidate(struct read_cache *cache, tape_partition_t part, tape_block_t from);
+void read_cache_invalidate_all(struct read_cache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __read_cache_h */
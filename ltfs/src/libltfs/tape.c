@@ -99,6 +99,7 @@
 #include "ltfs_endian.h"
 #include "kmi.h"
 #include "xattr.h"
+#include "read_cache.h"
 
 enum partition_status {
 	PART_WRITABLE = 0,  /* Device is writable */
@@ -176,6 +177,7 @@ void tape_device_free(struct device_data **device, void * const kmi_handle, bool
 			tape_device_close(*device, kmi_handle, force);
 		ltfs_mutex_destroy(&(*device)->backend_mutex);
 		ltfs_mutex_destroy(&(*device)->read_only_flag_mutex);
+		read_cache_destroy((*device)->read_cache);
 		free(*device);
 		*device = NULL;
 	}
@@ -301,6 +303,7 @@ void _tape_device_close(struct device_data *device, void * const kmi_handle,
 	if (!skip_aom_setting)
 		tape_enable_append_only_mode(device, false);
 	tape_release_device(device);
+	read_cache_invalidate_all(device->read_cache);
 
 	if (device->backend && device->backend_data)
 		device->backend->close(device->backend_data);
@@ -391,6 +394,7 @@ int tape_load_tape(struct device_data *dev, void * const kmi_handle)
 	ltfs_mutex_lock(&dev->append_pos_mutex);
 	dev->append_pos[0] = dev->append_pos[1] = 0;
 	ltfs_mutex_unlock(&dev->append_pos_mutex);
+	read_cache_invalidate_all(dev->read_cache);
 
 	ret = tape_wait_device_ready(dev, kmi_handle);
 	if (ret < 0) {
@@ -504,6 +508,7 @@ int tape_unload_tape(struct device_data *dev)
 	dev->previous_exist.tv_sec = 0;
 	dev->previous_exist.tv_nsec = 0;
 
+	read_cache_invalidate_all(dev->read_cache);
 	tape_allow_medium_removal(dev, false);
 	do {
 		ret = tape_rewind(dev);
@@ -988,6 +993,8 @@ int tape_seek(struct device_data *dev, struct tc_position *pos)
 	if (pos->partition == dev->position.partition && pos->block == dev->position.block)
 		ret = 0;
 	else {
+		if (pos->partition != dev->position.partition)
+			++dev->partition_switches;
 		ret = dev->backend->locate(dev->backend_data, *pos, &dev->position);
 		if (ret < 0)
 			ltfsmsg(LTFS_ERR, "12037E", ret);
@@ -1029,6 +1036,8 @@ int tape_seek_eod(struct device_data *dev, tape_partition_t partition)
 		return -LTFS_BAD_PARTNUM;
 	}
 
+	if (partition != dev->position.partition)
+		++dev->partition_switches;
 	ret = dev->backend->locate(dev->backend_data, seekpos, &dev->position);
 	if (ret < 0) {
 		ltfsmsg(LTFS_ERR, "12039E", ret);
@@ -1152,6 +1161,9 @@ ssize_t tape_write(struct device_data *dev, const char *buf, size_t count, bool
 	if (ret < 0)
 		return ret;
 
+	/* Everything from here to the end of the partition is about to be replaced */
+	read_cache_invalidate(dev->read_cache, dev->position.partition, dev->position.block);
+
 	ret = dev->backend->write(dev->backend_data, buf, count, &dev->position);
 	if (ret < 0) {
 		/* If a "real" write error occurs, refuse any additional writes */
@@ -1217,6 +1229,8 @@ int tape_write_filemark(struct device_data *dev, uint8_t count, bool ignore_less
 	if (ret < 0)
 		return ret;
 
+	read_cache_invalidate(dev->read_cache, dev->position.partition, dev->position.block);
+
 	ret = dev->backend->writefm(dev->backend_data, count, &dev->position, immed);
 	if (ret < 0) {
 		/* If a "real" write error occurs, refuse all further writes */
@@ -1320,6 +1334,7 @@ int tape_erase(struct device_data *dev, bool long_erase)
 
 	CHECK_ARG_NULL(dev, -LTFS_NULL_ARG);
 
+	read_cache_invalidate_all(dev->read_cache);
 	ret = dev->backend->erase(dev->backend_data, &dev->position, long_erase);
 	if (ret < 0)
 		ltfsmsg(LTFS_ERR, "17149E", ret);
@@ -1440,6 +1455,7 @@ int tape_format(struct device_data *dev, tape_partition_t index_part,
 		);
 
 	/* Issue Format Medium (destroy all medium data and make 2-partitition medium) */
+	read_cache_invalidate_all(dev->read_cache);
 	ret = dev->backend->format(dev->backend_data, TC_FORMAT_DEST_PART, vol_name, barcode_name);
 	if (ret < 0) {
 		ltfsmsg(LTFS_ERR, "12053E", ret);
@@ -1481,6 +1497,7 @@ int tape_unformat(struct device_data *dev)
 	}
 
 	/* Issue Format Medium */
+	read_cache_invalidate_all(dev->read_cache);
 	ret = dev->backend->format(dev->backend_data, TC_FORMAT_DEFAULT, NULL, NULL);
 	if (ret < 0) {
 		ltfsmsg(LTFS_ERR, "12055E", ret);
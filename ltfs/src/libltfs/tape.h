@@ -94,11 +94,15 @@ struct device_data {
 	bool fence;                           /**< Are device lock requests blocked? */
 	bool append_only_mode;                /**< Is in the append only mode? */
 	struct ltfs_timespec previous_exist;  /**< Previous time to be confirm drive connection presence */
+	uint64_t partition_switches;          /**< Number of locates which changed the partition */
 
 	struct tape_ops *backend;             /**< Backend functions */
 	void *backend_data;                   /**< Backend private data */
 	ltfs_mutex_t backend_mutex;           /**< Mutex to control backend access */
 	ltfs_mutex_t read_only_flag_mutex;    /**< Mutex to control read_only access */
+
+	struct read_cache *read_cache;        /**< Cache of blocks read from the tape. Protected by
+	                                           the device lock, see read_cache.h */
 };
 
 int tape_device_alloc(struct device_data **device);
@@ -69,6 +69,7 @@
 #include "ltfs_internal.h"
 #include "arch/time_internal.h"
 #include "periodic_sync.h"
+#include "iosched.h"
 #ifdef __APPLE__
 #include "arch/osx/osx_string.h"
 #endif /* __APPLE__ */
@@ -143,6 +144,7 @@ int xattr_do_set(struct dentry *d, const char *name, const char *value, size_t s
 		}
 		memcpy(xattr->value, value, size);
 	}
+	fs_set_xml_dirty(d);
 	return 0;
 
 out_remove:
@@ -196,12 +198,21 @@ int xattr_set(struct dentry *d, const char *name, const char *value, size_t size
 	/* In the future, there could be user-writeable reserved xattrs. For now, just deny
 	 * writes to all reserved xattrs not covered by the user-writeable virtual xattrs above. */
 	if (strcasestr(name, "ltfs") == name && strcmp(name, "ltfs.spannedFileOffset") &&
+				strcmp(name, LTFS_PRIORITY_EA_NAME) &&
 				strcasestr(name, "ltfs.permissions.") != name &&
 				strcasestr(name, "ltfs.hash.") != name) {
 		ret = -LTFS_RDONLY_XATTR;
 		goto out_unlock;
 	}
 
+	/* The priority class is either "high" or "normal" */
+	if (! strcmp(name, LTFS_PRIORITY_EA_NAME) &&
+		! (size == strlen("high") && ! strncmp(value, "high", size)) &&
+		! (size == strlen("normal") && ! strncmp(value, "normal", size))) {
+		ret = -LTFS_BAD_ARG;
+		goto out_unlock;
+	}
+
 	acquirewrite_mrsw(&d->meta_lock);
 
 	/* Search for existing xattr with this name. */
@@ -409,6 +420,7 @@ int xattr_do_remove(struct dentry *d, const char *name, bool force, struct ltfs_
 		/* If this xattr is in the reserved namespace, the user can't remove it. */
 		/* TODO: in the future, there could be user-removable reserved xattrs. */
 		if (strcasestr(name, "ltfs") == name && strcmp(name, "ltfs.spannedFileOffset") &&
+						strcmp(name, LTFS_PRIORITY_EA_NAME) &&
 						strcasestr(name, "ltfs.permissions.") != name &&
 						strcasestr(name, "ltfs.hash.") != name) {
 			releasewrite_mrsw(&d->meta_lock);
@@ -419,6 +431,7 @@ int xattr_do_remove(struct dentry *d, const char *name, bool force, struct ltfs_
 	/* Remove the xattr. */
 	TAILQ_REMOVE(&d->xattrlist, xattr, list);
 	get_current_timespec(&d->change_time);
+	fs_set_xml_dirty(d);
 	releasewrite_mrsw(&d->meta_lock);
 
 	free(xattr->key);
@@ -499,6 +512,35 @@ out_set:
 #endif
 }
 
+/**
+ * Find the I/O scheduler priority class of a file. The class is given by the ltfs.priority
+ * extended attribute of the file or, if it has none, of its nearest parent directory
+ * which has one. Files are in the normal class by default.
+ * Call this function with the volume lock held for read and without any lock on d or on
+ * its parents; their meta_locks are taken one at a time.
+ * @param d File to check.
+ * @return true if the file is in the high priority class, false otherwise.
+ */
+bool xattr_priority_high(struct dentry *d)
+{
+	struct xattr_info *xattr;
+	struct dentry *parent;
+	bool high = false;
+
+	while (d) {
+		acquireread_mrsw(&d->meta_lock);
+		_xattr_seek(&xattr, d, LTFS_PRIORITY_EA_NAME);
+		if (xattr)
+			high = (xattr->size == strlen("high") && ! strncmp(xattr->value, "high", xattr->size));
+		parent = d->parent;
+		releaseread_mrsw(&d->meta_lock);
+		if (xattr)
+			break;
+		d = parent;
+	}
+
+	return high;
+}
 
 /**
  * Search for an xattr with the given name. Must call this function with a lock on
@@ -721,10 +763,12 @@ bool _xattr_is_virtual(struct dentry *d, const char *name, struct ltfs_volume *v
 			|| ! strcmp(name, "ltfs.mediaEncrypted")
 			|| ! strcmp(name, "ltfs.driveEncryptionState")
 			|| ! strcmp(name, "ltfs.driveEncryptionMethod")
+			|| (iosched_initialized(vol) && ! strcmp(name, "ltfs.schedulerState"))
 			/* Vendor specific EAs */
 			|| ! strcmp(name, "ltfs.vendor.IBM.referencedBlocks")
 			|| ! strcmp(name, "ltfs.vendor.IBM.trace")
 			|| ! strcmp(name, "ltfs.vendor.IBM.totalBlocks")
+			|| ! strcmp(name, "ltfs.vendor.IBM.partitionSwitches")
 			|| ! strcmp(name, "ltfs.vendor.IBM.cartridgeMountNode")
 			|| ! strcmp(name, "ltfs.vendor.IBM.logLevel")
 			|| ! strcmp(name, "ltfs.vendor.IBM.syslogLevel")
@@ -1007,6 +1051,10 @@ int _xattr_get_virtual(struct dentry *d, char *buf, size_t buf_size, const char
 			ret = _xattr_get_string(tape_get_drive_encryption_state(vol->device), &val, name);
 		} else if (! strcmp(name, "ltfs.driveEncryptionMethod")) {
 			ret = _xattr_get_string(tape_get_drive_encryption_method(vol->device), &val, name);
+		} else if (! strcmp(name, "ltfs.schedulerState")) {
+			ret = iosched_get_state(&val, vol);
+			if (ret < 0)
+				val = NULL;
 		} else if (! strcmp(name, "ltfs.vendor.IBM.referencedBlocks")) {
 			ret = _xattr_get_u64(ltfs_get_valid_block_count_unlocked(vol), &val, name);
 		} else if (! strcmp(name, "ltfs.vendor.IBM.trace")) {
@@ -1017,6 +1065,8 @@ int _xattr_get_virtual(struct dentry *d, char *buf, size_t buf_size, const char
 				val = NULL;
 			else
 				ret = _xattr_get_u64(append_pos, &val, name);
+		} else if (! strcmp(name, "ltfs.vendor.IBM.partitionSwitches")) {
+			ret = _xattr_get_u64(ltfs_get_partition_switches(vol), &val, name);
 		} else if (! strcmp(name, "ltfs.vendor.IBM.cartridgeMountNode")) {
 			ret = asprintf(&val, "localhost");
 			if (ret < 0) {
@@ -1154,6 +1204,7 @@ int _xattr_set_virtual(struct dentry *d, const char *name, const char *value,
 			vol->index->volume_name = new_value;
 		}
 
+		fs_set_xml_dirty(vol->index->root);
 		ltfs_set_index_dirty(false, false, vol->index);
 		ltfs_mutex_unlock(&vol->index->dirty_lock);
 
@@ -1387,6 +1438,7 @@ int _xattr_remove_virtual(struct dentry *d, const char *name, struct ltfs_volume
 		if (vol->index->volume_name) {
 			free(vol->index->volume_name);
 			vol->index->volume_name = NULL;
+			fs_set_xml_dirty(vol->index->root);
 			ltfs_set_index_dirty(false, false, vol->index);
 		}
 /* Since the volume name is removed the mam volume name will be updated to NULL */
@@ -1571,6 +1623,7 @@ int _xattr_set_time(struct dentry *d, struct ltfs_timespec *out, const char *val
 
 	acquirewrite_mrsw(&d->meta_lock);
 	*out = t;
+	fs_set_xml_dirty(d);
 	releasewrite_mrsw(&d->meta_lock);
 
 	ltfs_set_index_dirty(true, false, vol->index);
@@ -77,6 +77,7 @@ int xattr_do_set(struct dentry *d, const char *name, const char *value, size_t s
 int xattr_do_remove(struct dentry *d, const char *name, bool force, struct ltfs_volume *vol);
 const char *_xattr_strip_name(const char *name);
 int xattr_set_mountpoint_length(struct dentry *d, const char* value, size_t size);
+bool xattr_priority_high(struct dentry *d);
 
 #ifdef __cplusplus
 }
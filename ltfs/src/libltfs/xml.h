@@ -245,6 +245,18 @@ struct xml_input_tape {
 int xml_input_tape_read_callback(void *context, char *buffer, int len);
 int xml_input_tape_close_callback(void *context);
 
+/**
+ * This structure is used to feed an XML document held in memory to libxml2 through the
+ * I/O callback method, which (unlike xmlReaderForMemory) is not limited to 2 GB.
+ */
+struct xml_input_mem {
+	const char *buf;            /**< Document to read. */
+	size_t size;                /**< Document size. */
+	size_t pos;                 /**< Offset of the next byte to read. */
+};
+int xml_input_mem_read_callback(void *context, char *buffer, int len);
+int xml_input_mem_close_callback(void *context);
+
 /* Generic tag parsers */
 int xml_scan_text(xmlTextReaderPtr reader, const char **value);
 int xml_next_tag(xmlTextReaderPtr reader, const char *containing_name,
@@ -63,6 +63,11 @@
 #define UID_TAGNAME        "fileuid"
 #define FILEOFFSET_TAGNAME "fileoffset"
 
+/* LTFS index version checks */
+#define IDX_VERSION_SPARSE     MAKE_LTFS_VERSION(2,0,0)
+#define IDX_VERSION_BACKUPTIME MAKE_LTFS_VERSION(2,0,0)
+#define IDX_VERSION_UID        MAKE_LTFS_VERSION(2,0,0)
+
 /* Functions for writing XML files. See xml_writer_libltfs.c */
 xmlBufferPtr xml_make_label(const char *creator, tape_partition_t partition,
 	const struct ltfs_label *label);
@@ -79,4 +84,9 @@ int xml_schema_from_file(const char *filename, struct ltfs_index *idx, struct lt
 int xml_schema_from_tape(uint64_t eod_pos, struct ltfs_volume *vol);
 int xml_extent_symlink_info_from_file(const char *filename, struct dentry *d);
 
+/* Index scanner which bypasses libxml2. See xml_reader_fast.c */
+int xml_schema_from_mem_fast(const char *buf, size_t size, struct ltfs_index *idx,
+	struct ltfs_volume *vol);
+int xml_schema_header_from_mem_fast(const char *buf, size_t size, struct ltfs_index *idx);
+
 #endif /* __xml_libltfs_h */
@@ -575,3 +575,27 @@ int xml_input_tape_close_callback(void *context)
 	free(ctx);
 	return 0;
 }
+
+/**
+ * Read callback for XML parser input from a memory buffer.
+ */
+int xml_input_mem_read_callback(void *context, char *buffer, int len)
+{
+	struct xml_input_mem *ctx = context;
+	size_t nread = ctx->size - ctx->pos;
+
+	if (nread > (size_t) len)
+		nread = len;
+	memcpy(buffer, ctx->buf + ctx->pos, nread);
+	ctx->pos += nread;
+	return nread;
+}
+
+/**
+ * Close callback for XML parser input from a memory buffer. The buffer belongs to the
+ * caller, so there is nothing to free.
+ */
+int xml_input_mem_close_callback(void *context)
+{
+	return 0;
+}
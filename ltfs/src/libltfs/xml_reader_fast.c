@@ -0,0 +1,1697 @@
+/*
+**  %Z% %I% %W% %G% %U%
+**
+**  ZZ_Copyright_BEGIN
+**
+**
+**  Licensed Materials - Property of IBM
+**
+**  IBM Linear Tape File System Single Drive Edition Version 2.2.0.2 for Linux and Mac OS X
+**
+**  Copyright IBM Corp. 2010, 2014
+**
+**  This file is part of the IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X
+**  (formally known as IBM Linear Tape File System)
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is free software;
+**  you can redistribute it and/or modify it under the terms of the GNU Lesser
+**  General Public License as published by the Free Software Foundation,
+**  version 2.1 of the License.
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is distributed in the
+**  hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+**  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**  See the GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public
+**  License along with this library; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+**  or download the license from <http://www.gnu.org/licenses/>.
+**
+**  ZZ_Copyright_END
+**
+*************************************************************************************
+**
+** COMPONENT NAME:  IBM Linear Tape File System
+**
+** FILE NAME:       xml_reader_fast.c
+**
+** DESCRIPTION:     Hand-written scanner for Indexes held in memory. It builds the
+**                  dentry tree in a single forward pass without going through the
+**                  libxml2 reader, and gives up on anything it does not recognize so
+**                  that the caller can parse the same buffer with libxml2 instead.
+**                  The subtrees of top-level directories of large Indexes are built
+**                  on a pool of threads.
+**
+*************************************************************************************
+*/
+
+#include "ltfs.h"
+#include "xml_libltfs.h"
+#include "fs.h"
+#include "base64.h"
+#include "pathname.h"
+#include "index_criteria.h"
+#include "arch/time_internal.h"
+
+/* Shared with the libxml2 parser in xml_reader_libltfs.c */
+int _xml_parse_version(const char *version_str, int *version_int);
+
+/* Indexes smaller than this are parsed on a single thread */
+#define XML_FAST_PARALLEL_MIN (4 * 1024 * 1024)
+
+/* Upper bound on the number of threads building top-level directories */
+#define XML_FAST_MAX_THREADS 32
+
+/**
+ * Scanner state. The input is never modified; decoded text values are copied into a
+ * scratch buffer that is reused for every value.
+ */
+struct xml_fast_reader {
+	const char *pos;       /**< Next unread byte */
+	const char *end;       /**< One past the last byte of the input */
+	const char *name;      /**< Name of the last tag read, not null-terminated */
+	size_t name_len;       /**< Length of name */
+	const char *attrs;     /**< Attribute text of the last start tag */
+	const char *attrs_end; /**< One past the end of attrs */
+	bool end_tag;          /**< Was the last tag an end tag? */
+	bool empty;            /**< Was the last start tag an empty element (<tag/>)? */
+	char *text;            /**< Scratch buffer holding the last decoded text value */
+	size_t text_size;      /**< Allocated size of text */
+	int threads;           /**< Threads for the top-level directories, 1 for none */
+	bool header_only;      /**< Stop at the root directory? */
+};
+
+/**
+ * A top-level directory whose subtree is built by the thread pool.
+ */
+struct xml_fast_job {
+	const char *start;        /**< First byte after the <directory> start tag */
+	const char *end;          /**< One past the matching </directory> end tag */
+	struct name_list *entry;  /**< Name list entry of the new directory */
+};
+
+/**
+ * Work shared by the threads building top-level directories.
+ */
+struct xml_fast_pool {
+	ltfs_mutex_t lock;         /**< Protects next_job, failed and the counters in idx */
+	struct xml_fast_job *jobs; /**< Top-level directories, in Index order */
+	size_t job_count;          /**< Number of jobs */
+	size_t next_job;           /**< Next job to hand out */
+	bool failed;               /**< Did any job fail? */
+	struct dentry *root;       /**< Root directory of the index */
+	struct ltfs_index *idx;    /**< Index being built */
+	struct ltfs_volume *vol;   /**< LTFS volume to which the index belongs. May be NULL. */
+};
+
+/* compare the name of the last tag with a string constant */
+#define fast_tag_is(r, str) \
+	((r)->name_len == sizeof(str) - 1 && ! memcmp((r)->name, (str), sizeof(str) - 1))
+
+/* grab the next tag inside the given tag, breaking out of the loop at its end tag.
+ * Like get_next_tag(), this macro is not wrapped in a do { ... } while (0) loop. */
+#define fast_next_tag(r, parent) \
+	if (_xml_fast_next_tag((r), (parent)) < 0) \
+		return -1; \
+	if ((r)->end_tag) \
+		break
+
+/* record a tag in the "have" bit mask, failing if it was already seen */
+#define fast_check_tag(bit) do { \
+	if (have & (1U << (bit))) \
+		return -1; \
+	have |= 1U << (bit); \
+} while (0)
+
+/* fail unless every tag in the mask has been seen */
+#define fast_check_required_tags(mask) do { \
+	if ((have & (mask)) != (mask)) \
+		return -1; \
+} while (0)
+
+/* read the text of a leaf tag and its end tag, failing if the text is empty */
+#define fast_get_tag_text(r, value) do { \
+	if (_xml_fast_tag_text((r), &(value)) < 0 || ! (value)[0]) \
+		return -1; \
+} while (0)
+
+static inline bool _xml_fast_is_space(char c)
+{
+	/* Carriage returns are left to libxml2, which normalizes them */
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+static inline bool _xml_fast_is_name_char(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+		c == '_' || c == '-' || c == '.' || c == ':';
+}
+
+/**
+ * Scan one attribute of a start tag.
+ * @param p Points to the attribute name on entry, and past the closing quote on success.
+ * @return 0 on success or -1 if the attribute is malformed.
+ */
+static int _xml_fast_scan_attr(const char **p, const char *end, const char **name,
+	size_t *name_len, const char **value, size_t *value_len)
+{
+	const char *s = *p, *v;
+	char quote;
+
+	*name = s;
+	while (s < end && _xml_fast_is_name_char(*s))
+		++s;
+	*name_len = s - *name;
+	if (*name_len == 0)
+		return -1;
+	while (s < end && _xml_fast_is_space(*s))
+		++s;
+	if (s >= end || *s != '=')
+		return -1;
+	++s;
+	while (s < end && _xml_fast_is_space(*s))
+		++s;
+	if (s >= end || (*s != '"' && *s != '\''))
+		return -1;
+	quote = *s++;
+	v = s;
+	while (s < end && *s != quote) {
+		/* Entities and markup characters in attribute values are left to libxml2 */
+		if (*s == '&' || *s == '<' || (unsigned char)*s < 0x20)
+			return -1;
+		++s;
+	}
+	if (s >= end)
+		return -1;
+	*value = v;
+	*value_len = s - v;
+	*p = s + 1;
+	return 0;
+}
+
+/**
+ * Read the next start or end tag. Whitespace before the tag is skipped; any other text,
+ * comments, processing instructions and CDATA sections make the scanner give up.
+ * @param r Scanner state.
+ * @param parent Name of the containing tag. An end tag is only accepted if it closes it.
+ * @return 0 on success or -1 if the scanner cannot handle the input.
+ */
+static int _xml_fast_next_tag(struct xml_fast_reader *r, const char *parent)
+{
+	const char *p = r->pos, *end = r->end, *attr_name, *attr_value;
+	size_t attr_name_len, attr_value_len;
+
+	while (p < end && _xml_fast_is_space(*p))
+		++p;
+	if (p >= end || *p != '<')
+		return -1;
+	++p;
+
+	r->end_tag = (p < end && *p == '/');
+	if (r->end_tag)
+		++p;
+
+	/* Tag names are plain ASCII in the LTFS schema; "<!" and "<?" are not handled here */
+	if (p >= end || ! ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || *p == '_'))
+		return -1;
+	r->name = p;
+	while (p < end && _xml_fast_is_name_char(*p))
+		++p;
+	r->name_len = p - r->name;
+
+	if (r->end_tag) {
+		if (strlen(parent) != r->name_len || memcmp(r->name, parent, r->name_len))
+			return -1;
+		while (p < end && _xml_fast_is_space(*p))
+			++p;
+		if (p >= end || *p != '>')
+			return -1;
+		r->pos = p + 1;
+		return 0;
+	}
+
+	r->attrs = p;
+	while (true) {
+		const char *ws = p;
+		while (p < end && _xml_fast_is_space(*p))
+			++p;
+		if (p >= end)
+			return -1;
+		if (*p == '>' || *p == '/')
+			break;
+		/* attributes must be separated from the tag name and from each other */
+		if (p == ws)
+			return -1;
+		if (_xml_fast_scan_attr(&p, end, &attr_name, &attr_name_len,
+			&attr_value, &attr_value_len) < 0)
+			return -1;
+	}
+	r->attrs_end = p;
+
+	r->empty = (*p == '/');
+	if (r->empty) {
+		++p;
+		if (p >= end || *p != '>')
+			return -1;
+	}
+	r->pos = p + 1;
+	return 0;
+}
+
+/**
+ * Look up an attribute of the last start tag.
+ * @return 0 and a pointer into the input on success, or -1 if the attribute is not present.
+ */
+static int _xml_fast_get_attr(struct xml_fast_reader *r, const char *name,
+	const char **value, size_t *value_len)
+{
+	const char *p = r->attrs, *attr_name;
+	size_t attr_name_len;
+
+	while (p < r->attrs_end) {
+		while (p < r->attrs_end && _xml_fast_is_space(*p))
+			++p;
+		if (p >= r->attrs_end)
+			break;
+		if (_xml_fast_scan_attr(&p, r->attrs_end, &attr_name, &attr_name_len, value, value_len) < 0)
+			return -1;
+		if (attr_name_len == strlen(name) && ! memcmp(attr_name, name, attr_name_len))
+			return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * Check the length of a well-formed UTF-8 sequence which is also a valid XML character.
+ * @return Length of the sequence, or 0 if it is not acceptable.
+ */
+static int _xml_fast_utf8_len(const unsigned char *p, const unsigned char *end)
+{
+	if (p[0] >= 0xC2 && p[0] <= 0xDF) {
+		if (end - p < 2 || (p[1] & 0xC0) != 0x80)
+			return 0;
+		return 2;
+	} else if (p[0] >= 0xE0 && p[0] <= 0xEF) {
+		if (end - p < 3 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80)
+			return 0;
+		if ((p[0] == 0xE0 && p[1] < 0xA0) || (p[0] == 0xED && p[1] > 0x9F))
+			return 0; /* overlong form or surrogate */
+		if (p[0] == 0xEF && p[1] == 0xBF && p[2] >= 0xBE)
+			return 0; /* U+FFFE and U+FFFF */
+		return 3;
+	} else if (p[0] >= 0xF0 && p[0] <= 0xF4) {
+		if (end - p < 4 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 ||
+			(p[3] & 0xC0) != 0x80)
+			return 0;
+		if ((p[0] == 0xF0 && p[1] < 0x90) || (p[0] == 0xF4 && p[1] > 0x8F))
+			return 0; /* overlong form or beyond U+10FFFF */
+		return 4;
+	}
+	return 0;
+}
+
+/**
+ * Decode a character reference (the part between "&#" and ";") into UTF-8.
+ * @return Number of bytes written to out, or 0 if the reference is not acceptable.
+ */
+static int _xml_fast_char_ref(const char *ref, size_t len, char *out)
+{
+	unsigned long c = 0;
+	size_t i = 0;
+	int base = 10, digit;
+
+	if (len > 0 && ref[0] == 'x') {
+		base = 16;
+		i = 1;
+	}
+	if (i == len || len - i > 8)
+		return 0;
+	for (; i < len; ++i) {
+		if (ref[i] >= '0' && ref[i] <= '9')
+			digit = ref[i] - '0';
+		else if (base == 16 && ref[i] >= 'a' && ref[i] <= 'f')
+			digit = ref[i] - 'a' + 10;
+		else if (base == 16 && ref[i] >= 'A' && ref[i] <= 'F')
+			digit = ref[i] - 'A' + 10;
+		else
+			return 0;
+		c = c * base + digit;
+	}
+
+	if (c == 0x9 || c == 0xA || c == 0xD || (c >= 0x20 && c < 0x80)) {
+		out[0] = c;
+		return 1;
+	} else if (c >= 0x80 && c < 0x800) {
+		out[0] = 0xC0 | (c >> 6);
+		out[1] = 0x80 | (c & 0x3F);
+		return 2;
+	} else if ((c >= 0x800 && c < 0xD800) || (c >= 0xE000 && c < 0xFFFE)) {
+		out[0] = 0xE0 | (c >> 12);
+		out[1] = 0x80 | ((c >> 6) & 0x3F);
+		out[2] = 0x80 | (c & 0x3F);
+		return 3;
+	} else if (c >= 0x10000 && c <= 0x10FFFF) {
+		out[0] = 0xF0 | (c >> 18);
+		out[1] = 0x80 | ((c >> 12) & 0x3F);
+		out[2] = 0x80 | ((c >> 6) & 0x3F);
+		out[3] = 0x80 | (c & 0x3F);
+		return 4;
+	}
+	return 0;
+}
+
+/**
+ * Read the text of a leaf tag and consume its end tag. The text is decoded into the
+ * scratch buffer, which stays valid until the next call.
+ * @param r Scanner state, positioned just after the start tag.
+ * @param value On success, points to the null-terminated text. Empty elements yield "".
+ * @return 0 on success or -1 if the scanner cannot handle the input.
+ */
+static int _xml_fast_tag_text(struct xml_fast_reader *r, const char **value)
+{
+	const char *start = r->pos, *p = r->pos, *semi, *tag = r->name;
+	size_t len, tag_len = r->name_len;
+	char *out, *tmp;
+	int n;
+
+	if (r->empty) {
+		*value = "";
+		return 0;
+	}
+
+	while (p < r->end && *p != '<')
+		++p;
+	if (p >= r->end)
+		return -1;
+
+	/* Decoded text is never longer than its source */
+	len = p - start;
+	if (len + 1 > r->text_size) {
+		tmp = realloc(r->text, len + 1);
+		if (! tmp)
+			return -1;
+		r->text = tmp;
+		r->text_size = len + 1;
+	}
+
+	out = r->text;
+	p = start;
+	while (*p != '<') {
+		unsigned char c = *p;
+		if (c >= 0x20 && c < 0x80 && c != '&') {
+			*out++ = *p++;
+		} else if (c == '\t' || c == '\n') {
+			*out++ = *p++;
+		} else if (c == '&') {
+			semi = memchr(p, ';', start + len - p);
+			if (! semi)
+				return -1;
+			++p;
+			if (semi - p == 2 && ! memcmp(p, "lt", 2))
+				*out++ = '<';
+			else if (semi - p == 2 && ! memcmp(p, "gt", 2))
+				*out++ = '>';
+			else if (semi - p == 3 && ! memcmp(p, "amp", 3))
+				*out++ = '&';
+			else if (semi - p == 4 && ! memcmp(p, "quot", 4))
+				*out++ = '"';
+			else if (semi - p == 4 && ! memcmp(p, "apos", 4))
+				*out++ = '\'';
+			else if (semi - p > 1 && *p == '#') {
+				/* a character reference never takes more bytes than its "&#...;" form */
+				n = _xml_fast_char_ref(p + 1, semi - p - 1, out);
+				if (n == 0)
+					return -1;
+				out += n;
+			} else
+				return -1;
+			p = semi + 1;
+		} else if (c >= 0x80) {
+			n = _xml_fast_utf8_len((const unsigned char *)p, (const unsigned char *)start + len);
+			if (n == 0)
+				return -1;
+			memcpy(out, p, n);
+			out += n;
+			p += n;
+		} else
+			return -1;
+	}
+	*out = '\0';
+
+	/* The text must be followed by the end tag of the same element */
+	++p;
+	if (p >= r->end || *p != '/')
+		return -1;
+	++p;
+	if (r->end - p < (ptrdiff_t) tag_len || memcmp(p, tag, tag_len))
+		return -1;
+	p += tag_len;
+	while (p < r->end && _xml_fast_is_space(*p))
+		++p;
+	if (p >= r->end || *p != '>')
+		return -1;
+
+	r->pos = p + 1;
+	*value = r->text;
+	return 0;
+}
+
+/**
+ * Parse a base-10 unsigned integer. Unlike xml_parse_ull(), signs, whitespace and values
+ * near the top of the range are rejected so that libxml2 sees them instead.
+ */
+static int _xml_fast_parse_ull(unsigned long long *out_val, const char *val)
+{
+	unsigned long long v = 0;
+
+	if (! *val)
+		return -1;
+	for (; *val; ++val) {
+		if (*val < '0' || *val > '9' || v > (ULLONG_MAX - 9) / 10)
+			return -1;
+		v = v * 10 + (*val - '0');
+	}
+
+	*out_val = v;
+	return 0;
+}
+
+/**
+ * Parse a time in the exact format produced by xml_format_time(). Other spellings and
+ * out-of-range values are left to xml_parse_time() on the libxml2 path.
+ */
+static int _xml_fast_parse_time(const char *val, struct ltfs_timespec *rawtime)
+{
+	static const char layout[] = "0000-00-00T00:00:00.000000000Z";
+	int digits[sizeof(layout) - 1];
+	struct tm tm;
+	size_t i;
+	long nsec = 0;
+
+	for (i = 0; i < sizeof(layout) - 1; ++i) {
+		if (layout[i] == '0') {
+			if (val[i] < '0' || val[i] > '9')
+				return -1;
+			digits[i] = val[i] - '0';
+		} else if (val[i] != layout[i])
+			return -1;
+	}
+	if (val[i] != '\0')
+		return -1;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = digits[0] * 1000 + digits[1] * 100 + digits[2] * 10 + digits[3] - 1900;
+	tm.tm_mon = digits[5] * 10 + digits[6] - 1;
+	tm.tm_mday = digits[8] * 10 + digits[9];
+	tm.tm_hour = digits[11] * 10 + digits[12];
+	tm.tm_min = digits[14] * 10 + digits[15];
+	tm.tm_sec = digits[17] * 10 + digits[18];
+	for (i = 20; i < 29; ++i)
+		nsec = nsec * 10 + digits[i];
+
+	rawtime->tv_sec = ltfs_timegm(&tm);
+	rawtime->tv_nsec = nsec;
+	if (normalize_ltfs_time(rawtime) != 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Normalize and validate a file, directory or xattr name. Plain ASCII names are already in
+ * NFC, so they skip the ICU round trip of xml_parse_filename().
+ */
+static int _xml_fast_parse_filename(char **out_val, const char *value)
+{
+	const char *p;
+
+	for (p = value; *p; ++p) {
+		if ((unsigned char)*p >= 0x80 || *p == ':' || *p == '/')
+			break;
+	}
+
+	if (! *p && p - value <= LTFS_FILENAME_MAX) {
+		*out_val = strdup(value);
+		return *out_val ? 0 : -1;
+	}
+
+	if (pathname_normalize(value, out_val) < 0)
+		return -1;
+	if (pathname_validate_file(*out_val) < 0) {
+		free(*out_val);
+		*out_val = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse a volume UUID, converting it to lower case. See xml_parse_uuid().
+ */
+static int _xml_fast_parse_uuid(char *out_val, const char *val)
+{
+	int i;
+
+	for (i = 0; i < 36; ++i) {
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (val[i] != '-')
+				return -1;
+			out_val[i] = '-';
+		} else if ((val[i] >= '0' && val[i] <= '9') || (val[i] >= 'a' && val[i] <= 'f'))
+			out_val[i] = val[i];
+		else if (val[i] >= 'A' && val[i] <= 'F')
+			out_val[i] = val[i] + 32;
+		else
+			return -1;
+	}
+	if (val[i] != '\0')
+		return -1;
+	out_val[i] = '\0';
+
+	return 0;
+}
+
+static int _xml_fast_parse_bool(bool *out_val, const char *value)
+{
+	if (! strcmp(value, "true") || ! strcmp(value, "1"))
+		*out_val = true;
+	else if (! strcmp(value, "false") || ! strcmp(value, "0"))
+		*out_val = false;
+	else
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Scan a tape offset (a partition tag and a startblock tag).
+ */
+static int _xml_fast_scan_tapepos(struct xml_fast_reader *r, const char *tag,
+	struct tape_offset *pos)
+{
+	unsigned long long value_int;
+	const char *value;
+	unsigned int have = 0;
+
+	while (true) {
+		fast_next_tag(r, tag);
+
+		if (fast_tag_is(r, "partition")) {
+			fast_check_tag(0);
+			fast_get_tag_text(r, value);
+			if (value[0] < 'a' || value[0] > 'z' || value[1])
+				return -1;
+			pos->partition = value[0];
+
+		} else if (fast_tag_is(r, "startblock")) {
+			fast_check_tag(1);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_ull(&value_int, value) < 0)
+				return -1;
+			pos->block = value_int;
+
+		} else
+			return -1;
+	}
+
+	fast_check_required_tags(0x3);
+	return 0;
+}
+
+/**
+ * Parse index partition criteria.
+ */
+static int _xml_fast_parse_ip_criteria(struct xml_fast_reader *r, struct ltfs_index *idx)
+{
+	unsigned long long value_int;
+	const char *value;
+	char *glob_norm, **patterns;
+	int num_patterns = 0;
+	unsigned int have = 0;
+
+	index_criteria_free(&idx->original_criteria);
+	index_criteria_free(&idx->index_criteria);
+	idx->original_criteria.have_criteria = true;
+
+	while (true) {
+		fast_next_tag(r, "indexpartitioncriteria");
+
+		if (fast_tag_is(r, "size")) {
+			fast_check_tag(0);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_ull(&value_int, value) < 0)
+				return -1;
+			idx->original_criteria.max_filesize_criteria = value_int;
+
+		} else if (fast_tag_is(r, "name")) {
+			fast_get_tag_text(r, value);
+			if (pathname_validate_file(value) < 0)
+				return -1;
+
+			patterns = realloc(idx->original_criteria.glob_patterns,
+				(num_patterns + 2) * sizeof(char *));
+			if (! patterns)
+				return -1;
+			patterns[num_patterns] = NULL;
+			patterns[num_patterns + 1] = NULL;
+			idx->original_criteria.glob_patterns = patterns;
+
+			if (pathname_normalize(value, &glob_norm) < 0)
+				return -1;
+			patterns[num_patterns++] = glob_norm;
+
+		} else
+			return -1;
+	}
+
+	fast_check_required_tags(0x1);
+
+	if (index_criteria_dup_rules(&idx->index_criteria, &idx->original_criteria) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Parse a data placement policy.
+ */
+static int _xml_fast_parse_policy(struct xml_fast_reader *r, struct ltfs_index *idx)
+{
+	unsigned int have = 0;
+
+	while (true) {
+		fast_next_tag(r, "dataplacementpolicy");
+
+		if (fast_tag_is(r, "indexpartitioncriteria") && ! r->empty) {
+			fast_check_tag(0);
+			if (_xml_fast_parse_ip_criteria(r, idx) < 0)
+				return -1;
+		} else
+			return -1;
+	}
+
+	fast_check_required_tags(0x1);
+	return 0;
+}
+
+/**
+ * Parse a single extended attribute, appending it to the xattr list of the given dentry.
+ */
+static int _xml_fast_parse_one_xattr(struct xml_fast_reader *r, struct dentry *d)
+{
+	struct xattr_info *xattr;
+	const char *value, *type;
+	size_t type_len;
+	bool base64 = false;
+	unsigned int have = 0;
+	int ret = -1;
+
+	xattr = calloc(1, sizeof(struct xattr_info));
+	if (! xattr)
+		return -1;
+
+	while (true) {
+		if (_xml_fast_next_tag(r, "xattr") < 0)
+			goto out;
+		if (r->end_tag)
+			break;
+
+		if (fast_tag_is(r, "key") && ! (have & 0x1)) {
+			have |= 0x1;
+			if (_xml_fast_tag_text(r, &value) < 0 || ! value[0])
+				goto out;
+			if (_xml_fast_parse_filename(&xattr->key, value) < 0)
+				goto out;
+
+		} else if (fast_tag_is(r, "value") && ! (have & 0x2)) {
+			have |= 0x2;
+			if (_xml_fast_get_attr(r, "type", &type, &type_len) == 0) {
+				if (type_len == 6 && ! memcmp(type, "base64", 6))
+					base64 = true;
+				else if (type_len != 4 || memcmp(type, "text", 4))
+					goto out;
+			}
+			if (r->empty)
+				continue;
+
+			if (_xml_fast_tag_text(r, &value) < 0 || (base64 && ! value[0]))
+				goto out;
+			if (! base64) {
+				xattr->value = strdup(value);
+				if (! xattr->value)
+					goto out;
+				xattr->size = strlen(value);
+			} else {
+				xattr->size = base64_decode((const unsigned char *)value, strlen(value),
+					(unsigned char **)(&xattr->value));
+				if (xattr->size == 0)
+					goto out;
+			}
+
+		} else
+			goto out;
+	}
+
+	if (have != 0x3)
+		goto out;
+
+	TAILQ_INSERT_TAIL(&d->xattrlist, xattr, list);
+	ret = 0;
+
+out:
+	if (ret < 0) {
+		if (xattr->key)
+			free(xattr->key);
+		if (xattr->value)
+			free(xattr->value);
+		free(xattr);
+	}
+	return ret;
+}
+
+/**
+ * Parse extended attributes for a file or directory.
+ */
+static int _xml_fast_parse_xattrs(struct xml_fast_reader *r, struct dentry *d)
+{
+	while (true) {
+		fast_next_tag(r, "extendedattributes");
+
+		if (fast_tag_is(r, "xattr") && ! r->empty) {
+			if (_xml_fast_parse_one_xattr(r, d) < 0)
+				return -1;
+		} else
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse an extent, adding it to the extent list of the given dentry in file offset order.
+ */
+static int _xml_fast_parse_one_extent(struct xml_fast_reader *r, int idx_version,
+	struct dentry *d)
+{
+	unsigned long long value_int;
+	struct extent_info *xt, *xt_last;
+	const char *value;
+	unsigned int have = 0;
+	bool xt_used = false;
+	int field;
+
+	xt = calloc(1, sizeof(struct extent_info));
+	if (! xt)
+		return -1;
+
+	while (true) {
+		if (_xml_fast_next_tag(r, "extent") < 0)
+			goto out_free;
+		if (r->end_tag)
+			break;
+
+		if (fast_tag_is(r, "partition") && ! (have & 0x1)) {
+			have |= 0x1;
+			if (_xml_fast_tag_text(r, &value) < 0 || value[0] < 'a' || value[0] > 'z' || value[1])
+				goto out_free;
+			xt->start.partition = value[0];
+			continue;
+		}
+
+		if (fast_tag_is(r, "startblock"))
+			field = 1;
+		else if (fast_tag_is(r, "byteoffset"))
+			field = 2;
+		else if (fast_tag_is(r, "bytecount"))
+			field = 3;
+		else if (idx_version >= IDX_VERSION_SPARSE && fast_tag_is(r, FILEOFFSET_TAGNAME))
+			field = 4;
+		else
+			goto out_free;
+		if (have & (1U << field))
+			goto out_free;
+		have |= 1U << field;
+
+		if (_xml_fast_tag_text(r, &value) < 0 || _xml_fast_parse_ull(&value_int, value) < 0)
+			goto out_free;
+		if (field == 1)
+			xt->start.block = value_int;
+		else if (field == 2)
+			xt->byteoffset = value_int;
+		else if (field == 3)
+			xt->bytecount = value_int;
+		else
+			xt->fileoffset = value_int;
+	}
+
+	/* For older index versions, set fileoffset at the end of the previous extent */
+	if (idx_version < IDX_VERSION_SPARSE) {
+		have |= 0x10;
+		if (! TAILQ_EMPTY(&d->extentlist)) {
+			xt_last = TAILQ_LAST(&d->extentlist, extent_struct);
+			xt->fileoffset = xt_last->fileoffset + xt_last->bytecount;
+		}
+	}
+
+	if (have != 0x1F)
+		goto out_free;
+
+	/* Extents are normally listed in order, so the common case is an append */
+	TAILQ_FOREACH_REVERSE(xt_last, &d->extentlist, extent_struct, list) {
+		if (xt_last->fileoffset + xt_last->bytecount <= xt->fileoffset) {
+			TAILQ_INSERT_AFTER(&d->extentlist, xt_last, xt, list);
+			xt_used = true;
+			break;
+		} else if (xt->fileoffset + xt->bytecount > xt_last->fileoffset)
+			goto out_free; /* overlap, reported by the libxml2 path */
+	}
+	if (! xt_used)
+		TAILQ_INSERT_HEAD(&d->extentlist, xt, list);
+
+	d->realsize += xt->bytecount;
+
+	if (d->vol) {
+		d->used_blocks += ((xt->byteoffset + xt->bytecount) / d->vol->label->blocksize);
+		if ((xt->byteoffset + xt->bytecount) % d->vol->label->blocksize)
+			d->used_blocks++;
+	}
+
+	return 0;
+
+out_free:
+	free(xt);
+	return -1;
+}
+
+/**
+ * Parse a file's extent list.
+ */
+static int _xml_fast_parse_extents(struct xml_fast_reader *r, int idx_version, struct dentry *d)
+{
+	while (true) {
+		fast_next_tag(r, "extentinfo");
+
+		if (fast_tag_is(r, "extent") && ! r->empty) {
+			if (_xml_fast_parse_one_extent(r, idx_version, d) < 0)
+				return -1;
+		} else
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse one of the four dentry time stamps, or the backup time.
+ * @return 0 on success, 1 if the tag is not a time stamp, or -1 on error.
+ */
+static int _xml_fast_parse_dentry_time(struct xml_fast_reader *r, struct dentry *d,
+	int idx_version, unsigned int *have, unsigned int first_bit)
+{
+	struct ltfs_timespec *t;
+	const char *value;
+	unsigned int bit;
+
+	if (fast_tag_is(r, "modifytime")) {
+		t = &d->modify_time;
+		bit = first_bit;
+	} else if (fast_tag_is(r, "creationtime")) {
+		t = &d->creation_time;
+		bit = first_bit + 1;
+	} else if (fast_tag_is(r, "accesstime")) {
+		t = &d->access_time;
+		bit = first_bit + 2;
+	} else if (fast_tag_is(r, "changetime")) {
+		t = &d->change_time;
+		bit = first_bit + 3;
+	} else if (idx_version >= IDX_VERSION_BACKUPTIME && fast_tag_is(r, BACKUPTIME_TAGNAME)) {
+		t = &d->backup_time;
+		bit = first_bit + 4;
+	} else
+		return 1;
+
+	if (*have & (1U << bit))
+		return -1;
+	*have |= 1U << bit;
+
+	fast_get_tag_text(r, value);
+	return _xml_fast_parse_time(value, t);
+}
+
+/**
+ * Parse a file into the given directory. The new dentry is stored in entry->d as soon as
+ * it is allocated, so that the caller can dispose of it on failure.
+ */
+static int _xml_fast_parse_file(struct xml_fast_reader *r, struct ltfs_index *idx,
+	struct dentry *dir, struct name_list *entry)
+{
+	unsigned long long value_int;
+	struct dentry *file;
+	struct extent_info *xt_last;
+	const char *value;
+	unsigned int have = 0;
+	int ret;
+
+	/* name, length, readonly, 4 time stamps, uid and backup time are required */
+	const unsigned int required = 0x1FF;
+
+	file = fs_allocate_dentry(dir, NULL, NULL, false, false, false, idx);
+	if (! file)
+		return -LTFS_NO_MEMORY;
+	entry->d = file;
+
+	while (true) {
+		fast_next_tag(r, "file");
+
+		if (fast_tag_is(r, "name")) {
+			fast_check_tag(0);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_filename(&file->name, value) < 0)
+				return -1;
+			entry->name = file->name;
+
+		} else if (fast_tag_is(r, "length")) {
+			fast_check_tag(1);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_ull(&value_int, value) < 0)
+				return -1;
+			file->size = value_int;
+
+		} else if (fast_tag_is(r, "readonly")) {
+			fast_check_tag(2);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_bool(&file->readonly, value) < 0)
+				return -1;
+
+		} else if ((ret = _xml_fast_parse_dentry_time(r, file, idx->version, &have, 3)) <= 0) {
+			if (ret < 0)
+				return -1;
+
+		} else if (fast_tag_is(r, "extendedattributes")) {
+			fast_check_tag(9);
+			if (! r->empty && _xml_fast_parse_xattrs(r, file) < 0)
+				return -1;
+
+		} else if (fast_tag_is(r, "extentinfo")) {
+			fast_check_tag(10);
+			if (! r->empty && _xml_fast_parse_extents(r, idx->version, file) < 0)
+				return -1;
+
+		} else if (fast_tag_is(r, "symlink")) {
+			fast_check_tag(11);
+			fast_get_tag_text(r, value);
+			file->target = strdup(value);
+			if (! file->target)
+				return -1;
+			file->isslink = true;
+
+		} else if (idx->version >= IDX_VERSION_UID && fast_tag_is(r, UID_TAGNAME)) {
+			fast_check_tag(8);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_ull(&value_int, value) < 0)
+				return -1;
+			file->uid = value_int;
+			if (file->uid > idx->uid_number)
+				idx->uid_number = file->uid;
+			entry->uid = file->uid;
+
+		} else
+			return -1;
+	}
+
+	/* For old index versions, allocate a UID */
+	if (idx->version < IDX_VERSION_UID) {
+		have |= 1U << 8;
+		file->uid = fs_allocate_uid(idx);
+		if (file->uid > idx->uid_number)
+			idx->uid_number = file->uid;
+		entry->uid = file->uid;
+	}
+
+	/* For old index versions, set backup time equal to creation time */
+	if (idx->version < IDX_VERSION_BACKUPTIME) {
+		have |= 1U << 7;
+		file->backup_time = file->creation_time;
+	}
+
+	fast_check_required_tags(required);
+
+	/* The file size must cover the extent list, UID 0 is reserved, and a dentry cannot be
+	 * both a symlink and a regular file. Leave the error reporting to libxml2. */
+	if (! TAILQ_EMPTY(&file->extentlist)) {
+		xt_last = TAILQ_LAST(&file->extentlist, extent_struct);
+		if (xt_last->fileoffset + xt_last->bytecount > file->size)
+			return -1;
+	}
+	if (file->uid == 0)
+		return -1;
+	if (file->isslink && (have & (1U << 10)))
+		return -1;
+
+	return 0;
+}
+
+static int _xml_fast_parse_dirtree(struct xml_fast_reader *r, struct dentry *parent,
+	struct ltfs_index *idx, struct ltfs_volume *vol, struct name_list *entry);
+
+/**
+ * Dispose of dentries which were allocated for a directory but never linked into it.
+ */
+static void _xml_fast_free_name_list(struct name_list *list)
+{
+	struct name_list *entry, *tmp;
+
+	HASH_ITER(hh, list, entry, tmp) {
+		HASH_DEL(list, entry);
+		entry->d->parent = NULL;
+		fs_release_dentry(entry->d);
+		free(entry);
+	}
+}
+
+/**
+ * Parse the contents of a directory, then link the new dentries into it.
+ */
+static int _xml_fast_parse_dir_contents(struct xml_fast_reader *r, struct dentry *dir,
+	struct ltfs_index *idx)
+{
+	struct name_list *list = NULL, *entry;
+	int ret;
+
+	while (true) {
+		if (_xml_fast_next_tag(r, "contents") < 0)
+			goto out_free;
+		if (r->end_tag)
+			break;
+
+		if (r->empty || ! (fast_tag_is(r, "file") || fast_tag_is(r, "directory")))
+			goto out_free;
+
+		entry = calloc(1, sizeof(struct name_list));
+		if (! entry)
+			goto out_free;
+
+		if (r->name[0] == 'f')
+			ret = _xml_fast_parse_file(r, idx, dir, entry);
+		else
+			ret = _xml_fast_parse_dirtree(r, dir, idx, dir->vol, entry);
+		if (ret < 0) {
+			if (entry->d) {
+				entry->d->parent = NULL;
+				fs_release_dentry(entry->d);
+			}
+			free(entry);
+			goto out_free;
+		}
+
+		errno = 0;
+		HASH_ADD_KEYPTR(hh, list, entry->name, strlen(entry->name), entry);
+		if (errno == ENOMEM) {
+			entry->d->parent = NULL;
+			fs_release_dentry(entry->d);
+			free(entry);
+			goto out_free;
+		}
+	}
+
+	if (fs_update_platform_safe_names(dir, idx, list) != 0)
+		return -1;
+
+	return 0;
+
+out_free:
+	_xml_fast_free_name_list(list);
+	return -1;
+}
+
+/**
+ * Find the end of the directory whose start tag was just read, without parsing it. Only
+ * <directory> and </directory> tags are looked at, which is enough because text in the
+ * Index cannot contain '<'.
+ * @return 0 with the reader positioned after the matching end tag, or -1 on failure.
+ */
+static int _xml_fast_skip_directory(struct xml_fast_reader *r)
+{
+	static const char tag[] = "directory";
+	const size_t tag_len = sizeof(tag) - 1;
+	const char *p = r->pos;
+	size_t depth = 1;
+
+	if (r->empty || r->attrs != r->attrs_end)
+		return -1;
+
+	while (depth > 0) {
+		p = memchr(p, '<', r->end - p);
+		if (! p)
+			return -1;
+		++p;
+		if (p < r->end && (*p == '!' || *p == '?'))
+			return -1;
+
+		if (p < r->end && *p == '/') {
+			++p;
+			if ((size_t) (r->end - p) <= tag_len || memcmp(p, tag, tag_len))
+				continue;
+			p += tag_len;
+			while (p < r->end && _xml_fast_is_space(*p))
+				++p;
+			if (p >= r->end)
+				return -1;
+			if (*p == '>')
+				--depth;
+			else if (! _xml_fast_is_name_char(*p))
+				return -1;
+		} else {
+			if ((size_t) (r->end - p) <= tag_len || memcmp(p, tag, tag_len))
+				continue;
+			p += tag_len;
+			if (*p == '>')
+				++depth;
+			else if (! _xml_fast_is_name_char(*p))
+				return -1;
+		}
+	}
+
+	r->pos = p + 1;
+	return 0;
+}
+
+/**
+ * Build top-level directories until the pool runs out of them. Each thread counts files,
+ * valid blocks and UIDs in a private index, which is merged into the real one at the end.
+ */
+static void _xml_fast_run_jobs(struct xml_fast_pool *pool)
+{
+	struct xml_fast_reader r;
+	struct xml_fast_job *job;
+	struct ltfs_index counters;
+	int ret;
+
+	memset(&r, 0, sizeof(r));
+	r.threads = 1;
+
+	memset(&counters, 0, sizeof(counters));
+	counters.version = pool->idx->version;
+	counters.uid_number = 1;
+	if (ltfs_mutex_init(&counters.dirty_lock)) {
+		ltfs_mutex_lock(&pool->lock);
+		pool->failed = true;
+		ltfs_mutex_unlock(&pool->lock);
+		return;
+	}
+
+	while (true) {
+		ltfs_mutex_lock(&pool->lock);
+		if (pool->failed || pool->next_job == pool->job_count) {
+			ltfs_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = &pool->jobs[pool->next_job++];
+		ltfs_mutex_unlock(&pool->lock);
+
+		r.pos = job->start;
+		r.end = job->end;
+		ret = _xml_fast_parse_dirtree(&r, pool->root, &counters, pool->vol, job->entry);
+		if (ret < 0 || r.pos != job->end) {
+			ltfs_mutex_lock(&pool->lock);
+			pool->failed = true;
+			ltfs_mutex_unlock(&pool->lock);
+		}
+	}
+
+	ltfs_mutex_lock(&pool->lock);
+	pool->idx->file_count += counters.file_count;
+	pool->idx->valid_blocks += counters.valid_blocks;
+	if (counters.uid_number > pool->idx->uid_number)
+		pool->idx->uid_number = counters.uid_number;
+	ltfs_mutex_unlock(&pool->lock);
+
+	ltfs_mutex_destroy(&counters.dirty_lock);
+	if (r.text)
+		free(r.text);
+}
+
+static ltfs_thread_return _xml_fast_thread(void *data)
+{
+	_xml_fast_run_jobs((struct xml_fast_pool *) data);
+	ltfs_thread_exit();
+	return LTFS_THREAD_RC_NULL;
+}
+
+/**
+ * Parse the contents of the root directory. Files are parsed right away, while top-level
+ * directories are only delimited here and then built on up to r->threads threads.
+ * The new dentries are linked into the root in Index order, as on the sequential path.
+ */
+static int _xml_fast_parse_root_contents(struct xml_fast_reader *r, struct dentry *dir,
+	struct ltfs_index *idx, struct ltfs_volume *vol)
+{
+	struct xml_fast_pool pool;
+	struct name_list **entries = NULL, *list = NULL, *entry;
+	size_t entry_count = 0, entry_alloc = 0, job_alloc = 0, i;
+	ltfs_thread_t threads[XML_FAST_MAX_THREADS];
+	int nthreads = 0, ret = -1;
+	void *tmp;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.root = dir;
+	pool.idx = idx;
+	pool.vol = vol;
+	if (ltfs_mutex_init(&pool.lock))
+		return -1;
+
+	while (true) {
+		if (_xml_fast_next_tag(r, "contents") < 0)
+			goto out;
+		if (r->end_tag)
+			break;
+
+		if (r->empty || ! (fast_tag_is(r, "file") || fast_tag_is(r, "directory")))
+			goto out;
+
+		if (entry_count == entry_alloc) {
+			entry_alloc = entry_alloc ? entry_alloc * 2 : 64;
+			tmp = realloc(entries, entry_alloc * sizeof(*entries));
+			if (! tmp)
+				goto out;
+			entries = tmp;
+		}
+		entry = calloc(1, sizeof(struct name_list));
+		if (! entry)
+			goto out;
+		entries[entry_count++] = entry;
+
+		if (r->name[0] == 'f') {
+			if (_xml_fast_parse_file(r, idx, dir, entry) < 0)
+				goto out;
+			continue;
+		}
+
+		if (pool.job_count == job_alloc) {
+			job_alloc = job_alloc ? job_alloc * 2 : 64;
+			tmp = realloc(pool.jobs, job_alloc * sizeof(*pool.jobs));
+			if (! tmp)
+				goto out;
+			pool.jobs = tmp;
+		}
+		pool.jobs[pool.job_count].start = r->pos;
+		if (_xml_fast_skip_directory(r) < 0)
+			goto out;
+		pool.jobs[pool.job_count].end = r->pos;
+		pool.jobs[pool.job_count].entry = entry;
+		++pool.job_count;
+	}
+
+	/* This thread takes part in the work, so start one thread less than requested */
+	for (i = 1; i < (size_t) r->threads && i < pool.job_count; ++i) {
+		if (ltfs_thread_create(&threads[nthreads], _xml_fast_thread, &pool))
+			break;
+		++nthreads;
+	}
+	ltfsmsg(LTFS_DEBUG, "17312D", (unsigned long) pool.job_count, nthreads + 1);
+
+	_xml_fast_run_jobs(&pool);
+	for (i = 0; i < (size_t) nthreads; ++i)
+		ltfs_thread_join(threads[i]);
+	if (pool.failed)
+		goto out;
+
+	for (i = 0; i < entry_count; ++i) {
+		entry = entries[i];
+		errno = 0;
+		HASH_ADD_KEYPTR(hh, list, entry->name, strlen(entry->name), entry);
+		if (errno == ENOMEM)
+			goto out;
+	}
+
+	/* On success the list is consumed here; on failure it is cleaned up with the entries */
+	entry_count = 0;
+	ret = fs_update_platform_safe_names(dir, idx, list) ? -1 : 0;
+	list = NULL;
+
+out:
+	HASH_CLEAR(hh, list);
+	for (i = 0; i < entry_count; ++i) {
+		if (entries[i]->d) {
+			entries[i]->d->parent = NULL;
+			fs_release_dentry(entries[i]->d);
+		}
+		free(entries[i]);
+	}
+	if (entries)
+		free(entries);
+	if (pool.jobs)
+		free(pool.jobs);
+	ltfs_mutex_destroy(&pool.lock);
+	return ret;
+}
+
+/**
+ * Parse a directory tree into the given index.
+ * @param parent Directory where the new subdirectory should be created, or NULL to populate
+ *               the root dentry.
+ * @param entry Name list entry of the new subdirectory. Unused for the root.
+ */
+static int _xml_fast_parse_dirtree(struct xml_fast_reader *r, struct dentry *parent,
+	struct ltfs_index *idx, struct ltfs_volume *vol, struct name_list *entry)
+{
+	unsigned long long value_int;
+	struct dentry *dir;
+	const char *value;
+	unsigned int have = 0;
+	int ret;
+
+	/* name, readonly, 4 time stamps, backup time, contents and uid are required */
+	const unsigned int required = 0x1FF;
+
+	if (! parent) {
+		dir = idx->root;
+		dir->vol = vol;
+	} else {
+		dir = fs_allocate_dentry(parent, NULL, NULL, true, false, false, idx);
+		if (! dir)
+			return -LTFS_NO_MEMORY;
+		entry->d = dir;
+	}
+
+	while (true) {
+		fast_next_tag(r, "directory");
+
+		if (fast_tag_is(r, "name")) {
+			fast_check_tag(0);
+			if (parent) {
+				fast_get_tag_text(r, value);
+				if (_xml_fast_parse_filename(&dir->name, value) < 0)
+					return -1;
+				entry->name = dir->name;
+			} else {
+				/* this is the root directory, so set the volume name */
+				if (_xml_fast_tag_text(r, &value) < 0)
+					return -1;
+				if (value[0] && _xml_fast_parse_filename(&idx->volume_name, value) < 0)
+					return -1;
+			}
+
+		} else if (fast_tag_is(r, "readonly")) {
+			fast_check_tag(1);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_bool(&dir->readonly, value) < 0)
+				return -1;
+
+		} else if ((ret = _xml_fast_parse_dentry_time(r, dir, idx->version, &have, 2)) <= 0) {
+			if (ret < 0)
+				return -1;
+
+		} else if (fast_tag_is(r, "contents")) {
+			fast_check_tag(7);
+			if (r->empty)
+				continue;
+			/* Older Indexes allocate UIDs in Index order, so they are parsed sequentially */
+			if (! parent && r->threads > 1 && idx->version >= IDX_VERSION_UID)
+				ret = _xml_fast_parse_root_contents(r, dir, idx, vol);
+			else
+				ret = _xml_fast_parse_dir_contents(r, dir, idx);
+			if (ret < 0)
+				return -1;
+
+		} else if (fast_tag_is(r, "extendedattributes")) {
+			fast_check_tag(9);
+			if (! r->empty && _xml_fast_parse_xattrs(r, dir) < 0)
+				return -1;
+
+		} else if (idx->version >= IDX_VERSION_UID && fast_tag_is(r, UID_TAGNAME)) {
+			fast_check_tag(8);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_ull(&value_int, value) < 0)
+				return -1;
+			dir->uid = value_int;
+			if (dir->uid > idx->uid_number)
+				idx->uid_number = dir->uid;
+			if (parent)
+				entry->uid = dir->uid;
+
+		} else
+			return -1;
+	}
+
+	/* For old index versions, allocate a UID. The root directory already has UID 1. */
+	if (idx->version < IDX_VERSION_UID) {
+		have |= 1U << 8;
+		if (parent) {
+			dir->uid = fs_allocate_uid(idx);
+			if (dir->uid > idx->uid_number)
+				idx->uid_number = dir->uid;
+			entry->uid = dir->uid;
+		}
+	}
+
+	/* For old index versions, set backup time equal to creation time */
+	if (idx->version < IDX_VERSION_BACKUPTIME) {
+		have |= 1U << 6;
+		dir->backup_time = dir->creation_time;
+	}
+
+	fast_check_required_tags(required);
+
+	/* Root directory must have uid==1, other dentries must have a nonzero UID */
+	if ((parent && dir->uid == 1) || (! parent && dir->uid != 1) || dir->uid == 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Parse the XML declaration and the top-level start tag, checking the index version.
+ */
+static int _xml_fast_parser_init(struct xml_fast_reader *r, int *idx_version)
+{
+	const char *p = r->pos, *name, *value;
+	size_t name_len, value_len;
+	char version[16];
+	bool have_version = false, have_utf8 = false;
+
+	/* The XML declaration must name UTF-8 explicitly, see _xml_parser_init() */
+	if (r->end - p < 6 || memcmp(p, "<?xml", 5) || ! _xml_fast_is_space(p[5]))
+		return -1;
+	p += 5;
+	while (true) {
+		while (p < r->end && _xml_fast_is_space(*p))
+			++p;
+		if (p >= r->end)
+			return -1;
+		if (*p == '?')
+			break;
+		if (_xml_fast_scan_attr(&p, r->end, &name, &name_len, &value, &value_len) < 0)
+			return -1;
+		if (name_len == 7 && ! memcmp(name, "version", 7))
+			have_version = true;
+		else if (name_len == 8 && ! memcmp(name, "encoding", 8))
+			have_utf8 = (value_len == 5 && ! memcmp(value, "UTF-8", 5));
+	}
+	if (! have_version || ! have_utf8 || r->end - p < 2 || p[1] != '>')
+		return -1;
+	r->pos = p + 2;
+
+	if (_xml_fast_next_tag(r, "") < 0 || r->end_tag || r->empty || ! fast_tag_is(r, "ltfsindex"))
+		return -1;
+	if (_xml_fast_get_attr(r, "version", &value, &value_len) < 0 ||
+		value_len >= sizeof(version))
+		return -1;
+	memcpy(version, value, value_len);
+	version[value_len] = '\0';
+
+	if (_xml_parse_version(version, idx_version) < 0 ||
+		*idx_version < LTFS_INDEX_VERSION_MIN || *idx_version > LTFS_INDEX_VERSION_MAX)
+		return -1;
+
+	return 0;
+}
+
+static int _xml_fast_parse_schema(struct xml_fast_reader *r, struct ltfs_index *idx,
+	struct ltfs_volume *vol)
+{
+	unsigned long long value_int;
+	const char *value;
+	unsigned int have = 0;
+
+	/* creator, volumeuuid, generationnumber, updatetime, location, allowpolicyupdate,
+	 * directory and highestfileuid are required */
+	const unsigned int required = 0xFF;
+
+	if (_xml_fast_parser_init(r, &idx->version) < 0)
+		return -1;
+
+	if (idx->commit_message) {
+		free(idx->commit_message);
+		idx->commit_message = NULL;
+	}
+
+	while (true) {
+		fast_next_tag(r, "ltfsindex");
+
+		if (fast_tag_is(r, "creator")) {
+			fast_check_tag(0);
+			fast_get_tag_text(r, value);
+			if (idx->creator)
+				free(idx->creator);
+			idx->creator = strdup(value);
+			if (! idx->creator)
+				return -1;
+
+		} else if (fast_tag_is(r, "volumeuuid")) {
+			fast_check_tag(1);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_uuid(idx->vol_uuid, value) < 0)
+				return -1;
+
+		} else if (fast_tag_is(r, "generationnumber")) {
+			fast_check_tag(2);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_ull(&value_int, value) < 0)
+				return -1;
+			idx->generation = value_int;
+
+		} else if (fast_tag_is(r, "updatetime")) {
+			fast_check_tag(3);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_time(value, &idx->mod_time) < 0)
+				return -1;
+
+		} else if (fast_tag_is(r, "location") && ! r->empty) {
+			fast_check_tag(4);
+			if (_xml_fast_scan_tapepos(r, "location", &idx->selfptr) < 0)
+				return -1;
+
+		} else if (fast_tag_is(r, "allowpolicyupdate")) {
+			fast_check_tag(5);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_bool(&idx->criteria_allow_update, value) < 0)
+				return -1;
+
+		} else if (fast_tag_is(r, "directory") && ! r->empty) {
+			fast_check_tag(6);
+			/* volumeuuid, generationnumber, updatetime and location precede the directory
+			 * tree in every Index written by LTFS */
+			if (r->header_only)
+				return ((have & 0x1E) == 0x1E) ? 0 : -1;
+			if (_xml_fast_parse_dirtree(r, NULL, idx, vol, NULL) < 0)
+				return -1;
+
+		} else if (fast_tag_is(r, "previousgenerationlocation") && ! r->empty) {
+			fast_check_tag(8);
+			if (_xml_fast_scan_tapepos(r, "previousgenerationlocation", &idx->backptr) < 0)
+				return -1;
+
+		} else if (fast_tag_is(r, "dataplacementpolicy") && ! r->empty) {
+			fast_check_tag(9);
+			if (_xml_fast_parse_policy(r, idx) < 0)
+				return -1;
+
+		} else if (fast_tag_is(r, "comment")) {
+			fast_check_tag(10);
+			fast_get_tag_text(r, value);
+			if (strlen(value) > INDEX_MAX_COMMENT_LEN)
+				return -1;
+			idx->commit_message = strdup(value);
+			if (! idx->commit_message)
+				return -1;
+
+		} else if (idx->version >= IDX_VERSION_UID && fast_tag_is(r, NEXTUID_TAGNAME)) {
+			fast_check_tag(7);
+			fast_get_tag_text(r, value);
+			if (_xml_fast_parse_ull(&value_int, value) < 0)
+				return -1;
+			if (value_int > idx->uid_number)
+				idx->uid_number = value_int;
+
+		} else
+			return -1;
+	}
+
+	/* For older index versions, assume we handle UIDs correctly */
+	if (idx->version < IDX_VERSION_UID)
+		have |= 1U << 7;
+
+	fast_check_required_tags(required);
+	return 0;
+}
+
+/**
+ * Parse an Index held in memory into the given index data structure, without libxml2.
+ * Only well-formed Indexes in the usual layout are accepted: unknown tags (which would have
+ * to be preserved), comments, CDATA sections, entities other than the predefined ones,
+ * out-of-range time stamps and anything that should produce a warning or an error make the
+ * scanner give up. In that case the index may be partially populated, and the caller must
+ * reset it and parse the buffer with libxml2, which also reports any problems.
+ * @param buf Index XML.
+ * @param size Length of buf in bytes.
+ * @param idx Index to populate. It must be freshly allocated.
+ * @param vol LTFS volume to which the index belongs. May be NULL.
+ * @return 0 on success or a negative value if the buffer must be parsed by libxml2.
+ */
+int xml_schema_from_mem_fast(const char *buf, size_t size, struct ltfs_index *idx,
+	struct ltfs_volume *vol)
+{
+	struct xml_fast_reader r;
+	int ret;
+
+	CHECK_ARG_NULL(buf, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(idx, -LTFS_NULL_ARG);
+
+	memset(&r, 0, sizeof(r));
+	r.pos = buf;
+	r.end = buf + size;
+	r.threads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+	if (size >= XML_FAST_PARALLEL_MIN) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpus > XML_FAST_MAX_THREADS)
+			r.threads = XML_FAST_MAX_THREADS;
+		else if (ncpus > 1)
+			r.threads = ncpus;
+	}
+#endif
+
+	ret = _xml_fast_parse_schema(&r, idx, vol);
+	if (ret < 0)
+		ltfsmsg(LTFS_DEBUG, "17311D", (unsigned long long)(r.pos - buf));
+
+	if (r.text)
+		free(r.text);
+	return ret < 0 ? -LTFS_INDEX_INVALID : 0;
+}
+
+/**
+ * Scan the properties at the start of an Index held in memory, up to the root directory.
+ * The buffer may end anywhere after the root directory tag, which makes it possible to
+ * identify an Index from its first block.
+ * @param buf Start of the Index XML.
+ * @param size Length of buf in bytes.
+ * @param idx Index to populate. It must be freshly allocated. On success its volume UUID,
+ *            generation number, update time and self pointer are filled in, and other
+ *            properties may be.
+ * @return 0 on success or a negative value if the properties cannot be scanned.
+ */
+int xml_schema_header_from_mem_fast(const char *buf, size_t size, struct ltfs_index *idx)
+{
+	struct xml_fast_reader r;
+	int ret;
+
+	CHECK_ARG_NULL(buf, -LTFS_NULL_ARG);
+	CHECK_ARG_NULL(idx, -LTFS_NULL_ARG);
+
+	memset(&r, 0, sizeof(r));
+	r.pos = buf;
+	r.end = buf + size;
+	r.threads = 1;
+	r.header_only = true;
+
+	ret = _xml_fast_parse_schema(&r, idx, NULL);
+
+	if (r.text)
+		free(r.text);
+	return ret < 0 ? -LTFS_INDEX_INVALID : 0;
+}
@@ -58,15 +58,12 @@
 #include "fs.h"
 #include "tape.h"
 #include "base64.h"
+#include "index_cache.h"
 #include "pathname.h"
 #include "index_criteria.h"
 #include "arch/time_internal.h"
 #include "ltfsprintf.h"
-
-/* LTFS index version checks */
-#define IDX_VERSION_SPARSE     MAKE_LTFS_VERSION(2,0,0)
-#define IDX_VERSION_BACKUPTIME MAKE_LTFS_VERSION(2,0,0)
-#define IDX_VERSION_UID        MAKE_LTFS_VERSION(2,0,0)
+#include "ltfs_internal.h"
 
 /* Label tag parsers */
 int _xml_parse_label(xmlTextReaderPtr reader, struct ltfs_label *label);
@@ -88,6 +85,7 @@ int _xml_parse_one_xattr(xmlTextReaderPtr read, struct dentry *d);
 int _xml_scan_tapepos(xmlTextReaderPtr reader, const char *tag, struct tape_offset *pos);
 
 /* Generic tag parsers */
+void _xml_check_index_version(int version);
 int _xml_parser_init(xmlTextReaderPtr reader, const char *top_name, int *idx_version,
 	int min_version, int max_version);
 
@@ -187,9 +185,195 @@ int xml_schema_from_file(const char *filename, struct ltfs_index *idx, struct lt
 	return ret;
 }
 
+/**
+ * Read an Index from tape into memory.
+ * @param ctx Tape input context, positioned at the start of the Index or after the part of it
+ *            which is already in the buffer.
+ * @param buf Buffer holding the Index. If NULL, a new buffer is allocated. On error the buffer
+ *            is freed and set to NULL.
+ * @param alloc Allocated size of buf.
+ * @param size Number of bytes of the Index in buf. Updated as the Index is read.
+ * @param one_block Stop after reading one block?
+ * @return 0 on success or a negative value on error.
+ */
+static int _xml_read_index_from_tape(struct xml_input_tape *ctx, char **buf, size_t *alloc,
+	size_t *size, bool one_block)
+{
+	char *tmp;
+	int nread;
+
+	if (! *buf) {
+		*alloc = (size_t) ctx->buf_size * 16;
+		*size = 0;
+		*buf = malloc(*alloc);
+		if (! *buf) {
+			ltfsmsg(LTFS_ERR, "10001E", "_xml_read_index_from_tape: buf");
+			return -LTFS_NO_MEMORY;
+		}
+	}
+
+	while (true) {
+		if (*alloc - *size < ctx->buf_size) {
+			tmp = realloc(*buf, *alloc * 2);
+			if (! tmp) {
+				ltfsmsg(LTFS_ERR, "10001E", "_xml_read_index_from_tape: buf");
+				free(*buf);
+				*buf = NULL;
+				return -LTFS_NO_MEMORY;
+			}
+			*buf = tmp;
+			*alloc *= 2;
+		}
+
+		nread = xml_input_tape_read_callback(ctx, *buf + *size, ctx->buf_size);
+		if (nread < 0) {
+			free(*buf);
+			*buf = NULL;
+			return -LTFS_INDEX_INVALID;
+		} else if (nread == 0)
+			break;
+		*size += nread;
+		if (one_block)
+			break;
+	}
+
+	return 0;
+}
+
+/**
+ * Load the Index from the Index cache instead of parsing it, if the cache holds the Index
+ * which starts with the block in the buffer. The file mark following the Index must be where
+ * the cache says it is.
+ * @param ctx Tape input context, positioned after the first block of the Index.
+ * @param start Position of the first block of the Index.
+ * @param buf First block of the Index.
+ * @param size Size of buf.
+ * @return 0 if the index was loaded and the tape positioned before the file mark following
+ *         the Index, 1 if the Index must be read from tape (from the current position), or
+ *         a negative value on error.
+ */
+static int _xml_schema_from_index_cache(struct xml_input_tape *ctx, struct tc_position *start,
+	const char *buf, size_t size)
+{
+	struct ltfs_volume *vol = ctx->vol;
+	struct ltfs_index *hdr = NULL;
+	struct tc_position pos;
+	tape_block_t fm_block;
+	bool moved = false;
+	ssize_t nread;
+	int ret;
+
+	ret = ltfs_index_alloc(&hdr, vol);
+	if (ret < 0)
+		return ret;
+	if (xml_schema_header_from_mem_fast(buf, size, hdr) < 0 ||
+		hdr->selfptr.partition != vol->label->part_num2id[start->partition] ||
+		hdr->selfptr.block != start->block) {
+		ltfs_index_free(&hdr);
+		return 1;
+	}
+
+	ret = index_cache_load(vol->index_cache_dir, hdr, &fm_block, vol);
+	ltfs_index_free(&hdr);
+	if (ret == 0 && fm_block > start->block && (ctx->eod_pos == 0 || fm_block < ctx->eod_pos)) {
+		/* The cached Index must end where the Index on tape does */
+		pos.partition = start->partition;
+		pos.block = fm_block;
+		moved = true;
+		ret = tape_seek(vol->device, &pos);
+		if (ret == 0) {
+			nread = tape_read(vol->device, ctx->buf, ctx->buf_size, false, vol->kmi_handle);
+			if (nread == 0)
+				ret = tape_spacefm(vol->device, -1);
+			else
+				ret = 1;
+		}
+		if (ret == 0) {
+			ltfsmsg(LTFS_INFO, "17313I", (unsigned int)vol->index->generation,
+				vol->index_cache_dir);
+			return 0;
+		}
+	} else if (ret == 1)
+		return 1;
+
+	/* Start over from an empty index, since the cache may have populated part of it */
+	ltfs_index_free(&vol->index);
+	ret = ltfs_index_alloc(&vol->index, vol);
+	if (ret < 0)
+		return ret;
+
+	/* Go back to where the Index on tape left off */
+	if (moved) {
+		pos.block = ctx->current_pos;
+		ret = tape_seek(vol->device, &pos);
+		if (ret < 0)
+			return ret;
+	}
+	return 1;
+}
+
+/**
+ * Parse an Index held in memory with libxml2.
+ */
+static int _xml_schema_from_mem(const char *buf, size_t size, struct ltfs_volume *vol)
+{
+	int ret;
+	struct xml_input_mem ctx;
+	xmlParserInputBufferPtr read_buf;
+	xmlTextReaderPtr reader;
+	xmlDocPtr doc;
+
+	ctx.buf = buf;
+	ctx.size = size;
+	ctx.pos = 0;
+
+	/* Create input buffer pointer. */
+	read_buf = xmlParserInputBufferCreateIO(xml_input_mem_read_callback,
+											xml_input_mem_close_callback,
+											&ctx, XML_CHAR_ENCODING_NONE);
+	if (! read_buf) {
+		ltfsmsg(LTFS_ERR, "17014E");
+		return -LTFS_LIBXML2_FAILURE;
+	}
+
+	/* Create XML reader. */
+	reader = xmlNewTextReader(read_buf, NULL);
+	if (! reader) {
+		ltfsmsg(LTFS_ERR, "17015E");
+		xmlFreeParserInputBuffer(read_buf);
+		return -LTFS_LIBXML2_FAILURE;
+	}
+
+	/* Workaround for old libxml2 version on OS X 10.5. See comment in xml_schema_from_file()
+	 * for details. */
+	doc = xmlTextReaderCurrentDoc(reader);
+
+	/* Generate the Index. */
+	ret = _xml_parse_schema(reader, vol->index, vol);
+	if (ret < 0) {
+		ltfsmsg(LTFS_ERR, "17016E");
+		if ((ret != -LTFS_UNSUPPORTED_INDEX_VERSION)&&( ret != -LTFS_SYMLINK_CONFLICT)) {
+			if (ret == -LTFS_NO_MEMORY)
+				ret = -LTFS_NO_MEMORY;
+			else
+				ret = -LTFS_INDEX_INVALID;
+		}
+	}
+	if (doc)
+		xmlFreeDoc(doc);
+	xmlFreeTextReader(reader);
+	xmlFreeParserInputBuffer(read_buf);
+
+	return ret;
+}
+
 /**
  * Parse an Index from tape and populate the vol->index->root virtual dentry tree
  * with the nodes found during the scanning.
+ * The whole Index is read into memory first. It is handed to the fast scanner in
+ * xml_reader_fast.c, and only parsed with libxml2 if the scanner gives up.
+ * If the Index cache is enabled and holds the Index which starts with the first block, the
+ * cache is loaded instead and the rest of the Index is not read.
  * If a file mark is encountered at the end of the Index, the tape is positioned before
  * the file mark.
  * @param eod_pos EOD block position for the current partition, or 0 to assume EOD will not be
@@ -203,9 +387,9 @@ int xml_schema_from_tape(uint64_t eod_pos, struct ltfs_volume *vol)
 	int ret;
 	struct tc_position current_pos;
 	struct xml_input_tape *ctx;
-	xmlParserInputBufferPtr read_buf;
-	xmlTextReaderPtr reader;
-	xmlDocPtr doc;
+	bool saw_file_mark;
+	char *xml_buf = NULL;
+	size_t xml_alloc, xml_size;
 
 	CHECK_ARG_NULL(vol, -LTFS_NULL_ARG);
 
@@ -236,47 +420,58 @@ int xml_schema_from_tape(uint64_t eod_pos, struct ltfs_volume *vol)
 	ctx->buf_start = 0;
 	ctx->buf_used = 0;
 
-	/* Create input buffer pointer. */
-	read_buf = xmlParserInputBufferCreateIO(xml_input_tape_read_callback,
-											xml_input_tape_close_callback,
-											ctx, XML_CHAR_ENCODING_NONE);
-	if (! read_buf) {
-		ltfsmsg(LTFS_ERR, "17014E");
-		free(ctx->buf);
-		free(ctx);
-		return -LTFS_LIBXML2_FAILURE;
+	if (vol->index_cache_dir) {
+		/* An Index which fits in one block is parsed as quickly as the cache is loaded */
+		ret = _xml_read_index_from_tape(ctx, &xml_buf, &xml_alloc, &xml_size, true);
+		if (ret == 0 && ! ctx->saw_small_block) {
+			ret = _xml_schema_from_index_cache(ctx, &current_pos, xml_buf, xml_size);
+			if (ret <= 0) {
+				xml_input_tape_close_callback(ctx);
+				if (xml_buf)
+					free(xml_buf);
+				if (ret == 0)
+					_xml_check_index_version(vol->index->version);
+				return ret;
+			}
+		}
+		if (ret < 0) {
+			xml_input_tape_close_callback(ctx);
+			ltfsmsg(LTFS_ERR, "17016E");
+			return ret;
+		}
 	}
 
-	/* Create XML reader. */
-	reader = xmlNewTextReader(read_buf, NULL);
-	if (! reader) {
-		ltfsmsg(LTFS_ERR, "17015E");
-		xmlFreeParserInputBuffer(read_buf);
-		return -LTFS_LIBXML2_FAILURE;
+	ret = _xml_read_index_from_tape(ctx, &xml_buf, &xml_alloc, &xml_size, false);
+	saw_file_mark = ctx->saw_file_mark;
+	xml_input_tape_close_callback(ctx);
+	if (ret < 0) {
+		ltfsmsg(LTFS_ERR, "17016E");
+		return ret;
 	}
 
-	/* Workaround for old libxml2 version on OS X 10.5. See comment in xml_schema_from_file()
-	 * for details. */
-	doc = xmlTextReaderCurrentDoc(reader);
-
 	/* Generate the Index. */
-	ret = _xml_parse_schema(reader, vol->index, vol);
-	if (ret < 0) {
-		ltfsmsg(LTFS_ERR, "17016E");
-		if ((ret != -LTFS_UNSUPPORTED_INDEX_VERSION)&&( ret != -LTFS_SYMLINK_CONFLICT)) {
-			if (ret == -LTFS_NO_MEMORY)
-				ret = -LTFS_NO_MEMORY;
-			else
-				ret = -LTFS_INDEX_INVALID;
+	ret = xml_schema_from_mem_fast(xml_buf, xml_size, vol->index, vol);
+	if (ret == 0)
+		_xml_check_index_version(vol->index->version);
+	else {
+		/* Start over from an empty index, since the scanner may have populated part of it */
+		ltfs_index_free(&vol->index);
+		ret = ltfs_index_alloc(&vol->index, vol);
+		if (ret < 0) {
+			free(xml_buf);
+			return ret;
 		}
-	} else if (ret == 0) {
-		if( ! ctx->saw_file_mark)
-			ret = 1;
+		ret = _xml_schema_from_mem(xml_buf, xml_size, vol);
 	}
-	if (doc)
-		xmlFreeDoc(doc);
-	xmlFreeTextReader(reader);
-	xmlFreeParserInputBuffer(read_buf);
+	free(xml_buf);
+
+	if (ret == 0 && ! saw_file_mark)
+		ret = 1;
+
+	/* Save the Index for the next mount. The tape is positioned before the file mark. */
+	if (ret == 0 && vol->index_cache_dir && xml_size > vol->label->blocksize &&
+		tape_get_position(vol->device, &current_pos) == 0)
+		index_cache_save(vol->index_cache_dir, vol->index->creator, current_pos.block, vol);
 
 #ifdef DEBUG
 	/* dump the tree if it isn't too large */
@@ -615,6 +810,31 @@ int _xml_parse_partition_map(xmlTextReaderPtr reader, struct ltfs_label *label)
 	return 0;
 }
 
+/**
+ * Warn if an index was written by a different version of the format.
+ */
+void _xml_check_index_version(int version)
+{
+	if (version < LTFS_INDEX_VERSION)
+		ltfsmsg(LTFS_WARN, "17095W",
+				LTFS_INDEX_VERSION_STR,
+				LTFS_FORMAT_MAJOR(version),
+				LTFS_FORMAT_MINOR(version),
+				LTFS_FORMAT_REVISION(version));
+	else if (version / 100 > LTFS_INDEX_VERSION / 100)
+		ltfsmsg(LTFS_WARN, "17096W",
+				LTFS_INDEX_VERSION_STR,
+				LTFS_FORMAT_MAJOR(version),
+				LTFS_FORMAT_MINOR(version),
+				LTFS_FORMAT_REVISION(version));
+	else if (version > LTFS_INDEX_VERSION)
+		ltfsmsg(LTFS_WARN, "17234W",
+				LTFS_INDEX_VERSION_STR,
+				LTFS_FORMAT_MAJOR(version),
+				LTFS_FORMAT_MINOR(version),
+				LTFS_FORMAT_REVISION(version));
+}
+
 /**
  * Parse an index file from the given source and populate the priv->root virtual dentry tree.
  * with the nodes found during the scanning.
@@ -636,24 +856,7 @@ int _xml_parse_schema(xmlTextReaderPtr reader, struct ltfs_index *idx, struct lt
 	if (ret < 0)
 		return ret;
 
-	if (idx->version < LTFS_INDEX_VERSION)
-		ltfsmsg(LTFS_WARN, "17095W",
-				LTFS_INDEX_VERSION_STR,
-				LTFS_FORMAT_MAJOR(idx->version),
-				LTFS_FORMAT_MINOR(idx->version),
-				LTFS_FORMAT_REVISION(idx->version));
-	else if (idx->version / 100 > LTFS_INDEX_VERSION / 100)
-		ltfsmsg(LTFS_WARN, "17096W",
-				LTFS_INDEX_VERSION_STR,
-				LTFS_FORMAT_MAJOR(idx->version),
-				LTFS_FORMAT_MINOR(idx->version),
-				LTFS_FORMAT_REVISION(idx->version));
-	else if (idx->version > LTFS_INDEX_VERSION)
-		ltfsmsg(LTFS_WARN, "17234W",
-				LTFS_INDEX_VERSION_STR,
-				LTFS_FORMAT_MAJOR(idx->version),
-				LTFS_FORMAT_MINOR(idx->version),
-				LTFS_FORMAT_REVISION(idx->version));
+	_xml_check_index_version(idx->version);
 
 	if (idx->commit_message) {
 		free(idx->commit_message);
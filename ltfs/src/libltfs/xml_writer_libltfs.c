@@ -38,6 +38,8 @@
 ** FILE NAME:       xml_writer.c
 **
 ** DESCRIPTION:     XML writer routines for Indexes and Labels.
+**                  The top-level directories of large Indexes are serialized on a
+**                  pool of threads.
 **
 ** AUTHORS:         Brian Biskeborn
 **                  IBM Almaden Research Center
@@ -55,12 +57,46 @@
 #include "fs.h"
 #include "tape.h"
 #include "pathname.h"
+#include "dcache.h"
 #include "arch/time_internal.h"
 
+/* Indexes with fewer files than this are written on a single thread */
+#define XML_WRITER_PARALLEL_MIN_FILES 10000
+
+/* Upper bound on the number of threads serializing top-level directories */
+#define XML_WRITER_MAX_THREADS 32
+
+/**
+ * A top-level directory serialized by the thread pool.
+ */
+struct xml_writer_job {
+	struct dentry *dir;  /**< Directory to serialize */
+	xmlBufferPtr buf;    /**< XML of the directory tree, set when the job is done */
+	bool done;           /**< Has the job finished, successfully or not? */
+};
+
+/**
+ * Work shared by the threads serializing top-level directories.
+ */
+struct xml_writer_pool {
+	ltfs_thread_mutex_t lock;    /**< Protects next_job, failed and the jobs */
+	ltfs_thread_cond_t cond;     /**< Signaled when a job finishes or the pool fails */
+	struct xml_writer_job *jobs; /**< Top-level directories, in Index order */
+	size_t job_count;            /**< Number of jobs */
+	size_t next_job;             /**< Next job to hand out */
+	bool failed;                 /**< Did any job, or the writer of the root, fail? */
+	bool cached;                 /**< Use the cached XML of unchanged directories */
+	const struct ltfs_index *idx; /**< Index being written */
+};
+
 int _xml_write_schema(xmlTextWriterPtr writer, const char *creator,
 	const struct ltfs_index *idx);
 int _xml_write_dirtree(xmlTextWriterPtr writer, struct dentry *dir,
 	const struct ltfs_index *idx);
+int _xml_write_dirtree_cached(xmlTextWriterPtr writer, struct dentry *dir,
+	const struct ltfs_index *idx);
+int _xml_write_dirtree_parallel(xmlTextWriterPtr writer, struct dentry *dir,
+	const struct ltfs_index *idx, int threads, bool cached);
 int _xml_write_file(xmlTextWriterPtr writer, const struct dentry *file);
 int _xml_write_dentry_times(xmlTextWriterPtr writer, const struct dentry *d);
 int _xml_write_xattr(xmlTextWriterPtr writer, const struct dentry *file);
@@ -317,9 +353,10 @@ int xml_schema_to_tape(char *reason, struct ltfs_volume *vol)
 int _xml_write_schema(xmlTextWriterPtr writer, const char *creator,
 	const struct ltfs_index *idx)
 {
-	int ret;
+	int ret, threads = 1;
 	size_t i;
 	char *update_time, **name_criteria;
+	bool cached;
 
 	ret = xml_format_time(idx->mod_time, &update_time);
 	if (!update_time)
@@ -390,7 +427,26 @@ int _xml_write_schema(xmlTextWriterPtr writer, const char *creator,
 	xml_mktag(xmlTextWriterWriteFormatElement(
 		writer, BAD_CAST NEXTUID_TAGNAME, "%"PRIu64, idx->uid_number), -1);
 
-	xml_mktag(_xml_write_dirtree(writer, idx->root, idx), -1);
+#ifndef INDENT_INDEXES
+	/* Cached and parallel directories are serialized without indentation, and in dcache mode
+	 * the dentries are not kept in memory between Index writes */
+	cached = idx->root->vol && idx->root->vol->incremental_index && ! dcache_initialized(NULL);
+#ifdef _SC_NPROCESSORS_ONLN
+	if (idx->file_count >= XML_WRITER_PARALLEL_MIN_FILES) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpus > XML_WRITER_MAX_THREADS)
+			threads = XML_WRITER_MAX_THREADS;
+		else if (ncpus > 1)
+			threads = ncpus;
+	}
+#endif
+	if (threads > 1)
+		xml_mktag(_xml_write_dirtree_parallel(writer, idx->root, idx, threads, cached), -1);
+	else if (cached)
+		xml_mktag(_xml_write_dirtree_cached(writer, idx->root, idx), -1);
+	else
+#endif
+		xml_mktag(_xml_write_dirtree(writer, idx->root, idx), -1);
 
 	/* Save unrecognized tags */
 	if (idx->tag_count > 0) {
@@ -414,21 +470,16 @@ int _xml_write_schema(xmlTextWriterPtr writer, const char *creator,
 }
 
 /**
- * Write XML tags representing the current directory tree to the given destination.
+ * Write the tags of a directory which precede its children, up to the start of the
+ * contents tag.
  * @param writer output pointer
  * @param dir directory to process
- * @param priv LTFS data
+ * @param idx index to which the directory belongs
  * @return 0 on success or negative on failure
  */
-int _xml_write_dirtree(xmlTextWriterPtr writer, struct dentry *dir,
+static int _xml_write_dir_start(xmlTextWriterPtr writer, struct dentry *dir,
 	const struct ltfs_index *idx)
 {
-	size_t i;
-	struct name_list *list_ptr, *list_tmp;
-
-	if (!dir)
-		return 0; /* nothing to do */
-
 	/* write standard attributes */
 	xml_mktag(xmlTextWriterStartElement(writer, BAD_CAST "directory"), -1);
 	if (dir == idx->root) {
@@ -452,17 +503,20 @@ int _xml_write_dirtree(xmlTextWriterPtr writer, struct dentry *dir,
 	/* write extended attributes */
 	xml_mktag(_xml_write_xattr(writer, dir), -1);
 
-	/* write children */
 	xml_mktag(xmlTextWriterStartElement(writer, BAD_CAST "contents"), -1);
-	/* Sort dentries by UID before generating xml */
-	HASH_SORT(dir->child_list, fs_hash_sort_by_uid);
+	return 0;
+}
 
-	HASH_ITER(hh, dir->child_list, list_ptr, list_tmp) {
-		if (list_ptr->d->isdir)
-			xml_mktag(_xml_write_dirtree(writer, list_ptr->d, idx), -1);
-		else
-			xml_mktag(_xml_write_file(writer, list_ptr->d), -1);
-	}
+/**
+ * Write the tags of a directory which follow its children, starting with the end of the
+ * contents tag.
+ * @param writer output pointer
+ * @param dir directory to process
+ * @return 0 on success or negative on failure
+ */
+static int _xml_write_dir_end(xmlTextWriterPtr writer, struct dentry *dir)
+{
+	size_t i;
 
 	xml_mktag(xmlTextWriterEndElement(writer), -1);
 
@@ -480,6 +534,409 @@ int _xml_write_dirtree(xmlTextWriterPtr writer, struct dentry *dir,
 	return 0;
 }
 
+/**
+ * Write XML tags representing the current directory tree to the given destination.
+ * @param writer output pointer
+ * @param dir directory to process
+ * @param priv LTFS data
+ * @return 0 on success or negative on failure
+ */
+int _xml_write_dirtree(xmlTextWriterPtr writer, struct dentry *dir,
+	const struct ltfs_index *idx)
+{
+	struct name_list *list_ptr, *list_tmp;
+
+	if (!dir)
+		return 0; /* nothing to do */
+
+	xml_mktag(_xml_write_dir_start(writer, dir, idx), -1);
+
+	/* write children */
+	/* Sort dentries by UID before generating xml */
+	HASH_SORT(dir->child_list, fs_hash_sort_by_uid);
+
+	HASH_ITER(hh, dir->child_list, list_ptr, list_tmp) {
+		if (list_ptr->d->isdir)
+			xml_mktag(_xml_write_dirtree(writer, list_ptr->d, idx), -1);
+		else
+			xml_mktag(_xml_write_file(writer, list_ptr->d), -1);
+	}
+
+	xml_mktag(_xml_write_dir_end(writer, dir), -1);
+	return 0;
+}
+
+/**
+ * Rebuild the cached XML of a directory. The cache holds everything _xml_write_dirtree()
+ * writes for the directory except the XML of its subdirectories; the offset at which each
+ * subdirectory goes is recorded instead.
+ * @param dir directory to process
+ * @param idx index to which the directory belongs
+ * @return 0 on success or negative on failure
+ */
+static int _xml_build_dir_cache(struct dentry *dir, const struct ltfs_index *idx)
+{
+	struct name_list *list_ptr, *list_tmp;
+	xmlBufferPtr buf;
+	xmlTextWriterPtr writer;
+	size_t *holes = NULL, hole_count = 0, len;
+	char *cache;
+	int ret = -1;
+
+	/* Clear the flag first, so that a change made while the cache is being built is seen by
+	 * the next Index write */
+	dir->xml_dirty = false;
+
+	HASH_SORT(dir->child_list, fs_hash_sort_by_uid);
+	HASH_ITER(hh, dir->child_list, list_ptr, list_tmp) {
+		if (list_ptr->d->isdir)
+			++hole_count;
+	}
+	if (hole_count) {
+		holes = malloc(hole_count * sizeof(size_t));
+		if (! holes) {
+			ltfsmsg(LTFS_ERR, "10001E", "_xml_build_dir_cache: holes");
+			dir->xml_dirty = true;
+			return -1;
+		}
+	}
+
+	buf = xmlBufferCreate();
+	if (! buf) {
+		ltfsmsg(LTFS_ERR, "17047E");
+		goto out;
+	}
+	/* Large directories append many small strings to the buffer */
+	xmlBufferSetAllocationScheme(buf, XML_BUFFER_ALLOC_DOUBLEIT);
+	writer = xmlNewTextWriterMemory(buf, 0);
+	if (! writer) {
+		ltfsmsg(LTFS_ERR, "17043E");
+		xmlBufferFree(buf);
+		goto out;
+	}
+	xmlTextWriterSetIndent(writer, 1);
+	xmlTextWriterSetIndentString(writer, BAD_CAST "");
+
+	if (_xml_write_dir_start(writer, dir, idx) < 0)
+		goto out_free;
+
+	hole_count = 0;
+	HASH_ITER(hh, dir->child_list, list_ptr, list_tmp) {
+		if (! list_ptr->d->isdir) {
+			if (_xml_write_file(writer, list_ptr->d) < 0)
+				goto out_free;
+			continue;
+		}
+
+		/* Close any pending start tag, then leave a hole on a line of its own, which is
+		 * where the writer would put the subdirectory's start tag */
+		if (xmlTextWriterWriteRaw(writer, BAD_CAST "") < 0 || xmlTextWriterFlush(writer) < 0)
+			goto out_free;
+		len = xmlBufferLength(buf);
+		if (len == 0 || xmlBufferContent(buf)[len - 1] != '\n') {
+			if (xmlTextWriterWriteRaw(writer, BAD_CAST "\n") < 0 ||
+				xmlTextWriterFlush(writer) < 0)
+				goto out_free;
+			len = xmlBufferLength(buf);
+		}
+		holes[hole_count++] = len;
+	}
+
+	if (_xml_write_dir_end(writer, dir) < 0 || xmlTextWriterFlush(writer) < 0)
+		goto out_free;
+
+	len = xmlBufferLength(buf);
+	cache = malloc(len);
+	if (! cache) {
+		ltfsmsg(LTFS_ERR, "10001E", "_xml_build_dir_cache: cache");
+		goto out_free;
+	}
+	memcpy(cache, xmlBufferContent(buf), len);
+
+	if (dir->xml_cache)
+		free(dir->xml_cache);
+	if (dir->xml_holes)
+		free(dir->xml_holes);
+	dir->xml_cache = cache;
+	dir->xml_cache_size = len;
+	dir->xml_holes = holes;
+	dir->xml_hole_count = hole_count;
+	holes = NULL;
+	ret = 0;
+
+out_free:
+	xmlFreeTextWriter(writer);
+	xmlBufferFree(buf);
+out:
+	if (holes)
+		free(holes);
+	if (ret < 0)
+		dir->xml_dirty = true;
+	return ret;
+}
+
+/**
+ * Write XML tags representing a directory tree, using the cached XML of directories which have
+ * not changed since it was built, and rebuilding the cache of the others.
+ * The output is the same as that of _xml_write_dirtree().
+ * @param writer output pointer
+ * @param dir directory to process
+ * @param idx index to which the directory belongs
+ * @return 0 on success or negative on failure
+ */
+int _xml_write_dirtree_cached(xmlTextWriterPtr writer, struct dentry *dir,
+	const struct ltfs_index *idx)
+{
+	struct name_list *list_ptr, *list_tmp;
+	size_t pos = 0, hole = 0;
+
+	if (!dir)
+		return 0; /* nothing to do */
+
+	if (! dir->xml_dirty && dir->xml_cache) {
+		/* Check that the subdirectories still match the cache */
+		HASH_ITER(hh, dir->child_list, list_ptr, list_tmp) {
+			if (list_ptr->d->isdir)
+				++hole;
+		}
+		if (hole != dir->xml_hole_count)
+			dir->xml_dirty = true;
+		hole = 0;
+	}
+
+	if (dir->xml_dirty || ! dir->xml_cache) {
+		if (_xml_build_dir_cache(dir, idx) < 0)
+			return -1;
+	}
+
+	HASH_ITER(hh, dir->child_list, list_ptr, list_tmp) {
+		if (! list_ptr->d->isdir)
+			continue;
+		if (dir->xml_holes[hole] > pos) {
+			xml_mktag(xmlTextWriterWriteRawLen(writer, BAD_CAST (dir->xml_cache + pos),
+				dir->xml_holes[hole] - pos), -1);
+			pos = dir->xml_holes[hole];
+		}
+		++hole;
+		xml_mktag(_xml_write_dirtree_cached(writer, list_ptr->d, idx), -1);
+	}
+
+	if (dir->xml_cache_size > pos) {
+		xml_mktag(xmlTextWriterWriteRawLen(writer, BAD_CAST (dir->xml_cache + pos),
+			dir->xml_cache_size - pos), -1);
+	}
+	return 0;
+}
+
+/**
+ * Serialize a directory tree into a new memory buffer, in the same form as the stream
+ * written by _xml_write_schema() when Indexes are not indented.
+ * @param dir directory to process
+ * @param idx index to which the directory belongs
+ * @param cached use the cached XML of unchanged directories
+ * @return the buffer, which the caller should free using xmlBufferFree, or NULL on failure
+ */
+static xmlBufferPtr _xml_write_dirtree_to_buffer(struct dentry *dir,
+	const struct ltfs_index *idx, bool cached)
+{
+	xmlBufferPtr buf;
+	xmlTextWriterPtr writer;
+	int ret;
+
+	buf = xmlBufferCreate();
+	if (! buf) {
+		ltfsmsg(LTFS_ERR, "17047E");
+		return NULL;
+	}
+	xmlBufferSetAllocationScheme(buf, XML_BUFFER_ALLOC_DOUBLEIT);
+	writer = xmlNewTextWriterMemory(buf, 0);
+	if (! writer) {
+		ltfsmsg(LTFS_ERR, "17043E");
+		xmlBufferFree(buf);
+		return NULL;
+	}
+	xmlTextWriterSetIndent(writer, 1);
+	xmlTextWriterSetIndentString(writer, BAD_CAST "");
+
+	if (cached)
+		ret = _xml_write_dirtree_cached(writer, dir, idx);
+	else
+		ret = _xml_write_dirtree(writer, dir, idx);
+	if (ret == 0 && xmlTextWriterFlush(writer) < 0)
+		ret = -1;
+
+	xmlFreeTextWriter(writer);
+	if (ret < 0) {
+		xmlBufferFree(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/**
+ * Serialize top-level directories until the pool runs out of them.
+ */
+static void _xml_writer_run_jobs(struct xml_writer_pool *pool)
+{
+	struct xml_writer_job *job;
+	xmlBufferPtr buf;
+
+	while (true) {
+		ltfs_thread_mutex_lock(&pool->lock);
+		if (pool->failed || pool->next_job == pool->job_count) {
+			ltfs_thread_mutex_unlock(&pool->lock);
+			break;
+		}
+		job = &pool->jobs[pool->next_job++];
+		ltfs_thread_mutex_unlock(&pool->lock);
+
+		buf = _xml_write_dirtree_to_buffer(job->dir, pool->idx, pool->cached);
+
+		ltfs_thread_mutex_lock(&pool->lock);
+		job->buf = buf;
+		job->done = true;
+		if (! buf)
+			pool->failed = true;
+		ltfs_thread_cond_broadcast(&pool->cond);
+		ltfs_thread_mutex_unlock(&pool->lock);
+	}
+}
+
+static ltfs_thread_return _xml_writer_thread(void *data)
+{
+	_xml_writer_run_jobs((struct xml_writer_pool *) data);
+	ltfs_thread_exit();
+	return LTFS_THREAD_RC_NULL;
+}
+
+/**
+ * Write XML tags representing a directory tree, serializing its subdirectories on up to
+ * the given number of threads. Each subdirectory is written to a memory buffer, and the
+ * buffers are copied to the output in Index order as they become ready, so that output
+ * proceeds while later subdirectories are still being serialized.
+ * The output is the same as that of _xml_write_dirtree().
+ * @param writer output pointer
+ * @param dir directory to process
+ * @param idx index to which the directory belongs
+ * @param threads number of threads serializing subdirectories
+ * @param cached use the cached XML of unchanged directories
+ * @return 0 on success or negative on failure
+ */
+int _xml_write_dirtree_parallel(xmlTextWriterPtr writer, struct dentry *dir,
+	const struct ltfs_index *idx, int threads, bool cached)
+{
+	struct xml_writer_pool pool;
+	struct xml_writer_job *job;
+	struct name_list *list_ptr, *list_tmp;
+	ltfs_thread_t thread_ids[XML_WRITER_MAX_THREADS];
+	int nthreads = 0, ret = 0;
+	bool first = true;
+	size_t i;
+
+	if (!dir)
+		return 0; /* nothing to do */
+
+	memset(&pool, 0, sizeof(pool));
+	pool.cached = cached;
+	pool.idx = idx;
+
+	/* Sort dentries by UID before generating xml */
+	HASH_SORT(dir->child_list, fs_hash_sort_by_uid);
+	HASH_ITER(hh, dir->child_list, list_ptr, list_tmp) {
+		if (list_ptr->d->isdir)
+			++pool.job_count;
+	}
+	if (pool.job_count == 0)
+		return _xml_write_dirtree(writer, dir, idx);
+
+	pool.jobs = calloc(pool.job_count, sizeof(*pool.jobs));
+	if (! pool.jobs) {
+		ltfsmsg(LTFS_ERR, "10001E", "_xml_write_dirtree_parallel: jobs");
+		return -1;
+	}
+	i = 0;
+	HASH_ITER(hh, dir->child_list, list_ptr, list_tmp) {
+		if (list_ptr->d->isdir)
+			pool.jobs[i++].dir = list_ptr->d;
+	}
+
+	if (ltfs_thread_mutex_init(&pool.lock)) {
+		free(pool.jobs);
+		return -1;
+	}
+	if (ltfs_thread_cond_init(&pool.cond)) {
+		ltfs_thread_mutex_destroy(&pool.lock);
+		free(pool.jobs);
+		return -1;
+	}
+
+	/* This thread writes the output, so all of the requested threads are started */
+	for (i = 0; i < (size_t) threads && i < pool.job_count; ++i) {
+		if (ltfs_thread_create(&thread_ids[nthreads], _xml_writer_thread, &pool))
+			break;
+		++nthreads;
+	}
+	ltfsmsg(LTFS_DEBUG, "17317D", (unsigned long) pool.job_count, nthreads);
+	if (nthreads == 0)
+		_xml_writer_run_jobs(&pool);
+
+	ret = _xml_write_dir_start(writer, dir, idx);
+
+	job = pool.jobs;
+	HASH_ITER(hh, dir->child_list, list_ptr, list_tmp) {
+		if (ret < 0)
+			break;
+		if (! list_ptr->d->isdir) {
+			ret = _xml_write_file(writer, list_ptr->d);
+			first = false;
+			continue;
+		}
+
+		ltfs_thread_mutex_lock(&pool.lock);
+		while (! job->done && ! pool.failed)
+			ltfs_thread_cond_wait(&pool.cond, &pool.lock);
+		ltfs_thread_mutex_unlock(&pool.lock);
+		if (! job->buf) {
+			ret = -1;
+			break;
+		}
+
+		/* Close the contents start tag and put the subdirectory on a line of its own,
+		 * as the writer does for its own start tags */
+		if (xmlTextWriterWriteRaw(writer, BAD_CAST (first ? "\n" : "")) < 0 ||
+			xmlTextWriterWriteRawLen(writer, xmlBufferContent(job->buf),
+				xmlBufferLength(job->buf)) < 0) {
+			ltfsmsg(LTFS_ERR, "17042E", __FUNCTION__);
+			ret = -1;
+			break;
+		}
+		xmlBufferFree(job->buf);
+		job->buf = NULL;
+		++job;
+		first = false;
+	}
+
+	if (ret == 0)
+		ret = _xml_write_dir_end(writer, dir);
+
+	if (ret < 0) {
+		ltfs_thread_mutex_lock(&pool.lock);
+		pool.failed = true;
+		ltfs_thread_mutex_unlock(&pool.lock);
+	}
+	for (i = 0; i < (size_t) nthreads; ++i)
+		ltfs_thread_join(thread_ids[i]);
+
+	for (i = 0; i < pool.job_count; ++i) {
+		if (pool.jobs[i].buf)
+			xmlBufferFree(pool.jobs[i].buf);
+	}
+	free(pool.jobs);
+	ltfs_thread_cond_destroy(&pool.cond);
+	ltfs_thread_mutex_destroy(&pool.lock);
+	return ret;
+}
+
 /**
  * Write file info to an XML stream.
  * @param writer output pointer
@@ -73,6 +73,7 @@
 #include "libltfs/pathname.h"
 #include "libltfs/xattr.h"
 #include "libltfs/periodic_sync.h"
+#include "libltfs/prefetch.h"
 #include "libltfs/arch/time_internal.h"
 #include "libltfs/arch/errormap.h"
 #include "libltfs/kmi.h"
@@ -1295,6 +1296,9 @@ void * ltfs_fuse_mount(struct fuse_conn_info *conn)
 		return NULL;
 	}
 
+	if (priv->index_cache)
+		ltfs_set_index_cache(priv->work_directory, priv->data);
+
 	ret = ltfs_mount(false, false, false, false, priv->rollback_gen, priv->data);
 	if (ret < 0) {
 		/* The return type -LTFS_NO_MEMORY happens when memory allocation fails */
@@ -1336,6 +1340,13 @@ void * ltfs_fuse_mount(struct fuse_conn_info *conn)
 	/* Configure I/O scheduler cache */
 	ltfs_set_scheduler_cache(priv->min_pool_size, priv->max_pool_size, priv->data);
 
+	/* Configure tape read cache */
+	ltfs_set_read_cache(priv->read_cache_blocks, priv->readahead_blocks, priv->data);
+
+	/* Configure small file packing */
+	ltfs_set_small_file_packing(priv->pack_small_files, priv->data);
+	ltfs_set_incremental_index(priv->incremental_index, priv->data);
+
 	/* mount read-only if underlying medium is write-protected */
 	ret = ltfs_get_tape_readonly(priv->data);
 	if (ret < 0 && ret != -LTFS_WRITE_PROTECT && ret != -LTFS_WRITE_ERROR
@@ -1493,6 +1504,9 @@ void * ltfs_fuse_mount(struct fuse_conn_info *conn)
 	if (priv->sync_type == LTFS_SYNC_TIME)
 		periodic_sync_thread_init(priv->sync_time, priv->data);
 
+	/* Kick read-ahead thread for sequential reads */
+	prefetch_thread_init(priv->data);
+
 	/* If user has selected to capture the index, we do that here. */
 	if (priv->capture_index)
 		ltfs_save_index_to_disk(priv->work_directory, NULL, false, priv->data);
@@ -1519,6 +1533,8 @@ void ltfs_fuse_umount(void *userdata)
 
 	if (periodic_sync_thread_initialized(priv->data))
 		periodic_sync_thread_destroy(priv->data);
+	if (prefetch_thread_initialized(priv->data))
+		prefetch_thread_destroy(priv->data);
 
 	/*
 	 * Destroy the I/O scheduler, if one has been specified by the user.
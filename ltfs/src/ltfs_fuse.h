@@ -111,6 +111,11 @@ struct ltfs_fuse_data {
 	char *force_max_pool;          /**< Override for the max pool size */
 	size_t min_pool_size;          /**< Minimum write cache pool size in MiB */
 	size_t max_pool_size;          /**< Maximum write cache pool size in MiB */
+	char *force_read_cache;        /**< Override for the read cache size */
+	char *force_readahead;         /**< Override for the read-ahead window */
+	size_t read_cache_blocks;      /**< Read cache size in tape blocks */
+	size_t readahead_blocks;       /**< Maximum read-ahead window in tape blocks */
+	int pack_small_files;          /**< Pack file tails into shared tape blocks? */
 	char *index_rules;             /**< Index rules (overrides the ones specified at format time) */
 
 	struct ltfs_volume *data;            /**< LTFS data */
@@ -131,6 +136,8 @@ struct ltfs_fuse_data {
 	int release_device;            /**< Release device? */
 	int allow_other;               /**< Allow all users to access the volume? */
 	int capture_index;             /**< Capture index information to work directory at unmount */
+	int index_cache;               /**< Keep a binary copy of the index in the work directory? */
+	int incremental_index;         /**< Reuse the XML of unchanged directories in index writes? */
 	char *symlink_str;             /**< Symbolic Link type fetched by option (live or posix)*/
 	char *str_append_only_mode;    /**< option sting of scsi_append_only_mode */
 	int append_only_mode;          /**< Use append-only mode */
@@ -128,6 +128,9 @@ static struct fuse_opt ltfs_options[] = {
 	LTFS_OPT("gid=%s",                 force_gid, 0),
 	LTFS_OPT("min_pool_size=%s",       force_min_pool, 0),
 	LTFS_OPT("max_pool_size=%s",       force_max_pool, 0),
+	LTFS_OPT("read_cache_blocks=%s",   force_read_cache, 0),
+	LTFS_OPT("readahead_blocks=%s",    force_readahead, 0),
+	LTFS_OPT("pack_small_files",       pack_small_files, 1),
 	LTFS_OPT("rules=%s",               index_rules, 0),
 	LTFS_OPT("quiet",                  verbose, LTFS_WARN),
 	LTFS_OPT("trace",                  verbose, LTFS_DEBUG),
@@ -144,6 +147,8 @@ static struct fuse_opt ltfs_options[] = {
 	LTFS_OPT("allow_other",            allow_other, 1),
 	LTFS_OPT("noallow_other",          allow_other, 0),
 	LTFS_OPT("capture_index",          capture_index, 1),
+	LTFS_OPT("index_cache",            index_cache, 1),
+	LTFS_OPT("incremental_index",      incremental_index, 1),
 	LTFS_OPT("symlink_type=%s",        symlink_str, 0),
 	/*LTFS_OPT("scsi_append_only_mode=%s", str_append_only_mode, 0),*/
 	LTFS_OPT_KEY("-a",                 KEY_ADVANCED_HELP),
@@ -170,6 +175,9 @@ void single_drive_advanced_usage(const char *default_driver, struct ltfs_fuse_da
 	ltfsresult("14419I");                        /* -o dmask=<mode> */
 	ltfsresult("14420I", LTFS_MIN_CACHE_SIZE_DEFAULT); /* -o min_pool_size=<num> */
 	ltfsresult("14421I", LTFS_MAX_CACHE_SIZE_DEFAULT); /* -o max_pool_size=<num> */
+	ltfsresult("14481I", LTFS_READ_CACHE_BLOCKS_DEFAULT); /* -o read_cache_blocks=<num> */
+	ltfsresult("14482I", LTFS_READAHEAD_BLOCKS_DEFAULT); /* -o readahead_blocks=<num> */
+	ltfsresult("14483I"); /* -o pack_small_files */
 	ltfsresult("14422I"); /* -o rules=<rule[,rule]> */
 	ltfsresult("14423I"); /* -o quiet */
 	ltfsresult("14405I"); /* -o trace */
@@ -188,6 +196,8 @@ void single_drive_advanced_usage(const char *default_driver, struct ltfs_fuse_da
 	ltfsresult("14437I"); /* -o rollback_mount */
 	ltfsresult("14448I"); /* -o release_device */
 	ltfsresult("14456I"); /* -o capture_index */
+	ltfsresult("14484I"); /* -o index_cache */
+	ltfsresult("14485I"); /* -o incremental_index */
 	/*ltfsresult("14463I");*/ /* -o scsi_append_only_mode=<on|off> */
 	ltfsresult("14406I"); /* -a */
 	/* TODO: future use for WORM */
@@ -867,6 +877,27 @@ int main(int argc, char **argv)
 		ltfsmsg(LTFS_ERR, "14003E", priv->min_pool_size, priv->max_pool_size);
 		return 1;
 	}
+	if (priv->force_read_cache) {
+		priv->read_cache_blocks = parse_size_t(priv->force_read_cache);
+		if (priv->read_cache_blocks == 0) {
+			ltfsmsg(LTFS_ERR, "14119E");
+			return 1;
+		}
+	} else
+		priv->read_cache_blocks = LTFS_READ_CACHE_BLOCKS_DEFAULT;
+	if (priv->force_readahead) {
+		priv->readahead_blocks = parse_size_t(priv->force_readahead);
+		if (priv->readahead_blocks == 0 && strcmp(priv->force_readahead, "0")) {
+			ltfsmsg(LTFS_ERR, "14120E");
+			return 1;
+		}
+	} else
+		priv->readahead_blocks = LTFS_READAHEAD_BLOCKS_DEFAULT;
+	if (priv->readahead_blocks >= priv->read_cache_blocks) {
+		/* The read-ahead window must leave room for the requested block */
+		ltfsmsg(LTFS_ERR, "14121E", priv->readahead_blocks, priv->read_cache_blocks);
+		return 1;
+	}
 
 	/*
 	 * Make sure at least one parameter was provided (mount point).  
@@ -1153,6 +1184,12 @@ int single_drive_main(struct fuse_args *args, struct ltfs_fuse_data *priv)
 		ltfsmsg(LTFS_INFO, "14092I", priv->symlink_str);
 	}
 
+	/* Keep a binary copy of the index in the work directory */
+	if (priv->index_cache && ltfs_set_index_cache(priv->work_directory, priv->data) < 0) {
+		ltfs_volume_free(&priv->data);
+		return 1;
+	}
+
 	/* Mount the volume */
 	ltfs_set_traverse_mode(TRAVERSE_BACKWARD, priv->data);
 	if (ltfs_mount(false, false, false, false, priv->rollback_gen, priv->data) < 0) {
@@ -1193,6 +1230,13 @@ int single_drive_main(struct fuse_args *args, struct ltfs_fuse_data *priv)
 	/* Configure I/O scheduler cache */
 	ltfs_set_scheduler_cache(priv->min_pool_size, priv->max_pool_size, priv->data);
 
+	/* Configure tape read cache */
+	ltfs_set_read_cache(priv->read_cache_blocks, priv->readahead_blocks, priv->data);
+
+	/* Configure small file packing */
+	ltfs_set_small_file_packing(priv->pack_small_files, priv->data);
+	ltfs_set_incremental_index(priv->incremental_index, priv->data);
+
 	/* mount read-only if underlying medium is write-protected */
 	ret = ltfs_get_tape_readonly(priv->data);
 	if (ret < 0 && ret != -LTFS_WRITE_PROTECT && ret != -LTFS_WRITE_ERROR && ret != -LTFS_NO_SPACE &&
@@ -0,0 +1,569 @@
+/*
+**  %Z% %I% %W% %G% %U%
+**
+**  ZZ_Copyright_BEGIN
+**
+**
+**  Licensed Materials - Property of IBM
+**
+**  IBM Linear Tape File System Single Drive Edition Version 2.2.0.2 for Linux and Mac OS X
+**
+**  Copyright IBM Corp. 2010, 2014
+**
+**  This file is part of the IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X
+**  (formally known as IBM Linear Tape File System)
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is free software;
+**  you can redistribute it and/or modify it under the terms of the GNU Lesser
+**  General Public License as published by the Free Software Foundation,
+**  version 2.1 of the License.
+**
+**  The IBM Linear Tape File System Single Drive Edition for Linux and Mac OS X is distributed in the
+**  hope that it will be useful, but WITHOUT ANY WARRANTY; without even the
+**  implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+**  See the GNU Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public
+**  License along with this library; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+**  or download the license from <http://www.gnu.org/licenses/>.
+**
+**
+**  ZZ_Copyright_END
+**
+*************************************************************************************
+**
+** COMPONENT NAME:  IBM Linear Tape File System
+**
+** FILE NAME:       ltfsrestore.c
+**
+** DESCRIPTION:     Copies many files off an LTFS volume in a single forward pass
+**                  over the medium, without mounting it through FUSE.
+**
+*************************************************************************************
+*/
+
+#ifdef HP_mingw_BUILD
+#include "libltfs/arch/win/win_util.h"
+#endif
+
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "../libltfs/ltfs.h"
+#include "../libltfs/ltfs_fsops_raw.h"
+#include "../libltfs/plugin.h"
+#include "../libltfs/tape.h"
+
+#ifdef __APPLE__
+#include "libltfs/arch/osx/osx_string.h"
+#endif
+
+#if defined(mingw_PLATFORM) && !defined(HP_mingw_BUILD)
+char *bin_ltfsck_dat;
+#else
+extern char bin_ltfsck_dat[];
+#endif
+
+struct other_restore_opts {
+	struct config_file *config; /* Configuration data read from the global LTFS config file */
+	char *devname;              /* Device to read from                                      */
+	char *backend_path;         /* Path to backend shared library                           */
+	char *list_file;            /* File holding the paths to restore, "-" for stdin         */
+	char *output_dir;           /* Directory receiving the restored files                   */
+	bool quiet;                 /* Quiet mode indicator                                     */
+	bool trace;                 /* Debug mode indicator                                     */
+	bool fulltrace;             /* Full trace mode indicator                                */
+};
+
+/* State shared with the batch read callbacks */
+struct restore_state {
+	const char *output_dir;     /* Directory receiving the restored files */
+	char **paths;               /* Paths of the files on the volume */
+	int *fds;                   /* Output file descriptor of each file, -1 if not open */
+	size_t restored;            /* Number of files restored successfully */
+};
+
+/* Forward declarations */
+int restore_files(struct other_restore_opts *opt, char **paths, size_t npaths);
+
+/* Command line options */
+static const char *short_options = "i:b:d:f:o:qtxh";
+static struct option long_options[] = {
+	{"config",          1, 0, 'i'},
+	{"backend",         1, 0, 'b'},
+	{"device",          1, 0, 'd'},
+	{"file-list",       1, 0, 'f'},
+	{"output",          1, 0, 'o'},
+	{"quiet",           0, 0, 'q'},
+	{"trace",           0, 0, 't'},
+	{"fulltrace",       0, 0, 'x'},
+	{"help",            0, 0, 'h'},
+	{0, 0, 0, 0}
+};
+
+void show_usage(char *appname, struct config_file *config, bool full)
+{
+	struct libltfs_plugin backend;
+	const char *default_backend;
+	char *devname = NULL;
+
+	default_backend = config_file_get_default_plugin("driver", config);
+	if (default_backend && plugin_load(&backend, "driver", default_backend, config) == 0) {
+		devname = strdup(ltfs_default_device_name(backend.ops));
+		plugin_unload(&backend);
+	}
+
+	if (! devname)
+		devname = strdup("<devname>");
+
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage: %s <options> [path ...]\n", appname);
+
+	fprintf(stderr, "\nwhere:\n");
+	fprintf(stderr, "\t-d, --device=<name>    specifies the tape drive to use (default: %s)\n", devname);
+	fprintf(stderr, "\t-f, --file-list=<file> reads the paths to restore from a file, one per line ('-' for stdin)\n");
+	fprintf(stderr, "\t-o, --output=<dir>     restores the files below this directory (default: current directory)\n");
+	fprintf(stderr, "\t-q, --quiet            suppresses all progress output\n");
+	fprintf(stderr, "\t-t, --trace            displays detailed progress\n");
+	fprintf(stderr, "\t-h, --help             shows this help\n");
+	fprintf(stderr, "\t-i, --config=<file>    overrides the default config file\n");
+	fprintf(stderr, "\t-b, --backend          specifies a different tape backend subsystem\n");
+	fprintf(stderr, "\t-x, --fulltrace        displays debug information (verbose)\n");
+	fprintf(stderr, "\nFiles are read in the order their data are stored on the medium.\n");
+
+	fprintf(stderr, "\n");
+	free(devname);
+}
+
+/**
+ * Append a path to the restore list, making it absolute within the volume.
+ */
+static int _ltfsrestore_add_path(const char *path, char ***paths, size_t *npaths, size_t *maxpaths)
+{
+	char **tmp;
+	int ret;
+
+	if (*npaths == *maxpaths) {
+		*maxpaths = *maxpaths ? *maxpaths * 2 : 64;
+		tmp = realloc(*paths, *maxpaths * sizeof(char *));
+		if (! tmp) {
+			ltfsmsg(LTFS_ERR, "10001E", "_ltfsrestore_add_path");
+			return -LTFS_NO_MEMORY;
+		}
+		*paths = tmp;
+	}
+
+	if (path[0] == '/')
+		ret = asprintf(&(*paths)[*npaths], "%s", path);
+	else
+		ret = asprintf(&(*paths)[*npaths], "/%s", path);
+	if (ret < 0) {
+		ltfsmsg(LTFS_ERR, "10001E", "_ltfsrestore_add_path: path");
+		return -LTFS_NO_MEMORY;
+	}
+
+	++(*npaths);
+	return 0;
+}
+
+/**
+ * Read the paths to restore from a list file, one per line. Empty lines are ignored.
+ */
+static int _ltfsrestore_read_list(const char *list_file, char ***paths, size_t *npaths,
+	size_t *maxpaths)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t len;
+	int ret = 0;
+
+	if (! strcmp(list_file, "-"))
+		fp = stdin;
+	else {
+		fp = fopen(list_file, "r");
+		if (! fp) {
+			ltfsmsg(LTFS_ERR, "16113E", list_file, -errno);
+			return -LTFS_FILE_ERR;
+		}
+	}
+
+	while ((len = getline(&line, &linesize, fp)) >= 0) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		ret = _ltfsrestore_add_path(line, paths, npaths, maxpaths);
+		if (ret < 0)
+			break;
+	}
+
+	if (ret == 0 && ferror(fp)) {
+		ltfsmsg(LTFS_ERR, "16113E", list_file, -EIO);
+		ret = -LTFS_FILE_ERR;
+	}
+
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return ret;
+}
+
+/**
+ * Create all missing parent directories of a path.
+ */
+static int _ltfsrestore_mkdir_parents(char *path)
+{
+	char *slash;
+
+	for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			*slash = '/';
+			return -errno;
+		}
+		*slash = '/';
+	}
+	return 0;
+}
+
+static int _ltfsrestore_open(size_t index, uint64_t size, void *priv)
+{
+	struct restore_state *state = priv;
+	char *dest;
+	int ret, fd;
+
+	ret = asprintf(&dest, "%s%s", state->output_dir, state->paths[index]);
+	if (ret < 0) {
+		ltfsmsg(LTFS_ERR, "10001E", "_ltfsrestore_open");
+		return -LTFS_NO_MEMORY;
+	}
+
+	ret = _ltfsrestore_mkdir_parents(dest);
+	if (ret == 0) {
+		fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			ret = -errno;
+		else {
+			state->fds[index] = fd;
+			/* Sparse regions of the file are never written by the batch reader */
+			if (ftruncate(fd, size) < 0)
+				ret = -errno;
+		}
+	}
+
+	if (ret < 0)
+		ltfsmsg(LTFS_ERR, "16115E", dest, ret);
+	free(dest);
+	return ret;
+}
+
+static int _ltfsrestore_write(size_t index, const char *buf, size_t count, uint64_t offset,
+	void *priv)
+{
+	struct restore_state *state = priv;
+	ssize_t written;
+
+	while (count > 0) {
+		written = pwrite(state->fds[index], buf, count, offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += written;
+		count -= written;
+		offset += written;
+	}
+
+	return 0;
+}
+
+static int _ltfsrestore_close(size_t index, int result, void *priv)
+{
+	struct restore_state *state = priv;
+	int ret = 0;
+
+	if (state->fds[index] >= 0) {
+		if (close(state->fds[index]) < 0)
+			ret = -errno;
+		state->fds[index] = -1;
+	}
+
+	if (result == 0)
+		result = ret;
+	if (result < 0)
+		ltfsmsg(LTFS_ERR, "16116E", state->paths[index], result);
+	else {
+		ltfsmsg(LTFS_DEBUG, "16120D", state->paths[index]);
+		++state->restored;
+	}
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct other_restore_opts opt;
+	int ret, log_level;
+	char *lang = NULL;
+	const char *config_file = NULL;
+	void *message_handle;
+	char **paths = NULL;
+	size_t i, npaths = 0, maxpaths = 0;
+
+#ifdef HP_mingw_BUILD
+	(void) lang;
+#endif /* HP_mingw_BUILD */
+
+#ifndef HP_mingw_BUILD
+	/* Check for LANG variable and set it to en_US.UTF-8 if it is unset. */
+	lang = getenv("LANG");
+	if (! lang) {
+		fprintf(stderr, "LTFS9015W Setting the locale to 'en_US.UTF-8'. If this is wrong, please set the LANG environment variable before starting ltfsrestore.\n");
+		ret = setenv("LANG", "en_US.UTF-8", 1);
+		if (ret) {
+			fprintf(stderr, "LTFS9016E Cannot set the LANG environment variable\n");
+			return PROG_OPERATIONAL_ERROR;
+		}
+	}
+#endif /* HP_mingw_BUILD */
+
+	/* Start up libltfs with the default logging level. */
+	ret = ltfs_init(LTFS_INFO, true, false);
+	if (ret < 0) {
+		ltfsmsg(LTFS_ERR, "10000E", ret);
+		return PROG_OPERATIONAL_ERROR;
+	}
+
+	/* Register messages with libltfs */
+	ret = ltfsprintf_load_plugin("bin_ltfsck", bin_ltfsck_dat, &message_handle);
+	if (ret < 0) {
+		ltfsmsg(LTFS_ERR, "10012E", ret);
+		return PROG_OPERATIONAL_ERROR;
+	}
+
+	memset(&opt, 0, sizeof(struct other_restore_opts));
+
+	/* Check for a config file path given on the command line */
+	while (true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, short_options, long_options, &option_index);
+		if (c == -1)
+			break;
+		if (c == 'i') {
+			config_file = strdup(optarg);
+			break;
+		}
+	}
+
+	/* Load configuration file */
+	ret = config_file_load(config_file, &opt.config);
+	if (ret < 0) {
+		ltfsmsg(LTFS_ERR, "10008E", ret);
+		return PROG_OPERATIONAL_ERROR;
+	}
+
+	/* Parse all command line arguments */
+	optind = 1;
+	while (true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, short_options, long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'i':
+			break;
+		case 'b':
+			free(opt.backend_path);
+			opt.backend_path = strdup(optarg);
+			break;
+		case 'd':
+			free(opt.devname);
+			opt.devname = strdup(optarg);
+			break;
+		case 'f':
+			free(opt.list_file);
+			opt.list_file = strdup(optarg);
+			break;
+		case 'o':
+			free(opt.output_dir);
+			opt.output_dir = strdup(optarg);
+			break;
+		case 'q':
+			opt.quiet = true;
+			break;
+		case 't':
+			opt.trace = true;
+			break;
+		case 'x':
+			opt.fulltrace = true;
+			break;
+		case 'h':
+			show_usage(argv[0], opt.config, false);
+			return PROG_NO_ERRORS;
+		case '?':
+		default:
+			show_usage(argv[0], opt.config, false);
+			return PROG_USAGE_SYNTAX_ERROR;
+		}
+	}
+
+	/* Pick up default backend if one wasn't specified before */
+	if (! opt.backend_path) {
+		const char *default_backend = config_file_get_default_plugin("driver", opt.config);
+		if (! default_backend) {
+			ltfsmsg(LTFS_ERR, "10009E");
+			return PROG_OPERATIONAL_ERROR;
+		}
+		opt.backend_path = strdup(default_backend);
+	}
+
+	/* Set the logging level */
+	if (opt.quiet && (opt.trace || opt.fulltrace)) {
+		ltfsmsg(LTFS_ERR, "9012E");
+		show_usage(argv[0], opt.config, false);
+		return PROG_USAGE_SYNTAX_ERROR;
+	} else if (opt.quiet)
+		log_level = LTFS_WARN;
+	else if (opt.trace)
+		log_level = LTFS_DEBUG;
+	else
+		log_level = LTFS_INFO;
+	if (opt.fulltrace)
+		log_level = LTFS_TRACE;
+	ltfs_set_log_level(log_level);
+
+	ltfsmsg(LTFS_INFO, "16119I", PACKAGE_NAME, PACKAGE_VERSION, log_level);
+
+	if (! opt.devname) {
+		ltfsmsg(LTFS_ERR, "16009E");
+		show_usage(argv[0], opt.config, false);
+		ret = PROG_USAGE_SYNTAX_ERROR;
+		goto out_free;
+	}
+	if (! opt.output_dir)
+		opt.output_dir = strdup(".");
+
+	/* Collect the paths to restore */
+	for (; optind < argc; ++optind) {
+		if (_ltfsrestore_add_path(argv[optind], &paths, &npaths, &maxpaths) < 0) {
+			ret = PROG_OPERATIONAL_ERROR;
+			goto out_free;
+		}
+	}
+	if (opt.list_file &&
+		_ltfsrestore_read_list(opt.list_file, &paths, &npaths, &maxpaths) < 0) {
+		ret = PROG_OPERATIONAL_ERROR;
+		goto out_free;
+	}
+	if (npaths == 0) {
+		ltfsmsg(LTFS_ERR, "16114E");
+		show_usage(argv[0], opt.config, false);
+		ret = PROG_USAGE_SYNTAX_ERROR;
+		goto out_free;
+	}
+
+	ret = ltfs_fs_init();
+	if (ret) {
+		ret = PROG_OPERATIONAL_ERROR;
+		goto out_free;
+	}
+
+	ret = restore_files(&opt, paths, npaths);
+
+out_free:
+	for (i = 0; i < npaths; ++i)
+		free(paths[i]);
+	free(paths);
+	free(opt.backend_path);
+	free(opt.devname);
+	free(opt.list_file);
+	free(opt.output_dir);
+	config_file_free(opt.config);
+	ltfsprintf_unload_plugin(message_handle);
+	ltfs_finish();
+	return ret;
+}
+
+int restore_files(struct other_restore_opts *opt, char **paths, size_t npaths)
+{
+	int ret, ret2;
+	size_t i;
+	struct libltfs_plugin backend;
+	struct ltfs_volume *vol;
+	struct restore_state state;
+	struct ltfs_fsraw_batch_ops ops = {
+		.open  = _ltfsrestore_open,
+		.write = _ltfsrestore_write,
+		.close = _ltfsrestore_close,
+	};
+
+	memset(&state, 0, sizeof(state));
+	state.output_dir = opt->output_dir;
+	state.paths = paths;
+	state.fds = malloc(npaths * sizeof(int));
+	if (! state.fds) {
+		ltfsmsg(LTFS_ERR, "10001E", "restore_files");
+		return PROG_OPERATIONAL_ERROR;
+	}
+	for (i = 0; i < npaths; ++i)
+		state.fds[i] = -1;
+
+	ret = ltfs_volume_alloc("ltfsrestore", &vol);
+	if (ret < 0) {
+		ltfsmsg(LTFS_ERR, "16001E");
+		free(state.fds);
+		return PROG_OPERATIONAL_ERROR;
+	}
+
+	/* load the backend, open the tape device, and mount the volume */
+	ret = plugin_load(&backend, "driver", opt->backend_path, opt->config);
+	if (ret < 0) {
+		ltfsmsg(LTFS_ERR, "16010E", opt->backend_path, ret);
+		ret = PROG_OPERATIONAL_ERROR;
+		goto out_free;
+	}
+
+	ret = PROG_OPERATIONAL_ERROR;
+	if (ltfs_device_open(opt->devname, backend.ops, vol) < 0) {
+		ltfsmsg(LTFS_ERR, "16011E", opt->devname);
+		goto out_unload_backend;
+	}
+	vol->append_only_mode = false;
+	vol->set_pew = false;
+	if (ltfs_setup_device(vol)) {
+		ltfsmsg(LTFS_ERR, "16092E", opt->devname);
+		goto out_close;
+	}
+
+	ltfs_set_traverse_mode(TRAVERSE_BACKWARD, vol);
+	ret2 = ltfs_mount(false, false, false, false, 0, vol);
+	if (ret2 < 0) {
+		ltfsmsg(LTFS_ERR, "16118E", ret2);
+		goto out_close;
+	}
+
+	ltfsmsg(LTFS_INFO, "16112I", (unsigned long)npaths, opt->devname, opt->output_dir);
+	ret2 = ltfs_fsraw_batch_read((const char **)paths, npaths, &ops, &state, vol);
+	ltfsmsg(LTFS_INFO, "16117I", (unsigned long)state.restored, (unsigned long)npaths);
+	ret = (ret2 < 0) ? PROG_OPERATIONAL_ERROR : PROG_NO_ERRORS;
+
+	/* Nothing was modified, so this does not write an index */
+	ltfs_unmount(SYNC_UNMOUNT, vol);
+
+out_close:
+	ltfs_device_close(vol);
+out_unload_backend:
+	ret2 = plugin_unload(&backend);
+	if (ret == PROG_NO_ERRORS && ret2 < 0) {
+		ltfsmsg(LTFS_WARN, "16020W", ret2);
+		ret = PROG_OPERATIONAL_ERROR;
+	}
+out_free:
+	ltfs_volume_free(&vol);
+	free(state.fds);
+	return ret;
+}